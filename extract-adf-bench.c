@@ -0,0 +1,974 @@
+/*
+ * extract-adf-bench.c
+ *
+ * Synthetic OFS image generator and extraction benchmark for extract-adf
+ *
+ * 2026 version 1.0
+ *
+ * Builds OFS floppy images from a seed, with a configurable number of files and directories, directory depth,
+ * fragmentation and injected corruption (lost file headers and broken parent pointers), and optionally packs them
+ * as ADZ (gzip) or DMS archives. The same images are then extracted by the extract-adf code linked into this
+ * program, and the throughput is reported for each input format as images per second and MB per second of raw
+ * image data, so changes to extract-adf can be compared from run to run with the same seed.
+ *
+ * The DMS archives use quick compression with literal codes only on top of RLE, this exercises the normal track
+ * decoding path without needing a real DMS cruncher, -M 0 or -M 1 writes stored or RLE only tracks instead.
+ *
+ * Use -K <rounds> to measure each DMS track decoder (store, RLE, quick, medium, deep and heavy) on its own instead,
+ * in MB per second of decoded data.
+ *
+ * This is built separately from extract-adf, it includes extract-adf.c with its main() left out:
+ *
+ *    gcc -O2 -o extract-adf-bench extract-adf-bench.c -lz -lpthread
+ *
+ * Use -g <directory> to only write the generated images to a directory instead of benchmarking them.
+ *
+ * Use -R <directory> to replay the inputs extract-adf-fuzz found the DMS decoders to be slowest on, kept in
+ * extract-adf-corpus/, instead. Every input is decoded -K times (default 10) and the slowest time is reported, the
+ * run fails if any input takes longer than -B milliseconds (default 50).
+ */
+
+#define EXTRACTADF_NO_MAIN
+#include "extract-adf.c"
+
+#include <dirent.h>
+
+// Sizes of the two kinds of floppies we can generate
+#define GEN_SECTORS_DD 1760
+#define GEN_SECTORS_HD 3520
+
+// Offsets of the fields we fill in, in bytes from the start of the block
+#define GEN_HIGH_SEQ 8
+#define GEN_FIRST_DATA 16
+#define GEN_CHKSUM 20
+#define GEN_TABLE 24
+#define GEN_TABLE_LAST 308
+#define GEN_BM_FLAG 312
+#define GEN_BM_PAGES 316
+#define GEN_BYTE_SIZE 324
+#define GEN_DAYS 420
+#define GEN_MINS 424
+#define GEN_TICKS 428
+#define GEN_NAME_LEN 432
+#define GEN_HASH_CHAIN 496
+#define GEN_PARENT 500
+#define GEN_EXTENSION 504
+#define GEN_SEC_TYPE 508
+
+// Secondary types
+#define GEN_ST_ROOT 1
+#define GEN_ST_USERDIR 2
+#define GEN_ST_FILE -3
+
+// Number of entries in a hash table or data block table
+#define GEN_TABLE_SIZE 72
+
+// Maximum number of directories in a generated image
+#define GEN_MAX_DIRS 256
+
+// Options controlling what the generated images look like
+struct genoptions {
+	// Number of files and directories to create
+	int files;
+	int dirs;
+	// Maximum depth of the directory tree
+	int depth;
+	// Percentage of blocks allocated at a random free block instead of the next free one
+	int fragmentation;
+	// Maximum size of a file in bytes
+	int maxsize;
+	// Number of file headers to wipe and number of parent pointers to break
+	int lostheaders;
+	int brokenparents;
+	// Set for high density images
+	int highdensity;
+};
+
+// The state of the image being generated
+struct genimage {
+	uint8_t *data;
+	unsigned int sectors;
+	unsigned int root;
+	// Allocation map, 1 if a block is in use, and where the next sequential allocation starts
+	uint8_t used[GEN_SECTORS_HD];
+	unsigned int cursor;
+	unsigned int freeblocks;
+	// Random number generator state
+	uint32_t random;
+};
+
+// Xorshift random number generator, so the images are the same on every platform for the same seed
+uint32_t genrandom(struct genimage *image) {
+	image->random ^= image->random << 13;
+	image->random ^= image->random >> 17;
+	image->random ^= image->random << 5;
+	return image->random;
+}
+
+// Store a big endian long word in a block
+void genput32(struct genimage *image, unsigned int block, unsigned int offset, uint32_t value) {
+	uint8_t *p = image->data+block*512+offset;
+
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+// Read a big endian long word from a block
+uint32_t genget32(struct genimage *image, unsigned int block, unsigned int offset) {
+	uint8_t *p = image->data+block*512+offset;
+
+	return ((uint32_t)p[0]<<24)+((uint32_t)p[1]<<16)+((uint32_t)p[2]<<8)+p[3];
+}
+
+// Calculate the checksum stored at offset so that the sum of all the long words in the block is 0
+void genchecksum(struct genimage *image, unsigned int block, unsigned int offset) {
+	uint32_t sum = 0;
+	int i = 0;
+
+	genput32(image,block,offset,0);
+	for(i = 0; i < 512; i += 4)
+		sum += genget32(image,block,i);
+	genput32(image,block,offset,-sum);
+}
+
+// Store a name in a header block as a BCPL string
+void genname(struct genimage *image, unsigned int block, char *name) {
+	image->data[block*512+GEN_NAME_LEN] = strlen(name);
+	memcpy(image->data+block*512+GEN_NAME_LEN+1,name,strlen(name));
+}
+
+// Store a random timestamp between 1990 and 2000 in a header block
+void genstamp(struct genimage *image, unsigned int block) {
+	genput32(image,block,GEN_DAYS,4383+genrandom(image)%3653);
+	genput32(image,block,GEN_MINS,genrandom(image)%1440);
+	genput32(image,block,GEN_TICKS,genrandom(image)%3000);
+}
+
+// The AmigaDOS filename hash, used to find the hash table slot of an entry
+unsigned int genhash(char *name) {
+	unsigned int hash = strlen(name);
+
+	for(; *name; name++)
+		hash = (hash*13+toupper((unsigned char)*name)) & 0x7ff;
+	return hash % GEN_TABLE_SIZE;
+}
+
+// Link a header into the hash table of its parent directory
+void genlink(struct genimage *image, unsigned int parent, unsigned int block, char *name) {
+	unsigned int slot = GEN_TABLE+genhash(name)*4;
+
+	genput32(image,block,GEN_HASH_CHAIN,genget32(image,parent,slot));
+	genput32(image,parent,slot,block);
+	genput32(image,block,GEN_PARENT,parent);
+}
+
+// Allocate a block, either the next free one after the last allocation or a random free one depending on the
+// fragmentation setting, returns 0 when the disk is full
+unsigned int genallocate(struct genimage *image, struct genoptions *options) {
+	unsigned int block = 0;
+
+	if(image->freeblocks == 0)
+		return 0;
+	if(genrandom(image)%100 < options->fragmentation)
+		image->cursor = 2+genrandom(image)%(image->sectors-2);
+	for(block = image->cursor; image->used[block]; )
+		if(++block >= image->sectors)
+			block = 2;
+	image->used[block] = 1;
+	image->freeblocks--;
+	image->cursor = block+1 < image->sectors ? block+1 : 2;
+	return block;
+}
+
+// Create one file in directory parent, returns the header block or 0 if the disk is full
+unsigned int genfile(struct genimage *image, struct genoptions *options, unsigned int parent, int number) {
+	char name[MAX_AMIGADOS_FILENAME_LENGTH];
+	unsigned int header = 0; unsigned int table = 0; unsigned int extension = 0;
+	unsigned int blocks = 0; unsigned int previous = 0; unsigned int block = 0;
+	unsigned int size = 0; unsigned int i = 0; unsigned int slot = 0; unsigned int k = 0;
+	uint32_t value = 0;
+
+	// A mix of small and large files, capped by the configured maximum size
+	size = genrandom(image)%(options->maxsize+1);
+	if(genrandom(image)%4 == 0)
+		size %= 1024;
+	blocks = (size+DATABYTES-1)/DATABYTES;
+	// Header, extension blocks and data blocks all have to fit
+	if(image->freeblocks < blocks+1+blocks/GEN_TABLE_SIZE)
+		return 0;
+
+	header = genallocate(image,options);
+	snprintf(name,sizeof(name),"file%d.dat",number);
+	genput32(image,header,0,T_HEADER);
+	genput32(image,header,4,header);
+	genput32(image,header,GEN_BYTE_SIZE,size);
+	genput32(image,header,GEN_SEC_TYPE,GEN_ST_FILE);
+	genname(image,header,name);
+	genstamp(image,header);
+	genlink(image,parent,header,name);
+
+	// Data blocks, the block tables are filled from the end, the header holds the first 72 and extension
+	// blocks hold the rest
+	table = header;
+	for(i = 0; i < blocks; i++) {
+		block = genallocate(image,options);
+		if(i > 0 && i % GEN_TABLE_SIZE == 0) {
+			genput32(image,table,GEN_HIGH_SEQ,GEN_TABLE_SIZE);
+			extension = block;
+			block = genallocate(image,options);
+			genput32(image,extension,0,T_LIST);
+			genput32(image,extension,4,extension);
+			genput32(image,extension,GEN_PARENT,header);
+			genput32(image,extension,GEN_SEC_TYPE,GEN_ST_FILE);
+			genput32(image,table,GEN_EXTENSION,extension);
+			if(table != header)
+				genchecksum(image,table,GEN_CHKSUM);
+			table = extension;
+		}
+		slot = i % GEN_TABLE_SIZE;
+		genput32(image,table,GEN_TABLE_LAST-slot*4,block);
+		if(i == 0)
+			genput32(image,header,GEN_FIRST_DATA,block);
+		else
+			genput32(image,previous,16,block);
+		genput32(image,block,0,T_DATA);
+		genput32(image,block,4,header);
+		genput32(image,block,8,i+1);
+		genput32(image,block,12,(i+1 < blocks) ? DATABYTES : size-i*DATABYTES);
+		// Somewhat compressible contents, runs of a random byte mixed with random data
+		for(k = 24; k < 512; k += 4) {
+			if(k % 64 == 24)
+				value = genrandom(image);
+			genput32(image,block,k,(genrandom(image)%4) ? value : genrandom(image));
+		}
+		if(previous)
+			genchecksum(image,previous,GEN_CHKSUM);
+		previous = block;
+	}
+	if(previous)
+		genchecksum(image,previous,GEN_CHKSUM);
+	genput32(image,table,GEN_HIGH_SEQ,blocks-(blocks ? (blocks-1)/GEN_TABLE_SIZE*GEN_TABLE_SIZE : 0));
+	if(table != header)
+		genchecksum(image,table,GEN_CHKSUM);
+	return header;
+}
+
+// Generate an OFS image, returns the image data (which the caller frees) or NULL if we're out of memory
+uint8_t *generateimage(struct genoptions *options, uint32_t seed, unsigned int *sectors) {
+	struct genimage *image;
+	uint8_t *data;
+	unsigned int dirs[GEN_MAX_DIRS];
+	int depth[GEN_MAX_DIRS];
+	unsigned int files[GEN_SECTORS_HD];
+	char name[MAX_AMIGADOS_FILENAME_LENGTH];
+	int numdirs = 0; int numfiles = 0;
+	int i = 0; int parent = 0;
+	unsigned int block = 0;
+	uint32_t sum = 0; uint32_t value = 0;
+
+	image = malloc(sizeof(struct genimage));
+	if(image == NULL)
+		return NULL;
+	memset(image,0,sizeof(struct genimage));
+	image->sectors = options->highdensity ? GEN_SECTORS_HD : GEN_SECTORS_DD;
+	image->root = image->sectors/2;
+	image->data = calloc(image->sectors,512);
+	if(image->data == NULL) {
+		free(image);
+		return NULL;
+	}
+	// The seed can't be 0 for xorshift
+	image->random = seed*2654435761u+1;
+	image->used[0] = image->used[1] = 1;
+	image->used[image->root] = image->used[image->root+1] = 1;
+	image->freeblocks = image->sectors-4;
+	image->cursor = image->root+2;
+
+	// Bootblock, DOS\0 with a valid checksum and the root block pointer
+	memcpy(image->data,"DOS\0",4);
+	genput32(image,0,8,image->root);
+	for(i = 0; i < 1024; i += 4) {
+		value = genget32(image,i/512,i%512);
+		if(sum+value < sum)
+			sum++;
+		sum += value;
+	}
+	genput32(image,0,4,~sum);
+
+	// Root block
+	genput32(image,image->root,0,T_HEADER);
+	genput32(image,image->root,12,GEN_TABLE_SIZE);
+	genput32(image,image->root,GEN_BM_FLAG,0xffffffff);
+	genput32(image,image->root,GEN_BM_PAGES,image->root+1);
+	genput32(image,image->root,GEN_SEC_TYPE,GEN_ST_ROOT);
+	genname(image,image->root,"Bench");
+	genstamp(image,image->root);
+	dirs[numdirs] = image->root;
+	depth[numdirs++] = 0;
+
+	// Directories, each one in a random directory that isn't already at the maximum depth
+	for(i = 0; i < options->dirs && numdirs < GEN_MAX_DIRS; i++) {
+		do {
+			parent = genrandom(image)%numdirs;
+		} while(depth[parent] >= options->depth && parent != 0);
+		if(depth[parent] >= options->depth)
+			break;
+		if((block = genallocate(image,options)) == 0)
+			break;
+		snprintf(name,sizeof(name),"dir%d",i);
+		genput32(image,block,0,T_HEADER);
+		genput32(image,block,4,block);
+		genput32(image,block,GEN_SEC_TYPE,GEN_ST_USERDIR);
+		genname(image,block,name);
+		genstamp(image,block);
+		genlink(image,dirs[parent],block,name);
+		dirs[numdirs] = block;
+		depth[numdirs++] = depth[parent]+1;
+	}
+
+	// Files, each one in a random directory, until we have enough or the disk is full
+	for(i = 0; i < options->files && numfiles < GEN_SECTORS_HD; i++) {
+		if((block = genfile(image,options,dirs[genrandom(image)%numdirs],i)) == 0)
+			break;
+		files[numfiles++] = block;
+	}
+
+	// Header checksums, the hash chains are only final now
+	for(i = 0; i < numdirs; i++)
+		genchecksum(image,dirs[i],GEN_CHKSUM);
+	for(i = 0; i < numfiles; i++)
+		genchecksum(image,files[i],GEN_CHKSUM);
+
+	// Injected corruption, broken parents point at a random block that is not a header
+	for(i = 0; i < options->brokenparents && numfiles > 0; i++) {
+		block = files[genrandom(image)%numfiles];
+		genput32(image,block,GEN_PARENT,2+genrandom(image)%(image->sectors-2));
+		genchecksum(image,block,GEN_CHKSUM);
+	}
+	// Lost headers are wiped completely
+	for(i = 0; i < options->lostheaders && numfiles > 0; i++)
+		memset(image->data+files[genrandom(image)%numfiles]*512,0,512);
+
+	// The bitmap, a set bit means the block is free, block 2 is the first bit
+	for(block = 2; block < image->sectors; block++)
+		if(!image->used[block])
+			image->data[(image->root+1)*512+4+((block-2)/32)*4+3-((block-2)%32)/8] |= 1 << ((block-2)%8);
+	genchecksum(image,image->root+1,0);
+	genchecksum(image,image->root,GEN_CHKSUM);
+
+	*sectors = image->sectors;
+	data = image->data;
+	free(image);
+	return data;
+}
+
+// Write an image as a raw ADF file
+int writeadf(char *path, uint8_t *data, unsigned int sectors) {
+	FILE *f = fopen(path,"w");
+
+	if(f == NULL)
+		return -1;
+	if(fwrite(data,512,sectors,f) != sectors) {
+		fclose(f);
+		return -1;
+	}
+	return fclose(f);
+}
+
+// Write an image as a gzip compressed ADZ file
+int writeadz(char *path, uint8_t *data, unsigned int sectors) {
+	gzFile gz = gzopen(path,"wb6");
+
+	if(gz == NULL)
+		return -1;
+	if(gzwrite(gz,data,sectors*512) != (int)(sectors*512)) {
+		gzclose(gz);
+		return -1;
+	}
+	return (gzclose(gz) == Z_OK) ? 0 : -1;
+}
+
+// Store a big endian word or long word in a buffer
+void genbe16(uint8_t *p, unsigned int value) {
+	p[0] = value >> 8;
+	p[1] = value;
+}
+
+void genbe32(uint8_t *p, uint32_t value) {
+	p[0] = value >> 24;
+	p[1] = value >> 16;
+	p[2] = value >> 8;
+	p[3] = value;
+}
+
+// RLE encode a track the way DMS does it, 0x90 starts a run (0x90 count byte, or 0x90 0xff byte count-high
+// count-low for long runs), a literal 0x90 is written as 0x90 0x00, returns the encoded size
+unsigned int genrle(uint8_t *source, unsigned int length, uint8_t *destination) {
+	unsigned int in = 0; unsigned int out = 0; unsigned int run = 0;
+
+	while(in < length) {
+		for(run = 1; in+run < length && source[in+run] == source[in] && run < 65535; run++)
+			;
+		if(run > 3 || (source[in] == 0x90 && run > 1)) {
+			destination[out++] = 0x90;
+			if(run < 255) {
+				destination[out++] = run;
+				destination[out++] = source[in];
+			} else {
+				destination[out++] = 255;
+				destination[out++] = source[in];
+				destination[out++] = run >> 8;
+				destination[out++] = run;
+			}
+			in += run;
+		} else {
+			destination[out++] = source[in];
+			if(source[in++] == 0x90)
+				destination[out++] = 0;
+		}
+	}
+	return out;
+}
+
+// Encode a buffer with DMS quick compression using only literal codes, every byte becomes a 1 bit followed by the
+// 8 bits of the byte, most significant bit first, returns the encoded size
+unsigned int genquick(uint8_t *source, unsigned int length, uint8_t *destination) {
+	uint32_t bits = 0; int count = 0;
+	unsigned int in = 0; unsigned int out = 0;
+
+	for(in = 0; in < length; in++) {
+		bits = (bits << 9) | 0x100 | source[in];
+		count += 9;
+		while(count >= 8) {
+			destination[out++] = bits >> (count-8);
+			count -= 8;
+		}
+	}
+	if(count > 0)
+		destination[out++] = bits << (8-count);
+	// The decoder always reads in pairs of bytes
+	if(out & 1)
+		destination[out++] = 0;
+	return out;
+}
+
+// Write an image as a DMS archive, one track (both sides of a cylinder) per DMS track, mode is the crunch mode of the
+// tracks, 0 stores them, 1 only RLE encodes them and 2 uses quick compression on top of RLE
+int writedms(char *path, uint8_t *data, unsigned int sectors, int mode) {
+	uint8_t header[56];
+	uint8_t trackheader[20];
+	uint8_t *rle; uint8_t *packed;
+	unsigned int tracksize = (sectors == GEN_SECTORS_HD) ? 22528 : 11264;
+	unsigned int tracks = sectors*512/tracksize;
+	unsigned int rlesize = 0; unsigned int packedsize = 0; unsigned int total = 0;
+	unsigned int track = 0;
+	FILE *f;
+
+	rle = malloc(tracksize*2);
+	packed = malloc(tracksize*3);
+	f = fopen(path,"w");
+	if(rle == NULL || packed == NULL || f == NULL) {
+		free(rle);
+		free(packed);
+		if(f != NULL)
+			fclose(f);
+		return -1;
+	}
+	memset(header,0,sizeof(header));
+	memcpy(header,"DMS!",4);
+	// The offsets are the ones undmsfile() uses plus 4 for the DMS! id
+	genbe32(header+8,(sectors == GEN_SECTORS_HD) ? DMS_HIGHDENSITY : 0);
+	genbe16(header+16,0);
+	genbe16(header+18,tracks-1);
+	genbe32(header+24,sectors*512);
+	// Amiga OFS disk and the crunch mode
+	genbe16(header+50,1);
+	genbe16(header+52,mode);
+	if(fwrite(header,1,sizeof(header),f) != sizeof(header))
+		goto error;
+	for(track = 0; track < tracks; track++) {
+		if(mode == 0) {
+			memcpy(packed,data+track*tracksize,tracksize);
+			packedsize = rlesize = tracksize;
+		} else if(mode == 1) {
+			packedsize = rlesize = genrle(data+track*tracksize,tracksize,packed);
+		} else {
+			rlesize = genrle(data+track*tracksize,tracksize,rle);
+			packedsize = genquick(rle,rlesize,packed);
+		}
+		total += packedsize+20;
+		memset(trackheader,0,sizeof(trackheader));
+		trackheader[0] = 'T';
+		trackheader[1] = 'R';
+		genbe16(trackheader+2,track);
+		genbe16(trackheader+6,packedsize);
+		genbe16(trackheader+8,rlesize);
+		genbe16(trackheader+10,tracksize);
+		trackheader[12] = 0;
+		trackheader[13] = mode;
+		genbe16(trackheader+14,mysimplecrc(data+track*tracksize,tracksize));
+		genbe16(trackheader+16,mycrc(packed,packedsize));
+		genbe16(trackheader+18,mycrc(trackheader,18));
+		if(fwrite(trackheader,1,20,f) != 20 || fwrite(packed,1,packedsize,f) != packedsize)
+			goto error;
+	}
+	// Now that the packed size is known, fill it in and calculate the header CRC
+	genbe32(header+20,total);
+	genbe16(header+54,mycrc(header+4,50));
+	if(fseek(f,0,SEEK_SET) != 0 || fwrite(header,1,sizeof(header),f) != sizeof(header))
+		goto error;
+	free(rle);
+	free(packed);
+	return fclose(f);
+
+error:
+	free(rle);
+	free(packed);
+	fclose(f);
+	return -1;
+}
+
+// Write count bits of value to a bit stream, most significant bit first, the way the DMS decoders read them
+void genbits(uint8_t *stream, unsigned int *position, uint32_t value, int count) {
+	while(count--) {
+		if((value >> count) & 1)
+			stream[*position >> 3] |= 0x80 >> (*position & 7);
+		else
+			stream[*position >> 3] &= ~(0x80 >> (*position & 7));
+		(*position)++;
+	}
+}
+
+// Measure the DMS track decoders on their own, each one decodes the same number of tracks from generated input and
+// the speed is reported in MB per second of decoded data. Store and RLE decode RLE encoded tracks of generated
+// images, the LZ decoders are given random bits which decode to a realistic mix of literals and matches, and heavy
+// is given a valid pair of code tables in front of its random bits
+int benchkernels(struct genoptions *genoptions, uint32_t seed, int rounds) {
+	char *names[] = { "store", "rle", "quick", "medium", "deep", "heavy1", "heavy2" };
+	unsigned int tracksize = 11264;
+	unsigned int tracks = 80;
+	unsigned int streamsize = 2*11264;
+	unsigned int *rlesizes;
+	uint8_t *data; uint8_t *rle; uint8_t *random;
+	uint8_t *output;
+	unsigned int sectors = 0; unsigned int track = 0; unsigned int position = 0; unsigned int i = 0;
+	struct genimage state;
+	uint8_t *source;
+	int mode = 0; int round = 0; int bad = 0;
+	uint64_t start = 0; double seconds = 0;
+
+	data = generateimage(genoptions,seed,&sectors);
+	rle = malloc(tracks*tracksize*2);
+	rlesizes = malloc(tracks*sizeof(unsigned int));
+	random = malloc(tracks*streamsize);
+	output = malloc(tracksize);
+	if(data == NULL || rle == NULL || rlesizes == NULL || random == NULL || output == NULL) {
+		fprintf(stderr,"Out of memory\n");
+		return 1;
+	}
+	tracks = sectors*512/tracksize < tracks ? sectors*512/tracksize : tracks;
+	state.random = seed ? seed : 1;
+	for(track = 0; track < tracks; track++) {
+		rlesizes[track] = genrle(data+track*tracksize,tracksize,rle+track*tracksize*2);
+		for(i = 0; i < streamsize; i++)
+			random[track*streamsize+i] = genrandom(&state);
+	}
+
+	fprintf(stdout,"DMS decoders, %u tracks of %u bytes, %d rounds\n",tracks,tracksize,rounds);
+	for(mode = 0; mode < 7; mode++) {
+		bad = 0;
+		start = monotonicnanoseconds();
+		for(round = 0; round < rounds; round++) {
+			for(track = 0; track < tracks; track++) {
+				source = random+track*streamsize;
+				switch(mode) {
+					case 0:
+						crunch_store(data+track*tracksize,data+(track+1)*tracksize,output,output+tracksize,0,stderr);
+						break;
+					case 1:
+						bad += crunch_rle(rle+track*tracksize*2,rle+track*tracksize*2+rlesizes[track],output,output+tracksize,0,stderr);
+						break;
+					case 2:
+						crunch_quick(source,source+streamsize,output,output+tracksize,0,stderr,track);
+						break;
+					case 3:
+						crunch_medium(source,source+streamsize,output,output+tracksize,0,stderr,track);
+						break;
+					case 4:
+						crunch_deep(source,source+streamsize,output,output+tracksize,0,stderr,track);
+						break;
+					default:
+						// 384 literals of 8 and 9 bits, and 16 offsets of 4 bits
+						position = 0;
+						genbits(source,&position,384,9);
+						for(i = 0; i < 384; i++)
+							genbits(source,&position,i < 128 ? 8 : 9,5);
+						genbits(source,&position,16,5);
+						for(i = 0; i < 16; i++)
+							genbits(source,&position,4,4);
+						bad += crunch_heavy(source,source+streamsize,output,output+tracksize,1,mode == 5 ? 13 : 14,0,stderr,track);
+						break;
+				}
+			}
+		}
+		seconds = (monotonicnanoseconds()-start)/1e9;
+		fprintf(stdout,"%s: %.3f s, %.2f MB/s",names[mode],seconds,(double)rounds*tracks*tracksize/seconds/1e6);
+		if(bad)
+			fprintf(stdout,", %d tracks did not decode",bad);
+		fprintf(stdout,"\n");
+	}
+	free(data);
+	free(rle);
+	free(rlesizes);
+	free(random);
+	free(output);
+	return 0;
+}
+
+// Decode every input in a directory of fuzzer inputs a number of rounds, returns 1 if any of them took longer than
+// bound milliseconds and 0 otherwise
+int benchcorpus(char *directory, int rounds, int bound) {
+	char path[MAX_FILENAME_LENGTH*4];
+	struct membuffer input;
+	struct dirent *entry;
+	DIR *dir;
+	FILE *nullfile;
+	uint64_t start = 0; uint64_t elapsed = 0; uint64_t slowest = 0; uint64_t total = 0;
+	int round = 0; int inputs = 0; int failed = 0; int nullfd = 0; int savedstderr = 0;
+
+	dir = opendir(directory);
+	nullfile = fopen("/dev/null","w");
+	nullfd = open("/dev/null",O_WRONLY);
+	if(dir == NULL || nullfile == NULL || nullfd == -1) {
+		fprintf(stderr,"Can't open %s or /dev/null\n",directory);
+		return 1;
+	}
+	fprintf(stdout,"Fuzzer inputs in %s, %d rounds, bound %d ms\n",directory,rounds,bound);
+	while((entry = readdir(dir)) != NULL) {
+		if(entry->d_name[0] == '.')
+			continue;
+		snprintf(path,sizeof(path),"%s/%s",directory,entry->d_name);
+		if(loadfile(path,&input) != 0) {
+			fprintf(stderr,"Can't read %s\n",path);
+			failed++;
+			continue;
+		}
+		slowest = 0;
+		for(round = 0; round < rounds; round++) {
+			// Broken archives are what the corpus is made of, the complaints about them are not interesting
+			fflush(stderr);
+			savedstderr = dup(2);
+			dup2(nullfd,2);
+			start = monotonicnanoseconds();
+			fuzzdecode(input.data,input.size,nullfile);
+			elapsed = monotonicnanoseconds()-start;
+			dup2(savedstderr,2);
+			close(savedstderr);
+			slowest = elapsed > slowest ? elapsed : slowest;
+			total += elapsed;
+		}
+		fprintf(stdout,"%s: %zu bytes, %s, slowest %.3f ms",entry->d_name,input.size,
+			input.size ? fuzzdecodernames[input.data[0] % FUZZ_DECODERS] : "empty",slowest/1e6);
+		if(slowest > (uint64_t)bound*1000000) {
+			fprintf(stdout,", over the bound");
+			failed++;
+		}
+		fprintf(stdout,"\n");
+		freebuffer(&input);
+		inputs++;
+	}
+	closedir(dir);
+	fclose(nullfile);
+	close(nullfd);
+	fprintf(stdout,"%d inputs in %.3f s, %d over the bound or unreadable\n",inputs,total/1e9,failed);
+	return failed ? 1 : 0;
+}
+
+// Remove a directory and everything below it
+int removetree(char *path) {
+	char entrypath[MAX_FILENAME_LENGTH*4];
+	struct dirent *entry;
+	struct stat st;
+	DIR *dir;
+	int result = 0;
+
+	dir = opendir(path);
+	if(dir == NULL)
+		return -1;
+	while((entry = readdir(dir)) != NULL) {
+		if(strcmp(entry->d_name,".") == 0 || strcmp(entry->d_name,"..") == 0)
+			continue;
+		snprintf(entrypath,sizeof(entrypath),"%s/%s",path,entry->d_name);
+		if(lstat(entrypath,&st) == 0 && S_ISDIR(st.st_mode))
+			result |= removetree(entrypath);
+		else
+			result |= unlink(entrypath);
+	}
+	closedir(dir);
+	return result | rmdir(path);
+}
+
+// Print usage information
+void benchusage(char *programname) {
+	fprintf(stderr,"Extract-ADF benchmark 1.0, generates synthetic OFS images and measures how fast extract-adf extracts them\n");
+	fprintf(stderr,"\nUsage: %s [-n <images>] [-f <files>] [-d <directories>] [-p <depth>] [-F <fragmentation>] [-m <maxsize>]\n",programname);
+	fprintf(stderr,"          [-L <lostheaders>] [-P <brokenparents>] [-H] [-S <seed>] [-t <formats>] [-T <threads>] [-b] [-g <directory>]\n");
+	fprintf(stderr,"          [-M <crunchmode>] [-K <rounds>] [-q <depth>] [-R <directory>] [-B <milliseconds>]\n");
+	fprintf(stderr,"\n\t-n number of images to generate for each format (default 20)");
+	fprintf(stderr,"\n\t-f number of files in each image (default 60, fewer if the disk fills up)");
+	fprintf(stderr,"\n\t-d number of directories in each image (default 10)");
+	fprintf(stderr,"\n\t-p maximum depth of the directory tree (default 4)");
+	fprintf(stderr,"\n\t-F percentage of blocks allocated at a random place on the disk (default 10)");
+	fprintf(stderr,"\n\t-m maximum file size in bytes (default 24000)");
+	fprintf(stderr,"\n\t-L number of file headers to wipe in each image (default 0)");
+	fprintf(stderr,"\n\t-P number of parent pointers to break in each image (default 0)");
+	fprintf(stderr,"\n\t-H will generate high density images");
+	fprintf(stderr,"\n\t-S seed for the generator (default 1), the same seed always gives the same images");
+	fprintf(stderr,"\n\t-t formats to benchmark, any combination of a (ADF), z (ADZ) and d (DMS) (default azd)");
+	fprintf(stderr,"\n\t-T number of threads extract-adf classifies sectors with (default 1)");
+	fprintf(stderr,"\n\t-b will make extract-adf only scan the blocks the allocation bitmap marks as in use");
+	fprintf(stderr,"\n\t-g along with a directory will only write the generated images to that directory");
+	fprintf(stderr,"\n\t-M crunch mode of the DMS archives, 0 (store), 1 (RLE) or 2 (quick, the default)");
+	fprintf(stderr,"\n\t-K along with a number of rounds will only measure the speed of each DMS track decoder on its own");
+	fprintf(stderr,"\n\t-q along with a queue depth will write the extracted files through io_uring instead of synchronously");
+	fprintf(stderr,"\n\t-R along with a directory will only replay the fuzzer inputs in it, -K rounds each (default 10)");
+	fprintf(stderr,"\n\t-B the longest an input replayed with -R may take to decode in milliseconds (default 50)\n");
+}
+
+int main(int argc,char **argv) {
+	// Generator options
+	struct genoptions genoptions;
+	// Extraction options passed to extractimage()
+	struct extractoptions options;
+	// Statistics for all the images of one format
+	struct extractstats totalstats;
+	// Number of images per format, seed and which formats to run
+	int images = 20;
+	uint32_t seed = 1;
+	char *formats = "azd";
+	// Number of threads extract-adf classifies sectors with
+	int threads = 1;
+	// Set to restrict the scan to the allocated blocks
+	int bitmapmode = 0;
+	// Directory to only write the images to
+	char *generatedir = NULL;
+	// Crunch mode of the DMS archives, and the rounds of the decoder benchmark, 0 to benchmark extraction
+	int crunchmode = 2;
+	int kernelrounds = 0;
+	// Depth of the io_uring output queue, 0 writes synchronously
+	int queuedepth = 0;
+	// Directory of fuzzer inputs to replay and the longest one of them may take in milliseconds
+	char *corpusdir = NULL;
+	int bound = 50;
+	// Working directory for the benchmark
+	char workdir[] = "/tmp/extractadfbench.XXXXXX";
+	char path[MAX_FILENAME_LENGTH];
+	char outputdir[MAX_FILENAME_LENGTH];
+	char *formatname;
+	char *extension;
+	uint8_t *data;
+	unsigned int sectors = 0;
+	int optionflag = 0; int i = 0; int startdir = 0; int nullfd = 0; int savedstderr = 0;
+	int failed = 0;
+	uint64_t start = 0; uint64_t elapsed = 0;
+	double seconds = 0;
+	struct stat st;
+	uint64_t inputbytes = 0;
+
+	genoptions.files = 60;
+	genoptions.dirs = 10;
+	genoptions.depth = 4;
+	genoptions.fragmentation = 10;
+	genoptions.maxsize = 24000;
+	genoptions.lostheaders = 0;
+	genoptions.brokenparents = 0;
+	genoptions.highdensity = 0;
+
+	while((optionflag = getopt(argc, argv, "n:f:d:p:F:m:L:P:HS:t:T:bg:M:K:q:R:B:")) != -1)
+		switch(optionflag) {
+			case 'n':
+				images = atoi(optarg);
+				break;
+			case 'f':
+				genoptions.files = atoi(optarg);
+				break;
+			case 'd':
+				genoptions.dirs = atoi(optarg);
+				break;
+			case 'p':
+				genoptions.depth = atoi(optarg);
+				break;
+			case 'F':
+				genoptions.fragmentation = atoi(optarg);
+				break;
+			case 'm':
+				genoptions.maxsize = atoi(optarg);
+				break;
+			case 'L':
+				genoptions.lostheaders = atoi(optarg);
+				break;
+			case 'P':
+				genoptions.brokenparents = atoi(optarg);
+				break;
+			case 'H':
+				genoptions.highdensity = 1;
+				break;
+			case 'S':
+				seed = strtoul(optarg,NULL,10);
+				break;
+			case 't':
+				formats = optarg;
+				break;
+			case 'T':
+				threads = atoi(optarg);
+				break;
+			case 'b':
+				bitmapmode = 1;
+				break;
+			case 'g':
+				generatedir = optarg;
+				break;
+			case 'M':
+				crunchmode = atoi(optarg);
+				break;
+			case 'K':
+				kernelrounds = atoi(optarg);
+				break;
+			case 'q':
+				queuedepth = atoi(optarg);
+				break;
+			case 'R':
+				corpusdir = optarg;
+				break;
+			case 'B':
+				bound = atoi(optarg);
+				break;
+			default:
+				benchusage(argv[0]);
+				return 2;
+		}
+	if(images <= 0 || threads < 1 || genoptions.files < 0 || genoptions.dirs < 0 || genoptions.depth < 1 || genoptions.maxsize < 0 ||
+		crunchmode < 0 || crunchmode > 2 || kernelrounds < 0 || queuedepth < 0 || queuedepth > 4096 || bound < 1) {
+		benchusage(argv[0]);
+		return 2;
+	}
+	if(corpusdir != NULL)
+		return benchcorpus(corpusdir,kernelrounds ? kernelrounds : 10,bound);
+	if(kernelrounds)
+		return benchkernels(&genoptions,seed,kernelrounds);
+
+	// Generate the images, the same ones for every format
+	if(generatedir == NULL) {
+		if(mkdtemp(workdir) == NULL) {
+			fprintf(stderr,"Can't create working directory, error returned was: %s\n",strerror(errno));
+			return 1;
+		}
+		generatedir = workdir;
+	} else if(mkdir(generatedir,0777) < 0 && errno != EEXIST) {
+		fprintf(stderr,"Can't create directory %s, error returned was: %s\n",generatedir,strerror(errno));
+		return 1;
+	}
+	for(i = 0; i < images; i++) {
+		data = generateimage(&genoptions,seed+i,&sectors);
+		if(data == NULL) {
+			fprintf(stderr,"Out of memory\n");
+			return 1;
+		}
+		for(formatname = formats; *formatname; formatname++) {
+			extension = (*formatname == 'z') ? "adz" : (*formatname == 'd') ? "dms" : "adf";
+			snprintf(path,sizeof(path),"%s/bench%04d.%s",generatedir,i,extension);
+			if(((*formatname == 'z') ? writeadz(path,data,sectors) : (*formatname == 'd') ? writedms(path,data,sectors,crunchmode) : writeadf(path,data,sectors)) != 0) {
+				fprintf(stderr,"Can't write %s\n",path);
+				return 1;
+			}
+		}
+		free(data);
+	}
+	if(generatedir != workdir) {
+		fprintf(stdout,"Wrote %d images for each format to %s\n",images,generatedir);
+		return 0;
+	}
+
+	// Extract every image with the output and errors going to /dev/null
+	options.format = 0;
+	options.startsector = FIRST_SECTOR;
+	options.endsector = genoptions.highdensity ? MAX_SECTORS : SECTORS;
+	options.chainmode = 0;
+	options.threads = threads;
+	options.bitmapmode = bitmapmode;
+	options.debug = 0;
+	options.window = 0;
+	options.includes = NULL;
+	options.numincludes = 0;
+	options.excludes = NULL;
+	options.numexcludes = 0;
+	options.outfile = fopen("/dev/null","w");
+	nullfd = open("/dev/null",O_WRONLY);
+	startdir = open(".",O_RDONLY);
+	if(options.outfile == NULL || nullfd == -1 || startdir == -1) {
+		fprintf(stderr,"Can't open /dev/null or the current directory\n");
+		return 1;
+	}
+	fprintf(stdout,"%d %s images per format, %d files, %d directories, depth %d, fragmentation %d%%, %d lost headers, %d broken parents, seed %u\n",
+		images,genoptions.highdensity ? "HD" : "DD",genoptions.files,genoptions.dirs,genoptions.depth,genoptions.fragmentation,
+		genoptions.lostheaders,genoptions.brokenparents,seed);
+#ifdef _HAVE_IO_URING
+	if(queuedepth)
+		outputring = outputringsetup(queuedepth);
+	if(outputring != NULL)
+		fprintf(stdout,"Writing through io_uring with a queue depth of %d\n",queuedepth);
+	else
+#endif
+		fprintf(stdout,"Writing synchronously%s\n",queuedepth ? ", io_uring is not available" : "");
+	for(formatname = formats; *formatname; formatname++) {
+		extension = (*formatname == 'z') ? "adz" : (*formatname == 'd') ? "dms" : "adf";
+		memset(&totalstats,0,sizeof(struct extractstats));
+		elapsed = 0;
+		inputbytes = 0;
+		failed = 0;
+		for(i = 0; i < images; i++) {
+			snprintf(path,sizeof(path),"%s/bench%04d.%s",workdir,i,extension);
+			snprintf(outputdir,sizeof(outputdir),"%s/out",workdir);
+			if(stat(path,&st) == 0)
+				inputbytes += st.st_size;
+			if(mkdir(outputdir,0777) < 0 || chdir(outputdir) < 0) {
+				fprintf(stderr,"Can't create %s\n",outputdir);
+				return 1;
+			}
+			fflush(stderr);
+			savedstderr = dup(2);
+			dup2(nullfd,2);
+			start = monotonicnanoseconds();
+			if(extractimage(path,&options) != 0)
+				failed++;
+			// The time has to include finishing what was queued
+			outputringdrain();
+			elapsed += monotonicnanoseconds()-start;
+			dup2(savedstderr,2);
+			close(savedstderr);
+			addstats(&totalstats,&imagestats,0);
+			if(fchdir(startdir) == -1 || removetree(outputdir) != 0) {
+				fprintf(stderr,"Can't clean up %s\n",outputdir);
+				return 1;
+			}
+		}
+		seconds = elapsed/1e9;
+		fprintf(stdout,"%s: %d images in %.3f s, %.1f images/s, %.2f MB/s raw, %.2f MB/s input",extension,images,seconds,
+			images/seconds,(double)images*sectors*512/seconds/1e6,inputbytes/seconds/1e6);
+		fprintf(stdout," (load %.1f ms, decompress %.1f ms, scan %.1f ms, write %.1f ms, %llu syscalls)",
+			totalstats.loadtime/1e6,totalstats.decompresstime/1e6,totalstats.scantime/1e6,totalstats.writetime/1e6,
+			(unsigned long long)totalstats.syscalls);
+		if(failed)
+			fprintf(stdout,", %d failed",failed);
+		fprintf(stdout,"\n");
+	}
+
+#ifdef _HAVE_IO_URING
+	outputringclose(outputring);
+#endif
+	// Clean up the generated images
+	removetree(workdir);
+	return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * extract-adf-fuzz.c
+ *
+ * Fuzzing harness for the DMS decoders of extract-adf
+ *
+ * 2026 version 1.0
+ *
+ * Every input is decoded by one of the crunch_* functions or by undmsbuffer(), the first byte of the input picks
+ * which, see fuzzdecode() in extract-adf.c for the layout. Besides crashes we're after inputs that take the decoders
+ * a long time, so the time every input takes is measured and the slowest input found so far for each decoder is
+ * written to slowest-<decoder> in the output directory. The slowest inputs found are kept in extract-adf-corpus/,
+ * extract-adf-bench -R replays them and fails if any of them takes longer than the bound it is given.
+ *
+ * With libFuzzer, or AFL++ which runs the same entry point:
+ *
+ *    clang -O1 -g -fsanitize=fuzzer,address -DEXTRACTADF_LIBFUZZER -o extract-adf-fuzz extract-adf-fuzz.c -lz -lpthread
+ *    afl-clang-fast -O2 -fsanitize=fuzzer -DEXTRACTADF_LIBFUZZER -o extract-adf-fuzz extract-adf-fuzz.c -lz -lpthread
+ *
+ * The output directory is then given with the EXTRACTADF_FUZZ_OUTPUT environment variable (default the current
+ * directory). Without either this is built with a simple driver of its own, which mutates the inputs it is given (or
+ * random ones) and keeps the ones that are the slowest yet to mutate further:
+ *
+ *    gcc -O2 -o extract-adf-fuzz extract-adf-fuzz.c -lz -lpthread
+ *    ./extract-adf-fuzz [-n <iterations>] [-S <seed>] [-o <directory>] [input ...]
+ *
+ * An input that starts with DMS! is taken to be a DMS archive and is decoded whole.
+ */
+
+#define EXTRACTADF_NO_MAIN
+#include "extract-adf.c"
+
+// Largest input we make, big enough for a HD archive with every track stored
+#define FUZZ_MAX_INPUT (2*1024*1024)
+
+// Inputs the driver keeps to mutate
+#define FUZZ_POOL 256
+
+// Where the slowest inputs are written, and the time the slowest one of each decoder took
+char *fuzzoutput = ".";
+uint64_t fuzzslowest[FUZZ_DECODERS];
+
+// Output of the decoders, they only write to it when something is wrong
+FILE *fuzzdebugfile = NULL;
+
+// Decode an input and keep it if it's the slowest one yet for its decoder, returns 1 if it was and 0 otherwise
+int fuzzone(const uint8_t *data, size_t size) {
+	char path[MAX_FILENAME_LENGTH];
+	uint64_t start = 0; uint64_t elapsed = 0;
+	int decoder = 0; int retry = 0;
+	FILE *f;
+
+	if(fuzzdebugfile == NULL)
+		fuzzdebugfile = fopen("/dev/null","w");
+	if(size < 4 || fuzzdebugfile == NULL)
+		return 0;
+	decoder = data[0] % FUZZ_DECODERS;
+	start = monotonicnanoseconds();
+	fuzzdecode(data,size,fuzzdebugfile);
+	elapsed = monotonicnanoseconds()-start;
+	// One slow run can be the scheduler or a page fault, an input only counts if it's slow every time
+	for(retry = 0; retry < 2 && elapsed > fuzzslowest[decoder]; retry++) {
+		start = monotonicnanoseconds();
+		fuzzdecode(data,size,fuzzdebugfile);
+		start = monotonicnanoseconds()-start;
+		elapsed = start < elapsed ? start : elapsed;
+	}
+	if(elapsed <= fuzzslowest[decoder])
+		return 0;
+	fuzzslowest[decoder] = elapsed;
+	snprintf(path,sizeof(path),"%s/slowest-%s",fuzzoutput,fuzzdecodernames[decoder]);
+	f = fopen(path,"w");
+	if(f == NULL || fwrite(data,1,size,f) != size)
+		fprintf(stderr,"Can't write %s\n",path);
+	if(f != NULL)
+		fclose(f);
+	fprintf(stderr,"Slowest %s input yet: %.3f ms, %zu bytes\n",fuzzdecodernames[decoder],elapsed/1e6,size);
+	return 1;
+}
+
+#ifdef EXTRACTADF_LIBFUZZER
+// Entry point of libFuzzer and AFL++
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	if(getenv("EXTRACTADF_FUZZ_OUTPUT") != NULL)
+		fuzzoutput = getenv("EXTRACTADF_FUZZ_OUTPUT");
+	fuzzone(data,size);
+	return 0;
+}
+#else
+// One input of the pool
+struct fuzzinput {
+	uint8_t *data;
+	size_t size;
+};
+
+// Xorshift, the same seed always gives the same run
+uint32_t fuzzrandom(uint32_t *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+// Change an input a little, a few bytes at a time like the mutators of libFuzzer do. The bytes that are most likely
+// to change how long decoding takes are the sizes and the RLE marker, so those are written more often
+size_t fuzzmutate(uint8_t *data, size_t size, uint32_t *state) {
+	static const uint8_t interesting[] = { 0x00, 0x01, 0x7f, 0x80, 0x90, 0xfe, 0xff };
+	size_t position = 0; size_t length = 0;
+	int count = 1+fuzzrandom(state)%4;
+
+	while(count--) {
+		position = size ? fuzzrandom(state)%size : 0;
+		switch(fuzzrandom(state)%7) {
+			case 0:
+				if(size)
+					data[position] ^= 1 << (fuzzrandom(state)%8);
+				break;
+			case 1:
+				if(size)
+					data[position] = fuzzrandom(state);
+				break;
+			case 2:
+				if(size)
+					data[position] = interesting[fuzzrandom(state)%sizeof(interesting)];
+				break;
+			case 3:
+				// Insert random bytes
+				length = 1+fuzzrandom(state)%64;
+				if(size+length > FUZZ_MAX_INPUT)
+					break;
+				memmove(data+position+length,data+position,size-position);
+				size += length;
+				while(length--)
+					data[position+length] = fuzzrandom(state);
+				break;
+			case 4:
+				// Remove a few bytes, the decoder byte and the sizes stay
+				length = 1+fuzzrandom(state)%64;
+				if(position < 4 || position+length > size)
+					break;
+				memmove(data+position,data+position+length,size-position-length);
+				size -= length;
+				break;
+			case 5:
+				// Repeat a piece of the input, runs are what the RLE and LZ decoders are slowest on
+				length = 1+fuzzrandom(state)%256;
+				if(position+length > size || size+length > FUZZ_MAX_INPUT)
+					break;
+				memmove(data+position+length,data+position,size-position);
+				size += length;
+				break;
+			default:
+				// A new size to unpack to, for a DMS archive this lands in the header
+				if(size > 3) {
+					data[1] = fuzzrandom(state);
+					data[2] = fuzzrandom(state);
+				}
+				break;
+		}
+	}
+	return size;
+}
+
+// Print usage information
+void fuzzusage(char *programname) {
+	fprintf(stderr,"Extract-ADF fuzzer 1.0, looks for inputs the DMS decoders crash on or are slow with\n");
+	fprintf(stderr,"\nUsage: %s [-n <iterations>] [-S <seed>] [-o <directory>] [input ...]\n",programname);
+	fprintf(stderr,"\n\t-n number of inputs to try (default 100000)");
+	fprintf(stderr,"\n\t-S seed for the mutations (default 1)");
+	fprintf(stderr,"\n\t-o directory to write the slowest input of each decoder to (default the current directory)");
+	fprintf(stderr,"\n\tThe inputs given are where the mutations start from, DMS archives are decoded whole, without any");
+	fprintf(stderr,"\n\trandom inputs are made for every decoder\n");
+}
+
+int main(int argc,char **argv) {
+	struct fuzzinput pool[FUZZ_POOL];
+	struct membuffer file;
+	uint8_t *data;
+	size_t size = 0;
+	uint32_t state = 1;
+	long iterations = 100000; long iteration = 0;
+	int numpool = 0; int optionflag = 0; int i = 0; int j = 0;
+
+	memset(pool,0,sizeof(pool));
+	while((optionflag = getopt(argc, argv, "n:S:o:")) != -1)
+		switch(optionflag) {
+			case 'n':
+				iterations = atol(optarg);
+				break;
+			case 'S':
+				state = strtoul(optarg,NULL,10);
+				break;
+			case 'o':
+				fuzzoutput = optarg;
+				break;
+			default:
+				fuzzusage(argv[0]);
+				return 2;
+		}
+	if(iterations < 1 || state == 0) {
+		fuzzusage(argv[0]);
+		return 2;
+	}
+	data = malloc(FUZZ_MAX_INPUT);
+	if(data == NULL) {
+		fprintf(stderr,"Out of memory\n");
+		return 1;
+	}
+	// The inputs given, a DMS archive gets the decoder byte in front of it
+	for(i = optind; i < argc && numpool < FUZZ_POOL; i++) {
+		if(loadfile(argv[i],&file) != 0 || file.size+1 > FUZZ_MAX_INPUT) {
+			fprintf(stderr,"Can't use %s as an input\n",argv[i]);
+			freebuffer(&file);
+			continue;
+		}
+		pool[numpool].data = malloc(FUZZ_MAX_INPUT);
+		if(pool[numpool].data == NULL)
+			break;
+		if(file.size >= 4 && memcmp(file.data,"DMS!",4) == 0) {
+			pool[numpool].data[0] = FUZZ_DMS;
+			memcpy(pool[numpool].data+1,file.data,file.size);
+			pool[numpool].size = file.size+1;
+		} else {
+			memcpy(pool[numpool].data,file.data,file.size);
+			pool[numpool].size = file.size;
+		}
+		freebuffer(&file);
+		numpool++;
+	}
+	// Or a few kilobytes of random bits for every track decoder, to unpack to a DD track
+	for(i = 0; numpool == 0 && i < FUZZ_DMS; i++) {
+		pool[i].data = malloc(FUZZ_MAX_INPUT);
+		if(pool[i].data == NULL) {
+			fprintf(stderr,"Out of memory\n");
+			return 1;
+		}
+		pool[i].size = 4096;
+		for(j = 0; j < (int)pool[i].size; j++)
+			pool[i].data[j] = fuzzrandom(&state);
+		pool[i].data[0] = i;
+		pool[i].data[1] = 11264 >> 8;
+		pool[i].data[2] = 11264 & 0xff;
+		pool[i].data[3] = 2;
+		if(i == FUZZ_DMS-1)
+			numpool = FUZZ_DMS;
+	}
+	for(i = 0; i < numpool; i++)
+		fuzzone(pool[i].data,pool[i].size);
+	// Mutate an input from the pool, one that turns out to be the slowest yet joins the pool so the next mutations
+	// start from it
+	for(iteration = 0; iteration < iterations; iteration++) {
+		i = fuzzrandom(&state)%numpool;
+		memcpy(data,pool[i].data,pool[i].size);
+		size = fuzzmutate(data,pool[i].size,&state);
+		if(fuzzone(data,size)) {
+			j = numpool < FUZZ_POOL ? numpool : (int)(fuzzrandom(&state)%FUZZ_POOL);
+			if(pool[j].data == NULL)
+				pool[j].data = malloc(FUZZ_MAX_INPUT);
+			if(pool[j].data == NULL)
+				continue;
+			if(j == numpool)
+				numpool++;
+			memcpy(pool[j].data,data,size);
+			pool[j].size = size;
+		}
+	}
+	for(i = 0; i < FUZZ_DECODERS; i++)
+		if(fuzzslowest[i])
+			fprintf(stdout,"%s: slowest input took %.3f ms\n",fuzzdecodernames[i],fuzzslowest[i]/1e6);
+	for(i = 0; i < FUZZ_POOL; i++)
+		free(pool[i].data);
+	free(data);
+	return 0;
+}
+#endif
@@ -0,0 +1,171 @@
+#!/bin/sh
+#
+# extract-adf-test.sh
+#
+# Regression tests for extract-adf
+#
+# Builds extract-adf and extract-adf-bench from the sources in the current directory, along with an extract-adf that
+# uses EXTRACTADF_PORTABLE_BYTEORDER and one built with EXTRACTADF_SWAPPED_HOST as if the host had the other byte
+# order, generates images with the benchmark's generator and checks what extract-adf makes of them. Prints a line for every test and exits 1 if any of them failed. Set CC and CFLAGS to build with
+# something else than cc -O2.
+#
+#    ./extract-adf-test.sh
+#
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+WORK=$(mktemp -d /tmp/extractadftest.XXXXXX) || exit 1
+FAILED=0
+
+trap 'rm -rf "$WORK"' EXIT
+
+# Report a test as passed or failed
+pass() {
+	echo "ok: $1"
+}
+fail() {
+	echo "FAILED: $1"
+	FAILED=1
+}
+
+# Number of files and bytes below a directory
+countfiles() {
+	find "$1" -type f | wc -l | tr -d ' '
+}
+countbytes() {
+	find "$1" -type f -exec cat {} + | wc -c | tr -d ' '
+}
+
+# Checksums of every file below a directory, by path
+treesums() {
+	(cd "$1" && find . -type f | sort | while read -r file; do
+		echo "$file $(cksum < "$file")"
+	done)
+}
+
+# SHA-256 of a file in hex
+sha256() {
+	if command -v sha256sum > /dev/null; then
+		sha256sum < "$1" | cut -d ' ' -f 1
+	else
+		shasum -a 256 < "$1" | cut -d ' ' -f 1
+	fi
+}
+
+# Extract an image into a new directory, extract <directory> <image> [options]
+extract() {
+	dir=$1; image=$2; shift 2
+	mkdir -p "$dir" && (cd "$dir" && "$WORK/extract-adf" "$@" "$image" > /dev/null 2>&1)
+}
+
+$CC $CFLAGS -o "$WORK/extract-adf" extract-adf.c -lz -lpthread || exit 1
+$CC $CFLAGS -o "$WORK/extract-adf-bench" extract-adf-bench.c -lz -lpthread || exit 1
+$CC $CFLAGS -DEXTRACTADF_PORTABLE_BYTEORDER -o "$WORK/extract-adf-portable" extract-adf.c -lz -lpthread || exit 1
+$CC $CFLAGS -DEXTRACTADF_SWAPPED_HOST -o "$WORK/extract-adf-swapped" extract-adf.c -lz -lpthread || exit 1
+
+# HD images keep their files past the DD range under their paths, the generator lays out the same files on a DD
+# and an HD image so both have to give the same tree, with and without chain mode and with nothing orphaned
+"$WORK/extract-adf-bench" -g "$WORK/hd" -H -n 1 -t a > /dev/null || exit 1
+"$WORK/extract-adf-bench" -g "$WORK/hd/dd" -n 1 -t a > /dev/null || exit 1
+extract "$WORK/hd/expected" "$WORK/hd/dd/bench0000.adf"
+extract "$WORK/hd/plain" "$WORK/hd/bench0000.adf" -e 3520
+extract "$WORK/hd/chain" "$WORK/hd/bench0000.adf" -c -e 3520
+if [ "$(countfiles "$WORK/hd/expected")" -gt 0 ] &&
+	[ "$(countfiles "$WORK/hd/plain/Orphaned")" -eq 0 ] &&
+	[ "$(treesums "$WORK/hd/plain")" = "$(treesums "$WORK/hd/expected")" ] &&
+	[ "$(treesums "$WORK/hd/chain")" = "$(treesums "$WORK/hd/expected")" ]; then
+	pass "HD images extract their files under their paths"
+else
+	fail "HD images extract their files under their paths"
+fi
+
+# The collection index only lists what the image produced, not what was in the directory before
+"$WORK/extract-adf-bench" -g "$WORK/dd" -n 1 -t ad > /dev/null || exit 1
+mkdir -p "$WORK/index/old" && echo unrelated > "$WORK/index/unrelated.txt" && echo old > "$WORK/index/old/x.library"
+extract "$WORK/index" "$WORK/dd/bench0000.adf" -I "$WORK/index.idx"
+if ! "$WORK/extract-adf" -L "$WORK/index.idx" unrelated.txt > /dev/null 2>&1 &&
+	! "$WORK/extract-adf" -L "$WORK/index.idx" x.library > /dev/null 2>&1 &&
+	"$WORK/extract-adf" -L "$WORK/index.idx" "$(cd "$WORK/index" && find Bench -type f -name '*.dat' | head -n 1 | sed 's,.*/,,')" > /dev/null 2>&1; then
+	pass "the collection index only has the files of the image"
+else
+	fail "the collection index only has the files of the image"
+fi
+
+# Extracting over a file that was changed since doesn't truncate it, the manifest has to describe what is on disk and
+# not only what was written
+mkdir -p "$WORK/manifest"
+extract "$WORK/manifest" "$WORK/dd/bench0000.adf" -m "$WORK/manifest1.txt"
+changed=$(cd "$WORK/manifest" && find Bench -type f -name '*.dat' | head -n 1)
+head -c 40000 /dev/urandom > "$WORK/manifest/$changed"
+extract "$WORK/manifest" "$WORK/dd/bench0000.adf" -m "$WORK/manifest2.txt"
+MATCH=1
+while IFS='	' read -r image path size sha fnv; do
+	if [ "$(wc -c < "$WORK/manifest/$path" | tr -d ' ')" != "$size" ] ||
+		[ "$(sha256 "$WORK/manifest/$path")" != "$sha" ]; then
+		MATCH=0
+	fi
+done < "$WORK/manifest2.txt"
+if [ -n "$changed" ] && [ $MATCH -eq 1 ] && grep -q "	$changed	40000	" "$WORK/manifest2.txt"; then
+	pass "the manifest describes a file that was extracted over"
+else
+	fail "the manifest describes a file that was extracted over"
+fi
+
+# Exporting a damaged image is an error, a gzip image cut in half doesn't come out as a raw image
+mkdir -p "$WORK/export" && gzip -c "$WORK/dd/bench0000.adf" > "$WORK/export/whole.adz" || exit 1
+head -c $(($(wc -c < "$WORK/export/whole.adz")/2)) "$WORK/export/whole.adz" > "$WORK/export/half.adz"
+if (cd "$WORK/export" && "$WORK/extract-adf" -A whole.adz > /dev/null 2>&1 && ! "$WORK/extract-adf" -A half.adz > /dev/null 2>&1) &&
+	cmp -s "$WORK/export/whole.adf" "$WORK/dd/bench0000.adf" && [ ! -f "$WORK/export/half.adf" ]; then
+	pass "export fails on a truncated image"
+else
+	fail "export fails on a truncated image"
+fi
+
+# Two images that would be exported to the same raw image are refused before anything is written
+mkdir -p "$WORK/export/other" && cp "$WORK/dd/bench0000.dms" "$WORK/export/other/whole.dms"
+if ! (cd "$WORK/export" && rm -f whole.adf && "$WORK/extract-adf" -A whole.adz other/whole.dms > /dev/null 2>&1) &&
+	[ ! -f "$WORK/export/whole.adf" ]; then
+	pass "export refuses images with the same name"
+else
+	fail "export refuses images with the same name"
+fi
+
+# The byte swapping built with shifts and masks gives the same files as the one built with the compiler's builtins,
+# on DD and HD images in every format and with broken blocks for the recovery paths. So does the build that pretends
+# the host has the other byte order, which catches fields that are read without amiga32()
+mkdir -p "$WORK/order" || exit 1
+"$WORK/extract-adf-bench" -g "$WORK/order/dd" -n 2 -t azd -L 2 -P 2 > /dev/null || exit 1
+"$WORK/extract-adf-bench" -g "$WORK/order/hd" -n 1 -t a -H -L 2 -P 2 > /dev/null || exit 1
+SAME=1
+SWAPPED=1
+for image in "$WORK"/order/dd/* "$WORK"/order/hd/*; do
+	case $image in
+		*/hd/*) size="-e 3520";;
+		*) size="";;
+	esac
+	for options in "$size" "$size -c"; do
+		rm -rf "$WORK/order/builtin" "$WORK/order/portable" "$WORK/order/swapped"
+		extract "$WORK/order/builtin" "$image" $options
+		mkdir -p "$WORK/order/portable" && (cd "$WORK/order/portable" && "$WORK/extract-adf-portable" $options "$image" > /dev/null 2>&1)
+		mkdir -p "$WORK/order/swapped" && (cd "$WORK/order/swapped" && "$WORK/extract-adf-swapped" $options "$image" > /dev/null 2>&1)
+		if [ "$(countfiles "$WORK/order/builtin")" -eq 0 ] ||
+			[ "$(treesums "$WORK/order/builtin")" != "$(treesums "$WORK/order/portable")" ]; then
+			SAME=0
+		fi
+		if [ "$(treesums "$WORK/order/builtin")" != "$(treesums "$WORK/order/swapped")" ]; then
+			SWAPPED=0
+		fi
+	done
+done
+if [ $SAME -eq 1 ]; then
+	pass "the portable byte order functions extract the same files"
+else
+	fail "the portable byte order functions extract the same files"
+fi
+if [ $SWAPPED -eq 1 ]; then
+	pass "a host with the other byte order extracts the same files"
+else
+	fail "a host with the other byte order extracts the same files"
+fi
+
+exit $FAILED
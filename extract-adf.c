@@ -50,6 +50,77 @@
  *       it should therefore now be possible to compile and use this on a bigendian machine, if you try it, tell me about it
  * Fixed some minor bugs
  *
+ * 2026 version 5.0
+ *
+ * Added a commandline option flag (-c) to reconstruct files whose header block is lost by following the next_data
+ *       links of their data blocks, the chains are stitched together per header key and written out in one go
+ * Timestamps are no longer set with utime() after every header and data block, the final timestamp of every file
+ *       and directory is recorded while extracting and applied once at the end, directories last
+ * More than one image can now be given on the command line, each image is extracted into a directory named after it
+ * Added a commandline option flag (-j) to write a JSON report with phase timings and counters for every image and
+ *       the totals of the run, use - as the filename to write it to stdout, the output then goes to stderr unless -o
+ *       is given
+ * Added extract-adf-bench.c, a generator for synthetic OFS/ADZ/DMS images and an extraction benchmark, it includes this
+ *       file with EXTRACTADF_NO_MAIN defined
+ * Added a commandline option flag (-t) to classify the sectors by block type in several threads before extracting, each
+ *       thread classifies its own share of the -s/-e range into per type index arrays which are then merged in order,
+ *       compile with -lpthread
+ * Added commandline option flags (-b) and (-u) to load the allocation bitmap of the disk first and only scan the blocks
+ *       that are in use, or only the free blocks to look for deleted files
+ * The input format is now detected from magic bytes (DMS!, PK\3\4, gzip, DOS bootblock) instead of the file extension,
+ *       which is only a fallback, and nested containers such as a zip of a DMS or a gzip of a zip are unpacked
+ *       layer by layer in memory, the decoders no longer use temporary files
+ * Added a commandline option flag (-w) for windowed extraction of uncompressed images of any size, the image is read a
+ *       window of sectors at a time and only 16 bytes are kept for each sector, headers and data blocks are read again
+ *       with pread() when a file is written, -b, -u, -c and -t don't apply in this mode
+ * The byte order of the host is now decided at compile time, the runtime test and the duplicated big endian code paths
+ *       are gone and every field is read with amiga32(), the macOS only libc.h and sys/_endian.h includes were replaced
+ *       by the standard headers so this builds on Linux and the BSDs as well
+ * The DMS decoders expand RLE runs with memset and copy literal spans in one go, and LZ matches in medium, deep and
+ *       heavy compressed tracks are copied 8 or 16 bytes at a time when they don't overlap too closely, RLE runs can
+ *       no longer write past the end of the track buffer
+ * Added commandline option flags (-I) to write a binary index of every file extracted in a run, sorted by name with a
+ *       hash and the $VER: string of each file, and (-L) to look file names up in such an index with a binary search
+ *       over the memory mapped file
+ * Added an optional io_uring output queue (-q) on Linux that writes and closes the extracted files in batches
+ * Files get the space their header says they take reserved on disk when they are created, and files that don't
+ *       come out that size are reported
+ * Added a daemon mode (-S) that takes extraction jobs on a Unix domain socket and answers each with its JSON
+ *       statistics, with a pool of worker processes (-P) that bounds how many jobs run at once
+ * Added commandline option flags (-i and -x) to only extract the files whose path matches, or doesn't match, a glob
+ *       pattern, the blocks of the other files are left out of the scan
+ * Added a commandline option flag (-m) to write a manifest with the SHA-256 and FNV-1a hash of every file extracted,
+ *       computed from the blocks as they are written instead of reading the files back
+ * Added a commandline option flag (-C) to compare two dumps of the same disk sector by sector, the sectors that
+ *       differ are traced back to the files they belong to and the changed, added and removed files are listed
+ * The names and path components used while extracting an image are carved out of an arena that is reset in one go
+ *       for the next image instead of being allocated and freed one by one, along with the names of the files and
+ *       directories whose timestamps are recorded and the names given to orphans, the JSON report has its peak size
+ * Added a commandline option flag (-T) to triage images, only the bootblock and the root block are read and one
+ *       line tells the format, density, filesystem, kind of bootblock and whether the root block is valid
+ * DMS archives can be indexed by their track headers and decoded a track at a time, each track along with the
+ *       tracks before it that its dictionary depends on, with -i only the tracks the selected files are on are decoded
+ * Amiga dates are converted with integer arithmetic in UTC instead of with localtime() and strftime(), which lock
+ *       and read the timezone database and depend on the locale, and file timestamps keep the fraction of a second
+ *       the ticks give
+ * Encrypted DMS archives are decrypted with the password given with -k or the key given with -K, without either the
+ *       key is searched for in several threads, and banner, FILE_ID.DIZ and fake bootblock tracks are skipped
+ *       instead of being taken for tracks of the disk
+ * The DMS decoder marks the tracks that are all zeros or aren't in the archive instead of writing them, the image
+ *       is allocated zeroed so they are never touched, they are neither copied nor scanned, and tracks the archive
+ *       skips no longer move the tracks after them up. Raw images can be written with those sectors as holes
+ * Added a commandline option flag (-A) to export images to raw ADF files instead of extracting them, the raw image
+ *       is written from the decoder's buffer with the empty tracks as holes, raw images are copied with
+ *       copy_file_range(), and a batch is spread over several threads
+ * Added extract-adf-fuzz.c, a libFuzzer/AFL++ harness for the DMS decoders that keeps the inputs they are slowest
+ *       on, the slowest ones found are in extract-adf-corpus/ and extract-adf-bench -R checks they decode in time
+ * Added extract-adf-test.sh, regression tests that run extract-adf on images made by the benchmark's generator
+ * Fixed DMS tracks that are stored or only RLE encoded (crunch mode 0 and 1), they were decoded from the wrong buffer
+ * Fixed temporary files for ADZ and DMS extraction, the name template was too short for mkstemp() on some systems
+ *       and the files were never removed
+ * Fixed crashes when a parent pointer points outside the image or the parents of a header form a loop, and when an
+ *       orphan filename has more than three parts
+ *
  * TODO:
  * The source code could do with a cleanup and even a rewrite, I'll leave that for the next time I have time to work on it
  */
@@ -58,8 +129,17 @@
 // Comment out if zlib support is not available (support for adz will not work)
 #define	_HAVE_ZLIB
 
-#include <libc.h>
-#include <sys/_endian.h>
+// Defined on Linux for the io_uring output queue (-q), which needs Linux 5.6 or later when it's used
+// Comment out if your kernel headers don't have linux/io_uring.h
+#ifdef __linux__
+	#define _HAVE_IO_URING
+	#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
@@ -70,7 +150,55 @@
 	#include <zlib.h>
 #endif
 #include <assert.h>
-#include <utime.h>
+#include <pthread.h>
+#include <limits.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fnmatch.h>
+#ifdef _HAVE_IO_URING
+	#include <linux/io_uring.h>
+	#include <sys/syscall.h>
+#endif
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+// Added for version 5
+// The byte order of the host is decided when compiling instead of being tested while extracting, every field of a
+// block is big endian and is read with amiga32(), which is a plain read on a big endian host and a single byte swap
+// instruction on a little endian one, define EXTRACTADF_PORTABLE_BYTEORDER to use shifts and masks instead of the
+// compiler builtin, the output must be the same either way
+// EXTRACTADF_SWAPPED_HOST is only for testing, it builds extract-adf as if the host had the other byte order, with the
+// portable swap, and swaps the words of every sector once the image is loaded. A field that is read without amiga32()
+// then comes out the way it would on the other kind of host
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+	#define NATIVE_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#elif defined(__BIG_ENDIAN__) || defined(__ARMEB__) || defined(__MIPSEB__)
+	#define NATIVE_BIG_ENDIAN 1
+#else
+	#define NATIVE_BIG_ENDIAN 0
+#endif
+
+#ifdef EXTRACTADF_SWAPPED_HOST
+	#define HOST_BIG_ENDIAN (!NATIVE_BIG_ENDIAN)
+	#ifndef EXTRACTADF_PORTABLE_BYTEORDER
+		#define EXTRACTADF_PORTABLE_BYTEORDER
+	#endif
+#else
+	#define HOST_BIG_ENDIAN NATIVE_BIG_ENDIAN
+#endif
+
+#if HOST_BIG_ENDIAN
+	#define amiga32(x) ((uint32_t)(x))
+#elif (defined(__GNUC__) || defined(__clang__)) && !defined(EXTRACTADF_PORTABLE_BYTEORDER)
+	#define amiga32(x) __builtin_bswap32((uint32_t)(x))
+#else
+	#define amiga32(x) ((((uint32_t)(x) & 0xff) << 24) | (((uint32_t)(x) & 0xff00) << 8) | (((uint32_t)(x) >> 8) & 0xff00) | ((uint32_t)(x) >> 24))
+#endif
 
 // These are defaults
 #define SECTORS 1760
@@ -94,6 +222,17 @@
 // Size of zlib chunks
 #define CHUNK 0x4000
 
+// Largest image the decoders will produce, and how many containers can be nested in each other
+#define MAX_DECODED_SIZE (256*1024*1024)
+#define MAX_CONTAINER_DEPTH 8
+
+// Input formats, the first three are also what -a, -z and -d select
+#define FORMAT_UNKNOWN 0
+#define FORMAT_ADF 1
+#define FORMAT_ADZ 2
+#define FORMAT_DMS 3
+#define FORMAT_ZIP 4
+
 // Maximum number of sectors
 #define MAX_SECTORS 3520
 
@@ -159,11 +298,29 @@ struct dataheader {
 	uint8_t data[488];
 };
 
+// The rootblock, added for version 5
+struct rootblock {
+	struct blkhdr hdr;
+	uint32_t hashtable[72];
+	int32_t bm_flag;
+	uint32_t bm_pages[25];
+	uint32_t bm_ext;
+	uint8_t misc[92];
+};
+
+// A bitmap block, a set bit means the block is free, the first bit is block 2, added for version 5
+struct bitmapblock {
+	uint32_t chksum;
+	uint32_t map[127];
+};
+
 // The sector
 union sector {
 	struct blkhdr hdr;
 	struct fileheader fh;
 	struct dataheader dh;
+	struct rootblock rb;
+	struct bitmapblock bm;
 };
 
 // Added sibbi 2019, DMS packing variables and tables along with DMS unpacking functions
@@ -171,33 +328,50 @@ union sector {
 // Copy paste from code written by David Tritscher, with slight formatting changes
 #define BUFFERSIZE 48000
 
-unsigned char pack_buffer[BUFFERSIZE];
-unsigned char unpack_buffer[BUFFERSIZE];
+// The decoders keep their state in these, every thread has its own copy so several threads can decode tracks at the
+// same time while searching for the key of an encrypted archive, added for version 5
+#if defined(__GNUC__)
+#define DMS_THREAD __thread
+#else
+#define DMS_THREAD _Thread_local
+#endif
+
+DMS_THREAD unsigned char pack_buffer[BUFFERSIZE];
+DMS_THREAD unsigned char unpack_buffer[BUFFERSIZE];
+
+DMS_THREAD unsigned char info_header[4];
+DMS_THREAD unsigned char archive_header[52];
+DMS_THREAD unsigned char track_header[20];
+
+DMS_THREAD unsigned char quick_buffer[256];
 
-unsigned char info_header[4];
-unsigned char archive_header[52];
-unsigned char track_header[20];
+DMS_THREAD unsigned char medium_buffer[16384];
 
-unsigned char quick_buffer[256];
+DMS_THREAD unsigned char deep_buffer[16384];
+DMS_THREAD unsigned short deep_weights[628];
+DMS_THREAD unsigned short deep_symbols[628];
+DMS_THREAD unsigned short deep_hash[942];
 
-unsigned char medium_buffer[16384];
+DMS_THREAD unsigned char heavy_buffer[8192];
+DMS_THREAD unsigned short heavy_literal_table[5120];
+DMS_THREAD unsigned short heavy_offset_table[320];
+DMS_THREAD unsigned char heavy_literal_len[512];
+DMS_THREAD unsigned char heavy_offset_len[32];
 
-unsigned char deep_buffer[16384];
-unsigned short deep_weights[628];
-unsigned short deep_symbols[628];
-unsigned short deep_hash[942];
+DMS_THREAD unsigned int quick_local;
+DMS_THREAD unsigned int medium_local;
+DMS_THREAD unsigned int deep_local;
+DMS_THREAD unsigned int heavy_local;
+DMS_THREAD unsigned int heavy_last_offset;
 
-unsigned char heavy_buffer[8192];
-unsigned short heavy_literal_table[5120];
-unsigned short heavy_offset_table[320];
-unsigned char heavy_literal_len[512];
-unsigned char heavy_offset_len[32];
+// Key of encrypted DMS archives, from the password given with -k or the key given with -K, -1 searches for it with
+// dmskeythreads threads, 0 threads is one per CPU
+int dmskey = -1;
+int dmskeythreads = 0;
 
-unsigned int quick_local;
-unsigned int medium_local;
-unsigned int deep_local;
-unsigned int heavy_local;
-unsigned int heavy_last_offset;
+// Set when exporting (-A), compressed data that is cut short and CRCs that don't match are then errors instead of
+// being reported and decoded as well as we can
+int strictdecode = 0;
 
 
 static const unsigned short CRCTable[256]=
@@ -266,45 +440,1060 @@ static const unsigned char table_two[256]=
    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8
 };
 
-// Helper function to convert Amiga timestamp to unix timestamp
-struct tm *amigatoepoch(unsigned int amigatime,struct tm *tm) {
+// Added for version 5
+// Seconds from 1970-01-01 to 1978-01-01, where the Amiga starts counting
+#define AMIGA_EPOCH 252460800
 
-	// Time variable for epoch at 1978-01-01
-	time_t origstamp = 252460800;
+// Break seconds since 1970-01-01 down into a struct tm in UTC like gmtime_r() does, but with integer arithmetic only so
+// it takes no lock and never reads the timezone database, the civil date comes from the days with the algorithm by
+// Howard Hinnant. Returns tm
+struct tm *epochtotm(int64_t seconds, struct tm *tm) {
+	int64_t days = seconds/86400; int64_t rest = seconds%86400;
+	int64_t era = 0; int64_t dayofera = 0; int64_t yearofera = 0; int64_t dayofyear = 0; int64_t month = 0;
 
-	// Add to the origstampto get epoch time
-	origstamp += amigatime;
-
-	// Make tm struct from timestamp
-	tm = localtime(&origstamp);
-
-	// Return the timestruct
+	if(rest < 0) {
+		rest += 86400;
+		days--;
+	}
+	memset(tm,0,sizeof(struct tm));
+	tm->tm_hour = rest/3600;
+	tm->tm_min = rest/60%60;
+	tm->tm_sec = rest%60;
+	// 1970-01-01 was a Thursday
+	tm->tm_wday = (int)(((days+4)%7+7)%7);
+	// Count the days from 0000-03-01 in eras of 400 years, so the leap day is the last day of the year
+	days += 719468;
+	era = (days >= 0 ? days : days-146096)/146097;
+	dayofera = days-era*146097;
+	yearofera = (dayofera-dayofera/1460+dayofera/36524-dayofera/146096)/365;
+	dayofyear = dayofera-(365*yearofera+yearofera/4-yearofera/100);
+	month = (5*dayofyear+2)/153;
+	tm->tm_mday = dayofyear-(153*month+2)/5+1;
+	tm->tm_mon = month < 10 ? month+2 : month-10;
+	tm->tm_year = yearofera+era*400+(tm->tm_mon <= 1)-1900;
+	if(tm->tm_mon <= 1)
+		tm->tm_yday = dayofyear-306;
+	else
+		tm->tm_yday = dayofyear+59+((tm->tm_year%4 == 0 && (tm->tm_year+1900)%100 != 0) || (tm->tm_year+1900)%400 == 0);
 	return tm;
+}
 
+// Write a time as YYYY-MM-DD HH:MM:SS in UTC, the same whatever the locale is. Returns buffer
+char *formatdate(char *buffer, size_t size, int64_t seconds) {
+	struct tm tm;
+
+	epochtotm(seconds,&tm);
+	snprintf(buffer,size,"%04d-%02d-%02d %02d:%02d:%02d",tm.tm_year+1900,tm.tm_mon+1,tm.tm_mday,tm.tm_hour,tm.tm_min,tm.tm_sec);
+	return buffer;
 }
 
 // Helper function to convert Amiga days, minutes, ticks to timestamp
-struct utimbuf *amigadaystoutimbuf(uint32_t days, uint32_t minutes, uint32_t ticks,struct utimbuf *utim) {
+// Changed for version 5, the ticks (50 per second) now give the fraction of a second as well, and the sum is done in
+// 64 bits so days after 2114 don't wrap around
+struct timespec *amigadaystotimespec(uint32_t days, uint32_t minutes, uint32_t ticks,struct timespec *ts) {
+	ts->tv_sec = (time_t)(AMIGA_EPOCH+(int64_t)days*86400+(int64_t)minutes*60+ticks/50);
+	ts->tv_nsec = (long)(ticks%50)*20000000;
+	return ts;
+}
+
+// Added for version 5
+// Counters and phase timers gathered while extracting an image, all times are in nanoseconds from a monotonic clock
+struct extractstats {
+	// Time spent loading the image, decompressing it, scanning the sectors and writing the output, and in total
+	uint64_t loadtime;
+	uint64_t decompresstime;
+	uint64_t scantime;
+	uint64_t writetime;
+	uint64_t totaltime;
+	// Sectors scanned, by type
+	unsigned int headersectors;
+	unsigned int datasectors;
+	unsigned int listsectors;
+	unsigned int othersectors;
+	// Sectors left out of the scan because of the allocation bitmap or the filters, or because the decoder knows
+	// they are zeros, those are also counted on their own
+	unsigned int skippedsectors;
+	unsigned int zerosectors;
+	// Orphaned data blocks found, and files and directories created
+	unsigned int orphans;
+	unsigned int files;
+	unsigned int directories;
+	// Files whose recovered size differs from the size in their header
+	unsigned int sizemismatches;
+	// Most bytes carved out of the name arena at once, the largest of any image for the totals of a run
+	uint64_t arenapeak;
+	// Bytes written to the output files, and output system calls issued
+	uint64_t byteswritten;
+	uint64_t syscalls;
+	// Images processed and how many of them failed, only used for the totals of a run
+	unsigned int images;
+	unsigned int failed;
+};
+
+// Statistics for the image currently being extracted
+struct extractstats imagestats;
+
+// Return the time from a monotonic clock in nanoseconds
+uint64_t monotonicnanoseconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
+// Add the statistics of an image to the totals of a run
+void addstats(struct extractstats *total, struct extractstats *image, int failed) {
+	total->loadtime += image->loadtime;
+	total->decompresstime += image->decompresstime;
+	total->scantime += image->scantime;
+	total->writetime += image->writetime;
+	total->totaltime += image->totaltime;
+	total->headersectors += image->headersectors;
+	total->datasectors += image->datasectors;
+	total->listsectors += image->listsectors;
+	total->othersectors += image->othersectors;
+	total->skippedsectors += image->skippedsectors;
+	total->zerosectors += image->zerosectors;
+	total->orphans += image->orphans;
+	total->files += image->files;
+	total->directories += image->directories;
+	total->sizemismatches += image->sizemismatches;
+	if(image->arenapeak > total->arenapeak)
+		total->arenapeak = image->arenapeak;
+	total->byteswritten += image->byteswritten;
+	total->syscalls += image->syscalls;
+	total->images++;
+	if(failed)
+		total->failed++;
+}
+
+// Write a string as a JSON string, escaping what needs to be escaped
+void writejsonstring(FILE *jsonfile, char *string) {
+	fputc('"',jsonfile);
+	for(; *string; string++) {
+		if(*string == '"' || *string == '\\')
+			fprintf(jsonfile,"\\%c",*string);
+		else if((unsigned char)*string < 32)
+			fprintf(jsonfile,"\\u%04x",(unsigned char)*string);
+		else
+			fputc(*string,jsonfile);
+	}
+	fputc('"',jsonfile);
+}
+
+// Write one set of statistics as a JSON object, image is NULL for the totals of a run
+// The object is left without a newline at the end, so the caller can put a separator after it
+void writejsonstats(FILE *jsonfile, char *image, int failed, struct extractstats *stats) {
+	fprintf(jsonfile,"{\n");
+	if(image != NULL) {
+		fprintf(jsonfile,"      \"image\": ");
+		writejsonstring(jsonfile,image);
+		fprintf(jsonfile,",\n      \"status\": \"%s\",\n",failed ? "failed" : "ok");
+	} else {
+		fprintf(jsonfile,"      \"images\": %u,\n      \"failed\": %u,\n",stats->images,stats->failed);
+	}
+	fprintf(jsonfile,"      \"time_ns\": { \"load\": %llu, \"decompress\": %llu, \"scan\": %llu, \"write\": %llu, \"total\": %llu },\n",
+		(unsigned long long)stats->loadtime,(unsigned long long)stats->decompresstime,(unsigned long long)stats->scantime,
+		(unsigned long long)stats->writetime,(unsigned long long)stats->totaltime);
+	fprintf(jsonfile,"      \"sectors\": { \"header\": %u, \"data\": %u, \"list\": %u, \"other\": %u, \"skipped\": %u, \"zero\": %u },\n",
+		stats->headersectors,stats->datasectors,stats->listsectors,stats->othersectors,stats->skippedsectors,stats->zerosectors);
+	fprintf(jsonfile,"      \"orphans\": %u,\n      \"files\": %u,\n      \"directories\": %u,\n",stats->orphans,stats->files,stats->directories);
+	fprintf(jsonfile,"      \"size_mismatches\": %u,\n",stats->sizemismatches);
+	fprintf(jsonfile,"      \"arena_peak_bytes\": %llu,\n",(unsigned long long)stats->arenapeak);
+	fprintf(jsonfile,"      \"bytes_written\": %llu,\n      \"syscalls\": %llu\n",(unsigned long long)stats->byteswritten,(unsigned long long)stats->syscalls);
+	fprintf(jsonfile,"    }");
+}
+
+// Added for version 5
+// Asynchronous output with io_uring, only on Linux. Files are still opened (and created) right away since the
+// extraction decides what to do from whether a file exists, but what is written to them and closing them is queued
+// and submitted whenever the queue is full. The operations on one file are hard linked so they run in the order they
+// were made and the close comes last, while different files are written at the same time. When something else was
+// queued in between or the file's earlier operations were already submitted, the operation drains the queue instead
+// of being linked. Completions are picked up without waiting whenever something is queued, only a full completion
+// ring or a drain waits for them. A write that comes back short counts as failed, the close linked after it may already
+// have run so the rest can't be written anymore. Looking at a file waits only if that file has something queued.
+// There is no io_uring operation for setting timestamps, those are still set with utimensat() after the queue has been
+// drained. If io_uring can't be set up the output is written synchronously like before.
+#ifdef _HAVE_IO_URING
+
+// The rings shared with the kernel and what has been queued
+struct outputring {
+	int fd;
+	unsigned int depth;
+	// Submission ring, its entries are indexes into sqes
+	unsigned int *sqhead;
+	unsigned int *sqtail;
+	unsigned int *sqmask;
+	unsigned int *sqarray;
+	struct io_uring_sqe *sqes;
+	// Completion ring
+	unsigned int *cqhead;
+	unsigned int *cqtail;
+	unsigned int *cqmask;
+	struct io_uring_cqe *cqes;
+	unsigned int cqentries;
+	// The mappings, to unmap them again
+	void *sqring;
+	size_t sqringsize;
+	void *cqring;
+	size_t cqringsize;
+	size_t sqesize;
+	// Operations queued but not submitted, and submitted but not completed
+	unsigned int queued;
+	unsigned int inflight;
+	// The file of the last operation queued
+	struct outputringfile *lastfile;
+	// The files that are open or still have operations queued
+	struct outputringfile *files;
+	// Operations that failed
+	unsigned int errors;
+};
+
+// A file written through the queue, the writes go to offset which is where stdio thinks the file is. It's freed when
+// its close completes
+struct outputringfile {
+	int fd;
+	off64_t offset;
+	// Operations queued or in flight
+	unsigned int pending;
+	// To find the file again from a stat() of its name
+	dev_t dev;
+	ino_t ino;
+	// The list of files in the queue
+	struct outputringfile *prev;
+	struct outputringfile *next;
+};
+
+// An operation in the queue, the data of a write follows it
+struct outputringop {
+	struct outputringfile *file;
+	int opcode;
+	unsigned int length;
+};
+
+// The queue, NULL when the output is written synchronously
+struct outputring *outputring = NULL;
+
+// Take a file off the list of files in the queue and free it
+void outputringfreefile(struct outputring *ring, struct outputringfile *file) {
+	if(file->prev != NULL)
+		file->prev->next = file->next;
+	else
+		ring->files = file->next;
+	if(file->next != NULL)
+		file->next->prev = file->prev;
+	free(file);
+}
+
+// Pick up the completed operations and free them, waiting until no more than limit are left in flight. A limit of
+// ring->inflight only takes what has already completed
+void outputringreap(struct outputring *ring, unsigned int limit) {
+	unsigned int head = 0; unsigned int tail = 0;
+	struct io_uring_cqe *cqe;
+	struct outputringop *op;
+
+	while(ring->inflight) {
+		head = *ring->cqhead;
+		tail = __atomic_load_n(ring->cqtail,__ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			cqe = &ring->cqes[head & *ring->cqmask];
+			op = (struct outputringop *)(uintptr_t)cqe->user_data;
+			if(cqe->res < 0 && cqe->res != -ECANCELED) {
+				if(!ring->errors)
+					fprintf(stderr,"Asynchronous output failed: %s\n",strerror(-cqe->res));
+				ring->errors++;
+			} else if(op->opcode == IORING_OP_WRITE && cqe->res >= 0 && (unsigned int)cqe->res < op->length) {
+				if(!ring->errors)
+					fprintf(stderr,"Asynchronous output only wrote %d of %u bytes\n",cqe->res,op->length);
+				ring->errors++;
+			}
+			op->file->pending--;
+			if(op->opcode == IORING_OP_CLOSE)
+				outputringfreefile(ring,op->file);
+			free(op);
+			ring->inflight--;
+		}
+		__atomic_store_n(ring->cqhead,head,__ATOMIC_RELEASE);
+		if(ring->inflight <= limit)
+			break;
+		imagestats.syscalls++;
+		if(syscall(__NR_io_uring_enter,ring->fd,0,ring->inflight-limit,IORING_ENTER_GETEVENTS,NULL,0) == -1 && errno != EINTR) {
+			fprintf(stderr,"Waiting for asynchronous output failed: %s\n",strerror(errno));
+			break;
+		}
+	}
+}
+
+// Submit what has been queued, waiting only if the completion ring has no room for it
+void outputringsubmit(struct outputring *ring) {
+	unsigned int submitted = 0;
+	int ret = 0;
+
+	if(ring->inflight+ring->queued > ring->cqentries)
+		outputringreap(ring,ring->cqentries-ring->queued);
+	while(submitted < ring->queued) {
+		imagestats.syscalls++;
+		ret = syscall(__NR_io_uring_enter,ring->fd,ring->queued-submitted,0,0,NULL,0);
+		if(ret == -1 && errno == EINTR)
+			continue;
+		if(ret <= 0) {
+			fprintf(stderr,"Submitting asynchronous output failed: %s\n",strerror(errno));
+			break;
+		}
+		submitted += ret;
+	}
+	ring->inflight += submitted;
+	ring->queued = 0;
+}
+
+// Queue an operation on a file, op is freed when it completes
+void outputringqueue(struct outputring *ring, struct outputringop *op, int opcode, struct outputringfile *file, void *data, unsigned int length, off64_t offset) {
+	unsigned int tail = 0; unsigned int index = 0;
+	struct io_uring_sqe *sqe;
+
+	outputringreap(ring,ring->inflight);
+	tail = *ring->sqtail;
+	index = tail & *ring->sqmask;
+	sqe = &ring->sqes[index];
+	memset(sqe,0,sizeof(struct io_uring_sqe));
+	// Operations on the same file have to run in order, link to the file's previous operation if it's the one queued
+	// right before this one and drain the queue if it's further back
+	if(file->pending) {
+		if(ring->queued && ring->lastfile == file)
+			ring->sqes[(tail-1) & *ring->sqmask].flags |= IOSQE_IO_HARDLINK;
+		else
+			sqe->flags |= IOSQE_IO_DRAIN;
+	}
+	op->file = file;
+	op->opcode = opcode;
+	op->length = length;
+	file->pending++;
+	ring->lastfile = file;
+	sqe->opcode = opcode;
+	sqe->fd = file->fd;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = length;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)op;
+	ring->sqarray[index] = index;
+	__atomic_store_n(ring->sqtail,tail+1,__ATOMIC_RELEASE);
+	if(++ring->queued == ring->depth)
+		outputringsubmit(ring);
+}
+
+// Submit everything queued and wait for it, before anything that needs the output to be on disk
+void outputringdrain(void) {
+	if(outputring == NULL || (!outputring->queued && !outputring->inflight))
+		return;
+	outputringsubmit(outputring);
+	outputringreap(outputring,0);
+}
+
+// Whether the file st describes still has operations queued or in flight
+int outputringpending(struct stat *st) {
+	struct outputringfile *file;
+
+	if(outputring == NULL)
+		return 0;
+	for(file = outputring->files; file != NULL; file = file->next)
+		if(file->pending && file->ino == st->st_ino && file->dev == st->st_dev)
+			return 1;
+	return 0;
+}
+
+// Set up a queue of depth operations, returns NULL if io_uring isn't available
+struct outputring *outputringsetup(unsigned int depth) {
+	struct io_uring_params params;
+	struct outputring *ring = calloc(1,sizeof(struct outputring));
+
+	if(ring == NULL)
+		return NULL;
+	memset(&params,0,sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup,depth,&params);
+	if(ring->fd == -1) {
+		free(ring);
+		return NULL;
+	}
+	// Queued writes and closes need Linux 5.6, which is also when this feature flag appeared
+	if(!(params.features & IORING_FEAT_RW_CUR_POS)) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+	ring->depth = params.sq_entries;
+	ring->cqentries = params.cq_entries;
+	ring->sqringsize = params.sq_off.array+params.sq_entries*sizeof(unsigned int);
+	ring->cqringsize = params.cq_off.cqes+params.cq_entries*sizeof(struct io_uring_cqe);
+	ring->sqesize = params.sq_entries*sizeof(struct io_uring_sqe);
+	ring->sqring = mmap(NULL,ring->sqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQ_RING);
+	ring->cqring = mmap(NULL,ring->cqringsize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL,ring->sqesize,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQES);
+	if(ring->sqring == MAP_FAILED || ring->cqring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		if(ring->sqring != MAP_FAILED)
+			munmap(ring->sqring,ring->sqringsize);
+		if(ring->cqring != MAP_FAILED)
+			munmap(ring->cqring,ring->cqringsize);
+		if(ring->sqes != MAP_FAILED)
+			munmap(ring->sqes,ring->sqesize);
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+	ring->sqhead = (unsigned int *)((uint8_t *)ring->sqring+params.sq_off.head);
+	ring->sqtail = (unsigned int *)((uint8_t *)ring->sqring+params.sq_off.tail);
+	ring->sqmask = (unsigned int *)((uint8_t *)ring->sqring+params.sq_off.ring_mask);
+	ring->sqarray = (unsigned int *)((uint8_t *)ring->sqring+params.sq_off.array);
+	ring->cqhead = (unsigned int *)((uint8_t *)ring->cqring+params.cq_off.head);
+	ring->cqtail = (unsigned int *)((uint8_t *)ring->cqring+params.cq_off.tail);
+	ring->cqmask = (unsigned int *)((uint8_t *)ring->cqring+params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((uint8_t *)ring->cqring+params.cq_off.cqes);
+	return ring;
+}
+
+// Drain the queue and tear it down, returns the number of operations that failed
+unsigned int outputringclose(struct outputring *ring) {
+	unsigned int errors = 0;
+
+	if(ring == NULL)
+		return 0;
+	outputringsubmit(ring);
+	outputringreap(ring,0);
+	errors = ring->errors;
+	munmap(ring->sqes,ring->sqesize);
+	munmap(ring->cqring,ring->cqringsize);
+	munmap(ring->sqring,ring->sqringsize);
+	close(ring->fd);
+	free(ring);
+	return errors;
+}
+
+// stdio callbacks of a file written through the queue, stdio does the buffering and hands us what it flushes
+ssize_t outputringwrite(void *cookie, const char *data, size_t size) {
+	struct outputringfile *file = cookie;
+	struct outputringop *op = malloc(sizeof(struct outputringop)+size);
+
+	if(op == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(op+1,data,size);
+	outputringqueue(outputring,op,IORING_OP_WRITE,file,op+1,size,file->offset);
+	file->offset += size;
+	return size;
+}
+
+int outputringseek(void *cookie, off64_t *offset, int whence) {
+	struct outputringfile *file = cookie;
+	struct stat st;
+
+	if(whence == SEEK_CUR) {
+		*offset += file->offset;
+	} else if(whence == SEEK_END) {
+		// The size is only right once everything queued has been written
+		outputringdrain();
+		if(fstat(file->fd,&st) == -1)
+			return -1;
+		*offset += st.st_size;
+	}
+	if(*offset < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	file->offset = *offset;
+	return 0;
+}
+
+int outputringclosefile(void *cookie) {
+	struct outputringfile *file = cookie;
+	struct outputringop *op = malloc(sizeof(struct outputringop));
+
+	// Without memory for the operation the file is closed right away, once its writes are done
+	if(op == NULL) {
+		outputringdrain();
+		close(file->fd);
+		outputringfreefile(outputring,file);
+		return 0;
+	}
+	outputringqueue(outputring,op,IORING_OP_CLOSE,file,NULL,0,0);
+	return 0;
+}
+
+// Write to a file that is already open through the queue, the descriptor is closed along with the stream, or right
+// away if the stream can't be set up
+FILE *outputringfdopen(int fd, char *mode) {
+	cookie_io_functions_t functions = { NULL, outputringwrite, outputringseek, outputringclosefile };
+	struct outputringfile *file = malloc(sizeof(struct outputringfile));
+	struct stat st;
+	FILE *f = NULL;
+
+	imagestats.syscalls++;
+	if(file == NULL || fstat(fd,&st) == -1) {
+		close(fd);
+		free(file);
+		return NULL;
+	}
+	file->fd = fd;
+	file->offset = 0;
+	file->pending = 0;
+	file->dev = st.st_dev;
+	file->ino = st.st_ino;
+	f = fopencookie(file,mode,functions);
+	if(f == NULL) {
+		close(fd);
+		free(file);
+		return NULL;
+	}
+	file->prev = NULL;
+	file->next = outputring->files;
+	if(file->next != NULL)
+		file->next->prev = file;
+	outputring->files = file;
+	return f;
+}
+
+// Open a file for writing through the queue, the modes are the ones the extraction uses, r+ and w
+FILE *outputringfopen(char *name, char *mode) {
+	struct stat st;
+	int fd = -1;
+
+	// Truncating a file that still has writes queued would have them land after the truncation
+	if(mode[0] == 'w' && stat(name,&st) == 0 && outputringpending(&st))
+		outputringdrain();
+	fd = open(name,(mode[0] == 'w') ? O_WRONLY|O_CREAT|O_TRUNC : O_RDWR,0666);
+	if(fd == -1)
+		return NULL;
+	return outputringfdopen(fd,mode);
+}
+
+#else
+
+// Without io_uring there is never anything queued
+void outputringdrain(void) {
+}
+
+#endif
+
+// Wrappers for the system calls used to write the output, they count the calls and the time spent in them
+int outputmkdir(char *name) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = mkdir(name,0777);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return ret;
+}
+
+int outputopendir(char *name) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = open(name,O_RDONLY);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return ret;
+}
+
+int outputclose(int fd) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = close(fd);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return ret;
+}
+
+int outputstat(char *name, struct stat *st) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = stat(name,st);
+
+	// The size of a file is only right once what has been queued for it has been written
+#ifdef _HAVE_IO_URING
+	if(ret == 0 && S_ISREG(st->st_mode) && outputringpending(st)) {
+		outputringdrain();
+		ret = stat(name,st);
+	}
+#endif
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return ret;
+}
+
+int outputremove(char *name) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = 0;
+
+	outputringdrain();
+	ret = remove(name);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return ret;
+}
+
+FILE *outputfopen(char *name, char *mode) {
+	uint64_t start = monotonicnanoseconds();
+	FILE *f = NULL;
+
+#ifdef _HAVE_IO_URING
+	if(outputring != NULL)
+		f = outputringfopen(name,mode);
+	else
+#endif
+		f = fopen(name,mode);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return f;
+}
+
+// Reserve size bytes on disk for the file fd is open on, so the data blocks written into it later end up in one extent
+// instead of growing the file a block at a time. Linux and macOS can do this without changing the size of the file, a
+// file whose data blocks are lost is still only as long as what was recovered. Elsewhere the file has to be grown to
+// size to reserve the space, that's only done if grown isn't NULL and the caller then cuts the file back to what it
+// wrote when *grown is set. Not every filesystem can reserve space, the file is then just written the way it always was
+void outputreserve(int fd, uint32_t size, int *grown) {
+	if(grown != NULL)
+		*grown = 0;
+	if(!size)
+		return;
+#if defined(FALLOC_FL_KEEP_SIZE)
+	fallocate(fd,FALLOC_FL_KEEP_SIZE,0,size);
+	imagestats.syscalls++;
+#elif defined(F_PREALLOCATE)
+	// Ask for one extent first and settle for several
+	fstore_t store = { F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, size, 0 };
+
+	imagestats.syscalls++;
+	if(fcntl(fd,F_PREALLOCATE,&store) == -1) {
+		store.fst_flags = F_ALLOCATEALL;
+		fcntl(fd,F_PREALLOCATE,&store);
+		imagestats.syscalls++;
+	}
+#elif defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+	if(grown != NULL) {
+		*grown = (posix_fallocate(fd,0,size) == 0);
+		imagestats.syscalls++;
+	}
+#endif
+}
+
+// Create a file if it isn't there yet and reserve the size its header gives for it, the file is left alone if it's
+// already there. Returns -1 if it can't be created
+int outputcreate(char *name, uint32_t size) {
+	uint64_t start = monotonicnanoseconds();
+	int fd = open(name,O_WRONLY|O_CREAT,0666);
+
+	imagestats.syscalls++;
+	if(fd != -1) {
+		outputreserve(fd,size,NULL);
+		close(fd);
+		imagestats.syscalls++;
+	}
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return fd == -1 ? -1 : 0;
+}
+
+// Create a file, emptying it if it's already there, reserve size bytes for it and open it for writing, like
+// outputfopen() with "w" but with the space reserved on the descriptor the file is written through. *grown is set if
+// the reservation made the file size bytes long. Returns NULL if it can't be created
+FILE *outputfcreate(char *name, uint32_t size, int *grown) {
+	uint64_t start = monotonicnanoseconds();
+	FILE *f = NULL;
+	int fd = -1;
+
+#ifdef _HAVE_IO_URING
+	struct stat st;
+
+	// Truncating a file that still has writes queued would have them land after the truncation
+	if(outputring != NULL && stat(name,&st) == 0 && outputringpending(&st))
+		outputringdrain();
+#endif
+	fd = open(name,O_RDWR|O_CREAT|O_TRUNC,0666);
+	imagestats.syscalls++;
+	if(fd != -1) {
+		outputreserve(fd,size,grown);
+#ifdef _HAVE_IO_URING
+		if(outputring != NULL)
+			f = outputringfdopen(fd,"r+");
+		else
+#endif
+		if((f = fdopen(fd,"r+")) == NULL)
+			close(fd);
+	}
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return f;
+}
+
+// Seeking and writing are buffered by stdio, they are counted as one system call each as they usually end up as one
+int outputfseek(FILE *f, long offset, int whence) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = fseek(f,offset,whence);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return ret;
+}
+
+size_t outputfwrite(void *data, size_t size, size_t count, FILE *f) {
+	uint64_t start = monotonicnanoseconds();
+	size_t ret = fwrite(data,size,count,f);
+
+	imagestats.syscalls++;
+	imagestats.byteswritten += ret*size;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return ret;
+}
+
+int outputfclose(FILE *f) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = fclose(f);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	return ret;
+}
+
+// Added for version 5
+// Arena for the names and path components of an image, they are carved out of a few large blocks instead of being
+// allocated one by one, and are all given back at once by resetting the arena when the next image starts. The blocks
+// are kept between images so a batch run only allocates them for the first one. Besides the buffers extractimage()
+// sets up, the arena holds the name of every file and directory whose timestamp is recorded and the names given to
+// orphans, so how much of it an image uses depends on how many files it has
+
+// Size of an arena block, a DD image with a few hundred files fits in one
+#define ARENA_BLOCK (1024*1024)
+
+struct arenablock {
+	struct arenablock *next;
+	size_t size;
+	size_t used;
+	uint8_t data[];
+};
+
+struct arena {
+	struct arenablock *first;
+	struct arenablock *current;
+	// Bytes carved out since the last reset, and the most there has been since then
+	size_t used;
+	size_t peak;
+};
+
+// Arena for the names and paths of the image being extracted
+struct arena namearena;
+
+// Carve length bytes out of an arena, aligned for any type, returns NULL if we're out of memory
+void *arenaalloc(struct arena *arena, size_t length) {
+	struct arenablock *block = arena->current;
+	void *data;
+
+	length = (length+15) & ~(size_t)15;
+	// Move on to the next block, or add one, until the allocation fits
+	while(block == NULL || block->used+length > block->size) {
+		if(block != NULL && block->next != NULL) {
+			block = block->next;
+			block->used = 0;
+			continue;
+		}
+		block = malloc(sizeof(struct arenablock)+(length > ARENA_BLOCK ? length : ARENA_BLOCK));
+		if(block == NULL)
+			return NULL;
+		block->next = NULL;
+		block->size = length > ARENA_BLOCK ? length : ARENA_BLOCK;
+		block->used = 0;
+		if(arena->current != NULL) {
+			// Link it in after the current block, the blocks after that are still there to be reused
+			block->next = arena->current->next;
+			arena->current->next = block;
+		} else {
+			arena->first = block;
+		}
+	}
+	arena->current = block;
+	data = block->data+block->used;
+	block->used += length;
+	arena->used += length;
+	if(arena->used > arena->peak)
+		arena->peak = arena->used;
+	return data;
+}
+
+// Carve a string of length bytes out of an arena and make it empty
+char *arenastring(struct arena *arena, size_t length) {
+	char *string = arenaalloc(arena,length);
+
+	if(string != NULL)
+		string[0] = '\0';
+	return string;
+}
+
+// Copy a string into an arena, cut to fit in length bytes like snprintf() would
+char *arenacopy(struct arena *arena, char *string, size_t length) {
+	size_t size = strnlen(string,length-1)+1;
+	char *copy = arenaalloc(arena,size);
+
+	if(copy != NULL) {
+		memcpy(copy,string,size-1);
+		copy[size-1] = '\0';
+	}
+	return copy;
+}
+
+// Give everything carved out of an arena back at once, the blocks are kept
+void arenareset(struct arena *arena) {
+	arena->current = arena->first;
+	if(arena->first != NULL)
+		arena->first->used = 0;
+	arena->used = 0;
+	arena->peak = 0;
+}
+
+// Added for version 5
+// Deferred timestamps, the final timestamp of every file and directory we create is recorded here while extracting
+// and applied once after the scan, so we don't do a path lookup and inode update for every single block
+struct stampentry {
+	// The directory the entry lives in, an index into the directory table
+	int dir;
+	// Set for directories, which get their timestamps applied after all the files
+	int isdir;
+	// Next entry recorded from the same sector, -1 if there is none
+	int next;
+	// Access and modification times
+	struct timespec times[2];
+	// Name of the entry inside its directory, in the name arena
+	char *name;
+};
+
+// A directory we have changed into, identified by its parent and name, directory 0 is where we started
+// The descriptor is opened the first time something is recorded in the directory and is used with utimensat()
+struct stampdir {
+	int parent;
+	int fd;
+	// In the name arena
+	char *name;
+};
+
+struct stamptable {
+	// The recorded entries
+	struct stampentry *entries;
+	int numentries;
+	int maxentries;
+	// First entry recorded for every sector, two slots per sector (file and directory), -1 if not recorded
+	int index[2*MAX_SECTORS];
+	// The directory table and the directory we're currently in
+	struct stampdir *dirs;
+	int numdirs;
+	int maxdirs;
+	int cwd;
+};
+
+// Initialize an empty stamp table, the current working directory becomes directory 0. The names are carved out of the
+// name arena, the table has to be done with before the arena is reset
+// Returns 0 on success, -1 if we're out of memory
+int initstamps(struct stamptable *table) {
+	int i = 0;
+
+	table->entries = NULL;
+	table->numentries = 0;
+	table->maxentries = 0;
+	table->numdirs = 0;
+	for(i = 0; i < 2*MAX_SECTORS; i++)
+		table->index[i] = -1;
+	table->dirs = malloc(64*sizeof(struct stampdir));
+	if(table->dirs == NULL)
+		return -1;
+	table->maxdirs = 64;
+	table->numdirs = 1;
+	table->cwd = 0;
+	table->dirs[0].parent = -1;
+	table->dirs[0].fd = -1;
+	table->dirs[0].name = arenacopy(&namearena,".",MAX_FILENAME_LENGTH);
+	return table->dirs[0].name == NULL ? -1 : 0;
+}
+
+// Find the directory called name inside directory parent, adding it to the table if we haven't been there before
+// Returns -1 if we're out of memory
+int stampdir(struct stamptable *table, int parent, char *name) {
+	struct stampdir *dirs;
+	int i = 0;
+
+	for(i = 1; i < table->numdirs; i++)
+		if(table->dirs[i].parent == parent && strncmp(table->dirs[i].name,name,MAX_FILENAME_LENGTH) == 0)
+			return i;
+	if(table->numdirs == table->maxdirs) {
+		dirs = realloc(table->dirs,(table->maxdirs+64)*sizeof(struct stampdir));
+		if(dirs == NULL)
+			return -1;
+		table->dirs = dirs;
+		table->maxdirs += 64;
+	}
+	table->dirs[table->numdirs].parent = parent;
+	table->dirs[table->numdirs].fd = -1;
+	table->dirs[table->numdirs].name = arenacopy(&namearena,name,MAX_FILENAME_LENGTH);
+	if(table->dirs[table->numdirs].name == NULL)
+		return -1;
+	return table->numdirs++;
+}
+
+// Change into the directory name and keep track of where we are, returns the result of chdir()
+int stampchdir(struct stamptable *table, char *name) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = chdir(name);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	if(ret == 0)
+		table->cwd = stampdir(table,table->cwd,name);
+	return ret;
+}
 
-	// Time variable for epoch at 1978-01-01
-	time_t origstamp = 252460800;
+// Change back to a directory we've saved a descriptor for, dir is where that descriptor points in the directory table
+// Returns the result of fchdir()
+int stampfchdir(struct stamptable *table, int fd, int dir) {
+	uint64_t start = monotonicnanoseconds();
+	int ret = fchdir(fd);
+
+	imagestats.syscalls++;
+	imagestats.writetime += monotonicnanoseconds()-start;
+	if(ret == 0)
+		table->cwd = dir;
+	return ret;
+}
 
-	// Div by zero check and fix for ticks
-	if(!ticks)
-		ticks=1;
+// Record the timestamp of an entry in the current working directory, key is the sector the entry was made from
+// If the entry has already been recorded only the timestamp is updated, which doesn't cost any system calls
+// If the entry can't be recorded the timestamp is applied right away instead
+// Returns the index of the entry in the table, or -1 if it wasn't recorded
+int recordstamp(struct stamptable *table, uint32_t key, int isdir, char *name, uint32_t days, uint32_t minutes, uint32_t ticks) {
+	struct stampentry *entries;
+	struct timespec ts;
+	int idx = -1;
+
+	amigadaystotimespec(days,minutes,ticks,&ts);
+	if(key < MAX_SECTORS && table->cwd != -1) {
+		// Look for the same entry in the same directory, if we've been there the last timestamp recorded wins
+		for(idx = table->index[key*2+(isdir ? 1 : 0)]; idx != -1; idx = table->entries[idx].next) {
+			if(table->entries[idx].dir == table->cwd && strncmp(table->entries[idx].name,name,MAX_FILENAME_LENGTH) == 0) {
+				table->entries[idx].times[0] = ts;
+				table->entries[idx].times[1] = ts;
+				return idx;
+			}
+		}
+		if(table->numentries == table->maxentries) {
+			entries = realloc(table->entries,(table->maxentries+256)*sizeof(struct stampentry));
+			if(entries != NULL) {
+				table->entries = entries;
+				table->maxentries += 256;
+			}
+		}
+		// Open a descriptor for the directory the first time we record something in it
+		if(table->dirs[table->cwd].fd == -1)
+			table->dirs[table->cwd].fd = outputopendir(".");
+		if(table->numentries < table->maxentries)
+			table->entries[table->numentries].name = arenacopy(&namearena,name,MAX_FILENAME_LENGTH);
+	}
+	if(key >= MAX_SECTORS || table->cwd == -1 || table->numentries == table->maxentries || table->dirs[table->cwd].fd == -1 ||
+		table->entries[table->numentries].name == NULL) {
+		struct timespec times[2] = { ts, ts };
+		outputringdrain();
+		imagestats.syscalls++;
+		utimensat(AT_FDCWD,name,times,0);
+		return -1;
+	}
+	table->entries[table->numentries].dir = table->cwd;
+	table->entries[table->numentries].isdir = isdir;
+	table->entries[table->numentries].times[0] = ts;
+	table->entries[table->numentries].times[1] = ts;
+	table->entries[table->numentries].next = table->index[key*2+(isdir ? 1 : 0)];
+	table->index[key*2+(isdir ? 1 : 0)] = table->numentries++;
+	return table->numentries-1;
+}
 
-	// Add to the origstampto get epoch time
-	// Multiply days with 86400 seconds per day, minutes with 60 seconds, and divide the ticks by 50 (ticks per second)
-	origstamp += (time_t)(days*86400)+(minutes*60)+(ticks/50);
+// Put the path of a recorded entry together from the directory table
+void stamppath(struct stamptable *table, int idx, char *path, size_t pathsize) {
+	char component[MAX_PATH_DEPTH*MAX_AMIGADOS_FILENAME_LENGTH];
+	int dir = 0;
 
-	// Set struct mod and access times as the current timestamp
+	snprintf(path,pathsize,"%s",table->entries[idx].name);
+	for(dir = table->entries[idx].dir; dir > 0; dir = table->dirs[dir].parent) {
+		snprintf(component,sizeof(component),"%s/%s",table->dirs[dir].name,path);
+		snprintf(path,pathsize,"%s",component);
+	}
+}
 
-	utim->actime = (time_t)origstamp;
-	utim->modtime = (time_t)origstamp;
+// Added for version 5
+// Compare the size of every file made from a file header with the size its header gives, a file comes out shorter
+// when data blocks are lost and longer when data blocks of another file with the same name land in it
+// Every mismatch is reported and counted, this has to be done before the timestamps are applied as that empties the table
+void checksizes(struct stamptable *table, union sector *sector, uint32_t endsector, FILE *outfile) {
+	char path[MAX_PATH_DEPTH*MAX_AMIGADOS_FILENAME_LENGTH];
+	struct stat st;
+	uint32_t key = 0; uint32_t size = 0;
+	int idx = 0;
+
+	// The sizes are only right once everything queued has been written
+	outputringdrain();
+	for(key = 0; key < endsector && key < MAX_SECTORS; key++) {
+		if(amiga32(sector[key].hdr.type) != T_HEADER || (int32_t)amiga32(sector[key].fh.sec_type) != -3)
+			continue;
+		size = amiga32(sector[key].fh.byte_size);
+		for(idx = table->index[key*2]; idx != -1; idx = table->entries[idx].next) {
+			if(table->dirs[table->entries[idx].dir].fd == -1)
+				continue;
+			imagestats.syscalls++;
+			if(fstatat(table->dirs[table->entries[idx].dir].fd,table->entries[idx].name,&st,0) == -1 || !S_ISREG(st.st_mode))
+				continue;
+			if((uint64_t)st.st_size == size)
+				continue;
+			imagestats.sizemismatches++;
+			stamppath(table,idx,path,sizeof(path));
+			fprintf(outfile,"Size mismatch: %s has %lld bytes but its header says %u\n",path,(long long)st.st_size,size);
+		}
+	}
+}
 
-	// Return the utimstruct
-	return utim;
+// Close the directory descriptors of a stamp table and empty it without applying anything, for when extracting an
+// image fails and after the timestamps have been applied
+void freestamps(struct stamptable *table) {
+	int i = 0;
+
+	for(i = 0; i < table->numdirs; i++)
+		if(table->dirs[i].fd != -1)
+			outputclose(table->dirs[i].fd);
+	free(table->dirs);
+	free(table->entries);
+	table->dirs = NULL;
+	table->entries = NULL;
+	table->numdirs = 0;
+	table->numentries = 0;
+	table->maxentries = 0;
+}
 
+// Apply all the recorded timestamps, files first and then directories so creating the files doesn't clobber the
+// directory timestamps, then close the directory descriptors and empty the table
+void applystamps(struct stamptable *table, unsigned int debug, FILE *debugfile) {
+	uint64_t start = monotonicnanoseconds();
+	int pass = 0; int i = 0;
+
+	// Everything has to be written before the timestamps are set
+	outputringdrain();
+	for(pass = 0; pass < 2; pass++) {
+		for(i = 0; i < table->numentries; i++) {
+			if(table->entries[i].isdir != pass)
+				continue;
+			// Every entry is one file or directory we created
+			if(pass)
+				imagestats.directories++;
+			else
+				imagestats.files++;
+			imagestats.syscalls++;
+			if(utimensat(table->dirs[table->entries[i].dir].fd,table->entries[i].name,table->entries[i].times,0) == -1 && debug)
+				fprintf(debugfile,"Can't set timestamp on %s: %s\n",table->entries[i].name,strerror(errno));
+		}
+	}
+	if(debug)
+		fprintf(debugfile,"Applied %d timestamps in %d directories\n",table->numentries,table->numdirs);
+	freestamps(table);
+	imagestats.writetime += monotonicnanoseconds()-start;
 }
 
 // DMS helper functions to calculate CRC, (C) 1998 David Tritscher
@@ -335,8 +1524,14 @@ int crunch_store(unsigned char *source, unsigned char *source_end,
                  unsigned char *destination, unsigned char *destination_end,
 	         unsigned int debug,FILE *debugfile)
 {
-	while((destination < destination_end) && (source < source_end))
-		*destination++ = *source++;
+	// Changed for version 5, copy the bytes in one go
+	size_t length = (source_end - source < destination_end - destination) ? source_end - source : destination_end - destination;
+
+	if(source < source_end && destination < destination_end) {
+		memcpy(destination,source,length);
+		source += length;
+		destination += length;
+	}
 
 	// Print debug output if wanted
 	if(debug) 
@@ -366,63 +1561,76 @@ int crunch_rle(unsigned char *source, unsigned char *source_end,
 	int unpackedsize = 0;
 	int rletotalbytes = 0;
 
+	// Length of a run of bytes copied as they are, and the RLE marker that ends it
+	size_t span = 0;
+	unsigned char *marker = NULL;
+
 	// Until we've completed reading all the destination bytes...
 	while((destination < destination_end) && (source < source_end)) {
+		// Changed for version 5, everything up to the next RLE marker is copied in one go
+		if(*source != 144) {
+			span = source_end - source;
+			if(span > destination_end - destination)
+				span = destination_end - destination;
+			marker = memchr(source,144,span);
+			if(marker != NULL)
+				span = marker - source;
+			memcpy(destination,source,span);
+			destination += span;
+			source += span;
+			totalbytes += span;
+			rletotalbytes += span;
+			continue;
+		}
 		// Read current pointed to of source into temp and then increment source
 		temp = *source++;
 		totalbytes++;
 		rletotalbytes++;
-		// Not RLE encoded, just copy bytes
-		if(temp != 144) {
-			*destination++ = temp;
-		} else {
-			// We've wasted a character here on rlebytes
-			rlebytes++;
-			// Count is in next seat
-			count = *source++;
-			// Another character here on rlebytes
-			rlebytes++;
+		// We've wasted a character here on rlebytes
+		rlebytes++;
+		// Count is in next seat
+		count = *source++;
+		// Another character here on rlebytes
+		rlebytes++;
+		totalbytes++;
+		rletotalbytes++;
+		// Count uses more than one byte?
+		if(count==255) {
+			// Next byte is rlechar
+			rlechar = *source++;
 			totalbytes++;
 			rletotalbytes++;
-			// Count uses more than one byte?
-			if(count==255) {
-				// Next byte is rlechar
-				rlechar = *source++;
-				totalbytes++;
-				rletotalbytes++;
-				// Next two bytes are the counter
-				temp = *source++;
-				totalbytes++;
-				rletotalbytes++;
-				tempcount = (temp <<8);
-				count = tempcount;
-				temp = *source++;
-				totalbytes++;
-				rletotalbytes++;
-				count += temp;
-				rlebytes+=3;
-			} else if(count != 0) {
-				// Next byte is rlechar
-				rlechar = *source++;
-				totalbytes++;
-				rletotalbytes++;
-			}
-			// Count is 0 than this is a literal  character
-			if(count == 0) {
-				*destination++ = temp;
-				// And we've saved one rle byte
-				rlebytes--;
-			// Counter is not 0, procceed with unRLE
-			} else {
-				// While we have repeats, fill the destination array with the repeated byte
-				while(count > 0) {
-					*destination++ = rlechar;
-					count--;
-					rlesaved++;
-					rletotalbytes++;
-				}
-				rlesaved--;
-			}
+			// Next two bytes are the counter
+			temp = *source++;
+			totalbytes++;
+			rletotalbytes++;
+			tempcount = (temp <<8);
+			count = tempcount;
+			temp = *source++;
+			totalbytes++;
+			rletotalbytes++;
+			count += temp;
+			rlebytes+=3;
+		} else if(count != 0) {
+			// Next byte is rlechar
+			rlechar = *source++;
+			totalbytes++;
+			rletotalbytes++;
+		}
+		// Count is 0 than this is a literal  character
+		if(count == 0) {
+			*destination++ = temp;
+			// And we've saved one rle byte
+			rlebytes--;
+		// Counter is not 0, procceed with unRLE
+		} else {
+			// Fill the destination with the repeated byte, a run can't go past the end of the destination
+			if(count > destination_end - destination)
+				count = destination_end - destination;
+			memset(destination,rlechar,count);
+			destination += count;
+			rlesaved += count - 1;
+			rletotalbytes += count;
 		}
 	}  // End while
 	unpackedsize = totalbytes - rlebytes + rlesaved;
@@ -435,6 +1643,55 @@ int crunch_rle(unsigned char *source, unsigned char *source_end,
 	return((source != source_end) || (destination != destination_end));
 }
 
+// Added for version 5
+// Copy a match of count bytes from offset in a ring buffer of mask+1 bytes to position *local in it and to destination,
+// this is what the LZ decoders used to do one byte at a time. A match one byte behind is a run and is filled with
+// memset, matches further behind are copied 16 or 8 bytes at a time, only short matches, matches that wrap around
+// the ring and matches that overlap by less than 8 bytes are copied byte by byte, returns the new end of the
+// destination
+unsigned char *copymatch(unsigned char *ring, unsigned int mask, unsigned int *local, int offset, int count,
+                         unsigned char *destination, unsigned char *destination_end)
+{
+	unsigned int from = offset & mask;
+	unsigned int to = *local & mask;
+	unsigned int distance = to - from;
+	int i = 0;
+
+	if(count > destination_end - destination)
+		count = destination_end - destination;
+	if(count <= 0)
+		return destination;
+	// The match is short or wraps around the ring, do it the old way
+	if(count < 8 || from + count > mask + 1 || to + count > mask + 1) {
+		while(count--)
+			*destination++ = ring[(*local)++ & mask] = ring[offset++ & mask];
+		return destination;
+	}
+	if(to < from) {
+		// The source is ahead of us in the ring, it's only ever read before it's overwritten
+		memmove(ring + to, ring + from, count);
+	} else if(distance == 1) {
+		memset(ring + to, ring[from], count);
+	} else if(distance >= (unsigned int)count) {
+		memcpy(ring + to, ring + from, count);
+	} else if(distance >= 8) {
+		// The match repeats itself, copy chunks no larger than the distance so every chunk reads finished bytes
+		if(distance >= 16)
+			for(; i + 16 <= count; i += 16)
+				memcpy(ring + to + i, ring + from + i, 16);
+		for(; i + 8 <= count; i += 8)
+			memcpy(ring + to + i, ring + from + i, 8);
+		for(; i < count; i++)
+			ring[to + i] = ring[from + i];
+	} else if(distance != 0) {
+		for(; i < count; i++)
+			ring[to + i] = ring[from + i];
+	}
+	memcpy(destination,ring + to,count);
+	*local += count;
+	return destination + count;
+}
+
 // Quick crunch function, (C) 1998 David Tritscher
 int crunch_quick(unsigned char *source, unsigned char *source_end,
                  unsigned char *destination, unsigned char *destination_end,
@@ -467,6 +1724,7 @@ int crunch_quick(unsigned char *source, unsigned char *source_end,
 			}
 			count = ((control >> 24) & 3) + 2;
 			offset = quick_local - ((control >> 16) & 255) - 1;
+			// Quick matches are 2 to 5 bytes, too short for copymatch() to be of any use
 			while((destination < destination_end) && (count--))
 				*destination++ = quick_buffer[quick_local++ & 255] =
 			quick_buffer[offset++ & 255];
@@ -522,8 +1780,7 @@ int crunch_medium(unsigned char *source, unsigned char *source_end,
 			}
 			offset += (control >> 16) & 255;
 			offset = medium_local - offset - 1;
-			while((destination < destination_end) && (count--))
-				*destination++ = medium_buffer[medium_local++ & 16383] = medium_buffer[offset++ & 16383];
+			destination = copymatch(medium_buffer,16383,&medium_local,offset,count,destination,destination_end);
 		}
 	} /* while */
 
@@ -668,8 +1925,7 @@ int crunch_deep(unsigned char *source, unsigned char *source_end,
 			}
 			offset += (control >> 16) & 255;
 			offset = deep_local - offset - 1;
-			while((destination < destination_end) && (count--))
-				*destination++ = deep_buffer[deep_local++ & 16383] = deep_buffer[offset++ & 16383];
+			destination = copymatch(deep_buffer,16383,&deep_local,offset,count,destination,destination_end);
 		}
 	} /* while */
 
@@ -913,8 +2169,7 @@ int crunch_heavy(unsigned char *source, unsigned char *source_end,
 					heavy_last_offset = offset;
 				}
 				offset = heavy_local - offset - 1;
-				while((destination < destination_end) && (count--))
-					*destination++ = heavy_buffer[heavy_local++ & 8191] = heavy_buffer[offset++ & 8191];
+				destination = copymatch(heavy_buffer,8191,&heavy_local,offset,count,destination,destination_end);
 			} /* if(string) */
 		}
 	} /* if(!flag) */
@@ -929,17 +2184,57 @@ int crunch_heavy(unsigned char *source, unsigned char *source_end,
 
 // Print usage information, Added Sibbi 2011, added 2017, 2019
 void usage(char *programname) {
-	fprintf(stderr,"Extract-ADF 4.0 Originally (C)2008 Michael Steil with many further additions by Sigurbjorn B. Larusson\n");
+	fprintf(stderr,"Extract-ADF 5.0 Originally (C)2008 Michael Steil with many further additions by Sigurbjorn B. Larusson\n");
 	fprintf(stderr,"DMS extraction code (C) 1998 David Tritscher\n");
-        fprintf(stderr,"\nUsage: %s [-D] [-a] [-z] [-d] [-s <startsector>] [-e <endsector>] [-o <outputfilename>] <adf/adz/dmsfilename>\n",programname);
+        fprintf(stderr,"\nUsage: %s [-D] [-a] [-z] [-d] [-c] [-b|-u] [-s <startsector>] [-e <endsector>] [-o <outputfilename>] [-j <jsonfilename>] [-t <threads>] [-w <sectors>] [-I <indexfile>] [-q <depth>] [-i <pattern>] [-x <pattern>] [-m <manifest>] [-k <password>|-K <key>] <adf/adz/dmsfilename> [...]\n",programname);
+	fprintf(stderr,"       %s [-o <outputfilename>] -L <indexfile> <filename>[@<version>] [...]\n",programname);
+	fprintf(stderr,"       %s [-o <outputfilename>] [-q <depth>] [options for every job] -S <socket> [-P <workers>]\n",programname);
+	fprintf(stderr,"       %s [-D] [-a|-z|-d] [-s <startsector>] [-e <endsector>] [-o <outputfilename>] -C <image> <otherimage>\n",programname);
+	fprintf(stderr,"       %s [-o <outputfilename>] -T <image> [...]\n",programname);
+	fprintf(stderr,"       %s [-D] [-a|-z|-d] [-o <outputfilename>] [-P <threads>] [-k <password>|-K <key>] -A <image> [...]\n",programname);
 	fprintf(stderr,"\n\t-a will force ADF extraction (if the filename ends in adf ADF will be assumed");
 	fprintf(stderr,"\n\t-z will force ADZ extraction (if the filename ends in adz or adf.gz ADZ will be assumed");
 	fprintf(stderr,"\n\t-d will force DMS extraction (if the filename ends in dms DMS format will be assumed");
+	fprintf(stderr,"\n\t-c will reconstruct files whose header block is lost by following the next_data chain of their data blocks");
+	fprintf(stderr,"\n\t-b will only scan the blocks the allocation bitmap of the disk marks as in use, skipping stale free blocks");
+	fprintf(stderr,"\n\t-u will only scan the blocks the allocation bitmap marks as free, use this to look for deleted files");
 	fprintf(stderr,"\n\t-D will activate debugging output which will print very detailed information about everything that is going on");
 	fprintf(stderr,"\n\t-s along with an integer argument from 0 to 1760 (DD) or 3520 (HD), will set the starting sector of the extraction process");
 	fprintf(stderr,"\n\t-e along with an integer argument from 0 to 1760 (DD) or 3520 (HD), will set the end sector of the extraction process");
 	fprintf(stderr,"\n\t-o along with an outputfilename will redirect output (including debugging output) to a file instead of to the screen");
-	fprintf(stderr,"\n\tFinally the last argument is the ADF/ADZ or DMS filename to process");
+	fprintf(stderr,"\n\t-j along with a filename will write a JSON report of timings and counters for every image to that file (- for stdout,\n\tthe output then goes to stderr unless -o is given)");
+	fprintf(stderr,"\n\t-t along with a number from 1 to 256 will split classifying the sectors by type between that many threads");
+	fprintf(stderr,"\n\t-w along with a number of sectors will extract an uncompressed image of any size in windowed mode, reading that");
+	fprintf(stderr,"\n\tmany sectors at a time and keeping only 16 bytes per sector in memory, the end sector defaults to the end of the image");
+	fprintf(stderr,"\n\t-I along with a filename will write an index of every file extracted (image, path, size, date, hash and $VER: string)");
+	fprintf(stderr,"\n\t-L along with an index filename looks up the file names given instead of images, in the indexes written with -I,");
+	fprintf(stderr,"\n\tname@text only matches files whose version string contains text, e.g. %s -L disks.idx xyz.library@40.",programname);
+	fprintf(stderr,"\n\t-q along with a queue depth from 1 to 4096 will queue the writes to the extracted files with io_uring on Linux,");
+	fprintf(stderr,"\n\tthe files are written synchronously if io_uring is not available");
+	fprintf(stderr,"\n\t-i along with a pattern like libs/*.library will only extract the files whose path from the root of the disk");
+	fprintf(stderr,"\n\tmatches it, a pattern without a / only has to match the file name, -x leaves the files that match out instead,");
+	fprintf(stderr,"\n\tboth can be given more than once and are not case sensitive");
+	fprintf(stderr,"\n\t-m along with a filename will write a manifest with the size, SHA-256 and 64 bit FNV-1a hash of every file");
+	fprintf(stderr,"\n\textracted, one tab separated line per file, computed while the files are written");
+	fprintf(stderr,"\n\t-k along with a password decrypts encrypted DMS archives, -K along with a number from 0 to 0xffff gives the");
+	fprintf(stderr,"\n\tkey itself, without either the key of an encrypted archive is searched for with -t threads (default the number");
+	fprintf(stderr,"\n\tof CPUs) and printed, banner and FILE_ID.DIZ tracks are skipped");
+	fprintf(stderr,"\n\t-C along with an image compares it with the other image sector by sector without extracting either, and");
+	fprintf(stderr,"\n\tlists the files that changed, were added or were removed, the exit code is 1 if any file differs");
+	fprintf(stderr,"\n\t-T only reads the bootblock and the root block of every image and writes one tab separated line about it: the");
+	fprintf(stderr,"\n\timage, its format, DD or HD, the filesystem, the bootblock (standard, custom, nonbootable or blank), whether");
+	fprintf(stderr,"\n\tthe root block is ok and the name of the disk");
+	fprintf(stderr,"\n\t-A unpacks every image to a raw ADF file named after it in the current directory instead of extracting it,");
+	fprintf(stderr,"\n\tthe empty tracks of a DMS archive are left as holes and raw images are copied as they are");
+	fprintf(stderr,"\n\t-S along with a socket path runs as a daemon that takes extraction jobs on that Unix domain socket, one per line");
+	fprintf(stderr,"\n\tas tab separated fields: the options -a -z -d -c -b -u -D -s -e -t -w -i -x, the image and the output directory,");
+	fprintf(stderr,"\n\teach job is answered with its JSON statistics and an empty line, SIGTERM stops the daemon");
+	fprintf(stderr,"\n\t-P along with a number from 1 to 256 sets how many jobs the daemon runs at once, or how many images -A");
+	fprintf(stderr,"\n\tunpacks at once (default the number of CPUs)");
+	fprintf(stderr,"\n\tFinally the last argument is the ADF/ADZ or DMS filename to process, if more than one is given each image is");
+	fprintf(stderr,"\n\textracted into a directory named after the image file");
+	fprintf(stderr,"\n\nThe format is detected from the first bytes of the file, the extension is only used if they are not recognised.");
+	fprintf(stderr,"\nDMS, gzip and zip containers are unpacked in memory, also when they are nested in each other");
 	fprintf(stderr,"\n\nThe defaults for start and end sector are 0 and 1760 respectively, this tool was originally"),
 	fprintf(stderr,"\ncreated to salvage lost data from kickstart disks (which contain the kickstart on sectors 0..512)");
 	fprintf(stderr,"\nin order to skip the sectors on kickstart disks which might contain non OFS data, set the start sector to 513\n");
@@ -949,851 +2244,3064 @@ void usage(char *programname) {
 	fprintf(stderr,"\nHappy hunting!\n");
 }
 
-// Added Sibbi for version 4
-// Uncompress file to temporary location and return a filepointer to the temporary uncompressed file
-#ifdef _HAVE_ZLIB
-FILE *uncompressfile(char *inputfile,unsigned int debug, FILE *debugfile) {
-	// File pointers
-	FILE *infile;
-	FILE *outfile;
-
-	// Temporary filename
-	char tmptemplate[] = "/tmp/extractadf.XXXXX";
+// Added for version 5
+// A growable buffer in memory, the decoders pass images to each other in these instead of in temporary files
+struct membuffer {
+	uint8_t *data;
+	// Bytes in use and bytes allocated
+	size_t size;
+	size_t allocated;
+	// Where readbuffer() continues from
+	size_t position;
+	// The allocation is known to be zeros from size up to here, see zeroedbuffer()
+	size_t cleared;
+	// Set for every sector that is all zeros or that the image doesn't have, NULL if the decoder doesn't keep track
+	// of them, only the DMS decoder does. These sectors are neither copied nor scanned
+	uint8_t *zerosectors;
+};
 
-	// File descriptor for temp file
-	int fd = 0;
+// Make room for length more bytes at the end of a buffer, returns 0 on success and 1 if the buffer would grow
+// beyond MAX_DECODED_SIZE or we're out of memory
+int reservebuffer(struct membuffer *buffer, size_t length) {
+	size_t allocated = buffer->allocated ? buffer->allocated : CHUNK;
+	uint8_t *data;
 
-	// To store whether this is a gzip or zip file, both of which are (annoyingly) common
-	int iszip = 0;
-	// To store the filename length for a zip file header
-	int zipfilenamelength = 0;
-	//  To store the extra header length for a zip file header
-	int zipextraheader = 0;
+	if(buffer->size+length > MAX_DECODED_SIZE)
+		return 1;
+	if(buffer->size+length <= buffer->allocated)
+		return 0;
+	while(allocated < buffer->size+length)
+		allocated *= 2;
+	data = realloc(buffer->data,allocated);
+	if(data == NULL)
+		return 1;
+	buffer->data = data;
+	buffer->allocated = allocated;
+	return 0;
+}
 
-	if(debug)
-	fprintf(debugfile,"Input filename is %s\n",inputfile);
-	
-	
-	// Define ZLib stream, and input and output chunks (CHUNK is defined as 0x4000 earlier in thsi program)
-	z_stream strm;
-	unsigned char in[CHUNK];
-	unsigned char out[CHUNK];
+// Read up to length bytes from the current position of a buffer, like fread() returns how much was read
+size_t readbuffer(void *destination, size_t length, struct membuffer *buffer) {
+	if(buffer->position >= buffer->size)
+		return 0;
+	if(length > buffer->size-buffer->position)
+		length = buffer->size-buffer->position;
+	memcpy(destination,buffer->data+buffer->position,length);
+	buffer->position += length;
+	return length;
+}
 
-	// For reading in the file header
-	unsigned char header[5];
-	// How many bytes we have
-	unsigned int have = 0;
-	// Store return code of inflate
-	int ret = 0;
+// Append length bytes to a buffer, like fwrite() returns how much was written
+size_t writebuffer(void *source, size_t length, struct membuffer *buffer) {
+	if(reservebuffer(buffer,length) != 0)
+		return 0;
+	memcpy(buffer->data+buffer->size,source,length);
+	buffer->size += length;
+	return length;
+}
 
-	// Open input and output files
-	if(inputfile != NULL) {
-		infile = fopen(inputfile,"r");
-		if(infile == NULL)  {
-			fprintf(stderr,"Can't open input file\n");
-			// Can't open file
-			return NULL;
-		}
-		// Is this a zip file?  A lot of people assume gzip/zip are the same, they are obviously not, zip is an archive file format
-		// However, even if this is a zip file, we might still be able to decompress it
-		// Read in the first four bytes
-		if(fread(header,1,4,infile) == 4) {
-			if(header[0] == 0x50 && header[1] == 0x4B && header[2] == 0x03 && header[3] == 0x04)  {
-				fprintf(stderr,"Input file appears to be in zip format\n");
-				// It's a zip file
-				iszip=1;
-				// Check the minimum version fields
-				if(fread(header,1,2,infile) == 2) {
-					if(header[1] != 0) {
-						// Seek to byte 5, after the pkzip + min version
-						fseek(infile,5,SEEK_SET);
-					// Otherwise this is a regular zip file
-					} else {
-						// Skip to byte 26 in the header
-						fseek(infile,26,SEEK_SET);
-						// Read the next 2 bytes which represent the length of the filename 
-						if(fread(header,1,2,infile) == 2) {
-							// Get length of filename (which is in LSB format) 
-							zipfilenamelength = (header[1]<<8)+header[0];
-							if(debug)
-								fprintf(debugfile,"Filename length %u %u\n",header[0],header[1]);
-							// Then the length of the extra header
-							if(fread(header,1,2,infile) == 2) {
-								zipextraheader = (header[1]<<8)+header[0];
-								// Skip 30+zipfilenamelength + zipextraheader bytes into the file
-								if(debug)
-									fprintf(debugfile,"Extra header length %u %u\n",header[0],header[1]);
-								fseek(infile,30+zipextraheader+zipfilenamelength,SEEK_SET);
-							} else {
-								fprintf(stderr,"ZIP header damaged\n");
-								return NULL;
-							}
-						} else {
-							fprintf(stderr,"ZIP header damaged\n");
-							return NULL;
-						}
-					} 
-				} else {
-					fprintf(stderr,"ZIP header damaged\n");
-					return NULL;
-				}
-			} else {
-				// Rewind to start of file
-				rewind(infile);
-			}
-		} else {
-			// Can't read 4 bytes from file
-			fprintf(stderr,"Can't read from input file\n");
-			return NULL;
-		}	
-		// Open temporary outfile
-		fd = mkstemp(tmptemplate);
-		// Can't create temp file
-		if(fd == -1) {
-			fprintf(stderr,"Can't open temporary file\n");
-			return NULL;
-		}
-		outfile = fdopen(fd,"w+");
-		if(outfile == NULL) {
-			fprintf(stderr,"Can't write temporary file\n");
-			// Can't write temporary outfile
-			return NULL;
-		}
-	} else {
-		fprintf(stderr,"Inputfile is not valid\n");
-		// Input file is not valid
-		return NULL;
+// Allocate an empty buffer with room for length bytes that are all zeros, along with the map of zero sectors. The
+// memory comes from calloc() so the pages that are never written are never even touched, which is what the zero
+// tracks of an image cost. Returns 0 on success and 1 if we're out of memory
+int zeroedbuffer(struct membuffer *buffer, size_t length) {
+	memset(buffer,0,sizeof(struct membuffer));
+	if(length > MAX_DECODED_SIZE)
+		length = MAX_DECODED_SIZE;
+	buffer->data = calloc(length ? length : 1,1);
+	buffer->zerosectors = calloc(MAX_DECODED_SIZE/sizeof(union sector),1);
+	if(buffer->data == NULL || buffer->zerosectors == NULL) {
+		free(buffer->data);
+		free(buffer->zerosectors);
+		memset(buffer,0,sizeof(struct membuffer));
+		return 1;
 	}
+	buffer->allocated = length;
+	buffer->cleared = length;
+	return 0;
+}
 
-	// Initial inflate state
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
+// Append length bytes of zeros to a buffer and mark the whole sectors among them in the zero map, they're only
+// written if the buffer wasn't allocated zeroed that far. Like fwrite() returns how much was written
+size_t zerobuffer(size_t length, struct membuffer *buffer) {
+	size_t start = buffer->size > buffer->cleared ? buffer->size : buffer->cleared;
+	size_t i = 0;
+
+	if(reservebuffer(buffer,length) != 0)
+		return 0;
+	if(buffer->size+length > start)
+		memset(buffer->data+start,0,buffer->size+length-start);
+	if(buffer->zerosectors != NULL)
+		for(i = (buffer->size+sizeof(union sector)-1)/sizeof(union sector); i < (buffer->size+length)/sizeof(union sector); i++)
+			buffer->zerosectors[i] = 1;
+	buffer->size += length;
+	return length;
+}
 
-	// if zip file return header, if we can't init, exit with NULL
-	if(!iszip) {
-		// Rewind to start of file
-		if(inflateInit2(&strm,32+MAX_WBITS) != Z_OK) {
-			fprintf(stderr,"Can't init zlib\n");
-			return NULL;
-		}
-	} else {
-		if(inflateInit2(&strm,-MAX_WBITS) != Z_OK) {
-			fprintf(stderr,"Can't init zlib\n");
-			return NULL;
-		}
-	}
+// Free the memory of a buffer and empty it
+void freebuffer(struct membuffer *buffer) {
+	free(buffer->data);
+	free(buffer->zerosectors);
+	memset(buffer,0,sizeof(struct membuffer));
+}
 
+// Read a whole file into a buffer, returns 0 on success and 1 on error
+int loadfile(char *filename, struct membuffer *buffer) {
+	uint8_t chunk[CHUNK];
+	size_t have = 0;
+	FILE *infile;
 
-	// Otherwise decompress until end of stream
-	do {
-		// Read CHUNK bytes from inputfile into the in buffer
-		strm.avail_in = fread(in,1,CHUNK,infile);
-		// Check for file error
-		if(ferror(infile)) {
-			fprintf(stderr,"Can't read inputfile\n");
-			// Error reading from inputfile, end inflate, return NULL
-			(void)inflateEnd(&strm);
-			return NULL;
+	memset(buffer,0,sizeof(struct membuffer));
+	infile = fopen(filename,"r");
+	if(infile == NULL)
+		return 1;
+	while((have = fread(chunk,1,CHUNK,infile)) > 0) {
+		if(writebuffer(chunk,have,buffer) != have) {
+			fprintf(stderr,"File %s is too large\n",filename);
+			fclose(infile);
+			freebuffer(buffer);
+			return 1;
 		}
-		if(strm.avail_in == 0)
-			// We are done reading, end this loop
-			break;
-		strm.next_in = in;
-		// Decompress data until available out bytes i 0
-		do {
-			strm.avail_out = CHUNK;
-			strm.next_out = out;
-
-			// Inflate and check for return code
-			ret = inflate(&strm,Z_NO_FLUSH);
-			assert(ret != Z_STREAM_ERROR);  /* state not clobbered, if so exit */
-			// If we encounter errors then exit
-			switch(ret) {
-				case Z_NEED_DICT:
-					fprintf(stderr,"Dictionary error while decompressing\n");
-					ret = Z_DATA_ERROR;     /* and fall through */
-				case Z_DATA_ERROR:
-					fprintf(stderr,"Data error while decompressing\n");
-				case Z_MEM_ERROR:
-					(void)inflateEnd(&strm);
-					return NULL;
+	}
+	if(ferror(infile)) {
+		fclose(infile);
+		freebuffer(buffer);
+		return 1;
+	}
+	fclose(infile);
+	return 0;
+}
+
+// Write an image to a raw file, runs of sectors that are zeros are left as holes by seeking over them instead of
+// being written, and the file is extended to its full size at the end so a trailing run is a hole as well. The
+// sectors in the zero map are zeros without looking at them, without the map the sectors are compared instead
+// Returns 0 on success and 1 on error
+int writesparseimage(char *filename, struct membuffer *image, unsigned int debug, FILE *debugfile) {
+	static const uint8_t zeros[sizeof(union sector)];
+	size_t sectors = image->size/sizeof(union sector);
+	size_t i = 0; size_t j = 0; size_t holes = 0;
+	ssize_t written = 0;
+	int fd = -1;
+
+	// The file is truncated first, so seeking is all it takes to make a hole and nothing has to be punched
+	fd = open(filename,O_WRONLY|O_CREAT|O_TRUNC,0666);
+	if(fd == -1) {
+		fprintf(stderr,"Can't create %s: %s\n",filename,strerror(errno));
+		return 1;
+	}
+	for(i = 0; i < sectors; i = j) {
+		// A run of sectors with data is written in one go
+		for(j = i; j < sectors && !(image->zerosectors != NULL ? image->zerosectors[j] :
+			memcmp(image->data+j*sizeof(union sector),zeros,sizeof(union sector)) == 0); j++);
+		while(i < j) {
+			written = write(fd,image->data+i*sizeof(union sector),(j-i)*sizeof(union sector));
+			if(written <= 0) {
+				fprintf(stderr,"Can't write %s: %s\n",filename,written < 0 ? strerror(errno) : "nothing was written");
+				close(fd);
+				return 1;
 			}
-			// Number of bytes we have to write
-			have = CHUNK - strm.avail_out;
-			// If we can't write out or there's a file error, exit
-			if(fwrite(out,1,have,outfile) != have || ferror(outfile)) {
-				fprintf(stderr,"Can't write to output file\n");
-				(void)inflateEnd(&strm);
-				return NULL;
+			i += written/sizeof(union sector);
+			if(written % sizeof(union sector) != 0) {
+				fprintf(stderr,"Can't write %s: short write\n",filename);
+				close(fd);
+				return 1;
 			}
-		} while(strm.avail_out == 0);
-	} while (ret != Z_STREAM_END);
-	// If we reached here the file is uncompressed...
-	// Close the input file
-	fclose(infile);
-	// Seek to 0 in the output file
-	rewind(outfile);
-	//  Return filepointer
-	return outfile;
-}	// End function uncompressfile
-#endif 	// if defined _HAVE_ZLIB
+		}
+		// And a run of zeros is skipped over
+		for(; j < sectors && (image->zerosectors != NULL ? image->zerosectors[j] :
+			memcmp(image->data+j*sizeof(union sector),zeros,sizeof(union sector)) == 0); j++)
+			holes++;
+		if(j > i && lseek(fd,(off_t)j*sizeof(union sector),SEEK_SET) == -1) {
+			fprintf(stderr,"Can't seek in %s: %s\n",filename,strerror(errno));
+			close(fd);
+			return 1;
+		}
+	}
+	// Anything after the last whole sector, and the size of the file if it ends in a hole
+	if(image->size > sectors*sizeof(union sector) &&
+		write(fd,image->data+sectors*sizeof(union sector),image->size-sectors*sizeof(union sector)) != (ssize_t)(image->size-sectors*sizeof(union sector))) {
+		fprintf(stderr,"Can't write %s: %s\n",filename,strerror(errno));
+		close(fd);
+		return 1;
+	}
+	if(ftruncate(fd,image->size) != 0 || close(fd) != 0) {
+		fprintf(stderr,"Can't write %s: %s\n",filename,strerror(errno));
+		return 1;
+	}
+	if(debug)
+		fprintf(debugfile,"Wrote %zu sectors to %s, %zu of them as holes\n",sectors,filename,holes);
+	return 0;
+}
 
-// Added Sibbi for version 4
-// Unpack DMS file to temporary location and return a filepointer to the temporary uncompressed file
-// Loosely based on code (C) 1998 David Tritscher
-FILE *undmsfile(char *inputfile,int endsector, unsigned int debug, FILE *debugfile) {
-	// File pointers
-	FILE *infile;
-	FILE *outfile;
+// Added for version 5
+// Collection index, a binary file listing every file extracted from every image of a run, sorted by file name so a
+// lookup is a binary search over the memory mapped index. The files are added as they are hashed for the manifest, so
+// only what an image produced ends up in the index and nothing is read back from disk. The index is written in the byte order of the host, the
+// byte order mark in the header tells a lookup on another kind of host that it can't use it
+
+#define INDEX_MAGIC "EADFIDX1"
+#define INDEX_BYTEORDER 0x01020304
+// Longest version string kept from a $VER: tag
+#define INDEX_MAX_VERSION 80
+
+// The header of an index file, followed by the images, the entries and the string table
+struct indexheader {
+	char magic[8];
+	uint32_t byteorder;
+	uint32_t images;
+	uint32_t entries;
+	uint32_t stringsize;
+};
 
-	// Temporary filename
-	char tmptemplate[] = "/tmp/extractadf.XXXXX";
+// One extracted file, the name is the last part of the path and is what the entries are sorted by, all the strings
+// are offsets into the string table, version is 0 if the file has no $VER: tag
+struct indexentry {
+	uint32_t name;
+	uint32_t path;
+	uint32_t version;
+	uint32_t image;
+	uint64_t size;
+	int64_t mtime;
+	uint64_t hash;
+};
 
-	// File descriptor for temp file
-	int fd = 0;
+// An index being built, the image table is the string offset of each image filename
+struct indexbuilder {
+	struct indexentry *entries;
+	uint32_t numentries;
+	uint32_t maxentries;
+	uint32_t *images;
+	uint32_t numimages;
+	struct membuffer strings;
+};
 
-	if(debug)
-		fprintf(debugfile,"Input filename is %s\n",inputfile);
-	
-	// Header array to read the dms header
-	unsigned char header[64];
+// The string table used while sorting the entries
+char *indexstrings;
 
-	//  Track header array to read the trackk header
-	unsigned char trackheader[32];
+// Add a string to the string table of an index, returns its offset
+uint32_t indexstring(struct indexbuilder *builder, char *string) {
+	uint32_t offset = builder->strings.size;
 
-	// Infobits integer
-	unsigned int infobits = 0;
+	if(writebuffer(string,strlen(string)+1,&builder->strings) != strlen(string)+1)
+		return 0;
+	return offset;
+}
 
-	//  Start and end track of DMS file
-	unsigned short dmsstarttrack = 0;
-	unsigned short dmsendtrack =  0;
+// Add a file to the index as belonging to image, version is the text of its $VER: tag or empty if it has none
+// Returns 1 if we're out of memory and 0 otherwise
+int indexadd(struct indexbuilder *builder, uint32_t image, char *path, uint64_t size, uint64_t hash, char *version, int64_t mtime) {
+	struct indexentry *entry;
 
-	// Size of compressed and uncompressed file
-	unsigned int dmspacksize = 0;
-	unsigned int dmsunpacksize = 0;
+	if(builder->numentries == builder->maxentries) {
+		entry = realloc(builder->entries,(builder->maxentries ? builder->maxentries*2 : 1024)*sizeof(struct indexentry));
+		if(entry == NULL) {
+			fprintf(stderr,"Out of memory\n");
+			return 1;
+		}
+		builder->entries = entry;
+		builder->maxentries = builder->maxentries ? builder->maxentries*2 : 1024;
+	}
+	entry = &builder->entries[builder->numentries++];
+	entry->name = indexstring(builder,strrchr(path,'/') != NULL ? strrchr(path,'/')+1 : path);
+	entry->path = indexstring(builder,path);
+	entry->version = *version ? indexstring(builder,version) : 0;
+	entry->image = image;
+	entry->size = size;
+	entry->mtime = mtime;
+	entry->hash = hash;
+	return 0;
+}
 
-	// Serial number of DMS file
-	unsigned int dmsserial = 0;
+// Added for version 5
+// Integrity manifest (-m), a SHA-256 and a 64 bit FNV-1a hash of every file extracted, computed from the blocks as
+// they are written so the files don't have to be read back. Every line is the image, the path of the file in the
+// output, its size, the SHA-256 and the FNV-1a hash separated by tabs
+
+// SHA-256 as in FIPS 180-4
+struct sha256 {
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t block[64];
+	unsigned int used;
+};
 
-	// DMS creator machine information
-	unsigned int dmscpu = 0;
-	unsigned int dmscopro = 0;
-	unsigned int dmsmachine = 0;
-	unsigned int dmsextra = 0;
-	unsigned int dmscpuspeed = 0;
+static const uint32_t sha256constants[64] = {
+	0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+	0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+	0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+	0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+	0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+	0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+	0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+	0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
 
-	// Time taken to create archive
-	unsigned int dmscreatetime = 0;
+#define SHA256ROTATE(x,n) (((x) >> (n)) | ((x) << (32-(n))))
+
+// Process one 64 byte block
+void sha256block(struct sha256 *sha, const uint8_t *block) {
+	uint32_t w[64];
+	uint32_t a = sha->state[0]; uint32_t b = sha->state[1]; uint32_t c = sha->state[2]; uint32_t d = sha->state[3];
+	uint32_t e = sha->state[4]; uint32_t f = sha->state[5]; uint32_t g = sha->state[6]; uint32_t h = sha->state[7];
+	uint32_t t1 = 0; uint32_t t2 = 0;
+	int i = 0;
+
+	for(i = 0; i < 16; i++)
+		w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16) | ((uint32_t)block[i*4+2] << 8) | block[i*4+3];
+	for(i = 16; i < 64; i++)
+		w[i] = (SHA256ROTATE(w[i-2],17) ^ SHA256ROTATE(w[i-2],19) ^ (w[i-2] >> 10)) + w[i-7] +
+			(SHA256ROTATE(w[i-15],7) ^ SHA256ROTATE(w[i-15],18) ^ (w[i-15] >> 3)) + w[i-16];
+	for(i = 0; i < 64; i++) {
+		t1 = h + (SHA256ROTATE(e,6) ^ SHA256ROTATE(e,11) ^ SHA256ROTATE(e,25)) + ((e & f) ^ (~e & g)) + sha256constants[i] + w[i];
+		t2 = (SHA256ROTATE(a,2) ^ SHA256ROTATE(a,13) ^ SHA256ROTATE(a,22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d+t1;
+		d = c; c = b; b = a; a = t1+t2;
+	}
+	sha->state[0] += a; sha->state[1] += b; sha->state[2] += c; sha->state[3] += d;
+	sha->state[4] += e; sha->state[5] += f; sha->state[6] += g; sha->state[7] += h;
+}
 
-	// Versions used to create and needed to extract this DMS
-	unsigned short dmscreateversion = 0;
-	unsigned short dmsextractversion = 0;
+void sha256init(struct sha256 *sha) {
+	static const uint32_t initial[8] = { 0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19 };
 
-	// Type of disk in this archive
-	unsigned short dmsdisktype = 0;
+	memcpy(sha->state,initial,sizeof(initial));
+	sha->length = 0;
+	sha->used = 0;
+}
 
-	// Struct to store dms time
-	struct tm *dmstime;
-	dmstime = malloc(sizeof(struct tm));
+void sha256update(struct sha256 *sha, const uint8_t *data, size_t size) {
+	size_t take = 0;
+
+	sha->length += size;
+	// Fill up a partial block first, then whole blocks straight from the data
+	if(sha->used) {
+		take = (size < 64-sha->used) ? size : 64-sha->used;
+		memcpy(sha->block+sha->used,data,take);
+		sha->used += take;
+		data += take;
+		size -= take;
+		if(sha->used < 64)
+			return;
+		sha256block(sha,sha->block);
+		sha->used = 0;
+	}
+	for(; size >= 64; data += 64, size -= 64)
+		sha256block(sha,data);
+	memcpy(sha->block,data,size);
+	sha->used = size;
+}
 
-	// Crunchmode used
-	unsigned short dmscrunchmode = 0;
+void sha256final(struct sha256 *sha, uint8_t *digest) {
+	uint64_t bits = sha->length*8;
+	int i = 0;
 
-	// DMS header CRC
-	unsigned short dmsheadercrc = 0;
+	sha->block[sha->used++] = 0x80;
+	if(sha->used > 56) {
+		memset(sha->block+sha->used,0,64-sha->used);
+		sha256block(sha,sha->block);
+		sha->used = 0;
+	}
+	memset(sha->block+sha->used,0,56-sha->used);
+	for(i = 0; i < 8; i++)
+		sha->block[56+i] = bits >> (56-i*8);
+	sha256block(sha,sha->block);
+	for(i = 0; i < 32; i++)
+		digest[i] = sha->state[i/4] >> (24-(i%4)*8);
+}
 
-	// Timestamp integer
-	time_t dmstimestamp = 0;
+// 64 bit FNV-1a, continued from hash, start with FNV1A64_START
+#define FNV1A64_START 0xcbf29ce484222325ULL
 
-	// Track header variables
-	unsigned int trackcurrent = 0;
-	unsigned int trackpacked = 0;
-	unsigned int trackrlesize = 0;
-	unsigned int trackunpacked = 0;
-	unsigned int trackpackmode = 0;
-	unsigned int trackcrc = 0;
-	unsigned int trackpackcrc = 0;
-	unsigned int trackunpackcrc = 0;
-	unsigned int trackcflags = 0;
+uint64_t fnv1a64(uint64_t hash, const uint8_t *data, size_t size) {
+	size_t i = 0;
 
-	// Flags set in trackcflags
-	unsigned int trackcflag_noclear = 0;
-	unsigned int trackcflag_compressed = 0;
-	unsigned int trackcflag_rle = 0;
+	for(i = 0; i < size; i++) {
+		hash ^= data[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
 
-	// Pointer to the current buffer
-	unsigned char *buffer;
+// Both hashes of a file that is written front to back, gaps are hashed as the zeroes they read back as
+struct filehash {
+	struct sha256 sha;
+	uint64_t fnv;
+	// Bytes hashed so far, and set if something was written before that or the file on disk holds more than what was
+	// hashed, the file then has to be hashed from disk
+	uint64_t length;
+	int rewritten;
+	// The text after the first $VER: tag for the collection index, and how much of the tag has been seen
+	char version[INDEX_MAX_VERSION];
+	int versionlength;
+	int versionstate;
+};
 
-	// String to print time
-	char timestring[80];
+// States of the $VER: tag search after the five characters of the tag, VERSION_SPACES skips the spaces after it
+#define VERSION_SPACES 5
+#define VERSION_TEXT 6
+#define VERSION_DONE 7
+
+void filehashinit(struct filehash *hash) {
+	sha256init(&hash->sha);
+	hash->fnv = FNV1A64_START;
+	hash->length = 0;
+	hash->rewritten = 0;
+	hash->version[0] = '\0';
+	hash->versionlength = 0;
+	hash->versionstate = 0;
+}
 
-	// Temporary loop variable
-	int i=0;
+// Look for the first $VER: tag in the next bytes of a file, the tag can be split over several calls
+void filehashversion(struct filehash *hash, const uint8_t *data, size_t size) {
+	static const char tag[] = "$VER:";
+	const uint8_t *end = data+size;
 
-	// Open input and output files
-	if(inputfile != NULL) {
-		infile = fopen(inputfile,"r");
-		if(infile == NULL)  {
-			fprintf(stderr,"Can't open input file\n");
-			// Can't open file
-			return NULL;
-		}
-		// Open temporary outfile
-		fd = mkstemp(tmptemplate);
-		// Can't create temp file
-		if(fd == -1) {
-			fprintf(stderr,"Can't open temporary file\n");
-			return NULL;
-		}
-		// Open outfile for read/write
-		outfile = fdopen(fd,"w+");
-		if(outfile == NULL) {
-			fprintf(stderr,"Can't write temporary file\n");
-			// Can't write temporary outfile
-			return NULL;
-		}
-		// We're ready to start processing the header...
-		if((fread(header,1,4,infile) == 4)) {
-			// Check for DMS header
-			if(header[0] == 'D' && header[1] == 'M' && header[2] == 'S' && header[3] == '!') {
-				if(debug)
-					fprintf(debugfile,"Valid DMS header found, proceeding\n");
+	while(data < end && hash->versionstate != VERSION_DONE) {
+		if(hash->versionstate == 0) {
+			data = memchr(data,'$',end-data);
+			if(data == NULL)
+				break;
+			hash->versionstate = 1;
+		} else if(hash->versionstate < VERSION_SPACES) {
+			// Not the tag after all, the byte could start another one
+			if(*data != tag[hash->versionstate]) {
+				hash->versionstate = 0;
+				continue;
 			}
+			hash->versionstate++;
+		} else if(hash->versionstate == VERSION_SPACES && *data == ' ') {
+			// Spaces before the version are left out
+		} else if(*data >= 32 && *data < 127 && hash->versionlength < INDEX_MAX_VERSION-1) {
+			hash->version[hash->versionlength++] = *data;
+			hash->versionstate = VERSION_TEXT;
+		} else {
+			hash->versionstate = VERSION_DONE;
 		}
-		// Read the rest of the header
-		if((fread(header,1,52,infile) == 52)) {
-			if((header[0] == ' ' && header[1] == 'P' && header[2] == 'R' && header[3] == 'O') && debug) 
-				fprintf(debugfile,"File is a DMS PRO file\n");
-
-			// Infobits is a long word stored in MSB at header locations 8-11
-			infobits=(header[4]<<24)+(header[5]<<16)+(header[6]<<8)+header[7];
+		data++;
+	}
+	hash->version[hash->versionlength] = '\0';
+}
 
-			if(debug)
-				fprintf(debugfile,"Infobits %u %u %u %u total: %u\n",header[4],header[5],header[6],header[7],infobits);
+void filehashupdate(struct filehash *hash, uint64_t offset, const uint8_t *data, size_t size) {
+	static const uint8_t zeroes[DATABYTES];
+	size_t gap = 0;
 
-			// DMS no zero flag is set
-			if((infobits & DMS_NOZERO) && debug)
-				fprintf(debugfile,"DMS No zero flag is set\n");
-			// Encrypted DMS file, return null, print error
-			if(infobits & DMS_ENCRYPT) {
-				fprintf(stderr,"This is an encrypted DMS file, those are unsupported, please decrypt the file before using thisi program\n");
-				return NULL;	
-			}
+	if(offset < hash->length) {
+		hash->rewritten = 1;
+		return;
+	}
+	while(hash->length < offset) {
+		gap = (offset-hash->length < DATABYTES) ? offset-hash->length : DATABYTES;
+		sha256update(&hash->sha,zeroes,gap);
+		hash->fnv = fnv1a64(hash->fnv,zeroes,gap);
+		filehashversion(hash,zeroes,gap);
+		hash->length += gap;
+	}
+	sha256update(&hash->sha,data,size);
+	hash->fnv = fnv1a64(hash->fnv,data,size);
+	filehashversion(hash,data,size);
+	hash->length += size;
+}
 
-			// Optimized DMS file (appends)
-			if((infobits & DMS_APPENDS) && debug) 
-				fprintf(debugfile,"DMS Appens flag is set\n");
+// What the manifest is written to and the contents of the files of the current image
+struct manifest {
+	// NULL when no manifest was asked for
+	FILE *file;
+	// The collection index the files are added to, NULL when no index was asked for, and their image in it
+	struct indexbuilder *index;
+	uint32_t indeximage;
+	// The image being extracted, the first field of every line
+	char *image;
+	// The contents of the files written, indexed like the entries of the timestamp table
+	struct membuffer *files;
+	int numfiles;
+	// Set when there wasn't memory for the contents of a file, the files are then hashed from disk
+	int fromdisk;
+	// The last entry looked up by manifestentry() and what it found, blocks of the same file tend to come together
+	int lastidx;
+	int lastentry;
+};
 
-			// Banner in file
-			if((infobits & DMS_BANNER) && debug) 
-				fprintf(debugfile,"DMS banner exists in file\n");
-			
-			// File is high density file...
-			if((infobits & DMS_HIGHDENSITY) && endsector < MAX_SECTORS) {
-				fprintf(stderr,"File is high density and endsector is less than 3520\n");
-				return NULL;
-			}
+struct manifest manifest;
 
-			// File is a PC floppy
-			if(infobits & DMS_PC)  {
-				fprintf(stderr,"File is a PC floppy\n");
-				return NULL;
-			}
+// Whether the files written have to be hashed, for the manifest or the collection index
+int manifestwanted(void) {
+	return manifest.file != NULL || manifest.index != NULL;
+}
 
-			// DMS device fix bit is set
-			if((infobits & DMS_DEVICEFIX) && debug)
-				fprintf(debugfile,"DMS Device Fix bit is set\n");
-	
-			// DMS FILE_ID.DIZ bit is set
-			if((infobits & DMS_FILEIDBIZ) && debug)
-				fprintf(debugfile,"DMS FILE.ID_BIZ bit is set\n");
+// Write the line for one file and add it to the collection index, with the hashes finished from hash, mtime is the
+// modification time the file gets
+void manifestline(char *path, struct filehash *hash, int64_t mtime) {
+	uint8_t digest[32];
+	int i = 0;
+
+	if(manifest.index != NULL)
+		indexadd(manifest.index,manifest.indeximage,path,hash->length,hash->fnv,hash->version,mtime);
+	if(manifest.file == NULL)
+		return;
+	sha256final(&hash->sha,digest);
+	fprintf(manifest.file,"%s\t%s\t%llu\t",manifest.image,path,(unsigned long long)hash->length);
+	for(i = 0; i < 32; i++)
+		fprintf(manifest.file,"%02x",digest[i]);
+	fprintf(manifest.file,"\t%016llx\n",(unsigned long long)hash->fnv);
+}
 
-			// Get amiga timestamp from header (Amiga seconds since 1. jan 1978)
-			dmstimestamp=(time_t)(header[8]<<24)+(header[9]<<16)+(header[10]<<8)+header[11];	
+// Write the line for a file whose whole contents are in data
+void manifestdata(char *path, uint8_t *data, size_t size, int64_t mtime) {
+	struct filehash hash;
 
-			// Convert DMS timestring into epoch, and then to a valid timestring
-			strftime(timestring,80,"%c",amigatoepoch(dmstimestamp,dmstime));
+	filehashinit(&hash);
+	filehashupdate(&hash,0,data,size);
+	manifestline(path,&hash,mtime);
+}
 
-			if(debug)
-				fprintf(debugfile,"File created %s\n",timestring);
+// Write the line for a file that has been written, hashed from what is on disk. Returns 0 on success and 1 if the file
+// couldn't be read
+int manifestfile(char *path, int64_t mtime) {
+	uint8_t chunk[CHUNK];
+	struct filehash hash;
+	size_t have = 0;
+	FILE *infile;
 
-			// Start and end track
-			dmsstarttrack = (header[12]<<8)+header[13];
-			dmsendtrack = (header[14]<<8)+header[15];
+	// Queued writes have to be on disk first
+	outputringdrain();
+	infile = fopen(path,"r");
+	if(infile == NULL) {
+		fprintf(stderr,"Can't read %s for the manifest, error returned was: %s\n",path,strerror(errno));
+		return 1;
+	}
+	filehashinit(&hash);
+	while((have = fread(chunk,1,CHUNK,infile)) > 0)
+		filehashupdate(&hash,hash.length,chunk,have);
+	if(ferror(infile)) {
+		fprintf(stderr,"Can't read %s for the manifest\n",path);
+		fclose(infile);
+		return 1;
+	}
+	fclose(infile);
+	manifestline(path,&hash,mtime);
+	return 0;
+}
 
-			if(debug)
-				fprintf(debugfile,"DMS start track: %u, end track: %u\n",dmsstarttrack,dmsendtrack);
+// Write the line for a file from what was hashed while writing it, or from disk if that isn't what the file holds
+void manifestfinish(char *path, struct filehash *hash, int64_t mtime) {
+	if(hash->rewritten)
+		manifestfile(path,mtime);
+	else
+		manifestline(path,hash,mtime);
+}
 
-			// Before and after compression sizes
-			dmspacksize = (header[16]<<24)+(header[17]<<16)+(header[18]<<8)+header[19];
-			dmsunpacksize = (header[20]<<24)+(header[21]<<16)+(header[22]<<8)+header[23];
+// Keep a copy of a block written at offset into the file of timestamp table entry index
+// The blocks of a file are written in sector order, which isn't the order they are in the file, so the file is put
+// together in memory and hashed when everything has been written
+void manifestblock(int index, uint64_t offset, uint8_t *data, uint32_t size) {
+	struct membuffer *files = NULL;
+	struct membuffer *file = NULL;
+
+	if(!manifestwanted() || index < 0 || manifest.fromdisk)
+		return;
+	if(index >= manifest.numfiles) {
+		files = realloc(manifest.files,(index+256)*sizeof(struct membuffer));
+		if(files == NULL) {
+			manifest.fromdisk = 1;
+			return;
+		}
+		memset(files+manifest.numfiles,0,(index+256-manifest.numfiles)*sizeof(struct membuffer));
+		manifest.files = files;
+		manifest.numfiles = index+256;
+	}
+	file = &manifest.files[index];
+	if(offset+size > file->size) {
+		if(reservebuffer(file,offset+size-file->size) != 0) {
+			manifest.fromdisk = 1;
+			return;
+		}
+		memset(file->data+file->size,0,offset+size-file->size);
+		file->size = offset+size;
+	}
+	memcpy(file->data+offset,data,size);
+}
 
-			if(debug)
-				fprintf(debugfile,"DMS Packed size: %u, unpacked size: %u\n",dmspacksize,dmsunpacksize);
+// Forget the contents of the files of the last image
+void manifestreset(void) {
+	int i = 0;
+
+	for(i = 0; i < manifest.numfiles; i++)
+		freebuffer(&manifest.files[i]);
+	free(manifest.files);
+	manifest.files = NULL;
+	manifest.numfiles = 0;
+	manifest.fromdisk = 0;
+	manifest.lastidx = -1;
+}
 
-			// Serial number of the creator
-			dmsserial = (header[24]<<24)+(header[25]<<16)+(header[26]<<8)+header[27];
-			if(debug) {
-				if(dmsserial == 4292345787)
-					fprintf(debugfile,"DMS Serial number of creator: Unregistered copy\n");
-				else
-					fprintf(debugfile,"DMS Serial number of creator: %u\n",dmsserial);
-			}
+// Blocks of files with different headers can end up in the same file (orphans of the same directory do), returns the
+// first entry of the timestamp table for the same file as entry idx
+int manifestentry(struct stamptable *table, int idx) {
+	int i = 0;
+
+	if(idx < 0)
+		return -1;
+	if(idx == manifest.lastidx)
+		return manifest.lastentry;
+	for(i = 0; i < idx; i++)
+		if(!table->entries[i].isdir && table->entries[i].dir == table->entries[idx].dir &&
+			strncmp(table->entries[i].name,table->entries[idx].name,MAX_FILENAME_LENGTH) == 0)
+			break;
+	manifest.lastidx = idx;
+	manifest.lastentry = i;
+	return i;
+}
 
-			// CPU, co-pro, machine type and cpu speed of creator
-			dmscpu = (header[28]<<8)+header[29];
-			dmscopro = (header[30]<<8)+header[30];
-			dmsmachine = (header[32]<<8)+header[33];
-			dmsextra = (header[34]<<8)+header[35];	
-			dmscpuspeed = ((header[36]<<8)+header[37]);
+// Write a manifest line for every file recorded in the timestamp table and add the files to the collection index,
+// from the contents kept by manifestblock(), or from disk if it ran out of memory
+// Existing files are extracted into without being truncated, a file that comes out larger than what was written to it
+// held something before and is hashed from disk as well
+void writemanifest(struct stamptable *table) {
+	char path[MAX_PATH_DEPTH*MAX_AMIGADOS_FILENAME_LENGTH];
+	struct filehash hash;
+	struct stat st;
+	uint64_t size = 0;
+	int i = 0;
+
+	// What was kept is of no use if some of it is missing, let it go before reading the files back
+	if(manifest.fromdisk) {
+		fprintf(stderr,"Out of memory for the manifest, hashing the files from disk\n");
+		for(i = 0; i < manifest.numfiles; i++)
+			freebuffer(&manifest.files[i]);
+	}
+	// The sizes are only right once everything queued has been written
+	outputringdrain();
+	for(i = 0; i < table->numentries; i++) {
+		if(table->entries[i].isdir || manifestentry(table,i) != i)
+			continue;
+		stamppath(table,i,path,sizeof(path));
+		size = (i < manifest.numfiles) ? manifest.files[i].size : 0;
+		filehashinit(&hash);
+		hash.rewritten = manifest.fromdisk;
+		if(!hash.rewritten && table->dirs[table->entries[i].dir].fd != -1) {
+			imagestats.syscalls++;
+			if(fstatat(table->dirs[table->entries[i].dir].fd,table->entries[i].name,&st,0) == 0 && (uint64_t)st.st_size != size)
+				hash.rewritten = 1;
+		}
+		if(!hash.rewritten && size)
+			filehashupdate(&hash,0,manifest.files[i].data,size);
+		manifestfinish(path,&hash,table->entries[i].times[1].tv_sec);
+	}
+	manifestreset();
+}
 
-			if(debug) {
-				switch(dmscpu) {
-					case 0:
-						fprintf(debugfile,"DMS CPU type of creator: M68000\n");
-						break;
-					case 1:
-						fprintf(debugfile,"DMS CPU type of creator: M68010\n");
-						break;
-					case 2:
-						fprintf(debugfile,"DMS CPU type of creator: M68020\n");
-						break;
-					case 3:
-						fprintf(debugfile,"DMS CPU type of creator: M68030\n");
-						break;
-					case 4:
-						fprintf(debugfile,"DMS CPU type of creator: M68040\n");
-						break;
-					case 5:
-						fprintf(debugfile,"DMS CPU type of creator: M68060\n");
-						break;
-					case 6:
-						fprintf(debugfile,"DMS CPU type of creator: i8086\n");
-						break;
-					case 7:
-						fprintf(debugfile,"DMS CPU type of creator: i8088\n");
-						break;
-					case 8:
-						fprintf(debugfile,"DMS CPU type of creator: i80188\n");
-						break;
-					case 9:
-						fprintf(debugfile,"DMS CPU type of creator: i80186\n");
-						break;
-					case 10:
-						fprintf(debugfile,"DMS CPU type of creator: i80286\n");
-						break;
-					case 11:
-						fprintf(debugfile,"DMS CPU type of creator: i80386SX\n");
-						break;
-					case 12:
-						fprintf(debugfile,"DMS CPU type of creator: i80386\n");
-						break;
-					case 13:
-						fprintf(debugfile,"DMS CPU type of creator: i80486\n");
-						break;
-					case 14:
-						fprintf(debugfile,"DMS CPU type of creator: i80586\n");
-						break;
-					default:
-						fprintf(debugfile,"DMS CPU type of creator: unknown\n");
-						break;
-				}
-				switch(dmscopro) {
-					case 0:
-						fprintf(debugfile,"DMS Math Coprocessor type of creator: None\n");
-						break;
-					case 1:
-						fprintf(debugfile,"DMS Math Coprocessor type of creator: M68881\n");
-						break;
-					case 2:
-						fprintf(debugfile,"DMS Math Coprocessor type of creator: M68882\n");
-						break;
-					case 3:
-						fprintf(debugfile,"DMS Math Coprocessor type of creator: i8087\n");
-						break;
-					case 4:
-						fprintf(debugfile,"DMS Math Coprocessor type of creator: i80287SX\n");
-						break;
-					case 5:
-						fprintf(debugfile,"DMS Math Coprocessor type of creator: i80387\n");
-						break;
-					default:
-						fprintf(debugfile,"DMS Math Coprocessor type of creator: unknown\n");
-						break;
-				}
-				switch(dmsmachine) {
-					case 0:
-						fprintf(debugfile,"DMS Machine type of creator: Unknown\n");
-						break;
-					case 1:
-						fprintf(debugfile,"DMS Machine type of creator: Amiga\n");
-						break;
-					case 2:
-						fprintf(debugfile,"DMS Machine type of creator: x86 Clone\n");
-						break;
-					case 3:
-						fprintf(debugfile,"DMS Machine type of creator: Mac\n");
-						break;
-					case 4:
-						fprintf(debugfile,"DMS Machine type of creator: Atari\n");
-						break;
-					default:
-						fprintf(debugfile,"DMS Machine type of creator: Unknown\n");
-						break;
-				}
-				switch(dmsextra) {
-					case 0x8000:
-						fprintf(debugfile,"DMS Machine of creator is AGA\n");
-						break;
+#ifdef _HAVE_ZLIB
+// Added for version 5
+// Compare the CRC-32 of an uncompressed zip entry with the one in the archive, a mismatch is only an error when
+// exporting. Returns 0 if the entry can be used and 1 otherwise
+int zipcheckcrc(unsigned long zipcrc, uint8_t *data, size_t size) {
+	// The buffers are never near the 4 GB that crc32() can take at once
+	unsigned long crc = crc32(crc32(0L,Z_NULL,0),data,size);
+
+	if(crc == zipcrc)
+		return 0;
+	fprintf(stderr,"ZIP CRC-32 mismatch, header: %08lx, actual: %08lx%s\n",zipcrc,crc,strictdecode ? "" : ", continuing anyway");
+	return strictdecode;
+}
 
-				}
-				fprintf(debugfile,"DMS CPU speed of creator (approx) in Mhz: %d\n",dmscpuspeed);
-			} // if debug print creator machine info
+// Added Sibbi for version 4, changed for version 5 to uncompress from and to memory buffers instead of temporary files
+// Uncompress a gzip (or zlib) stream, or the first entry of a zip archive, from in and append it to out
+// Returns 0 on success and 1 on error
+int uncompressbuffer(struct membuffer *in, struct membuffer *out, unsigned int debug, FILE *debugfile) {
+	// Define ZLib stream
+	z_stream strm;
+	// To store whether this is a gzip or zip file, both of which are (annoyingly) common
+	int iszip = 0;
+	// The zip local file header fields we need
+	unsigned int zipflags = 0;
+	unsigned int zipmethod = 0;
+	unsigned long zipcrc = 0;
+	size_t zipcompressedsize = 0;
+	size_t zipfilenamelength = 0;
+	size_t zipextraheader = 0;
+	// Where the compressed data starts, and where the uncompressed data starts in out
+	size_t offset = 0;
+	size_t start = out->size;
+	// Store return code of inflate
+	int ret = 0;
 
-			dmscreatetime = (header[38]<<24)+(header[39]<<16)+(header[40]<<8)+header[41];
-			if(debug)
-				fprintf(debugfile,"DMS Time taken to create archive by creator: %u\n",dmscreatetime);
+	// Is this a zip file?  A lot of people assume gzip/zip are the same, they are obviously not, zip is an archive file format
+	// However, even if this is a zip file, we can still decompress the first file in it
+	if(in->size >= 30 && in->data[0] == 0x50 && in->data[1] == 0x4B && in->data[2] == 0x03 && in->data[3] == 0x04) {
+		if(debug)
+			fprintf(debugfile,"Input appears to be in zip format\n");
+		iszip = 1;
+		// The local file header is in LSB format
+		zipflags = in->data[6]+(in->data[7]<<8);
+		zipmethod = in->data[8]+(in->data[9]<<8);
+		zipcrc = in->data[14]+(in->data[15]<<8)+(in->data[16]<<16)+((unsigned long)in->data[17]<<24);
+		zipcompressedsize = in->data[18]+(in->data[19]<<8)+(in->data[20]<<16)+((size_t)in->data[21]<<24);
+		zipfilenamelength = in->data[26]+(in->data[27]<<8);
+		zipextraheader = in->data[28]+(in->data[29]<<8);
+		offset = 30+zipfilenamelength+zipextraheader;
+		if(debug)
+			fprintf(debugfile,"Zip method %u, flags %u, compressed size %lu, filename length %lu, extra header length %lu\n",
+				zipmethod,zipflags,(unsigned long)zipcompressedsize,(unsigned long)zipfilenamelength,(unsigned long)zipextraheader);
+		if(offset > in->size) {
+			fprintf(stderr,"ZIP header damaged\n");
+			return 1;
+		}
+		// A stored entry is just copied, if the size is only in the data descriptor we can't tell where it ends
+		if(zipmethod == 0) {
+			if((zipflags & 8) || zipcompressedsize > in->size-offset) {
+				fprintf(stderr,"ZIP header damaged\n");
+				return 1;
+			}
+			if(writebuffer(in->data+offset,zipcompressedsize,out) != zipcompressedsize) {
+				fprintf(stderr,"Out of memory\n");
+				return 1;
+			}
+			return zipcheckcrc(zipcrc,out->data+start,out->size-start);
+		} else if(zipmethod != 8) {
+			fprintf(stderr,"ZIP compression method %u is not supported\n",zipmethod);
+			return 1;
+		}
+	}
 
-			dmscreateversion = (header[42]<<8)+header[43];
-			dmsextractversion = (header[44]<<8)+header[45];
+	// Initial inflate state
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
 
-			if(debug) {
-				fprintf(debugfile,"DMS version used to create this archive: %u\n",dmscreateversion);
-				fprintf(debugfile,"DMS version required to extract this archive: %u\n",dmsextractversion);
-			}
+	// Zip files have a raw deflate stream, otherwise let zlib detect the gzip or zlib header
+	if(inflateInit2(&strm,iszip ? -MAX_WBITS : 32+MAX_WBITS) != Z_OK) {
+		fprintf(stderr,"Can't init zlib\n");
+		return 1;
+	}
+	strm.next_in = in->data+offset;
+	strm.avail_in = in->size-offset;
 
-			dmsdisktype = (header[46]<<8)+header[47];
-		
-			if(debug) {
-				switch(dmsdisktype) {
-					case 0:
-						fprintf(debugfile,"DMS Diskette type: Unknown, proceeding anyway\n");
-						break;
-					case 1:
-						fprintf(debugfile,"DMS Diskette type: Amiga OFS\n");
-						break;
-					case 2:
-						fprintf(debugfile,"DMS Diskette type: Amiga FFS, this program does not support non OFS floppies\n");
-						return NULL;
-						break;
-					case 3:
-						fprintf(debugfile,"DMS Diskette type: Amiga 3.0 International mode, this program does not support non OFS floppies\n");
-						return NULL;
-						break;
-					case 4:
-						fprintf(debugfile,"DMS Diskette type: Amiga 3.0 FFS International mode, this program does not support non OFS floppies\n");
-						return NULL;
-						break;
-					case 5:
-						fprintf(debugfile,"DMS Diskette type: Amiga 3.0 Dircache mode, this program does not support non OFS floppies\n");
-						return NULL;
-						break;
-					case 6:
-						fprintf(debugfile,"DMS Diskette type: Amiga 3.0 FFS Dircache mode, this program does not support non OFS floppies\n");
-						return NULL;
-						break;
-					case 7:
-						fprintf(debugfile,"DMS Diskette type: FMS (Filemasher) mode, this program does not support non OFS floppies\n");
-						return NULL;
-						break;
-					default:
-						fprintf(debugfile,"DMS Diskette type: Unknown, proceeding anyway\n");
-						break;
+	// Decompress straight into the output buffer until the end of the stream
+	do {
+		if(reservebuffer(out,CHUNK) != 0) {
+			fprintf(stderr,"Uncompressed data is too large\n");
+			(void)inflateEnd(&strm);
+			return 1;
+		}
+		strm.next_out = out->data+out->size;
+		strm.avail_out = CHUNK;
+		ret = inflate(&strm,Z_NO_FLUSH);
+		out->size += CHUNK-strm.avail_out;
+		switch(ret) {
+			case Z_NEED_DICT:
+				fprintf(stderr,"Dictionary error while decompressing\n");
+				(void)inflateEnd(&strm);
+				return 1;
+			case Z_STREAM_ERROR:
+			case Z_DATA_ERROR:
+				fprintf(stderr,"Data error while decompressing\n");
+				(void)inflateEnd(&strm);
+				return 1;
+			case Z_MEM_ERROR:
+				fprintf(stderr,"Out of memory while decompressing\n");
+				(void)inflateEnd(&strm);
+				return 1;
+			case Z_BUF_ERROR:
+				// No more input, a truncated file still gives us what was there, like it always has, unless we're exporting
+				if(strictdecode) {
+					fprintf(stderr,"Compressed data is truncated\n");
+					(void)inflateEnd(&strm);
+					return 1;
+				}
+				fprintf(stderr,"Compressed data is truncated, continuing with what could be uncompressed\n");
+				ret = Z_STREAM_END;
+				iszip = 0;
+				break;
+		}
+	} while(ret != Z_STREAM_END);
+	// zlib checks the CRC of a gzip stream, for a zip entry it's in the header or in the data descriptor after the data
+	if(iszip && (zipflags & 8)) {
+		offset = strm.avail_in >= 8 && strm.next_in[0] == 0x50 && strm.next_in[1] == 0x4B && strm.next_in[2] == 0x07 && strm.next_in[3] == 0x08 ? 4 : 0;
+		if(strm.avail_in >= offset+4)
+			zipcrc = strm.next_in[offset]+(strm.next_in[offset+1]<<8)+(strm.next_in[offset+2]<<16)+((unsigned long)strm.next_in[offset+3]<<24);
+		else
+			iszip = 0;
+	}
+	(void)inflateEnd(&strm);
+	if(debug)
+		fprintf(debugfile,"Uncompressed %lu bytes into %lu bytes\n",(unsigned long)in->size,(unsigned long)out->size);
+	return iszip ? zipcheckcrc(zipcrc,out->data+start,out->size-start) : 0;
+}	// End function uncompressbuffer
+#endif 	// if defined _HAVE_ZLIB
 
+// Decrunch a track whose packed bytes are in pack_buffer, returns the buffer the unpacked track is in or NULL if it
+// can't be decrunched or the CRC of the unpacked track doesn't match, moved out of undmsbuffer() for version 5 so
+// single tracks can be decoded, nothing is reported if debugfile is NULL
+unsigned char *decrunchtrack(unsigned int track, unsigned int trackpackmode, unsigned int trackcflags, unsigned int trackpacked,
+	unsigned int trackrlesize, unsigned int trackunpacked, unsigned int trackunpackcrc, unsigned int debug, FILE *debugfile) {
+	// Flags set in trackcflags
+	unsigned int trackcflag_noclear = trackcflags & 1;
+	unsigned int trackcflag_compressed = trackcflags & 2;
+	unsigned int trackcflag_rle = trackcflags & 4;
+	// Pointer to the buffer the track ends up in
+	unsigned char *buffer = NULL;
+
+	switch(trackpackmode) {
+		case 0:
+			if(debug)
+				fprintf(debugfile,"\tTrack crunch mode: No compression\n");
+			// The packed bytes are the track, they used to be read from the wrong buffer
+			if(!crunch_store(pack_buffer, pack_buffer + trackpacked,
+				         unpack_buffer, unpack_buffer + trackunpacked,
+					 debug,debugfile))
+				buffer = unpack_buffer;
+			break;
+		case 1:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Simple compression\n");
+			// The packed bytes are only RLE encoded, they used to be read from the wrong buffer
+			if(!crunch_rle(pack_buffer, pack_buffer + trackpacked,
+				       unpack_buffer, unpack_buffer + trackunpacked,
+				       debug,debugfile))
+				buffer=unpack_buffer;
+			break;
+		case 2:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Quick compression\n");
+			if(!crunch_quick(pack_buffer, pack_buffer + trackpacked + 16,
+				        unpack_buffer, unpack_buffer + trackrlesize,
+					debug,debugfile,trackcflag_noclear))
+				if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
+				               pack_buffer, pack_buffer + trackunpacked,
+					       debug,debugfile))
+					buffer=pack_buffer;
+			break;
+		case 3:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Medium compression\n");
+			if(!crunch_medium(pack_buffer, pack_buffer + trackpacked + 16,
+				        unpack_buffer, unpack_buffer + trackrlesize,
+					debug,debugfile,trackcflag_noclear))
+				if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
+				               pack_buffer, pack_buffer + trackunpacked,
+					       debug,debugfile))
+					buffer = pack_buffer;
+			break;
+		case 4:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Deep compression\n");
+
+			if(!crunch_deep(pack_buffer, pack_buffer + trackpacked + 16,
+				        unpack_buffer, unpack_buffer + trackrlesize,
+					debug,debugfile,trackcflag_noclear))
+				if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
+				               pack_buffer, pack_buffer + trackunpacked,
+						debug,debugfile))
+					buffer = pack_buffer;
+			break;
+		case 5:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Heavy (1) compression\n");
+			// Decrunch, the track
+			if(!crunch_heavy(pack_buffer, pack_buffer + trackpacked + 16, 
+				        unpack_buffer, unpack_buffer + trackrlesize,
+				        trackcflag_compressed, 13,
+					debug,debugfile, trackcflag_noclear)) {	
+				// If RLE is set, also use RLE
+				if(trackcflag_rle) { 
+					if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
+					               pack_buffer, pack_buffer + trackunpacked,
+						       debug,debugfile)) {
+						buffer = pack_buffer;
+						if(debug)
+							fprintf(debugfile,"\tBuffer is set to pack buffer\n");
+					}
+				} else {
+					if(debug)
+						fprintf(debugfile,"Buffer is set to unpack buffer\n");
+					buffer = unpack_buffer;
+				}
+			} else {
+				if(debugfile != NULL)
+					fprintf(debugfile,"Cannot heavy(2) decompress track %u\n",track);
+				return NULL;
+			}
+			break;
+		case 6:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Heavy (2) compression\n");
+			// Decrunch, the track
+			if(!crunch_heavy(pack_buffer, pack_buffer + trackpacked + 16, 
+				        unpack_buffer, unpack_buffer + trackrlesize,
+				        trackcflag_compressed, 14,
+					debug,debugfile, trackcflag_noclear)) {	
+				// If RLE is set, also use RLE
+				if(trackcflag_rle) { 
+					if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
+					               pack_buffer, pack_buffer + trackunpacked,
+						       debug,debugfile)) {
+						buffer = pack_buffer;
+						if(debug)
+							fprintf(debugfile,"\tBuffer is set to pack buffer\n");
+					}
+				} else {
+					if(debug)
+						fprintf(debugfile,"Buffer is set to unpack buffer\n");
+					buffer = unpack_buffer;
 				}
+			} else {
+				if(debugfile != NULL)
+					fprintf(debugfile,"Cannot heavy(2) decompress track %u\n",track);
+				return NULL;
 			}
+			break;
+		case 7:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Heavy (3) compression\n");
 
-			dmscrunchmode = (header[48]<<8) + header[49];
-			dmsheadercrc = (header[50]<<8)+header[51];
+			fprintf(stderr,"Heavy(3) compression not supported\n");
+			return NULL;
+			break;
+		case 8:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Heavy (4) compression\n");
+			fprintf(stderr,"Heavy(4) compression not supported\n");
+			return NULL;
+			break;
+		case 9:
+			if(debug)
+				fprintf(debugfile,"\tDMS crunch mode: Heavy (5) compression\n");
+			fprintf(stderr,"Heavy(5) compression not supported\n");
+			return NULL;
+			break;
+		default:
+			if(debugfile != NULL)
+				fprintf(debugfile,"Unknown crunch mode used in DMS\n");
+			return NULL;
+	}
+	// Verify CRC of unpacked track vs unpack CRC
+	if(buffer == NULL || mysimplecrc(buffer,trackunpacked) != trackunpackcrc) {
+		if(debugfile != NULL)
+			fprintf(debugfile,"Unpack CRC does not match, header: %u, actual: %u, uncrunch or file error\n",trackunpackcrc,buffer ? mysimplecrc(buffer,trackunpacked) : 0);
+		return NULL;
+	}
+	// Unpack CRC is okay, track was unpacked succesfully
+	if(debug)
+		fprintf(debugfile,"\tUnpack CRC: %u Trackheader unpack CRC: %u\n",mysimplecrc(buffer,trackunpacked),trackunpackcrc);
+	return buffer;
+}
+
+// Added for version 5
+// Decrypt the packed bytes of a track, the key carries on from one track to the next in *pass
+void dmsdecrypt(unsigned char *data, unsigned int length, unsigned int *pass) {
+	unsigned int byte = 0;
+
+	while(length--) {
+		byte = *data;
+		*data++ ^= *pass & 0xff;
+		*pass = ((*pass >> 1) + byte) & 0xffff;
+	}
+}
+
+// Tell if a track header is for a track that isn't part of the disk, returns what it is or NULL if it's a disk track
+// The banner is track 0xffff, FILE_ID.DIZ is track 80 and some archives carry a 1024 byte fake bootblock with more
+// advertising, they come before or after the tracks of the disk
+char *dmsextratrack(unsigned char *trackheader, unsigned int infobits, unsigned int endtrack) {
+	unsigned int track = (trackheader[2]<<8)+trackheader[3];
+
+	if(track == 0xffff)
+		return "banner";
+	if(track == 80 && ((infobits & DMS_FILEIDBIZ) || endtrack < 80))
+		return "FILE_ID.DIZ";
+	if((unsigned int)((trackheader[10]<<8)+trackheader[11]) <= 2048)
+		return "fake bootblock";
+	return NULL;
+}
+
+// One shard of the search for the key of an encrypted archive, a thread tries the keys from first to last on the
+// first encrypted track
+struct dmskeyshard {
+	unsigned char *trackheader;
+	unsigned char *packed;
+	unsigned int first;
+	unsigned int last;
+	// The best key the track decodes with and how well it decodes
+	int key;
+	unsigned int score;
+	pthread_t thread;
+	int started;
+};
+
+// Try the keys of one shard, each thread decodes into its own buffers
+void *dmskeyrange(void *arg) {
+	struct dmskeyshard *shard = arg;
+	unsigned char *header = shard->trackheader;
+	unsigned int track = (header[2]<<8)+header[3];
+	unsigned int packed = (header[6]<<8)+header[7];
+	unsigned int unpacked = (header[10]<<8)+header[11];
+	unsigned int pass = 0;
+	unsigned int key = 0;
+	unsigned int score = 0;
+	unsigned int i = 0;
+	unsigned char *buffer;
+
+	for(key = shard->first; key < shard->last && shard->score <= unpacked; key++) {
+		memcpy(pack_buffer,shard->packed,packed);
+		memset(pack_buffer+packed,0,16);
+		pass = key;
+		dmsdecrypt(pack_buffer,packed,&pass);
+		// Nothing is decoded before the first track, so it's decoded with cleared dictionaries whatever its flags say
+		buffer = decrunchtrack(track,header[13],header[12] & ~1,packed,(header[8]<<8)+header[9],(header[10]<<8)+header[11],
+			(header[14]<<8)+header[15],0,NULL);
+		if(buffer == NULL)
+			continue;
+		// A bootblock on track 0 settles it, otherwise the banner is text so the most printable bytes win
+		score = 1;
+		if(track == 0 && memcmp(buffer,"DOS",3) == 0)
+			score += unpacked;
+		else
+			for(i = 0; i < unpacked; i++)
+				if(buffer[i] == '\n' || (buffer[i] >= 0x20 && buffer[i] < 0x7f))
+					score++;
+		if(score > shard->score) {
+			shard->key = key;
+			shard->score = score;
+		}
+	}
+	return NULL;
+}
+
+// Search for the key of an encrypted archive whose first track header is at the read position of in, the key is
+// 16 bits and only the first bytes of the archive depend on it, so every key is tried on the first encrypted track
+// until the checksum of the unpacked track matches, split between threads like classifysectors() does
+// A 16 bit checksum can match by chance, so of the keys that match the one that decodes track 0 to an AmigaDOS
+// bootblock or the banner to the most text is taken, a wrong key only garbles the first bytes of the track
+// Returns the key or -1 if none decodes the track
+int dmsfindkey(struct membuffer *in, int threads, unsigned int debug, FILE *debugfile) {
+	struct dmskeyshard *shards;
+	unsigned char *trackheader = NULL;
+	size_t position = in->position;
+	unsigned int share = 0;
+	unsigned int score = 0;
+	int key = -1;
+	int i = 0;
+
+	// The FILE_ID.DIZ track isn't encrypted, the first track that isn't it is where the key starts
+	while(position+20 <= in->size && in->data[position] == 'T' && in->data[position+1] == 'R') {
+		trackheader = in->data+position;
+		if((trackheader[2]<<8)+trackheader[3] != 80)
+			break;
+		position += 20+(trackheader[6]<<8)+trackheader[7];
+		trackheader = NULL;
+	}
+	if(trackheader == NULL || position+20+(trackheader[6]<<8)+trackheader[7] > in->size || trackheader[13] > 6 ||
+		(trackheader[6]<<8)+trackheader[7] > BUFFERSIZE-16 || (trackheader[8]<<8)+trackheader[9] > BUFFERSIZE ||
+		(trackheader[10]<<8)+trackheader[11] > BUFFERSIZE)
+		return -1;
+	if(threads < 1)
+		threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	if(threads > 256)
+		threads = 256;
+	shards = malloc(threads*sizeof(struct dmskeyshard));
+	if(shards == NULL) {
+		fprintf(stderr,"Can't allocate memory to search for the DMS key\n");
+		return -1;
+	}
+	share = (65536+threads-1)/threads;
+	for(i = 0; i < threads; i++) {
+		memset(&shards[i],0,sizeof(struct dmskeyshard));
+		shards[i].trackheader = trackheader;
+		shards[i].packed = trackheader+20;
+		shards[i].first = i*share < 65536 ? i*share : 65536;
+		shards[i].last = shards[i].first+share < 65536 ? shards[i].first+share : 65536;
+		shards[i].key = -1;
+		// This thread searches the first shard once the others are running, as well as any we can't start a thread for
+		if(i > 0 && pthread_create(&shards[i].thread,NULL,dmskeyrange,&shards[i]) == 0)
+			shards[i].started = 1;
+		else if(i > 0 && debug)
+			fprintf(debugfile,"Can't start key search thread %d, searching its keys serially\n",i);
+	}
+	for(i = 0; i < threads; i++) {
+		if(shards[i].started)
+			pthread_join(shards[i].thread,NULL);
+		else
+			dmskeyrange(&shards[i]);
+	}
+	for(i = 0; i < threads; i++)
+		if(shards[i].score > score) {
+			key = shards[i].key;
+			score = shards[i].score;
+		}
+	if(debug)
+		fprintf(debugfile,"Searched 65536 DMS keys on track %u with %d thread(s)\n",(trackheader[2]<<8)+trackheader[3],threads);
+	free(shards);
+	return key;
+}
+
+// Added Sibbi for version 4, changed for version 5 to unpack from and to memory buffers instead of temporary files
+// Unpack a DMS archive from in and append the unpacked tracks to out, returns 0 on success and 1 on error
+// Loosely based on code (C) 1998 David Tritscher
+int undmsbuffer(struct membuffer *in, struct membuffer *out, int endsector, unsigned int debug, FILE *debugfile) {
+	// Header array to read the dms header
+	unsigned char header[64];
+
+	//  Track header array to read the trackk header
+	unsigned char trackheader[32];
+
+	// Infobits integer
+	unsigned int infobits = 0;
+
+	//  Start and end track of DMS file
+	unsigned short dmsstarttrack = 0;
+	unsigned short dmsendtrack =  0;
+
+	// Size of compressed and uncompressed file
+	unsigned int dmspacksize = 0;
+	unsigned int dmsunpacksize = 0;
+
+	// Serial number of DMS file
+	unsigned int dmsserial = 0;
+
+	// DMS creator machine information
+	unsigned int dmscpu = 0;
+	unsigned int dmscopro = 0;
+	unsigned int dmsmachine = 0;
+	unsigned int dmsextra = 0;
+	unsigned int dmscpuspeed = 0;
+
+	// Time taken to create archive
+	unsigned int dmscreatetime = 0;
+
+	// Versions used to create and needed to extract this DMS
+	unsigned short dmscreateversion = 0;
+	unsigned short dmsextractversion = 0;
+
+	// Type of disk in this archive
+	unsigned short dmsdisktype = 0;
+
+
+	// Crunchmode used
+	unsigned short dmscrunchmode = 0;
+
+	// DMS header CRC
+	unsigned short dmsheadercrc = 0;
+
+	// Timestamp integer
+	time_t dmstimestamp = 0;
+
+	// Track header variables
+	unsigned int trackcurrent = 0;
+	unsigned int trackpacked = 0;
+	unsigned int trackrlesize = 0;
+	unsigned int trackunpacked = 0;
+	unsigned int trackpackmode = 0;
+	unsigned int trackcrc = 0;
+	unsigned int trackpackcrc = 0;
+	unsigned int trackunpackcrc = 0;
+	unsigned int trackcflags = 0;
+
+	// Flags set in trackcflags
+	unsigned int trackcflag_noclear = 0;
+	unsigned int trackcflag_compressed = 0;
+	unsigned int trackcflag_rle = 0;
+
+	// Pointer to the current buffer
+	unsigned char *buffer;
+
+	// Tracks the archive doesn't have, and how many bytes were appended
+	unsigned int missing = 0;
+	size_t written = 0;
+
+	// Key of an encrypted archive as it carries on from track to track, and what a track that isn't on the disk is
+	int key = dmskey;
+	unsigned int dmspass = 0;
+	char *extratrack = NULL;
+
+	// String to print time
+	char timestring[80];
+
+	// Temporary loop variable
+	int i=0;
+
+	// Check the input buffer
+	if(in != NULL && in->data != NULL) {
+		// We're ready to start processing the header...
+		if((readbuffer(header,4,in) == 4)) {
+			// Check for DMS header
+			if(header[0] == 'D' && header[1] == 'M' && header[2] == 'S' && header[3] == '!') {
+				if(debug)
+					fprintf(debugfile,"Valid DMS header found, proceeding\n");
+			}
+		}
+		// Read the rest of the header
+		if((readbuffer(header,52,in) == 52)) {
+			if((header[0] == ' ' && header[1] == 'P' && header[2] == 'R' && header[3] == 'O') && debug) 
+				fprintf(debugfile,"File is a DMS PRO file\n");
+
+			// Infobits is a long word stored in MSB at header locations 8-11
+			infobits=(header[4]<<24)+(header[5]<<16)+(header[6]<<8)+header[7];
+
+			if(debug)
+				fprintf(debugfile,"Infobits %u %u %u %u total: %u\n",header[4],header[5],header[6],header[7],infobits);
+
+			// DMS no zero flag is set
+			if((infobits & DMS_NOZERO) && debug)
+				fprintf(debugfile,"DMS No zero flag is set\n");
+			// Encrypted DMS file, without a key from the command line we search for it
+			if(infobits & DMS_ENCRYPT) {
+				if(key < 0) {
+					key = dmsfindkey(in,dmskeythreads,debug,debugfile);
+					if(key < 0) {
+						fprintf(stderr,"This is an encrypted DMS file and no key decodes its first track, give the password with -k\n");
+						return 1;
+					}
+					fprintf(debugfile,"Encrypted DMS file, found key 0x%04x, -K 0x%04x skips the search\n",key,key);
+				} else if(debug) {
+					fprintf(debugfile,"Encrypted DMS file, decrypting with key 0x%04x\n",key);
+				}
+				dmspass = key;
+			}
+
+			// Optimized DMS file (appends)
+			if((infobits & DMS_APPENDS) && debug) 
+				fprintf(debugfile,"DMS Appens flag is set\n");
+
+			// Banner in file
+			if((infobits & DMS_BANNER) && debug) 
+				fprintf(debugfile,"DMS banner exists in file\n");
+			
+			// File is high density file...
+			if((infobits & DMS_HIGHDENSITY) && endsector < MAX_SECTORS) {
+				fprintf(stderr,"File is high density and endsector is less than 3520\n");
+				return 1;
+			}
+
+			// File is a PC floppy
+			if(infobits & DMS_PC)  {
+				fprintf(stderr,"File is a PC floppy\n");
+				return 1;
+			}
+
+			// DMS device fix bit is set
+			if((infobits & DMS_DEVICEFIX) && debug)
+				fprintf(debugfile,"DMS Device Fix bit is set\n");
+	
+			// DMS FILE_ID.DIZ bit is set
+			if((infobits & DMS_FILEIDBIZ) && debug)
+				fprintf(debugfile,"DMS FILE.ID_BIZ bit is set\n");
+
+			// Get amiga timestamp from header (Amiga seconds since 1. jan 1978)
+			dmstimestamp=(time_t)(header[8]<<24)+(header[9]<<16)+(header[10]<<8)+header[11];	
+
+			// Convert DMS timestring into epoch, and then to a valid timestring
+			formatdate(timestring,sizeof(timestring),AMIGA_EPOCH+(int64_t)dmstimestamp);
+
+			if(debug)
+				fprintf(debugfile,"File created %s\n",timestring);
+
+			// Start and end track
+			dmsstarttrack = (header[12]<<8)+header[13];
+			dmsendtrack = (header[14]<<8)+header[15];
+
+			if(debug)
+				fprintf(debugfile,"DMS start track: %u, end track: %u\n",dmsstarttrack,dmsendtrack);
+
+			// Before and after compression sizes
+			dmspacksize = (header[16]<<24)+(header[17]<<16)+(header[18]<<8)+header[19];
+			dmsunpacksize = (header[20]<<24)+(header[21]<<16)+(header[22]<<8)+header[23];
+
+			if(debug)
+				fprintf(debugfile,"DMS Packed size: %u, unpacked size: %u\n",dmspacksize,dmsunpacksize);
+
+			// Serial number of the creator
+			dmsserial = (header[24]<<24)+(header[25]<<16)+(header[26]<<8)+header[27];
+			if(debug) {
+				if(dmsserial == 4292345787)
+					fprintf(debugfile,"DMS Serial number of creator: Unregistered copy\n");
+				else
+					fprintf(debugfile,"DMS Serial number of creator: %u\n",dmsserial);
+			}
+
+			// CPU, co-pro, machine type and cpu speed of creator
+			dmscpu = (header[28]<<8)+header[29];
+			dmscopro = (header[30]<<8)+header[30];
+			dmsmachine = (header[32]<<8)+header[33];
+			dmsextra = (header[34]<<8)+header[35];	
+			dmscpuspeed = ((header[36]<<8)+header[37]);
+
+			if(debug) {
+				switch(dmscpu) {
+					case 0:
+						fprintf(debugfile,"DMS CPU type of creator: M68000\n");
+						break;
+					case 1:
+						fprintf(debugfile,"DMS CPU type of creator: M68010\n");
+						break;
+					case 2:
+						fprintf(debugfile,"DMS CPU type of creator: M68020\n");
+						break;
+					case 3:
+						fprintf(debugfile,"DMS CPU type of creator: M68030\n");
+						break;
+					case 4:
+						fprintf(debugfile,"DMS CPU type of creator: M68040\n");
+						break;
+					case 5:
+						fprintf(debugfile,"DMS CPU type of creator: M68060\n");
+						break;
+					case 6:
+						fprintf(debugfile,"DMS CPU type of creator: i8086\n");
+						break;
+					case 7:
+						fprintf(debugfile,"DMS CPU type of creator: i8088\n");
+						break;
+					case 8:
+						fprintf(debugfile,"DMS CPU type of creator: i80188\n");
+						break;
+					case 9:
+						fprintf(debugfile,"DMS CPU type of creator: i80186\n");
+						break;
+					case 10:
+						fprintf(debugfile,"DMS CPU type of creator: i80286\n");
+						break;
+					case 11:
+						fprintf(debugfile,"DMS CPU type of creator: i80386SX\n");
+						break;
+					case 12:
+						fprintf(debugfile,"DMS CPU type of creator: i80386\n");
+						break;
+					case 13:
+						fprintf(debugfile,"DMS CPU type of creator: i80486\n");
+						break;
+					case 14:
+						fprintf(debugfile,"DMS CPU type of creator: i80586\n");
+						break;
+					default:
+						fprintf(debugfile,"DMS CPU type of creator: unknown\n");
+						break;
+				}
+				switch(dmscopro) {
+					case 0:
+						fprintf(debugfile,"DMS Math Coprocessor type of creator: None\n");
+						break;
+					case 1:
+						fprintf(debugfile,"DMS Math Coprocessor type of creator: M68881\n");
+						break;
+					case 2:
+						fprintf(debugfile,"DMS Math Coprocessor type of creator: M68882\n");
+						break;
+					case 3:
+						fprintf(debugfile,"DMS Math Coprocessor type of creator: i8087\n");
+						break;
+					case 4:
+						fprintf(debugfile,"DMS Math Coprocessor type of creator: i80287SX\n");
+						break;
+					case 5:
+						fprintf(debugfile,"DMS Math Coprocessor type of creator: i80387\n");
+						break;
+					default:
+						fprintf(debugfile,"DMS Math Coprocessor type of creator: unknown\n");
+						break;
+				}
+				switch(dmsmachine) {
+					case 0:
+						fprintf(debugfile,"DMS Machine type of creator: Unknown\n");
+						break;
+					case 1:
+						fprintf(debugfile,"DMS Machine type of creator: Amiga\n");
+						break;
+					case 2:
+						fprintf(debugfile,"DMS Machine type of creator: x86 Clone\n");
+						break;
+					case 3:
+						fprintf(debugfile,"DMS Machine type of creator: Mac\n");
+						break;
+					case 4:
+						fprintf(debugfile,"DMS Machine type of creator: Atari\n");
+						break;
+					default:
+						fprintf(debugfile,"DMS Machine type of creator: Unknown\n");
+						break;
+				}
+				switch(dmsextra) {
+					case 0x8000:
+						fprintf(debugfile,"DMS Machine of creator is AGA\n");
+						break;
+
+				}
+				fprintf(debugfile,"DMS CPU speed of creator (approx) in Mhz: %d\n",dmscpuspeed);
+			} // if debug print creator machine info
+
+			dmscreatetime = (header[38]<<24)+(header[39]<<16)+(header[40]<<8)+header[41];
+			if(debug)
+				fprintf(debugfile,"DMS Time taken to create archive by creator: %u\n",dmscreatetime);
+
+			dmscreateversion = (header[42]<<8)+header[43];
+			dmsextractversion = (header[44]<<8)+header[45];
+
+			if(debug) {
+				fprintf(debugfile,"DMS version used to create this archive: %u\n",dmscreateversion);
+				fprintf(debugfile,"DMS version required to extract this archive: %u\n",dmsextractversion);
+			}
+
+			dmsdisktype = (header[46]<<8)+header[47];
+		
+			if(debug) {
+				switch(dmsdisktype) {
+					case 0:
+						fprintf(debugfile,"DMS Diskette type: Unknown, proceeding anyway\n");
+						break;
+					case 1:
+						fprintf(debugfile,"DMS Diskette type: Amiga OFS\n");
+						break;
+					case 2:
+						fprintf(debugfile,"DMS Diskette type: Amiga FFS, this program does not support non OFS floppies\n");
+						return 1;
+						break;
+					case 3:
+						fprintf(debugfile,"DMS Diskette type: Amiga 3.0 International mode, this program does not support non OFS floppies\n");
+						return 1;
+						break;
+					case 4:
+						fprintf(debugfile,"DMS Diskette type: Amiga 3.0 FFS International mode, this program does not support non OFS floppies\n");
+						return 1;
+						break;
+					case 5:
+						fprintf(debugfile,"DMS Diskette type: Amiga 3.0 Dircache mode, this program does not support non OFS floppies\n");
+						return 1;
+						break;
+					case 6:
+						fprintf(debugfile,"DMS Diskette type: Amiga 3.0 FFS Dircache mode, this program does not support non OFS floppies\n");
+						return 1;
+						break;
+					case 7:
+						fprintf(debugfile,"DMS Diskette type: FMS (Filemasher) mode, this program does not support non OFS floppies\n");
+						return 1;
+						break;
+					default:
+						fprintf(debugfile,"DMS Diskette type: Unknown, proceeding anyway\n");
+						break;
+
+				}
+			}
+
+			dmscrunchmode = (header[48]<<8) + header[49];
+			dmsheadercrc = (header[50]<<8)+header[51];
+
+			if(mycrc(header, 50) == dmsheadercrc) {
+				fprintf(debugfile,"DMS header CRC is OK\n");
+			} else if(strictdecode) {
+				fprintf(stderr,"DMS header CRC mismatch, the archive is damaged\n");
+				return 1;
+			} else {
+				fprintf(debugfile,"DMS header CRC mismatch, changes are this is a damaged archive, continuing anyway\n");
+			}
+
+			if(debug) {
+				fprintf(debugfile,"DMS Header CRC: %u\n",dmsheadercrc);
+			}
+			// Print the crunch mode
+			switch(dmscrunchmode) {
+				case 0:
+					fprintf(debugfile,"DMS crunch mode: No compression\n");
+					break;
+				case 1:
+					fprintf(debugfile,"DMS crunch mode: Simple compression\n");
+					break;
+				case 2:
+					fprintf(debugfile,"DMS crunch mode: Quick compression\n");
+					break;
+				case 3:
+					fprintf(debugfile,"DMS crunch mode: Medium compression\n");
+					break;
+				case 4:
+					fprintf(debugfile,"DMS crunch mode: Deep compression\n");
+					break;
+				case 5:
+					fprintf(debugfile,"DMS crunch mode: Heavy (1) compression\n");
+					break;
+				case 6:
+					fprintf(debugfile,"DMS crunch mode: Heavy (2) compression\n");
+					break;
+				case 7:
+					fprintf(debugfile,"DMS crunch mode: Heavy (3) compression\n");
+					break;
+				case 8:
+					fprintf(debugfile,"DMS crunch mode: Heavy (4) compression\n");
+					break;
+				case 9:
+					fprintf(debugfile,"DMS crunch mode: Heavy (5) compression\n");
+					break;
+				default:
+					fprintf(debugfile,"Unknown crunch mode used in DMSg\n");
+					return 1;
+			}
+			// The image is allocated zeroed for the tracks the header says there are, the tracks that are all zeros
+			// or aren't in the archive are then only marked in the zero map and never written
+			if(out->data == NULL && dmsendtrack >= dmsstarttrack &&
+				zeroedbuffer(out,(size_t)(dmsendtrack-dmsstarttrack+1)*((infobits & DMS_HIGHDENSITY) ? MAX_SECTORS : SECTORS)/80*sizeof(union sector)) != 0) {
+				fprintf(stderr,"Out of memory\n");
+				return 1;
+			}
+			// Read the track headers and on and on until we're done..
+			for(i=dmsstarttrack;i<=dmsendtrack;i++) {
+				if((readbuffer(trackheader,20,in)) == 20)  {
+					// Read the trackheader successfully, check if it's valid
+					if(trackheader[0] == 'T' && trackheader[1] == 'R')  {
+						if(debug) 
+							fprintf(debugfile,"Valid track header on track %u, file position: 0x%lx\n",i,(long)in->position);
+						// Get CRC of header
+						trackcrc = (trackheader[18]<<8) + trackheader[19];
+						// Get CRC of packed track
+						trackpackcrc = (trackheader[16]<<8) + trackheader[17];
+						// Get CRC of unpacked track
+						trackunpackcrc = (trackheader[14]<<8) + trackheader[15];
+						// Get flags
+						trackcflags = trackheader[12];
+
+						// Set flags accordingly
+						trackcflag_noclear = trackcflags & 1;
+						trackcflag_compressed = trackcflags & 2;
+						trackcflag_rle = trackcflags & 4;
+
+						// This is a valid trackheader, check if CRC is valid
+						if( mycrc(trackheader, 18) == trackcrc) {
+							if(debug)
+								fprintf(debugfile,"\tTrack header CRC is OK\n");
+							trackcurrent = (trackheader[2]<<8)+trackheader[3];
+							trackpacked = (trackheader[6]<<8)+trackheader[7];
+							trackrlesize = (trackheader[8]<<8)+trackheader[9];
+							trackunpacked = (trackheader[10]<<8)+trackheader[11];
+							extratrack = dmsextratrack(trackheader,infobits,dmsendtrack);
+							// A track further on is a gap in the archive, those are filled in below
+							if(extratrack == NULL && (trackcurrent < (unsigned int)i || trackcurrent > dmsendtrack)) 
+								fprintf(debugfile,"\tCurrent track, track header mismatch, current: %u header: %u\n",trackcurrent,i);
+							else if(extratrack == NULL && debug)
+								fprintf(debugfile,"\tCurrent track OK, current: %u header: %u\n",trackcurrent,i);
+							if(debug) {
+									fprintf(debugfile,"\tPacked track size: %u, RLE size: %u, Unpacked size: %u\n",trackpacked,trackrlesize,trackunpacked);
+									fprintf(debugfile,"\tTrack compression flags set: %u noclear: %u compressed: %u rle: %u\n",trackcflags,trackcflag_noclear,trackcflag_compressed,trackcflag_rle);
+							}
+
+							trackpackmode = trackheader[13]; 
+
+							// The track has to fit in the buffers, a larger one can only come from a damaged archive
+							if(trackpacked > BUFFERSIZE-16 || trackrlesize > BUFFERSIZE || trackunpacked > BUFFERSIZE) {
+								fprintf(debugfile,"Track %u is too large for the unpack buffers, file is probably corrupt\n",i);
+								return 1;
+							}
+
+							// Read in the packed bytes
+							if((readbuffer(pack_buffer,trackpacked,in) == trackpacked) && mycrc(pack_buffer, trackpacked) == trackpackcrc) {
+								// Managed to read in the packed bytes from the file
+
+								// Every track but FILE_ID.DIZ is encrypted, the banner as well
+								if((infobits & DMS_ENCRYPT) && trackcurrent != 80)
+									dmsdecrypt(pack_buffer,trackpacked,&dmspass);
+
+								// The banner, FILE_ID.DIZ and fake bootblock aren't on the disk, read the next
+								// track header in place of this one
+								if(extratrack != NULL) {
+									if(debug)
+										fprintf(debugfile,"\tSkipping the %s track\n",extratrack);
+									i--;
+									continue;
+								}
+
+								// Tracks the archive skips are left empty, instead of the tracks after them
+								// moving up to take their place
+								if(trackcurrent > (unsigned int)i && trackcurrent <= dmsendtrack) {
+									missing = trackcurrent-i;
+									fprintf(debugfile,"\tTracks %d to %u are not in the DMS file, leaving them empty\n",i,trackcurrent-1);
+									if(zerobuffer((size_t)missing*trackunpacked,out) != (size_t)missing*trackunpacked) {
+										fprintf(debugfile,"Cannot write to outputfile, exiting\n");
+										return 1;
+									}
+									i = trackcurrent;
+								}
+	
+								// Deal with the decompression
+								// This is in order of increasing compression, the simplest is just store encryption where there is no compression and no RLE encoding
+								// Then there is just RLE, followed by quick, medium, deep, heavy and heavy 2 compression, there are further 3 options available in DMS which are not supported in this program, heavy(3), heavy(4) and heavy(5) 
+				
+								buffer = decrunchtrack(i,trackpackmode,trackcflags,trackpacked,trackrlesize,trackunpacked,trackunpackcrc,debug,debugfile);
+								if(buffer == NULL)
+									return 1;
+								// Write track and buffer to outfile, a track of zeros is only marked
+								if(trackunpacked > 0 && buffer[0] == 0 && memcmp(buffer,buffer+1,trackunpacked-1) == 0)
+									written = zerobuffer(trackunpacked,out);
+								else
+									written = writebuffer(buffer,trackunpacked,out);
+								if(written != trackunpacked) {
+									fprintf(debugfile,"Cannot write to outputfile, exiting\n");
+									return 1;
+								} else if(debug) {
+									fprintf(debugfile,"\tSuccessfully wrote track %u, output file offset: %lx\n",i,(long)out->size);
+								}
+							} else {
+								fprintf(debugfile,"Can't read packed bytes from DMS file or CRC error, file is probably corrupt\n");
+								return 1;
+							}
+						} else {
+							fprintf(debugfile,"Track header CRC on track %u is invalid\n",i);
+							if(debug)
+								fprintf(debugfile,"Track header CRC: %u Calculated CRC: %u\n",((trackheader[18]<<8)+trackheader[19]),mycrc(trackheader, 18));
+							if(strictdecode)
+								return 1;
+						}
+					} else {
+						fprintf(debugfile,"Corrupt track header %u from DMS file\n",i);
+						return 1;
+					}
+				} else if((infobits & DMS_NOZERO) && trackunpacked > 0 && in->position >= in->size) {
+					// The archive leaves out the empty tracks at the end of the disk
+					fprintf(debugfile,"The DMS file ends before track %d, leaving the rest of the disk empty\n",i);
+					if(zerobuffer((size_t)(dmsendtrack-i+1)*trackunpacked,out) != (size_t)(dmsendtrack-i+1)*trackunpacked) {
+						fprintf(debugfile,"Cannot write to outputfile, exiting\n");
+						return 1;
+					}
+					break;
+				} else {
+					fprintf(debugfile,"Error reading track %u from DMS file\n",i);
+					return 1;
+				}
+			}
+		} else {
+			fprintf(stderr,"File is not a valid DMS file or header is corrupt\n");
+			return 1;
+		}	
+	} else {
+		fprintf(stderr,"Inputfile is not valid\n");
+		// Input file is not valid
+		return 1;
+	}
+
+	// If we reached here the file is uncompressed...
+	return 0;
+} // End function undmsbuffer
+
+// Added for version 5
+// Determine the format of an image from its first bytes, returns FORMAT_UNKNOWN if they don't tell us
+int detectformat(uint8_t *data, size_t size) {
+	if(size >= 4 && data[0] == 'D' && data[1] == 'M' && data[2] == 'S' && data[3] == '!')
+		return FORMAT_DMS;
+	if(size >= 4 && data[0] == 0x50 && data[1] == 0x4B && data[2] == 0x03 && data[3] == 0x04)
+		return FORMAT_ZIP;
+	if(size >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+		return FORMAT_ADZ;
+	// Any AmigaDOS bootblock, DOS\0 is OFS, the other flavours are still raw images
+	if(size >= 4 && data[0] == 'D' && data[1] == 'O' && data[2] == 'S' && data[3] <= 7)
+		return FORMAT_ADF;
+	return FORMAT_UNKNOWN;
+}
+
+// Name of a format for messages
+char *formatname(int format) {
+	switch(format) {
+		case FORMAT_ADF:
+			return "ADF";
+		case FORMAT_ADZ:
+			return "gzip";
+		case FORMAT_DMS:
+			return "DMS";
+		case FORMAT_ZIP:
+			return "ZIP";
+		default:
+			return "unknown";
+	}
+}
+
+// Decode an image in place until it's a raw ADF, each layer is recognised by its magic bytes so mislabeled files and
+// containers nested in each other (a zip of a DMS, a gzip of a zip) are all handled in memory
+// forcedformat is the format given on the command line and is used for the outermost layer, hintformat is the one
+// guessed from the file extension which is only used when the outermost layer has no magic bytes we know
+// Returns 0 on success and 1 on error
+int decodeimage(struct membuffer *image, int forcedformat, int hintformat, int endsector, unsigned int debug, FILE *debugfile) {
+	struct membuffer decoded;
+	int format = 0; int depth = 0; int ret = 0;
+
+	for(depth = 0; depth < MAX_CONTAINER_DEPTH; depth++) {
+		format = detectformat(image->data,image->size);
+		if(depth == 0 && forcedformat)
+			format = forcedformat;
+		else if(depth == 0 && format == FORMAT_UNKNOWN)
+			format = hintformat;
+		else if(depth == 0 && hintformat && hintformat != (format == FORMAT_ZIP ? FORMAT_ADZ : format))
+			fprintf(debugfile,"The contents of the file are %s, ignoring the file extension\n",formatname(format));
+		if(debug || (depth > 0 && format != FORMAT_ADF && format != FORMAT_UNKNOWN))
+			fprintf(debugfile,"Layer %d is %s\n",depth,format == FORMAT_UNKNOWN ? "not recognised, assuming ADF" : formatname(format));
+		if(format == FORMAT_ADF || format == FORMAT_UNKNOWN)
+			return 0;
+		memset(&decoded,0,sizeof(struct membuffer));
+		image->position = 0;
+		if(format == FORMAT_DMS) {
+			ret = undmsbuffer(image,&decoded,endsector,debug,debugfile);
+		} else {
+			#ifdef _HAVE_ZLIB
+			ret = uncompressbuffer(image,&decoded,debug,debugfile);
+			#else
+			fprintf(debugfile,"No zlib support, try changing _HAVE_ZLIB define and compiling with -lz\n");
+			ret = 1;
+			#endif
+		}
+		if(ret != 0) {
+			fprintf(stderr,"Can't decode %s data\n",formatname(format));
+			freebuffer(&decoded);
+			return 1;
+		}
+		freebuffer(image);
+		*image = decoded;
+	}
+	fprintf(stderr,"Containers are nested more than %d deep, giving up\n",MAX_CONTAINER_DEPTH);
+	return 1;
+}
+
+// Added for version 5
+// Whether a data block belongs to a file header the main loop writes it to, the main loop and recoverchains() have to
+// agree on this or chain mode loses the blocks that neither of them takes. The header has to be inside the sectors
+// that were read, which on HD images goes past the DD range
+int hasheader(union sector *sector, uint32_t header_key, unsigned int endsector) {
+	return header_key < endsector && amiga32(sector[header_key].hdr.type) == T_HEADER;
+}
+
+#ifdef EXTRACTADF_SWAPPED_HOST
+// Put the words of the sectors in the byte order of the host the build pretends to be on, the names, comments and
+// the data of data blocks are bytes and stay as they are
+void swaphostorder(union sector *sector, unsigned int sectors) {
+	uint8_t *block;
+	uint32_t type = 0;
+	unsigned int i = 0; unsigned int k = 0;
+
+	for(i = 0; i < sectors; i++) {
+		block = (uint8_t *)&sector[i];
+		type = ((uint32_t)block[0] << 24) | ((uint32_t)block[1] << 16) | ((uint32_t)block[2] << 8) | block[3];
+		for(k = 0; k < sizeof(union sector); k += 4) {
+			if(type == T_DATA && k >= offsetof(struct dataheader,data))
+				break;
+			if((type == T_HEADER || type == T_LIST) && ((k >= offsetof(struct fileheader,comm_len) && k < offsetof(struct fileheader,days)) ||
+				(k >= offsetof(struct fileheader,name_len) && k < offsetof(struct fileheader,unused4))))
+				continue;
+			*(uint32_t *)(block+k) = ((uint32_t)block[k] << 24) | ((uint32_t)block[k+1] << 16) | ((uint32_t)block[k+2] << 8) | block[k+3];
+		}
+	}
+}
+#endif
+
+// Whether a block pointer as it is stored in a block passes the sanity check extract-adf has always made on header keys
+// and parents, the low five bits of its first byte have to be zero, which they are for any sector a floppy can have
+int plausiblepointer(uint32_t pointer) {
+	return ((amiga32(pointer) >> 24) & 31) == 0;
+}
+
+// Added for version 5
+// Helper struct used to sort the chains found by recoverchains(), one entry per chain head
+struct chainhead {
+	uint32_t header_key;
+	uint32_t seq_num;
+	int sector;
+};
+
+// Comparison function for qsort, sorts chain heads by header key and then by sequence number
+int comparechainheads(const void *a, const void *b) {
+	const struct chainhead *heada = a;
+	const struct chainhead *headb = b;
+
+	if(heada->header_key != headb->header_key)
+		return (heada->header_key < headb->header_key) ? -1 : 1;
+	if(heada->seq_num != headb->seq_num)
+		return (heada->seq_num < headb->seq_num) ? -1 : 1;
+	return heada->sector - headb->sector;
+}
+
+// Added for version 5
+// Reconstruct files whose header block has been lost by following the next_data links of their data blocks
+// The block graph is built in one pass over the sector range using arrays indexed by sector number, every chain
+// belonging to the same header key is then stitched into a single buffer at the offset given by its sequence number,
+// and each file is written out to the Orphaned directory with a single write
+// If scanmask is not NULL only the data blocks set in it are considered
+// Returns the number of files written, or -1 on error
+int recoverchains(union sector *sector, uint8_t *scanmask, int startsector, unsigned int endsector, unsigned int debug, FILE *debugfile) {
+	// Next sector in the chain for every sector, -1 if there is none
+	int chainnext[MAX_SECTORS];
+	// Whether a sector is a headerless data block, and whether some other block links to it
+	uint8_t headerless[MAX_SECTORS];
+	uint8_t haspredecessor[MAX_SECTORS];
+	// The chain heads, sorted by header key so all the chains of one file are next to each other
+	struct chainhead heads[MAX_SECTORS];
+	int numheads = 0;
+	// Buffer used to stitch the file together, large enough to hold every data block in the range
+	uint8_t *buffer;
+	// Size of the file being stitched together
+	size_t filesize = 0;
+	// Number of files written
+	int files = 0;
+	// Temporary variables
+	int i = 0; int n = 0; int first = 0;
+	uint32_t header_key = 0; uint32_t next = 0; uint32_t seq_num = 0; uint32_t data_size = 0;
+	// Filename of the reconstructed file
+	char filename[MAX_FILENAME_LENGTH];
+	char path[MAX_FILENAME_LENGTH+16];
+	// File pointer for the reconstructed file
+	FILE *f;
+	// Directory we return to when we're done
+	int root = 0;
+
+	if(endsector > MAX_SECTORS)
+		endsector = MAX_SECTORS;
+
+	// First pass, find every data block whose header key does not point at a valid header block
+	for(i = 0; i < endsector; i++) {
+		chainnext[i] = -1;
+		headerless[i] = 0;
+		haspredecessor[i] = 0;
+		if(i < startsector || (scanmask != NULL && !scanmask[i]) || amiga32(sector[i].hdr.type) != T_DATA)
+			continue;
+		header_key = amiga32(sector[i].hdr.header_key);
+		if(hasheader(sector,header_key,endsector))
+			continue;
+		headerless[i] = 1;
+	}
+
+	// Second pass, link every headerless block to its successor if the successor agrees on the header key and
+	// carries the next sequence number, a block can only have one predecessor
+	for(i = startsector; i < endsector; i++) {
+		if(!headerless[i])
+			continue;
+		next = amiga32(sector[i].hdr.next_data);
+		if(next == 0 || next >= endsector || !headerless[next] || haspredecessor[next])
+			continue;
+		if(sector[next].hdr.header_key != sector[i].hdr.header_key)
+			continue;
+		if(amiga32(sector[next].hdr.seq_num) != amiga32(sector[i].hdr.seq_num)+1)
+			continue;
+		chainnext[i] = next;
+		haspredecessor[next] = 1;
+	}
+
+	// Every headerless block that nothing links to starts a chain
+	for(i = startsector; i < endsector; i++) {
+		if(!headerless[i] || haspredecessor[i])
+			continue;
+		heads[numheads].header_key = amiga32(sector[i].hdr.header_key);
+		heads[numheads].seq_num = amiga32(sector[i].hdr.seq_num);
+		heads[numheads].sector = i;
+		numheads++;
+	}
+	if(debug)
+		fprintf(debugfile,"Found %d headerless data block chains\n",numheads);
+	if(numheads == 0)
+		return 0;
+
+	qsort(heads,numheads,sizeof(struct chainhead),comparechainheads);
+
+	buffer = malloc(endsector * DATABYTES);
+	if(buffer == NULL) {
+		fprintf(stderr,"Out of memory\n");
+		return -1;
+	}
+
+	// Write the files into the Orphaned directory and then return to where we were
+	root = outputopendir(".");
+	if(root == -1) {
+		fprintf(stderr,"Can't write to root directory, exiting\n");
+		free(buffer);
+		return -1;
+	}
+	if(outputmkdir("Orphaned") < 0 && errno != EEXIST)
+		fprintf(stderr,"Can't create directory in current path, check permissions\n");
+	imagestats.syscalls++;
+	if(chdir("Orphaned") == -1) {
+		fprintf(stderr,"Can't change to orphan directory, exiting\n");
+		close(root);
+		free(buffer);
+		return -1;
+	}
+
+	for(first = 0; first < numheads; first = n) {
+		filesize = 0;
+		// Walk every chain with the same header key and copy its blocks into place
+		for(n = first; n < numheads && heads[n].header_key == heads[first].header_key; n++) {
+			for(i = heads[n].sector; i != -1; i = chainnext[i]) {
+				seq_num = amiga32(sector[i].hdr.seq_num);
+				data_size = amiga32(sector[i].hdr.data_size);
+				// Sequence numbers or sizes outside the range of the disk are corrupt, skip those blocks
+				if(seq_num == 0 || seq_num > endsector || data_size > DATABYTES) {
+					if(debug)
+						fprintf(debugfile,"Sector %d has an invalid seq_num %u or data_size %u, skipping\n",i,seq_num,data_size);
+					continue;
+				}
+				// Fill any gap left by a lost block with zeroes
+				if((seq_num-1)*DATABYTES > filesize)
+					memset(buffer+filesize,0,(seq_num-1)*DATABYTES-filesize);
+				memcpy(buffer+(seq_num-1)*DATABYTES,sector[i].dh.data,data_size);
+				if((seq_num-1)*DATABYTES+data_size > filesize)
+					filesize = (seq_num-1)*DATABYTES+data_size;
+				if(debug)
+					fprintf(debugfile,"Chain for header key %u: sector %d seq_num %u data_size %u next_data %d\n",heads[first].header_key,i,seq_num,data_size,chainnext[i]);
+			}
+		}
+		if(filesize == 0)
+			continue;
+		snprintf(filename,MAX_FILENAME_LENGTH,"Chain-%u-%d",heads[first].header_key,heads[first].sector);
+		f = outputfopen(filename,"w");
+		if(f == NULL) {
+			fprintf(stderr,"Can't create file %s\n",filename);
+			continue;
+		}
+		if(outputfwrite(buffer,1,filesize,f) != filesize)
+			fprintf(stderr,"Can't write to file %s\n",filename);
+		outputfclose(f);
+		if(manifestwanted()) {
+			snprintf(path,sizeof(path),"Orphaned/%s",filename);
+			manifestdata(path,buffer,filesize,time(NULL));
+		}
+		files++;
+		imagestats.files++;
+		if(debug)
+			fprintf(debugfile,"Reconstructed %s, %lu bytes from %d chain(s)\n",filename,(unsigned long)filesize,n-first);
+	}
+
+	imagestats.syscalls++;
+	if(fchdir(root) == -1)
+		fprintf(stderr,"Can't return to previous working directory\n");
+	outputclose(root);
+	free(buffer);
+
+	return files;
+} // End function recoverchains
+
+// Added for version 5
+// Load the allocation bitmap the root block points to into allocated, one byte per sector which is 1 if the sector is
+// in use, the bootblock and the root block are always in use, disksectors is the size of the whole disk (1760 or 3520)
+// Returns 0 if the bitmap was loaded, 1 if the root block or the bitmap is missing or not valid
+int loadbitmap(union sector *sector, unsigned int endsector, unsigned int disksectors, uint8_t *allocated, unsigned int debug, FILE *debugfile) {
+	unsigned int root = disksectors/2;
+	unsigned int block = 0; unsigned int page = 0; unsigned int bit = 0;
+	uint32_t sum = 0; uint32_t map = 0;
+	int i = 0;
+
+	if(root >= endsector || amiga32(sector[root].hdr.type) != T_HEADER || amiga32(sector[root].fh.sec_type) != 1) {
+		fprintf(stderr,"No valid root block at sector %u, can't use the allocation bitmap\n",root);
+		return 1;
+	}
+	// AmigaDOS clears the flag while the bitmap is being changed, it can't be trusted if the disk wasn't validated
+	if(sector[root].rb.bm_flag != -1) {
+		fprintf(stderr,"The allocation bitmap is marked as not valid, can't use it\n");
+		return 1;
+	}
+	memset(allocated,0,disksectors);
+	allocated[0] = allocated[1] = 1;
+	allocated[root] = 1;
+	// Each bitmap block covers 127*32 blocks starting from block 2, a floppy never needs the bitmap extension blocks
+	for(block = 2, page = 0; block < disksectors && page < 25; page++) {
+		bit = amiga32(sector[root].rb.bm_pages[page]);
+		if(bit == 0 || bit >= endsector) {
+			fprintf(stderr,"Bitmap block %u of the root block (%u) is missing or outside the image, can't use the allocation bitmap\n",page,bit);
+			return 1;
+		}
+		for(sum = 0, i = 0; i < 128; i++)
+			sum += amiga32(((uint32_t *)&sector[bit])[i]);
+		if(sum != 0) {
+			fprintf(stderr,"Bitmap block %u has a bad checksum, can't use the allocation bitmap\n",bit);
+			return 1;
+		}
+		// The bitmap blocks themselves are in use
+		allocated[bit] = 1;
+		for(i = 0; i < 127 && block < disksectors; i++) {
+			map = amiga32(sector[bit].bm.map[i]);
+			for(; block < disksectors && block < 2+(page*127+i+1)*32; block++)
+				if(!(map & (1u << ((block-2)%32))))
+					allocated[block] = 1;
+		}
+	}
+	if(debug) {
+		for(block = 0, bit = 0; block < disksectors; block++)
+			bit += allocated[block];
+		fprintf(debugfile,"Allocation bitmap loaded, %u of %u blocks are in use\n",bit,disksectors);
+	}
+	return 0;
+}
+
+// Added for version 5
+// The result of classifying a range of sectors, the header, data and list blocks each in their own index array in
+// ascending sector order, along with a count of everything else
+struct sectorindex {
+	unsigned int *headers;
+	unsigned int numheaders;
+	unsigned int *data;
+	unsigned int numdata;
+	unsigned int *lists;
+	unsigned int numlists;
+	unsigned int others;
+	unsigned int skipped;
+};
+
+// One shard of the classification, a thread classifies the sectors from start to end into its own slice of the
+// index arrays
+struct classifyshard {
+	union sector *sector;
+	// Only sectors set here are classified, NULL means all of them
+	uint8_t *scanmask;
+	unsigned int start;
+	unsigned int end;
+	struct sectorindex index;
+	pthread_t thread;
+	int started;
+};
+
+// Classify the sectors of one shard by their block type, this only reads the sector array so the shards can run
+// at the same time
+void *classifyrange(void *arg) {
+	struct classifyshard *shard = arg;
+	unsigned int i = 0;
+	uint32_t type = 0;
+
+	for(i = shard->start; i < shard->end; i++) {
+		if(shard->scanmask != NULL && !shard->scanmask[i]) {
+			shard->index.skipped++;
+			continue;
+		}
+		type = amiga32(shard->sector[i].hdr.type);
+		if(type == T_HEADER)
+			shard->index.headers[shard->index.numheaders++] = i;
+		else if(type == T_DATA)
+			shard->index.data[shard->index.numdata++] = i;
+		else if(type == T_LIST)
+			shard->index.lists[shard->index.numlists++] = i;
+		else
+			shard->index.others++;
+	}
+	return NULL;
+}
+
+// Free the index arrays of a sector index
+void freesectorindex(struct sectorindex *index) {
+	free(index->headers);
+	free(index->data);
+	free(index->lists);
+	memset(index,0,sizeof(struct sectorindex));
+}
+
+// Classify the sectors from startsector to endsector using the given number of threads, each thread gets an equal
+// share of the range and the shards are merged in order afterwards so the result is the same as a serial pass
+// Returns 0 on success, the caller then frees the index arrays with freesectorindex(), or 1 if we're out of memory, with
+// nothing left allocated
+// If scanmask is not NULL only the sectors set in it are classified, the others are counted as skipped
+int classifysectors(union sector *sector, uint8_t *scanmask, unsigned int startsector, unsigned int endsector, int threads, struct sectorindex *index, unsigned int debug, FILE *debugfile) {
+	struct classifyshard *shards;
+	unsigned int sectors = endsector > startsector ? endsector-startsector : 0;
+	unsigned int share = 0;
+	int i = 0;
+
+	memset(index,0,sizeof(struct sectorindex));
+	// Room for every sector in every array, so each shard can write into its own slice without locking
+	index->headers = malloc((sectors+1)*sizeof(unsigned int));
+	index->data = malloc((sectors+1)*sizeof(unsigned int));
+	index->lists = malloc((sectors+1)*sizeof(unsigned int));
+	if(threads < 1)
+		threads = 1;
+	if(threads > sectors)
+		threads = sectors ? sectors : 1;
+	shards = malloc(threads*sizeof(struct classifyshard));
+	if(index->headers == NULL || index->data == NULL || index->lists == NULL || shards == NULL) {
+		fprintf(stderr,"Can't allocate memory for the sector index\n");
+		freesectorindex(index);
+		free(shards);
+		return 1;
+	}
+	share = (sectors+threads-1)/threads;
+	for(i = 0; i < threads; i++) {
+		memset(&shards[i],0,sizeof(struct classifyshard));
+		shards[i].sector = sector;
+		shards[i].scanmask = scanmask;
+		shards[i].start = startsector+i*share;
+		shards[i].end = (shards[i].start+share < endsector) ? shards[i].start+share : endsector;
+		if(shards[i].start > shards[i].end)
+			shards[i].start = shards[i].end;
+		shards[i].index.headers = index->headers+(shards[i].start-startsector);
+		shards[i].index.data = index->data+(shards[i].start-startsector);
+		shards[i].index.lists = index->lists+(shards[i].start-startsector);
+		// The first shard is classified by this thread once the others are running, as is any shard we can't start
+		// a thread for
+		if(i > 0 && pthread_create(&shards[i].thread,NULL,classifyrange,&shards[i]) == 0)
+			shards[i].started = 1;
+		else if(i > 0 && debug)
+			fprintf(debugfile,"Can't start classification thread %d, classifying its sectors serially\n",i);
+	}
+	for(i = 0; i < threads; i++) {
+		if(shards[i].started)
+			pthread_join(shards[i].thread,NULL);
+		else
+			classifyrange(&shards[i]);
+	}
+	// Merge the slices, shards are in sector order so moving each slice down behind the previous one keeps the order
+	for(i = 0; i < threads; i++) {
+		memmove(index->headers+index->numheaders,shards[i].index.headers,shards[i].index.numheaders*sizeof(unsigned int));
+		index->numheaders += shards[i].index.numheaders;
+		memmove(index->data+index->numdata,shards[i].index.data,shards[i].index.numdata*sizeof(unsigned int));
+		index->numdata += shards[i].index.numdata;
+		memmove(index->lists+index->numlists,shards[i].index.lists,shards[i].index.numlists*sizeof(unsigned int));
+		index->numlists += shards[i].index.numlists;
+		index->others += shards[i].index.others;
+		index->skipped += shards[i].index.skipped;
+	}
+	if(debug)
+		fprintf(debugfile,"Classified %u sectors with %d thread(s): %u headers, %u data blocks, %u list blocks, %u others, %u skipped\n",
+			sectors,threads,index->numheaders,index->numdata,index->numlists,index->others,index->skipped);
+	free(shards);
+	return 0;
+}
+
+// Return the next sector to extract from the index, the lowest sector number at the front of the three index
+// arrays, positions holds how far we've come in each of them, returns 0 when all of them are exhausted
+int nextsector(struct sectorindex *index, unsigned int positions[3], unsigned int *sector) {
+	unsigned int best = 3;
+	unsigned int candidate[3];
+	unsigned int i = 0;
+
+	candidate[0] = positions[0] < index->numheaders ? index->headers[positions[0]] : UINT_MAX;
+	candidate[1] = positions[1] < index->numdata ? index->data[positions[1]] : UINT_MAX;
+	candidate[2] = positions[2] < index->numlists ? index->lists[positions[2]] : UINT_MAX;
+	for(i = 0; i < 3; i++)
+		if(candidate[i] != UINT_MAX && (best == 3 || candidate[i] < candidate[best]))
+			best = i;
+	if(best == 3)
+		return 0;
+	*sector = candidate[best];
+	positions[best]++;
+	return 1;
+}
+
+
+// Added for version 5
+// Options that apply to every image processed in a run
+struct extractoptions {
+	// Forced format, 0 means it's determined from the filename
+	int format;
+	// The sector range to process
+	int startsector;
+	unsigned int endsector;
+	// Set if headerless files should be reconstructed from their next_data chains
+	int chainmode;
+	// Number of threads used to classify the sectors
+	int threads;
+	// 0 scans every sector, 1 only the blocks the allocation bitmap marks as used, 2 only the free ones
+	int bitmapmode;
+	// Debugging level, and where the output (including debugging output) goes
+	int debug;
+	FILE *outfile;
+	// Sectors per window in windowed mode, 0 loads the whole image into memory
+	unsigned int window;
+	// Glob patterns for the files to extract and the files to leave out, with none everything is extracted
+	char **includes;
+	int numincludes;
+	char **excludes;
+	int numexcludes;
+};
+
+// Added for version 5
+// Windowed extraction, for images too large to hold in memory. The image is read in windows of sectors with pread(),
+// for every sector only a compact description of the block is kept, header blocks are read again through a small
+// cache when they're needed and data blocks are read again when their file is written
+
+// What kind of header a header block is, kept in the block description
+#define META_FILE 1
+#define META_DIR 2
+#define META_ROOT 3
+
+// Set in the block description once a data block has been written out
+#define META_WRITTEN 1
+
+// Number of header blocks kept in the cache, and the default window size in sectors
+#define WINDOW_CACHE_SIZE 256
+#define WINDOW_SECTORS 2048
+
+// Compact description of a block, 16 bytes for every sector of the image instead of 512
+struct blockmeta {
+	uint32_t header_key;
+	uint32_t seq_num;
+	// For data blocks the next data block, for file headers the first data block
+	uint32_t next_data;
+	uint16_t data_size;
+	// T_HEADER, T_DATA or T_LIST, 0 for anything else
+	uint8_t type;
+	// META_FILE, META_DIR or META_ROOT for header blocks, and META_WRITTEN for data blocks
+	uint8_t kind;
+};
+
+// Direct mapped cache of header blocks read from the image
+struct windowcache {
+	int fd;
+	uint32_t endsector;
+	// Sector number plus one of the block in each slot, 0 for an empty slot
+	uint32_t keys[WINDOW_CACHE_SIZE];
+	union sector blocks[WINDOW_CACHE_SIZE];
+};
+
+// A directory whose timestamp is set when everything has been written
+struct windowstamp {
+	char *path;
+	struct timespec times[2];
+};
+
+// The hashes of a file for the manifest, a file the third pass writes to is hashed from disk at the end instead
+struct windowhash {
+	char *path;
+	uint32_t key;
+	struct filehash hash;
+	int64_t mtime;
+};
+
+// Add a file to the manifest, returns 1 if we're out of memory
+int windowaddhash(struct windowhash **hashes, int *numhashes, int *maxhashes, char *path, uint32_t key, struct filehash *hash, int64_t mtime) {
+	struct windowhash *grown = NULL;
+
+	if(*numhashes == *maxhashes) {
+		grown = realloc(*hashes,(*maxhashes ? *maxhashes*2 : 64)*sizeof(struct windowhash));
+		if(grown == NULL)
+			return 1;
+		*hashes = grown;
+		*maxhashes = *maxhashes ? *maxhashes*2 : 64;
+	}
+	(*hashes)[*numhashes].path = strdup(path);
+	if((*hashes)[*numhashes].path == NULL)
+		return 1;
+	(*hashes)[*numhashes].key = key;
+	(*hashes)[*numhashes].mtime = mtime;
+	(*hashes)[(*numhashes)++].hash = *hash;
+	return 0;
+}
+
+// Add a timestamp to set at the end, returns 1 if we're out of memory
+int windowaddstamp(struct windowstamp **stamps, int *numstamps, int *maxstamps, char *path, struct timespec *times) {
+	struct windowstamp *grown = NULL;
+
+	if(*numstamps == *maxstamps) {
+		grown = realloc(*stamps,(*maxstamps ? *maxstamps*2 : 64)*sizeof(struct windowstamp));
+		if(grown == NULL)
+			return 1;
+		*stamps = grown;
+		*maxstamps = *maxstamps ? *maxstamps*2 : 64;
+	}
+	(*stamps)[*numstamps].path = strdup(path);
+	if((*stamps)[*numstamps].path == NULL)
+		return 1;
+	(*stamps)[*numstamps].times[0] = times[0];
+	(*stamps)[(*numstamps)++].times[1] = times[1];
+	return 0;
+}
+
+// Read count sectors starting at sector first into buffer, returns the number of whole sectors read
+uint32_t readsectors(int fd, void *buffer, uint64_t first, uint32_t count) {
+	size_t done = 0;
+	ssize_t got = 0;
+
+	while(done < (size_t)count*sizeof(union sector)) {
+		got = pread(fd,(uint8_t *)buffer+done,(size_t)count*sizeof(union sector)-done,(off_t)(first*sizeof(union sector)+done));
+		if(got <= 0)
+			break;
+		done += got;
+	}
+	return done/sizeof(union sector);
+}
+
+// Return a sector through the cache, NULL if it's outside the image or can't be read
+union sector *cachedsector(struct windowcache *cache, uint32_t sector) {
+	unsigned int slot = sector % WINDOW_CACHE_SIZE;
+
+	if(sector >= cache->endsector)
+		return NULL;
+	if(cache->keys[slot] != sector+1) {
+		if(readsectors(cache->fd,&cache->blocks[slot],sector,1) != 1) {
+			cache->keys[slot] = 0;
+			return NULL;
+		}
+		cache->keys[slot] = sector+1;
+	}
+	return &cache->blocks[slot];
+}
+
+// Copy the name of a header block into name, characters that can't be in a filename are replaced by _, an empty
+// name is replaced by the sector number
+void windowname(union sector *block, uint32_t sector, char *name) {
+	unsigned int length = block->fh.name_len;
+	unsigned int i = 0;
+
+	if(length > sizeof(block->fh.filename))
+		length = sizeof(block->fh.filename);
+	for(i = 0; i < length && block->fh.filename[i]; i++)
+		name[i] = ((unsigned char)block->fh.filename[i] < 32 || block->fh.filename[i] == '/') ? '_' : block->fh.filename[i];
+	name[i] = '\0';
+	if(i == 0 || strcmp(name,".") == 0 || strcmp(name,"..") == 0)
+		snprintf(name,MAX_AMIGADOS_FILENAME_LENGTH,"Unnamed-%u",sector);
+}
+
+// Build the path of a header block by following the parents up to the root block, the directories on the way are
+// created, a header whose parents don't lead to the root is placed in the Orphaned directory
+// Returns 0 on success and 1 if the header itself can't be read
+int windowpath(struct windowcache *cache, struct blockmeta *meta, uint32_t sector, char *path, size_t pathsize, int createdirs) {
+	char names[MAX_PATH_DEPTH][MAX_AMIGADOS_FILENAME_LENGTH];
+	union sector *block;
+	uint32_t parent = 0;
+	int depth = 0; int orphan = 1; int i = 0;
+	size_t length = 0;
+
+	while(depth < MAX_PATH_DEPTH) {
+		block = cachedsector(cache,sector);
+		if(block == NULL)
+			return depth == 0;
+		windowname(block,sector,names[depth++]);
+		if(meta[sector].kind == META_ROOT) {
+			orphan = 0;
+			break;
+		}
+		parent = amiga32(block->fh.parent);
+		if(parent == 0 || parent >= cache->endsector || meta[parent].type != T_HEADER || parent == sector)
+			break;
+		sector = parent;
+	}
+	path[0] = '\0';
+	if(orphan) {
+		length = snprintf(path,pathsize,"Orphaned");
+		if(createdirs && outputmkdir(path) == -1 && errno != EEXIST)
+			fprintf(stderr,"Can't create directory %s\n",path);
+	}
+	// The names are from the header upwards, the path is built from the top down
+	for(i = depth-1; i >= 0 && length < pathsize; i--) {
+		length += snprintf(path+length,pathsize-length,"%s%s",length ? "/" : "",names[i]);
+		if(i > 0 && createdirs && outputmkdir(path) == -1 && errno != EEXIST)
+			fprintf(stderr,"Can't create directory %s\n",path);
+	}
+	return 0;
+}
+
+// Added for version 5
+// Include and exclude filters, glob patterns matched against the path of a file from the root of the disk, e.g.
+// s/startup-sequence or libs/*.library. A pattern without a / only has to match the name of the file, and like
+// AmigaDOS names they're not case sensitive. With filters only the files that match an include pattern (if any are
+// given) and no exclude pattern are extracted, along with the directories they are in
+
+// Match a path against one pattern, returns 1 if it matches
+int pathmatch(char *pattern, char *path) {
+	char *name = strrchr(path,'/');
+	int flags = 0;
+
+#ifdef FNM_CASEFOLD
+	flags |= FNM_CASEFOLD;
+#endif
+	if(strchr(pattern,'/') == NULL)
+		return fnmatch(pattern,name != NULL ? name+1 : path,flags) == 0;
+	return fnmatch(pattern,path,flags|FNM_PATHNAME) == 0;
+}
+
+// Returns 1 if the file with this path is to be extracted
+int pathselected(struct extractoptions *options, char *path) {
+	int i = 0;
+
+	for(i = 0; i < options->numincludes; i++)
+		if(pathmatch(options->includes[i],path))
+			break;
+	if(options->numincludes && i == options->numincludes)
+		return 0;
+	for(i = 0; i < options->numexcludes; i++)
+		if(pathmatch(options->excludes[i],path))
+			return 0;
+	return 1;
+}
+
+// Returns 0 if none of the files below the directory with this path can be selected, this only looks at the part of
+// each pattern before its first wildcard, a pattern without a / can match a file in any directory
+int directoryselected(struct extractoptions *options, char *path) {
+	size_t length = strlen(path); size_t prefix = 0;
+	int i = 0;
+
+	for(i = 0; i < options->numincludes; i++) {
+		if(strchr(options->includes[i],'/') == NULL)
+			return 1;
+		prefix = strcspn(options->includes[i],"*?[\\");
+		// The directory is a prefix of the pattern, or the pattern of the directory and the / after it
+		if(strncasecmp(options->includes[i],path,prefix < length ? prefix : length) == 0 &&
+			(prefix <= length || options->includes[i][length] == '/'))
+			return 1;
+	}
+	return options->numincludes == 0;
+}
+
+// Build the path of a file header from the root of the disk by following the parents, if they don't lead to the
+// root block the path starts at the last parent found
+void headerpath(union sector *sector, uint32_t key, uint32_t endsector, char *path, size_t pathsize) {
+	char names[MAX_PATH_DEPTH][MAX_AMIGADOS_FILENAME_LENGTH];
+	uint32_t parent = 0;
+	int depth = 0; int i = 0;
+	size_t length = 0;
+
+	while(depth < MAX_PATH_DEPTH) {
+		windowname(&sector[key],key,names[depth++]);
+		parent = amiga32(sector[key].fh.parent);
+		// The name of the root block is the name of the disk, that's not part of the path
+		if(parent == 0 || parent >= endsector || parent == key || amiga32(sector[parent].hdr.type) != T_HEADER ||
+			amiga32(sector[parent].fh.sec_type) == 1)
+			break;
+		key = parent;
+	}
+	path[0] = '\0';
+	for(i = depth-1; i >= 0 && length < pathsize; i--)
+		length += snprintf(path+length,pathsize-length,"%s%s",length ? "/" : "",names[i]);
+}
+
+// Take every block that doesn't belong to a selected file out of the scan, so nothing is read or written for the
+// files that aren't selected. Directory headers are taken out as well, the directories a selected file is in are
+// created when the file is. Returns 1 if we're out of memory
+int filtersectors(union sector *sector, uint32_t startsector, uint32_t endsector, struct extractoptions *options, uint8_t *scanmask, unsigned int debug, FILE *debugfile) {
+	char path[MAX_PATH_DEPTH*MAX_AMIGADOS_FILENAME_LENGTH];
+	uint8_t *selected = calloc(endsector ? endsector : 1,1);
+	uint32_t i = 0; uint32_t key = 0;
+	unsigned int files = 0;
+
+	if(selected == NULL)
+		return 1;
+	for(i = 0; i < endsector; i++) {
+		if(amiga32(sector[i].hdr.type) != T_HEADER || (int32_t)amiga32(sector[i].fh.sec_type) != -3)
+			continue;
+		headerpath(sector,i,endsector,path,sizeof(path));
+		selected[i] = pathselected(options,path);
+		if(selected[i] && i >= startsector) {
+			files++;
+			if(debug)
+				fprintf(debugfile,"Selected %s\n",path);
+		}
+	}
+	for(i = startsector; i < endsector; i++) {
+		switch(amiga32(sector[i].hdr.type)) {
+			case T_HEADER:
+				key = i;
+				break;
+			case T_DATA:
+				key = amiga32(sector[i].hdr.header_key);
+				break;
+			case T_LIST:
+				key = amiga32(sector[i].fh.parent);
+				break;
+			default:
+				continue;
+		}
+		if(key >= endsector || !selected[key])
+			scanmask[i] = 0;
+	}
+	free(selected);
+	fprintf(debugfile,"The filters select %u files\n",files);
+	return 0;
+}
+
+// Added for version 5
+// Index of the tracks of a DMS archive, so the tracks that hold the sectors we want can be decoded on their own instead
+// of decoding the whole archive. The quick, medium, deep and heavy modes keep their dictionary from one track to the
+// next unless a track clears it (the noclear flag isn't set), and heavy tracks can reuse the Huffman tables of the
+// heavy track before them, so a track can only be decoded after the tracks of the same mode back to the last one that
+// started afresh, that is its chain. Store and RLE tracks stand on their own
+
+// One track of a DMS archive
+struct dmstrack {
+	// Where the packed bytes of the track start in the archive
+	size_t offset;
+	unsigned int packed;
+	unsigned int rlesize;
+	unsigned int unpacked;
+	unsigned int flags;
+	unsigned int mode;
+	unsigned int unpackcrc;
+	// First track of the chain that has to be decoded before this one, the track itself if it doesn't need one
+	int chain;
+};
+
+struct dmsindex {
+	struct dmstrack *tracks;
+	int numtracks;
+	// Bytes in an unpacked track
+	unsigned int tracksize;
+	// The last track decoded with each dictionary, the next track with that dictionary can carry on from there
+	int position[4];
+};
+
+// The dictionary a crunch mode uses, the two heavy modes share one, -1 for the modes that don't have one
+int dmsdictionary(unsigned int mode) {
+	switch(mode) {
+		case 2:
+			return 0;
+		case 3:
+			return 1;
+		case 4:
+			return 2;
+		case 5:
+		case 6:
+			return 3;
+		default:
+			return -1;
+	}
+}
+
+// Index the tracks of a DMS archive by reading only the headers and skipping over the packed bytes
+// Returns 0 on success and 1 if the archive can't be decoded a track at a time, it's then decoded in full by
+// undmsbuffer() which reports what is wrong with it
+int indexdms(struct membuffer *in, struct dmsindex *index, unsigned int endsector, unsigned int debug, FILE *debugfile) {
+	uint8_t *header = in->data;
+	uint8_t *trackheader;
+	size_t position = 56;
+	unsigned int infobits = 0; unsigned int starttrack = 0; unsigned int endtrack = 0;
+	int last[4] = { -1, -1, -1, -1 };
+	int tables = -1; int dictionary = 0; int i = 0;
+	struct dmstrack *track;
+
+	memset(index,0,sizeof(struct dmsindex));
+	if(in->size < position || memcmp(header,"DMS!",4) != 0)
+		return 1;
+	infobits = (header[8]<<24)+(header[9]<<16)+(header[10]<<8)+header[11];
+	starttrack = (header[16]<<8)+header[17];
+	endtrack = (header[18]<<8)+header[19];
+	if((infobits & (DMS_ENCRYPT|DMS_PC)) || ((infobits & DMS_HIGHDENSITY) && endsector < MAX_SECTORS) || starttrack != 0 || endtrack < starttrack)
+		return 1;
+	index->tracks = malloc((endtrack+1)*sizeof(struct dmstrack));
+	if(index->tracks == NULL)
+		return 1;
+	for(i = 0; i < 4; i++)
+		index->position[i] = -1;
+	// The tracks have to be numbered from 0 in order and be the same size, so every track has its place in the image
+	for(i = 0; i <= (int)endtrack; i++) {
+		trackheader = in->data+position;
+		if(position+20 > in->size || trackheader[0] != 'T' || trackheader[1] != 'R' ||
+			mycrc(trackheader,18) != (unsigned int)((trackheader[18]<<8)+trackheader[19]))
+			break;
+		// The banner, FILE_ID.DIZ and fake bootblock are stepped over like undmsbuffer() does
+		if(dmsextratrack(trackheader,infobits,endtrack) != NULL) {
+			position += 20+(trackheader[6]<<8)+trackheader[7];
+			i--;
+			continue;
+		}
+		if((unsigned int)((trackheader[2]<<8)+trackheader[3]) != (unsigned int)i)
+			break;
+		track = &index->tracks[i];
+		track->offset = position+20;
+		track->packed = (trackheader[6]<<8)+trackheader[7];
+		track->rlesize = (trackheader[8]<<8)+trackheader[9];
+		track->unpacked = (trackheader[10]<<8)+trackheader[11];
+		track->flags = trackheader[12];
+		track->mode = trackheader[13];
+		track->unpackcrc = (trackheader[14]<<8)+trackheader[15];
+		if(track->packed > BUFFERSIZE-16 || track->rlesize > BUFFERSIZE || track->unpacked > BUFFERSIZE ||
+			track->unpacked == 0 || track->unpacked % sizeof(union sector) != 0 || track->offset+track->packed > in->size ||
+			mycrc(in->data+track->offset,track->packed) != (unsigned int)((trackheader[16]<<8)+trackheader[17]) ||
+			(i > 0 && track->unpacked != index->tracksize))
+			break;
+		index->tracksize = track->unpacked;
+		// A track that clears the dictionary starts a chain, a heavy track that has no tables of its own needs the
+		// last one that had them as well
+		track->chain = i;
+		dictionary = dmsdictionary(track->mode);
+		if(dictionary >= 0) {
+			if(!(track->flags & 1))
+				last[dictionary] = i;
+			if(dictionary == 3 && (track->flags & 2))
+				tables = i;
+			track->chain = last[dictionary] >= 0 ? last[dictionary] : 0;
+			if(dictionary == 3 && (tables < 0 || tables < track->chain))
+				track->chain = tables >= 0 ? tables : 0;
+		}
+		position = track->offset+track->packed;
+	}
+	if(i <= (int)endtrack) {
+		if(debug)
+			fprintf(debugfile,"Track %d of the DMS archive can't be indexed, decoding all of it\n",i);
+		free(index->tracks);
+		index->tracks = NULL;
+		return 1;
+	}
+	index->numtracks = i;
+	if(debug)
+		fprintf(debugfile,"Indexed %d DMS tracks of %u bytes\n",index->numtracks,index->tracksize);
+	return 0;
+}
 
-			if(mycrc(header, 50) == dmsheadercrc) 
-				fprintf(debugfile,"DMS header CRC is OK\n");
-			else
-				fprintf(debugfile,"DMS header CRC mismatch, changes are this is a damaged archive, continuing anyway\n");
+// Decode the tracks marked in wanted, and the tracks their chains need, into sector which holds the first endsector
+// sectors of the image, decoded marks the tracks that have been decoded. A chain carries on from the last track
+// decoded with the same dictionary if it can, so asking for the tracks in order only decodes every track once
+// Returns the number of tracks decoded, or -1 if one of them can't be
+int undmstracks(struct membuffer *in, struct dmsindex *index, uint8_t *wanted, uint8_t *decoded, union sector *sector, unsigned int endsector, unsigned int debug, FILE *debugfile) {
+	struct dmstrack *track;
+	unsigned char *buffer;
+	uint64_t offset = 0; uint64_t length = 0;
+	int i = 0; int j = 0; int first = 0; int dictionary = 0; int count = 0;
 
-			if(debug) {
-				fprintf(debugfile,"DMS Header CRC: %u\n",dmsheadercrc);
+	for(i = 0; i < index->numtracks; i++) {
+		if(!wanted[i] || decoded[i])
+			continue;
+		dictionary = dmsdictionary(index->tracks[i].mode);
+		first = i;
+		if(dictionary >= 0) {
+			first = index->tracks[i].chain;
+			if(index->position[dictionary] >= first && index->position[dictionary] < i)
+				first = index->position[dictionary]+1;
+		}
+		for(j = first; j <= i; j++) {
+			track = &index->tracks[j];
+			if(j != i && dmsdictionary(track->mode) != dictionary)
+				continue;
+			memcpy(pack_buffer,in->data+track->offset,track->packed);
+			memset(pack_buffer+track->packed,0,16);
+			buffer = decrunchtrack(j,track->mode,track->flags,track->packed,track->rlesize,track->unpacked,track->unpackcrc,debug,debugfile);
+			if(buffer == NULL) {
+				// Whatever state the dictionaries are in now, it's not one any chain can carry on from
+				for(j = 0; j < 4; j++)
+					index->position[j] = -1;
+				return -1;
 			}
-			// Print the crunch mode
-			switch(dmscrunchmode) {
-				case 0:
-					fprintf(debugfile,"DMS crunch mode: No compression\n");
-					break;
-				case 1:
-					fprintf(debugfile,"DMS crunch mode: Simple compression\n");
-					break;
-				case 2:
-					fprintf(debugfile,"DMS crunch mode: Quick compression\n");
-					break;
-				case 3:
-					fprintf(debugfile,"DMS crunch mode: Medium compression\n");
-					break;
-				case 4:
-					fprintf(debugfile,"DMS crunch mode: Deep compression\n");
-					break;
-				case 5:
-					fprintf(debugfile,"DMS crunch mode: Heavy (1) compression\n");
-					break;
-				case 6:
-					fprintf(debugfile,"DMS crunch mode: Heavy (2) compression\n");
-					break;
-				case 7:
-					fprintf(debugfile,"DMS crunch mode: Heavy (3) compression\n");
-					break;
-				case 8:
-					fprintf(debugfile,"DMS crunch mode: Heavy (4) compression\n");
-					break;
-				case 9:
-					fprintf(debugfile,"DMS crunch mode: Heavy (5) compression\n");
-					break;
-				default:
-					fprintf(debugfile,"Unknown crunch mode used in DMSg\n");
-					return NULL;
+			if(dictionary >= 0)
+				index->position[dictionary] = j;
+			// Tracks decoded only for their dictionary are copied as well, they're right
+			offset = (uint64_t)j*index->tracksize;
+			if(offset < (uint64_t)endsector*sizeof(union sector)) {
+				length = (uint64_t)endsector*sizeof(union sector)-offset < track->unpacked ? (uint64_t)endsector*sizeof(union sector)-offset : track->unpacked;
+				memcpy((uint8_t *)sector+offset,buffer,length);
 			}
-			// Read the track headers and on and on until we're done..
-			for(i=dmsstarttrack;i<=dmsendtrack;i++) {
-				if((fread(trackheader,1,20,infile)) == 20)  {
-					// Read the trackheader successfully, check if it's valid
-					if(trackheader[0] == 'T' && trackheader[1] == 'R')  {
-						if(debug) 
-							fprintf(debugfile,"Valid track header on track %u, file position: 0x%lx\n",i,ftell(infile));
-						// Get CRC of header
-						trackcrc = (trackheader[18]<<8) + trackheader[19];
-						// Get CRC of packed track
-						trackpackcrc = (trackheader[16]<<8) + trackheader[17];
-						// Get CRC of unpacked track
-						trackunpackcrc = (trackheader[14]<<8) + trackheader[15];
-						// Get flags
-						trackcflags = trackheader[12];
-
-						// Set flags accordingly
-						trackcflag_noclear = trackcflags & 1;
-						trackcflag_compressed = trackcflags & 2;
-						trackcflag_rle = trackcflags & 4;
+			if(!decoded[j])
+				count++;
+			decoded[j] = 1;
+		}
+	}
+	return count;
+}
 
-						// This is a valid trackheader, check if CRC is valid
-						if( mycrc(trackheader, 18) == trackcrc) {
-							if(debug)
-								fprintf(debugfile,"\tTrack header CRC is OK\n");
-							trackcurrent = (trackheader[2]<<8)+trackheader[3];
-							if(trackcurrent != i) 
-								fprintf(debugfile,"\tCurrent track, track header mismatch, current: %u header: %u\n",trackcurrent,i);
-							else if(debug)
-								fprintf(debugfile,"\tCurrent track OK, current: %u header: %u\n",trackcurrent,i);
-							trackpacked = (trackheader[6]<<8)+trackheader[7];
-							trackrlesize = (trackheader[8]<<8)+trackheader[9];
-							trackunpacked = (trackheader[10]<<8)+trackheader[11];
-							if(debug) {
-									fprintf(debugfile,"\tPacked track size: %u, RLE size: %u, Unpacked size: %u\n",trackpacked,trackrlesize,trackunpacked);
-									fprintf(debugfile,"\tTrack compression flags set: %u noclear: %u compressed: %u rle: %u\n",trackcflags,trackcflag_noclear,trackcflag_compressed,trackcflag_rle);
-							}
+// Make sure the track a block is on has been decoded, returns 0 if it has and -1 if it can't be
+int dmsblock(struct membuffer *in, struct dmsindex *index, uint8_t *wanted, uint8_t *decoded, union sector *sector, uint32_t block, unsigned int endsector, unsigned int debug, FILE *debugfile) {
+	uint32_t track = 0;
 
-							trackpackmode = trackheader[13]; 
+	if(block >= endsector || (track = (uint64_t)block*sizeof(union sector)/index->tracksize) >= (uint32_t)index->numtracks)
+		return -1;
+	if(decoded[track])
+		return 0;
+	wanted[track] = 1;
+	return undmstracks(in,index,wanted,decoded,sector,endsector,debug,debugfile) < 0 ? -1 : 0;
+}
 
-							// Read in the packed bytes
-							if((fread(pack_buffer,1,trackpacked,infile) == trackpacked) && mycrc(pack_buffer, trackpacked) == trackpackcrc) {
-								// Managed to read in the packed bytes from the file
-	
-								// Deal with the decompression
-								// This is in order of increasing compression, the simplest is just store encryption where there is no compression and no RLE encoding
-								// Then there is just RLE, followed by quick, medium, deep, heavy and heavy 2 compression, there are further 3 options available in DMS which are not supported in this program, heavy(3), heavy(4) and heavy(5) 
-				
-								switch(trackpackmode) {
-									case 0:
-										if(debug)
-											fprintf(debugfile,"\tTrack crunch mode: No compression\n");
-										if(!crunch_store(unpack_buffer, unpack_buffer + trackrlesize,
-											         pack_buffer, pack_buffer + trackunpacked,
-												 debug,debugfile))
-											buffer = unpack_buffer;
-										break;
-									case 1:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Simple compression\n");
-										if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
-											       pack_buffer, pack_buffer + trackunpacked,
-											       debug,debugfile))
-											buffer=unpack_buffer;
-										break;
-									case 2:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Quick compression\n");
-										if(!crunch_quick(pack_buffer, pack_buffer + trackpacked + 16,
-											        unpack_buffer, unpack_buffer + trackrlesize,
-												debug,debugfile,trackcflag_noclear))
-											if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
-											               pack_buffer, pack_buffer + trackunpacked,
-												       debug,debugfile))
-												buffer=pack_buffer;
-										break;
-									case 3:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Medium compression\n");
-										if(!crunch_medium(pack_buffer, pack_buffer + trackpacked + 16,
-											        unpack_buffer, unpack_buffer + trackrlesize,
-												debug,debugfile,trackcflag_noclear))
-											if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
-											               pack_buffer, pack_buffer + trackunpacked,
-												       debug,debugfile))
-												buffer = pack_buffer;
-										break;
-									case 4:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Deep compression\n");
-
-										if(!crunch_deep(pack_buffer, pack_buffer + trackpacked + 16,
-											        unpack_buffer, unpack_buffer + trackrlesize,
-												debug,debugfile,trackcflag_noclear))
-											if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
-											               pack_buffer, pack_buffer + trackunpacked,
-													debug,debugfile))
-												buffer = pack_buffer;
-										break;
-									case 5:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Heavy (1) compression\n");
-										// Decrunch, the track
-										if(!crunch_heavy(pack_buffer, pack_buffer + trackpacked + 16, 
-											        unpack_buffer, unpack_buffer + trackrlesize,
-											        trackcflag_compressed, 13,
-												debug,debugfile, trackcflag_noclear)) {	
-											// If RLE is set, also use RLE
-											if(trackcflag_rle) { 
-												if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
-                                        							               pack_buffer, pack_buffer + trackunpacked,
-													       debug,debugfile)) {
-                          										buffer = pack_buffer;	
-													if(debug)
-														fprintf(debugfile,"\tBuffer is set to pack buffer\n");
-												}
-											} else {
-												if(debug)
-													fprintf(debugfile,"Buffer is set to unpack buffer\n");
-												buffer = unpack_buffer;
-											}
-										} else {
-											fprintf(debugfile,"Cannot heavy(2) decompress track %u\n",i);
-											return NULL;
-										}
-										break;
-									case 6:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Heavy (2) compression\n");
-										// Decrunch, the track
-										if(!crunch_heavy(pack_buffer, pack_buffer + trackpacked + 16, 
-											        unpack_buffer, unpack_buffer + trackrlesize,
-											        trackcflag_compressed, 14,
-												debug,debugfile, trackcflag_noclear)) {	
-											// If RLE is set, also use RLE
-											if(trackcflag_rle) { 
-												if(!crunch_rle(unpack_buffer, unpack_buffer + trackrlesize,
-                                        							               pack_buffer, pack_buffer + trackunpacked,
-													       debug,debugfile)) {
-                          										buffer = pack_buffer;	
-													if(debug)
-														fprintf(debugfile,"\tBuffer is set to pack buffer\n");
-												}
-											} else {
-												if(debug)
-													fprintf(debugfile,"Buffer is set to unpack buffer\n");
-												buffer = unpack_buffer;
-											}
-										} else {
-											fprintf(debugfile,"Cannot heavy(2) decompress track %u\n",i);
-											return NULL;
-										}
-										break;
-									case 7:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Heavy (3) compression\n");
-
-										fprintf(stderr,"Heavy(3) compression not supported\n");
-										return NULL;
-										break;
-									case 8:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Heavy (4) compression\n");
-										fprintf(stderr,"Heavy(4) compression not supported\n");
-										return NULL;
-										break;
-									case 9:
-										if(debug)
-											fprintf(debugfile,"\tDMS crunch mode: Heavy (5) compression\n");
-										fprintf(stderr,"Heavy(5) compression not supported\n");
-										return NULL;
-										break;
-									default:
-										fprintf(debugfile,"Unknown crunch mode used in DMS\n");
-										return NULL;
-								}
-								// Verify CRC of unpacked track vs unpack CRC
-								if(mysimplecrc(buffer,trackunpacked) == trackunpackcrc) {
-									// Unpack CRC is okay, track was unpacked succesfully
-									if(debug)
-										fprintf(debugfile,"\tUnpack CRC: %u Trackheader unpack CRC: %u\n",mysimplecrc(buffer,trackunpacked),trackunpackcrc);
-									// Write track and buffer to outfile
-									if(fwrite(buffer,1,trackunpacked,outfile) != trackunpacked) {
-										fprintf(debugfile,"Cannot write to outputfile, exiting\n");
-										return NULL;
-									} else if(debug) {
-										fprintf(debugfile,"\tSuccessfully wrote track %u, output file offset: %lx\n",i,ftell(outfile));
-									}
-								} else {
-									fprintf(debugfile,"Unpack CRC does not match, header: %u, actual: %u, uncrunch or file error\n",trackunpackcrc,mysimplecrc(buffer,trackunpacked));
-									return NULL;
-								}
-							} else {
-								fprintf(debugfile,"Can't read packed bytes from DMS file or CRC error, file is probably corrupt\n");
-								return NULL;
-							}
-						} else {
-							fprintf(debugfile,"Track header CRC on track %u is invalid\n",i);
-							if(debug)
-								fprintf(debugfile,"Track header CRC: %u Calculated CRC: %u\n",((trackheader[18]<<8)+trackheader[19]),mycrc(trackheader, 18));
-						}
-					} else {
-						fprintf(debugfile,"Corrupt track header %u from DMS file\n",i);
-						return NULL;
+// Decode only the tracks of a DMS image that the files the -i patterns select need. The directory tree is walked from
+// the root block and the track of each header is decoded when we get to it, and then the tracks of the data blocks of
+// the selected files are decoded in one go. sector has to be zeroed and have room for endsector sectors, sectors is
+// set to how many sectors the archive has. Returns the number of tracks decoded, or -1 if the archive has to be
+// decoded in full, because it can't be decoded a track at a time or the directory tree is damaged
+int undmsselected(struct membuffer *in, struct extractoptions *options, union sector *sector, unsigned int endsector, unsigned int *sectors, unsigned int debug, FILE *debugfile) {
+	char path[MAX_PATH_DEPTH*MAX_AMIGADOS_FILENAME_LENGTH];
+	struct dmsindex index;
+	uint8_t *wanted = NULL; uint8_t *decoded = NULL; uint8_t *visited = NULL;
+	uint32_t *directories = NULL;
+	uint32_t root = 0; uint32_t key = 0; uint32_t block = 0; uint32_t list = 0; uint32_t data = 0;
+	int numdirectories = 0; int h = 0; int k = 0; int ret = -1; int selected = 0;
+
+	if(indexdms(in,&index,endsector,debug,debugfile) != 0)
+		return -1;
+	*sectors = (uint64_t)index.numtracks*index.tracksize/sizeof(union sector);
+	root = *sectors/2;
+	wanted = calloc(index.numtracks,1);
+	decoded = calloc(index.numtracks,1);
+	visited = calloc(endsector+1,1);
+	directories = malloc((endsector+1)*sizeof(uint32_t));
+	if(wanted == NULL || decoded == NULL || visited == NULL || directories == NULL)
+		goto done;
+	if(dmsblock(in,&index,wanted,decoded,sector,root,endsector,debug,debugfile) != 0 ||
+		amiga32(sector[root].hdr.type) != T_HEADER || amiga32(sector[root].fh.sec_type) != 1)
+		goto done;
+	directories[numdirectories++] = root;
+	visited[root] = 1;
+	while(numdirectories > 0) {
+		block = directories[--numdirectories];
+		for(h = 0; h < 72; h++) {
+			for(key = amiga32(sector[block].rb.hashtable[h]); key != 0; key = amiga32(sector[key].fh.hash_chain)) {
+				if(key >= endsector || visited[key] || dmsblock(in,&index,wanted,decoded,sector,key,endsector,debug,debugfile) != 0 ||
+					amiga32(sector[key].hdr.type) != T_HEADER)
+					goto done;
+				visited[key] = 1;
+				if(amiga32(sector[key].fh.sec_type) == 2) {
+					headerpath(sector,key,endsector,path,sizeof(path));
+					if(directoryselected(options,path))
+						directories[numdirectories++] = key;
+					continue;
+				}
+				if((int32_t)amiga32(sector[key].fh.sec_type) != -3)
+					continue;
+				headerpath(sector,key,endsector,path,sizeof(path));
+				if(!pathselected(options,path))
+					continue;
+				selected++;
+				// The data blocks are listed in the header and its extension blocks, the extension blocks are
+				// needed right away to get at the rest of the list
+				for(list = key; list != 0; list = amiga32(sector[list].fh.extension)) {
+					if(list != key && (list >= endsector || visited[list] ||
+						dmsblock(in,&index,wanted,decoded,sector,list,endsector,debug,debugfile) != 0))
+						break;
+					visited[list] = 1;
+					for(k = 0; k < 72; k++) {
+						data = amiga32(((uint32_t *)sector[list].fh.misc)[k]);
+						if(data != 0 && data < endsector && (uint64_t)data*sizeof(union sector)/index.tracksize < (uint64_t)index.numtracks)
+							wanted[(uint64_t)data*sizeof(union sector)/index.tracksize] = 1;
 					}
-				} else {
-					fprintf(debugfile,"Error reading track %u from DMS file\n",i);
-					return NULL;
 				}
 			}
-		} else {
-			fprintf(stderr,"File is not a valid DMS file or header is corrupt\n");
-			return NULL;
-		}	
-	} else {
-		fprintf(stderr,"Inputfile is not valid\n");
-		// Input file is not valid
-		return NULL;
+		}
+	}
+	ret = undmstracks(in,&index,wanted,decoded,sector,endsector,debug,debugfile);
+	if(ret >= 0) {
+		for(ret = 0, k = 0; k < index.numtracks; k++)
+			ret += decoded[k];
+		fprintf(debugfile,"Decoded %d of %d DMS tracks for the %d selected files\n",ret,index.numtracks,selected);
 	}
+done:
+	if(ret < 0)
+		fprintf(debugfile,"Can't decode only the tracks of the selected files, decoding the whole archive\n");
+	free(index.tracks);
+	free(wanted);
+	free(decoded);
+	free(visited);
+	free(directories);
+	return ret;
+}
 
-	// If we reached here the file is uncompressed...
-	// Close the input file
-	fclose(infile);
-	// Seek to 0 in the temporary file before returning
-	rewind(outfile);
-	// Free time struct
-	free(dmstime);
-	//  Return filepointer
-	return outfile;
-} // End function undmsfile
+// Write a data block into an open file at the place its sequence number says, returns where the data written ends
+uint64_t windowwrite(FILE *f, union sector *block, struct blockmeta *meta) {
+	uint32_t size = meta->data_size > DATABYTES ? DATABYTES : meta->data_size;
+
+	if(meta->seq_num == 0 || meta->seq_num > 0x7fffffff/DATABYTES)
+		return 0;
+	if(ftell(f) != (long)((meta->seq_num-1)*DATABYTES))
+		outputfseek(f,(meta->seq_num-1)*DATABYTES,SEEK_SET);
+	if(outputfwrite(block->dh.data,1,size,f) != size)
+		fprintf(stderr,"Can't write to output file\n");
+	meta->kind |= META_WRITTEN;
+	return (uint64_t)(meta->seq_num-1)*DATABYTES+size;
+}
 
+// Extract an image in windowed mode into the current working directory, returns 0 on success and 1 on error
+int extractwindowed(char *imagefile, struct extractoptions *options) {
+	FILE *outfile = options->outfile;
+	unsigned int debug = options->debug;
+	uint32_t window = options->window;
+	uint32_t startsector = options->startsector;
+	uint32_t endsector = options->endsector;
+	struct blockmeta *meta = NULL;
+	struct windowcache *cache = NULL;
+	struct windowstamp *stamps = NULL;
+	int numstamps = 0; int maxstamps = 0;
+	// Files for the manifest, the first numchained are the ones written in the second pass, in sector order
+	struct windowhash *hashes = NULL;
+	int numhashes = 0; int maxhashes = 0; int numchained = 0;
+	int low = 0; int high = 0;
+	struct filehash hash;
+	union sector *buffer = NULL;
+	union sector *block;
+	struct stat st;
+	struct timespec times[2];
+	// A file can end up under its name with the header key added, which is copied back into path
+	char path[MAX_PATH_DEPTH*MAX_AMIGADOS_FILENAME_LENGTH+16];
+	char filename[MAX_PATH_DEPTH*MAX_AMIGADOS_FILENAME_LENGTH+16];
+	uint32_t first = 0; uint32_t count = 0; uint32_t got = 0; uint32_t i = 0; uint32_t k = 0;
+	uint32_t next = 0; uint32_t run = 0; uint32_t openkey = 0;
+	uint32_t type = 0; int32_t sectype = 0; uint32_t bytesize = 0; uint32_t reserve = 0; int grown = 0; int stamped = 0;
+	uint64_t length = 0; uint64_t end = 0;
+	uint64_t phasestart = 0; uint64_t writestart = 0;
+	FILE *f = NULL;
+	int fd = 0; int format = 0; int ret = 1;
+
+	memset(&imagestats,0,sizeof(struct extractstats));
+	manifest.image = imagefile;
+	phasestart = monotonicnanoseconds();
+	fd = open(imagefile,O_RDONLY);
+	if(fd == -1 || fstat(fd,&st) == -1) {
+		fprintf(stderr,"Can't open file %s for reading, error returned was: %s\n",imagefile,strerror(errno));
+		if(fd != -1)
+			close(fd);
+		return 1;
+	}
+	// Windowed mode reads the image directly, so it has to be a raw image
+	buffer = malloc(sizeof(union sector));
+	format = (buffer != NULL && readsectors(fd,buffer,0,1) == 1) ? detectformat((uint8_t *)buffer,sizeof(union sector)) : -1;
+	if(format != FORMAT_ADF && format != FORMAT_UNKNOWN) {
+		fprintf(stderr,"Windowed mode needs an uncompressed image, %s is %s\n",imagefile,format == -1 ? "unreadable" : formatname(format));
+		free(buffer);
+		close(fd);
+		return 1;
+	}
+	free(buffer);
+	// Without an end sector the whole image is processed
+	if(endsector == 0 || endsector > st.st_size/sizeof(union sector))
+		endsector = st.st_size/sizeof(union sector);
+	if(startsector >= endsector) {
+		fprintf(stderr,"Start sector %u is beyond the end of the image (%u sectors)\n",startsector,endsector);
+		close(fd);
+		return 1;
+	}
+	fprintf(outfile,"Windowed extraction of %s, sectors %u to %u, %u sectors per window\n",imagefile,startsector,endsector,window);
+
+	meta = calloc(endsector,sizeof(struct blockmeta));
+	cache = calloc(1,sizeof(struct windowcache));
+	buffer = malloc((size_t)window*sizeof(union sector));
+	if(meta == NULL || cache == NULL || buffer == NULL) {
+		fprintf(stderr,"Can't allocate memory for %u block descriptions\n",endsector);
+		goto done;
+	}
+	cache->fd = fd;
+	cache->endsector = endsector;
+
+	// First pass, read the image a window at a time and describe every block
+	for(first = startsector; first < endsector; first += count) {
+		count = (endsector-first < window) ? endsector-first : window;
+		got = readsectors(fd,buffer,first,count);
+		for(k = 0; k < got; k++) {
+			block = &buffer[k];
+			type = amiga32(block->hdr.type);
+			if(type != T_HEADER && type != T_DATA && type != T_LIST) {
+				imagestats.othersectors++;
+				continue;
+			}
+			meta[first+k].type = type;
+			meta[first+k].header_key = amiga32(block->hdr.header_key);
+			meta[first+k].seq_num = amiga32(block->hdr.seq_num);
+			meta[first+k].next_data = amiga32(block->hdr.next_data);
+			meta[first+k].data_size = amiga32(block->hdr.data_size) > DATABYTES ? DATABYTES : amiga32(block->hdr.data_size);
+			if(type == T_HEADER) {
+				imagestats.headersectors++;
+				sectype = amiga32(block->fh.sec_type);
+				meta[first+k].kind = (sectype == 1) ? META_ROOT : (sectype == 2) ? META_DIR : (sectype == -3) ? META_FILE : 0;
+			} else if(type == T_DATA) {
+				imagestats.datasectors++;
+			} else {
+				imagestats.listsectors++;
+			}
+		}
+		if(got < count) {
+			fprintf(stderr,"Only managed to read %u sectors out of %u requested, stopping there\n",first+got-startsector,endsector-startsector);
+			endsector = cache->endsector = first+got;
+			break;
+		}
+	}
+	imagestats.loadtime += monotonicnanoseconds()-phasestart;
+	if(debug)
+		fprintf(outfile,"Described %u sectors: %u headers, %u data blocks, %u list blocks, %u others, %lu bytes of descriptions\n",
+			endsector-startsector,imagestats.headersectors,imagestats.datasectors,imagestats.listsectors,imagestats.othersectors,
+			(unsigned long)(endsector*sizeof(struct blockmeta)));
+
+	phasestart = monotonicnanoseconds();
+	writestart = imagestats.writetime;
+	// Second pass, create every directory and file from its header, following the data block chain of each file
+	for(i = startsector; i < endsector; i++) {
+		if(meta[i].type != T_HEADER || meta[i].kind == 0)
+			continue;
+		// With filters the directories are only created for the files in them, and files that aren't selected are
+		// marked as unusable so the third pass leaves their data blocks alone as well
+		if(options->numincludes || options->numexcludes) {
+			if(meta[i].kind != META_FILE)
+				continue;
+			if(windowpath(cache,meta,i,path,sizeof(path),0) != 0)
+				continue;
+			if(!pathselected(options,strchr(path,'/') != NULL ? strchr(path,'/')+1 : path)) {
+				meta[i].kind = 0;
+				continue;
+			}
+		}
+		if(windowpath(cache,meta,i,path,sizeof(path),1) != 0)
+			continue;
+		if(debug)
+			fprintf(outfile,"%u: %s %s\n",i,meta[i].kind == META_FILE ? "File" : "Directory",path);
+		block = cachedsector(cache,i);
+		if(block == NULL)
+			continue;
+		amigadaystotimespec(amiga32(block->fh.days),amiga32(block->fh.mins),amiga32(block->fh.ticks),&times[0]);
+		times[1] = times[0];
+		if(meta[i].kind != META_FILE) {
+			if(outputmkdir(path) == -1 && errno != EEXIST)
+				fprintf(stderr,"Can't create directory %s\n",path);
+			imagestats.directories++;
+			// Directory timestamps are set at the end, creating what's in them would change them
+			if(windowaddstamp(&stamps,&numstamps,&maxstamps,path,times) != 0) {
+				fprintf(stderr,"Out of memory\n");
+				goto done;
+			}
+			continue;
+		}
+		// Reserve the space the header says the file takes, unless it's more than the image holds
+		bytesize = amiga32(block->fh.byte_size);
+		reserve = ((uint64_t)bytesize <= (uint64_t)(endsector-startsector)*DATABYTES) ? bytesize : 0;
+		f = outputfcreate(path,reserve,&grown);
+		if(f == NULL) {
+			// The name could already be taken by a directory, add the header key
+			if(snprintf(filename,sizeof(filename),"%s-%u",path,i) >= (int)sizeof(filename)) {
+				fprintf(stderr,"Can't create file %s, the name is too long\n",path);
+				continue;
+			}
+			f = outputfcreate(filename,reserve,&grown);
+			if(f == NULL) {
+				fprintf(stderr,"Can't create file %s\n",filename);
+				continue;
+			}
+			snprintf(path,sizeof(path),"%s",filename);
+		}
+		// Follow the data blocks of the file, reading runs of consecutive blocks in one go
+		length = 0;
+		filehashinit(&hash);
+		for(next = meta[i].next_data, k = 0; next != 0 && k < endsector; ) {
+			if(next >= endsector || meta[next].type != T_DATA || meta[next].header_key != i || (meta[next].kind & META_WRITTEN))
+				break;
+			for(run = 1; run < window && next+run < endsector && meta[next+run-1].next_data == next+run &&
+				meta[next+run].type == T_DATA && meta[next+run].header_key == i && !(meta[next+run].kind & META_WRITTEN); run++)
+				;
+			got = readsectors(fd,buffer,next,run);
+			for(count = 0; count < got; count++) {
+				end = windowwrite(f,&buffer[count],&meta[next+count]);
+				if(end > length)
+					length = end;
+				if(end && manifestwanted())
+					filehashupdate(&hash,end-meta[next+count].data_size,buffer[count].dh.data,meta[next+count].data_size);
+			}
+			if(got < run)
+				break;
+			k += run;
+			next = meta[next+run-1].next_data;
+		}
+		// The reservation made the file as long as its header says, cut it back to what the chain held
+		if(grown && fflush(f) == 0) {
+			imagestats.syscalls++;
+			if(ftruncate(fileno(f),length) == -1)
+				fprintf(stderr,"Can't set the size of %s\n",path);
+		}
+		// The file is still open, so its timestamp is set on the descriptor. With queued output the file may not have
+		// been written yet, its timestamp is then set with the directories
+		stamped = 0;
+#ifdef _HAVE_IO_URING
+		if(outputring == NULL)
+#endif
+		if(fflush(f) == 0) {
+			imagestats.syscalls++;
+			stamped = (futimens(fileno(f),times) == 0);
+		}
+		outputfclose(f);
+		f = NULL;
+		imagestats.files++;
+		if(manifestwanted()) {
+			if(windowaddhash(&hashes,&numhashes,&maxhashes,path,i,&hash,times[1].tv_sec) != 0) {
+				fprintf(stderr,"Out of memory\n");
+				goto done;
+			}
+			numchained = numhashes;
+		}
+		// Orphaned data blocks can still be added to the file later, but what the chain held should be the whole file
+		if(length != bytesize) {
+			imagestats.sizemismatches++;
+			fprintf(outfile,"Size mismatch: %s has %llu bytes but its header says %u\n",path,(unsigned long long)length,bytesize);
+		}
+		if(!stamped && windowaddstamp(&stamps,&numstamps,&maxstamps,path,times) != 0) {
+			fprintf(stderr,"Out of memory\n");
+			goto done;
+		}
+	}
 
-int main(int argc,char **argv) {
+	// Third pass, the data blocks no chain led to, either their file has a broken chain or their header is gone
+	for(i = startsector; i < endsector; i++) {
+		if(meta[i].type != T_DATA || (meta[i].kind & META_WRITTEN))
+			continue;
+		// With filters only the data blocks of selected files are written, wherever they are
+		if((options->numincludes || options->numexcludes) && (meta[i].header_key >= endsector ||
+			meta[meta[i].header_key].type != T_HEADER || meta[meta[i].header_key].kind != META_FILE))
+			continue;
+		if(f == NULL || meta[i].header_key != openkey) {
+			if(f != NULL)
+				outputfclose(f);
+			f = NULL;
+			openkey = meta[i].header_key;
+			if(openkey < endsector && meta[openkey].type == T_HEADER && meta[openkey].kind == META_FILE &&
+				windowpath(cache,meta,openkey,path,sizeof(path),1) == 0) {
+				f = outputfopen(path,"r+");
+				if(f == NULL && snprintf(filename,sizeof(filename),"%s-%u",path,openkey) < (int)sizeof(filename))
+					f = outputfopen(filename,"r+");
+				// What the manifest has for the file isn't all of it any more
+				for(low = 0, high = numchained; low < high; ) {
+					if(hashes[low+(high-low)/2].key < openkey)
+						low = low+(high-low)/2+1;
+					else
+						high = low+(high-low)/2;
+				}
+				if(low < numchained && hashes[low].key == openkey)
+					hashes[low].hash.rewritten = 1;
+			} else {
+				if(outputmkdir("Orphaned") == -1 && errno != EEXIST)
+					fprintf(stderr,"Can't create directory Orphaned\n");
+				snprintf(filename,sizeof(filename),"Orphaned/Orphan-%u",openkey);
+				f = outputfopen(filename,"r+");
+				if(f == NULL) {
+					f = outputfopen(filename,"w");
+					imagestats.files += (f != NULL);
+					// The orphans are only complete at the end, they are hashed from disk
+					if(f != NULL && manifestwanted()) {
+						filehashinit(&hash);
+						hash.rewritten = 1;
+						if(windowaddhash(&hashes,&numhashes,&maxhashes,filename,openkey,&hash,time(NULL)) != 0) {
+							fprintf(stderr,"Out of memory\n");
+							goto done;
+						}
+					}
+				}
+			}
+			if(f == NULL) {
+				fprintf(stderr,"Can't open a file for the data blocks of header %u\n",openkey);
+				continue;
+			}
+		}
+		block = cachedsector(cache,i);
+		if(block == NULL)
+			continue;
+		imagestats.orphans++;
+		windowwrite(f,block,&meta[i]);
+	}
+	if(f != NULL)
+		outputfclose(f);
+	f = NULL;
+	imagestats.scantime += (monotonicnanoseconds()-phasestart)-(imagestats.writetime-writestart);
+
+	// Finally the directory timestamps
+	phasestart = monotonicnanoseconds();
+	outputringdrain();
+	for(k = 0; k < numstamps; k++) {
+		imagestats.syscalls++;
+		utimensat(AT_FDCWD,stamps[k].path,stamps[k].times,0);
+	}
+	imagestats.writetime += monotonicnanoseconds()-phasestart;
+	for(k = 0; k < numhashes; k++) {
+		manifestfinish(hashes[k].path,&hashes[k].hash,hashes[k].mtime);
+	}
+	ret = 0;
+
+done:
+	// The error paths can leave a file open
+	if(f != NULL)
+		outputfclose(f);
+	for(k = 0; k < numhashes; k++)
+		free(hashes[k].path);
+	free(hashes);
+	for(k = 0; k < numstamps; k++)
+		free(stamps[k].path);
+	free(stamps);
+	free(buffer);
+	free(cache);
+	free(meta);
+	close(fd);
+	return ret;
+} // End function extractwindowed
+
+// Extract one image into the current working directory, this is what main() used to do before batch runs
+// Returns 0 on success and 1 on error
+int extractimage(char *imagefile, struct extractoptions *options) {
 	// The Filepointer used to write the file to the disk
 	FILE *f;
 	// Temporary variables
 	int i=0; int j=0; int n=0;
 	// Type of file, 0 is unset (determined by filename, or exit if unsuccesful)
-	int format=0;
+	int format=options->format;
 	// A integer to store whether the file is an orphan
 	int orphan = 0;
+	// The timestamp table entry of the file a block was written to
+	int stampindex = -1;
 	// A integer to store whether the filename or parent path name is a legal string
 	int invalidstring=0; int invalidparentstring=0;
 	// A integer to store the header key
@@ -1809,7 +5317,7 @@ int main(int argc,char **argv) {
 	uint32_t minutes[MAX_PATH_DEPTH];
 	uint32_t ticks[MAX_PATH_DEPTH];
 	// Array to keep track of orphaned sectors
-	int *orphansector;
+	int *orphansector = NULL;
 	// Array to keep track of orphan filenames
 	char **orphanfilename;
 	// Arrays to keep track of days, minutes and tick for orphans
@@ -1820,212 +5328,168 @@ int main(int argc,char **argv) {
 	uint32_t orphanday = 0;
 	uint32_t orphanminute = 0;
 	uint32_t orphantick = 0;
-	// Time struct to store access and mod times
-	struct utimbuf *utim;
-	utim=malloc(sizeof(struct utimbuf));
+	// The sectors each entry in filepath was made from, used to key the recorded timestamps
+	uint32_t pathsector[MAX_PATH_DEPTH];
+	// Table of timestamps to apply when we're done
+	struct stamptable *stamps = malloc(sizeof(struct stamptable));
 	// A string to store the previous filepath, used for orphaned files
 	char previousfilepath[MAX_FILENAME_LENGTH] = "";
-	// Strings for orphan string splitting
-	char *orphansplit = malloc(MAX_FILENAME_LENGTH +1 * sizeof(char *));
+	// Strings for orphan string splitting, and a copy of the filename for strsep() to take apart
+	char *orphansplit = NULL;
+	char *orphanfilenamecopy = NULL;
 	/* A integer to store the root and orphan directories */
-	int root = 0; int orphandir = 0;
-	/* A integer to hold the start sector, defaults to the defined value FIRST_SECTOR */
-	int startsector = FIRST_SECTOR;
-	/* A integer to hold the last sector, defaults to the defined value SECTORS */
-	unsigned int endsector = SECTORS;
+	int root = -1; int orphandir = -1;
+	// Where the orphan directory is in the timestamp directory table
+	int orphandirid = 0;
+	/* A integer to hold the start sector */
+	int startsector = options->startsector;
+	/* A integer to hold the last sector */
+	unsigned int endsector = options->endsector;
+	/* The root block is in the middle of the disk, 880 on DD images and 1760 on HD images */
+	unsigned int rootblock = (endsector > SECTORS ? MAX_SECTORS : SECTORS)/2;
 	/* Variable to hold the debugging value */
-	int debug = DEBUG;
-	// int to read option value from getopt and a temp variable to read in the option index
-        int optionflag; int index = 0;
+	int debug = options->debug;
+	// Set if headerless files should be reconstructed from their next_data chains
+	int chainmode = options->chainmode;
 	// File descriptor used either for the outfile, or set as stdout
-        FILE *outfile = NULL;
-	// Boolean to check whether system is big or little endian
-	short bigendian = 1;
+	FILE *outfile = options->outfile;
+	// Timestamps used to measure the phases
+	uint64_t phasestart = 0; uint64_t writestart = 0;
+	// The header, data and list blocks of the image, how far we've come in each of them and the current sector
+	struct sectorindex index;
+	unsigned int positions[3] = { 0, 0, 0 };
+	unsigned int current = 0;
+	// Sectors to scan according to the allocation bitmap, NULL to scan all of them
+	uint8_t *scanmask = NULL;
+	// The file being extracted, and the format its extension suggests
+	struct membuffer image;
+	int hintformat = FORMAT_UNKNOWN;
+	// Sectors in a DMS archive that was only decoded in part
+	unsigned int dmssectors = 0;
+	// Sectors the decoder knows are zeros, NULL if it doesn't say
+	uint8_t *zerosectors = NULL;
+	// The sectors of the image
+	union sector *sector = NULL;
+	// Everything allocated here is freed on the way out, whether the image could be extracted or not
+	int ret = 1;
+	// All the names and paths of the last image are given back at once, they're carved out of the arena
+	arenareset(&namearena);
+	memset(&image,0,sizeof(struct membuffer));
+	memset(&index,0,sizeof(struct sectorindex));
+	// Init the timestamp table
+	if(stamps == NULL || initstamps(stamps) == -1) {
+		fprintf(stderr, "Out of memory\n");
+		goto done;
+	}
 	// Allocate space for filename and extension
-	filename = malloc(MAX_FILENAME_LENGTH + 1 * sizeof(char *));
-	extension = malloc(MAX_FILENAME_LENGTH + 1 * sizeof(char *));
+	filename = arenastring(&namearena,MAX_FILENAME_LENGTH+1);
+	extension = arenastring(&namearena,MAX_FILENAME_LENGTH+1);
+	orphansplit = arenastring(&namearena,MAX_FILENAME_LENGTH+1);
+	orphanfilenamecopy = arenastring(&namearena,MAX_FILENAME_LENGTH);
 	/* Allocate space for MAX_PATH_DEPTH rows in filepath[X][] */
-	filepath = malloc(MAX_PATH_DEPTH * sizeof(char *));
-	if(filepath == NULL) {
+	filepath = arenaalloc(&namearena,MAX_PATH_DEPTH * sizeof(char *));
+	if(filename == NULL || extension == NULL || orphansplit == NULL || orphanfilenamecopy == NULL || filepath == NULL) {
 		fprintf(stderr, "Out of memory\n");
-		return 1;
+		goto done;
 	}
 	// Alloc and init the filepath array
 	for(i = 0; i < MAX_PATH_DEPTH ; i++) {
 		/* Allocate space for MAX_AMIGADOS_FILENAME_LENGTH entries in filepath[X][Y] */
-		filepath[i] = malloc(MAX_AMIGADOS_FILENAME_LENGTH * sizeof(char));
+		filepath[i] = arenastring(&namearena,MAX_AMIGADOS_FILENAME_LENGTH * sizeof(char));
 		if(filepath[i] == NULL) {
 			fprintf(stderr, "Out of memory\n");
-			return 1;
+			goto done;
 		}
-		snprintf(filepath[i],MAX_AMIGADOS_FILENAME_LENGTH,"");
 	}
-	// Alloc and init the orphanfilename array as well as the orphan day, minutes, seconds array
-	orphanfilename = malloc(MAX_SECTORS * sizeof(char *));
+	// Alloc and init the orphanfilename array as well as the orphan day, minutes, seconds array, the names are carved
+	// out of the arena when the orphans are named
+	orphanfilename = arenaalloc(&namearena,MAX_SECTORS * sizeof(char *));
+	if(orphanfilename == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto done;
+	}
 	for(i = 0; i<MAX_SECTORS; i++) {
-		orphanfilename[i] = malloc(MAX_FILENAME_LENGTH * sizeof(char));
-		if(orphanfilename[i] == NULL) {
-			fprintf(stderr, "Out of memory\n");
-			return 1;
-		}
-		snprintf(orphanfilename[i],MAX_FILENAME_LENGTH,"");
+		orphanfilename[i] = NULL;
 		orphandays[i] = 0;
 		orphanminutes[i] = 0;
 		orphanticks[i] = 0;
 	}
-	
+
 	// Malloc and init Init the orphansector array, all sectors are not orphans to start with
 	orphansector = malloc(MAX_SECTORS * sizeof(*orphansector));
+	if(orphansector == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto done;
+	}
 	for(i = 0; i<MAX_SECTORS ; i++) {
 		orphansector[i]=0;
 	}
 
-	// Check for endianness
-	uint8_t swaptest[2] = {1,0};
-	if ( *(short *)swaptest == 1) 
-    		bigendian = 0;
-
-	// Read the passed options if any (-d sets debug, -o sets an optional filename to pipe the output to)
-        while((optionflag = getopt(argc, argv, "adzDo:s:e:")) != -1) 
-		switch(optionflag) {
-			// ADF format forced
-			case 'a':
-				format=1;
-				break;
-			// ADZ format forced
-			case 'z':
-				format=2;
-				break;
-			// DMS format forced
-			case 'd':
-				format=3;
-				break;
-                        // Debug flag is set to on
-                        case 'D':
-                                debug=1;
-                                break;
-                        // Output file flag is specified
-                        case 'o':
-                                outfile = fopen(optarg,"w");
-                                // If output file didn't open, error occured, print error, exit
-                                if(outfile == NULL) {
-                                        fprintf(stderr,"Can't open output file %s for writing, error returned was: %s\n",optarg,strerror(errno));
-                                        return 1;
-                                } else {
-                                        // Announce that we're writing the output to a file on stdout
-                                        fprintf(stdout,"Writing output to %s\n",optarg);
-                                }
-                                break;
-			// Start sector is specified
-			case 's':
-				i=strtoimax(optarg,NULL,10);
-				// Not an integer or value over 3520 (last sector on a HD adf), print usage
-				if(i>3520 || i <0 || i>endsector) {
-					usage(argv[0]);
-					return 2;
-				// Otherwise set the start sector
-				} else {
-					startsector = i;
-				}
-				break;
-			case 'e':		
-				i=strtoimax(optarg,NULL,10);
-				// Not an integer or value over 3520 (last sector on a HD adf), print usage
-				if(i>3520 || i <0 || i<startsector) {
-					usage(argv[0]);
-					return 2;
-				// Otherwise set the end sector
-				} else {
-					endsector = i;
-				}
-				break;
-                        // Missing argument to o,s or e
-                        case '?':
-                                usage(argv[0]);
-                                return 2;
-                                break;
-                }
-	// Check if outfile is set, if not set outfile as stdout
-	if(outfile == NULL)
-		outfile=stdout;
-	if(debug) {
-		if(format==0)
-			fprintf(outfile,"File format is not set!\n");
-		else if(format==1) 
-			fprintf(outfile,"File format is ADF\n");
-		else if(format==2) 
-			fprintf(outfile,"File format is ADZ\n");
-		else if(format==3) 
-			fprintf(outfile,"File format is DMS\n");
-	}
-	// The filename should be the last non-option argument given
-	for (index = optind; index < argc; index++) {
-		// Copy argument into the filename variable
-		snprintf(filename,MAX_FILENAME_LENGTH-1,"%s",argv[index]);
-		// Try opening the file for reading...
-		f = fopen(filename,"r");
-		if(f == NULL) {
-			fprintf(stderr,"Can't open file %s for reading, error returned was: %s\n",filename,strerror(errno));
-			return 1;
+	// Reset the statistics for this image
+	memset(&imagestats,0,sizeof(struct extractstats));
+	manifestreset();
+	manifest.image = imagefile;
+
+	// Copy the image filename into the filename variable
+	snprintf(filename,MAX_FILENAME_LENGTH-1,"%s",imagefile);
+	// Read the whole file into memory, everything from here on works on memory buffers
+	phasestart = monotonicnanoseconds();
+	if(loadfile(filename,&image) != 0) {
+		fprintf(stderr,"Can't open file %s for reading, error returned was: %s\n",filename,strerror(errno));
+		goto done;
+	}
+	imagestats.loadtime += monotonicnanoseconds()-phasestart;
+	// If format not already set, guess the format from file ending, the contents of the file have the final say
+	if(!format) {
+		if(debug)
+			fprintf(outfile,"Input filename is %s\n",imagefile);
+		// No extension, the contents will have to tell
+		if(strrchr(imagefile,'.') == NULL)  {
+			fprintf(outfile,"No file extension, detecting the format from the contents\n");
 		} else {
-			// Close the file for now
-			fclose(f);			
-			// If format not already set, determine format from file ending
-			if(!format) {
-				if(debug)
-					fprintf(outfile,"Input filename is %s\n",argv[index]);
-				// Get the extension of the file
-				extension = strrchr(argv[index],'.');
-				// No extension, assume ADF
-				if(extension == NULL)  {
-					fprintf(outfile,"No file extension, assuming ADF");
-					format=1;
-				} else {
-					if(debug)
-						fprintf(outfile,"Extension is %s\n",extension);
-					// Lowercase the extension
-					for (i = 0; extension[i] != '\0'; i++)
-					    extension[i] = (char)tolower(extension[i]);
-					if(debug)
-						fprintf(outfile,"Extension lowercase is %s\n",extension);
-					// Reset i
-					i=0;
-					// Is this an adf file?
-					if(strncmp(".adf",extension,MAX_FILENAME_LENGTH) == 0) {
-						format=1;
-						fprintf(outfile,"Autodetected fileformat from extension is ADF\n");
-					// or an adz file?
-					} else if(strncmp(".adz",extension,MAX_FILENAME_LENGTH) == 0) {
-						format=2;
-						fprintf(outfile,"Autodetected fileformat from extension is ADZ (.adz)\n");
-					// or an adf.gz file (same thing as an adz, but perhaps more *nix like)
-					} else if(strncmp(".adf.gz",extension,MAX_FILENAME_LENGTH) == 0) {
-						format=2;
-						fprintf(outfile,"Autodetected fileformat from extension is ADZ (.adf.gz)\n");
-					// or a zip file (this will also work since there's support in the adz decompression code to skip the zip header)
-					} else if(strncmp(".zip",extension,MAX_FILENAME_LENGTH) == 0) {
-						format=2;
-						fprintf(outfile,"Autodetected fileformat from extension is ZIP (.zip)\n");
-					// or a DMS file
-					} else if(strncmp(".dms",extension,MAX_FILENAME_LENGTH) == 0) {
-						format=3;
-						fprintf(outfile,"Autodetected fileformat from extension is DMS (.dms)\n");
-					// Otherwise have no idea what it is and we'll assume it's an adf
-					} else {
-						fprintf(outfile,"Can not figure out file format from file extension, assuming ADF");
-						format=1;
-					}
-				}
+			// Get a copy of the extension of the file
+			snprintf(extension,MAX_FILENAME_LENGTH,"%s",strrchr(imagefile,'.'));
+			if(debug)
+				fprintf(outfile,"Extension is %s\n",extension);
+			// Lowercase the extension
+			for (i = 0; extension[i] != '\0'; i++)
+			    extension[i] = (char)tolower(extension[i]);
+			if(debug)
+				fprintf(outfile,"Extension lowercase is %s\n",extension);
+			// Reset i
+			i=0;
+			// Is this an adf file?
+			if(strncmp(".adf",extension,MAX_FILENAME_LENGTH) == 0) {
+				hintformat=FORMAT_ADF;
+				fprintf(outfile,"Autodetected fileformat from extension is ADF\n");
+			// or an adz file?
+			} else if(strncmp(".adz",extension,MAX_FILENAME_LENGTH) == 0) {
+				hintformat=FORMAT_ADZ;
+				fprintf(outfile,"Autodetected fileformat from extension is ADZ (.adz)\n");
+			// or an adf.gz file (same thing as an adz, but perhaps more *nix like)
+			} else if(strncmp(".adf.gz",extension,MAX_FILENAME_LENGTH) == 0) {
+				hintformat=FORMAT_ADZ;
+				fprintf(outfile,"Autodetected fileformat from extension is ADZ (.adf.gz)\n");
+			// or a zip file (this will also work since there's support in the adz decompression code to skip the zip header)
+			} else if(strncmp(".zip",extension,MAX_FILENAME_LENGTH) == 0) {
+				hintformat=FORMAT_ADZ;
+				fprintf(outfile,"Autodetected fileformat from extension is ZIP (.zip)\n");
+			// or a DMS file
+			} else if(strncmp(".dms",extension,MAX_FILENAME_LENGTH) == 0) {
+				hintformat=FORMAT_DMS;
+				fprintf(outfile,"Autodetected fileformat from extension is DMS (.dms)\n");
+			// Otherwise have no idea what it is and the contents will have to tell, if they don't we'll assume it's an adf
+			} else {
+				fprintf(outfile,"Can not figure out file format from file extension, detecting it from the contents\n");
 			}
 		}
 	}
-	// No file given, print usage instructions
-	if(f == NULL) {
-		usage(argv[0]);
-		return 2;
+	// Define and allocate memory for the sectors, zeroed so the sectors of zeros don't have to be copied
+	sector = calloc(endsector+1,sizeof(union sector));
+	if(sector == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		goto done;
 	}
-	// Define and allocate memory for the sectors
-	union sector *sector = malloc((endsector+1)*sizeof(union sector));
 	
 	// Print start and end sector
 	fprintf(outfile,"Startsector is %d\n",startsector);
@@ -2034,100 +5498,136 @@ int main(int argc,char **argv) {
 	// Integer to hold total sectors read..
 	int r=0;
 
-	// How we fill up the sector array depends on the file format
-	switch(format) {
-		// Simplest case, simple uncompressed ADF file, we can simply read the sectors directly into an array...
-		case 1:
-			// Open the ADF file
-			f=fopen(filename,"r");
-			// If Null exit
-			if(f == NULL) {
-				fprintf(stderr,"Can't open file %s for reading, error returned was: %s\n",filename,strerror(errno));
-				return 1;
-			}
-			break;
-		case 2:
-			#ifdef _HAVE_ZLIB
-			// Uncompress the adf file and get a pointer to the open file
-			f=uncompressfile(filename,debug,outfile);
-			// If we get null back (TODO, would be good to do more error checking here)
-			if(f == NULL) {
-				fprintf(stderr,"Can't uncompress file %s\n",filename);
-				return 1;
-			}
-			break;
-			#else
-			fprintf(outfile,"No zlib support, try changing _HAVE_ZLIB define and compiling with -lz\n");
-			return 1;
-			break;
-			#endif
-		case 3:
-			// Decrunch DMS file and write to temporary raw file which we'll use to extract from
-			if(debug)
-				fprintf(outfile,"Decoding DMS file\n");
-			f=undmsfile(filename,endsector,debug,outfile);
-			if(f == NULL) {
-				fprintf(stderr,"Fatal error, exiting\n");
-				return 1;
+	// With -i only the tracks of a DMS archive that the selected files are on are decoded, straight into the sectors
+	phasestart = monotonicnanoseconds();
+	n = -1;
+	if(options->numincludes && (format == 0 || format == FORMAT_DMS) && detectformat(image.data,image.size) == FORMAT_DMS) {
+		n = undmsselected(&image,options,sector,endsector,&dmssectors,debug,outfile);
+	}
+	// Unpack whatever containers the image is in until we get to the raw ADF
+	if(n < 0 && decodeimage(&image,format,hintformat,endsector,debug,outfile) != 0) {
+		fprintf(stderr,"Can't decode file %s\n",filename);
+		goto done;
+	}
+	imagestats.decompresstime += monotonicnanoseconds()-phasestart;
+	phasestart = monotonicnanoseconds();
+	if(n >= 0) {
+		r = dmssectors < endsector ? dmssectors : endsector;
+	} else {
+		// Copy the raw image into the sector array, only the runs of sectors that aren't zeros if the decoder knows
+		// which those are
+		r = image.size/sizeof(union sector) < endsector ? image.size/sizeof(union sector) : endsector;
+		if(image.zerosectors == NULL) {
+			memcpy(sector,image.data,r*sizeof(union sector));
+		} else {
+			for(i = 0; i < r; i = j) {
+				for(j = i; j < r && !image.zerosectors[j]; j++);
+				memcpy(sector+i,image.data+(size_t)i*sizeof(union sector),(j-i)*sizeof(union sector));
+				for(; j < r && image.zerosectors[j]; j++)
+					imagestats.zerosectors++;
 			}
-			break;
-		default:
-			// We've reached here and the format is not clear, print error and exit
-			fprintf(outfile,"No format selected, don't know what to do, exiting\n");
-			return 1;
-			break;
+			zerosectors = image.zerosectors;
+			image.zerosectors = NULL;
+		}
 	}
-	// Read from the file (which is in the ADF sector format regardless of what the input file was) into the sector array
-	r= fread(sector, sizeof(union sector), endsector, f);
 	if(debug)
 		fprintf(outfile,"Total sectors: %d\n\n", r);
+	freebuffer(&image);
+#ifdef EXTRACTADF_SWAPPED_HOST
+	swaphostorder(sector,r);
+#endif
 
 	// Not enough sectors read?
 	if(r < (endsector-startsector)) {
 		fprintf(stderr,"Only managed to read %d sectors out of %d requested, cowardly refusing to continue\n",r,(endsector-startsector));
-		return 1;
+		goto done;
+	}
+	imagestats.loadtime += monotonicnanoseconds()-phasestart;
+
+	// Restrict the scan to the allocated or to the free blocks if asked to, if the bitmap can't be used we scan
+	// everything like we normally do
+	if(options->bitmapmode) {
+		scanmask = malloc(MAX_SECTORS);
+		if(scanmask != NULL && loadbitmap(sector,endsector,endsector > SECTORS ? MAX_SECTORS : SECTORS,scanmask,debug,outfile) == 0) {
+			// For undeleting we want the free blocks instead
+			if(options->bitmapmode == 2)
+				for(i = 0; i < MAX_SECTORS; i++)
+					scanmask[i] = !scanmask[i];
+			fprintf(outfile,"Scanning only the %s blocks\n",options->bitmapmode == 2 ? "free" : "allocated");
+		} else {
+			fprintf(outfile,"Scanning all blocks\n");
+			free(scanmask);
+			scanmask = NULL;
+		}
 	}
-	// Close the file
-	fclose(f);
 
+	// With filters the blocks of the files that aren't selected are left out of the scan
+	if(options->numincludes || options->numexcludes) {
+		if(scanmask == NULL) {
+			scanmask = malloc(MAX_SECTORS);
+			if(scanmask == NULL) {
+				fprintf(stderr,"Out of memory\n");
+				goto done;
+			}
+			memset(scanmask,1,MAX_SECTORS);
+		}
+		if(filtersectors(sector,startsector,endsector,options,scanmask,debug,outfile) != 0) {
+			fprintf(stderr,"Out of memory\n");
+			goto done;
+		}
+	}
 
-	// Loop through the sectors we are supposed to read and recover the data
-	for (i=startsector; i<endsector; i++) {
-		if(bigendian)
-			type = sector[i].hdr.type;
-		else
-			type = ntohl(sector[i].hdr.type);
-		if (type != T_HEADER && type != T_DATA && type != T_LIST)
-			continue;
-		if(debug) {
-			if(bigendian) {
-				fprintf(outfile,"%x: type       %x\n", i, sector[i].hdr.type);
-				fprintf(outfile,"%x: header_key %x\n", i, sector[i].hdr.header_key);
-				fprintf(outfile,"%x: seq_num    %x\n", i, sector[i].hdr.seq_num);
-				fprintf(outfile,"%x: data_size  %x\n", i, sector[i].hdr.data_size);
-				fprintf(outfile,"%x: next_data  %x\n", i, sector[i].hdr.next_data);
-				fprintf(outfile,"%x: chksum     %x\n", i, sector[i].hdr.chksum);
-			} else {
-				fprintf(outfile,"%x: type       %x\n", i, ntohl(sector[i].hdr.type));
-				fprintf(outfile,"%x: header_key %x\n", i, ntohl(sector[i].hdr.header_key));
-				fprintf(outfile,"%x: seq_num    %x\n", i, ntohl(sector[i].hdr.seq_num));
-				fprintf(outfile,"%x: data_size  %x\n", i, ntohl(sector[i].hdr.data_size));
-				fprintf(outfile,"%x: next_data  %x\n", i, ntohl(sector[i].hdr.next_data));
-				fprintf(outfile,"%x: chksum     %x\n", i, ntohl(sector[i].hdr.chksum));
+	// The sectors of zeros can't hold anything, they are left out of the scan
+	if(zerosectors != NULL && imagestats.zerosectors) {
+		if(scanmask == NULL) {
+			scanmask = malloc(MAX_SECTORS);
+			if(scanmask == NULL) {
+				fprintf(stderr,"Out of memory\n");
+				goto done;
 			}
+			memset(scanmask,1,MAX_SECTORS);
+		}
+		for(i = 0; i < r && i < MAX_SECTORS; i++)
+			if(zerosectors[i])
+				scanmask[i] = 0;
+		if(debug)
+			fprintf(outfile,"%u sectors are zeros and are not scanned\n",imagestats.zerosectors);
+	}
+	free(zerosectors);
+	zerosectors = NULL;
+
+	// The scan is timed without the time spent in output calls, that is counted as writing
+	phasestart = monotonicnanoseconds();
+	writestart = imagestats.writetime;
+
+	// Classify the sectors by type first, that is split between the threads, only the extraction itself is serial
+	if(classifysectors(sector,scanmask,startsector,endsector,options->threads,&index,debug,outfile) != 0)
+		goto done;
+	// Count the sectors by type
+	imagestats.headersectors += index.numheaders;
+	imagestats.datasectors += index.numdata;
+	imagestats.listsectors += index.numlists;
+	imagestats.othersectors += index.others;
+	imagestats.skippedsectors += index.skipped;
+
+	// Loop through the header, data and list blocks in sector order and recover the data
+	while(nextsector(&index,positions,&current)) {
+		i = current;
+		type = amiga32(sector[i].hdr.type);
+		if(debug) {
+			fprintf(outfile,"%x: type       %x\n", i, amiga32(sector[i].hdr.type));
+			fprintf(outfile,"%x: header_key %x\n", i, amiga32(sector[i].hdr.header_key));
+			fprintf(outfile,"%x: seq_num    %x\n", i, amiga32(sector[i].hdr.seq_num));
+			fprintf(outfile,"%x: data_size  %x\n", i, amiga32(sector[i].hdr.data_size));
+			fprintf(outfile,"%x: next_data  %x\n", i, amiga32(sector[i].hdr.next_data));
+			fprintf(outfile,"%x: chksum     %x\n", i, amiga32(sector[i].hdr.chksum));
 		}
 		switch (type) {
 			case T_HEADER:
-				if(bigendian)
-					header_key=sector[i].hdr.header_key;
-				else
-					header_key=ntohl(sector[i].hdr.header_key);
+				header_key=amiga32(sector[i].hdr.header_key);
 				if(debug) {
 					fprintf(outfile,"%x:  filename  \"%s\"\n", i, sector[i].fh.filename);
-					if(bigendian) 
-						fprintf(outfile,"%x:  byte_size %d\n", i, sector[i].fh.byte_size);
-					else 
-						fprintf(outfile,"%x:  byte_size %d\n", i, ntohl(sector[i].fh.byte_size));
+					fprintf(outfile,"%x:  byte_size %d\n", i, amiga32(sector[i].fh.byte_size));
 					
 				}
 				// Set n here as the header key of the current sector, we'll use it to find all parent headers so we can re-create the directory structure of the disk
@@ -2137,63 +5637,56 @@ int main(int argc,char **argv) {
 				while(n >= 0) {
 					// Add the current filename to the array of paths
 					snprintf(filepath[j],MAX_AMIGADOS_FILENAME_LENGTH,"%s",sector[n].fh.filename);
+					pathsector[j] = n;
 					//  Also store days, minutes and ticks to recreate the correct date and time of the files
-					if(bigendian) {
-						days[j] = sector[n].fh.days;
-						minutes[j] = sector[n].fh.mins;
-						ticks[j] = sector[n].fh.ticks;
-					} else { 
-						days[j] = ntohl(sector[n].fh.days);
-						minutes[j] = ntohl(sector[n].fh.mins);
-						ticks[j] = ntohl(sector[n].fh.ticks);
-					}
+					days[j] = amiga32(sector[n].fh.days);
+					minutes[j] = amiga32(sector[n].fh.mins);
+					ticks[j] = amiga32(sector[n].fh.ticks);
 					
 					if(debug) {
 						fprintf(outfile,"N: %d I: %d J: %d Current object is %s\n",n,i,j,sector[n].fh.filename);
-						if(bigendian)
-							fprintf(outfile,"Parent object is %s\n",sector[sector[n].fh.parent].fh.filename);
-						else
-							fprintf(outfile,"Parent object is %s\n",sector[ntohl(sector[n].fh.parent)].fh.filename);
+						fprintf(outfile,"Parent object is %s\n",sector[amiga32(sector[n].fh.parent)].fh.filename);
 					}
 					// If the current path is the root sector we don't need more iterations	
-					if(n == 880) {
+					if(n == rootblock) {
 						if(debug)
-							fprintf(outfile,"Parent is root block 880, stopping this loop\n");
+							fprintf(outfile,"Parent is root block %d, stopping this loop\n",rootblock);
 						break;
 					} else if(!sector[n].fh.parent) {
 						// No parent object, leave the loop
 						break;
+					} else if(amiga32(sector[n].fh.parent) > endsector || j+1 >= MAX_PATH_DEPTH) {
+						// Parent is outside the image or the parents loop, treat it like a missing parent
+						break;
 					} else {
 						// Increment j since the path length is increasing
 						j++;
 					}
 					// Set n as the parent to recurse backwards
-					if(bigendian)
-						n = sector[n].fh.parent;
-					else
-						n = ntohl(sector[n].fh.parent);
+					n = amiga32(sector[n].fh.parent);
 				}
 				// We should now have an array of all the filepaths belonging to this header, we'll now re-create all the directories in that path (we might do this multiple times for the top level directories but there is no harm in that)
 				// Open the current directory so we can return to it later
-				root = open(".",O_RDONLY);
+				root = outputopendir(".");
 				if(root == -1 ) {
 					fprintf(stderr,"Can't write to root directory, exiting\n");
-					return 1;
+					goto done;
 				}
 				// Make a directory for orphaned files and directories, ignore if it already exists but stop on other errors
-				if(mkdir("Orphaned",0777) > 0 && errno != EEXIST) 
+				if(outputmkdir("Orphaned") > 0 && errno != EEXIST) 
 					fprintf(stderr,"Can't create directory in current path, check permissions\n");
 
-				chdir("Orphaned");
+				stampchdir(stamps,"Orphaned");
+				orphandirid = stamps->cwd;
 				// Save the orphandir so we cacn return laer
-				orphandir = open(".",O_RDONLY);
+				orphandir = outputopendir(".");
 				if(orphandir == -1 ) {
 					fprintf(stderr,"Can't write to orphan directory, exiting\n");
-					return 1;
+					goto done;
 				}
 				
 				// Change back to root directory
-				fchdir(root);
+				stampfchdir(stamps,root,0);
 				// Reverse loop through the filepath to change into the correct directory to output the file 
 				// filepath for this file other than the root filepath
 				for(n=j;n>0;n--) {
@@ -2201,36 +5694,36 @@ int main(int argc,char **argv) {
 					// That will happen quite a bit since this code is executed once per block, 
 					// and the same file (and directory) can be passed over hundreds of times. 
 					// This isn't very efficient, but it does work.
-					if(mkdir(filepath[n],0777) < 0 && errno != EEXIST) {
+					if(outputmkdir(filepath[n]) < 0 && errno != EEXIST) {
 						fprintf(stderr,"Can't create directory %s, exiting\n",filepath[n]);
 					} else {
 						if(debug)
 							fprintf(outfile,"Created directory %s\n",filepath[n]);
-						// Set correct timestamp for directory
-						utime(filepath[n],amigadaystoutimbuf(days[n],minutes[n],ticks[n],utim));
+						// Record correct timestamp for directory
+						recordstamp(stamps,pathsector[n],1,filepath[n],days[n],minutes[n],ticks[n]);
 						// Change directory to the newly created directory
-						if(chdir(filepath[n]) == -1) {
+						if(stampchdir(stamps,filepath[n]) == -1) {
 							// There is a chance, there's a filename that's the same as the name of the directory we're trying to create, in that case this is most likely
 							// an orphaned directory (there can't be a directory and a file with the same name in the same directory so that means one of the entries is corrupted,
 							// an orphaned file would never have been created under the restored directory structure, but rather at the root level, so there is a high probability
 							// that this directory is an orphan, in which case we should place it at the root level, like an orphaned file
 							// Return to the root directory
-							if(fchdir(orphandir) == -1) {
+							if(stampfchdir(stamps,orphandir,orphandirid) == -1) {
 								fprintf(stderr,"Can't return to previous working directory, exiting\n");
-								return 1;
+								goto done;
 							} 
 							// Try to create the directory at the root level instead of down the filesystem level
-							if(mkdir(filepath[n],0777) < 0 && errno != EEXIST) {
+							if(outputmkdir(filepath[n]) < 0 && errno != EEXIST) {
 								fprintf(stderr,"Can't create directory %s\n",filepath[n]);
 							} else {
 								if(debug)
 									fprintf(outfile,"Created Orphaned directory %s\n",filepath[n]);
-								// Set correct timestamp for directory
-								utime(filepath[n],amigadaystoutimbuf(days[n],minutes[n],ticks[n],utim));
+								// Record correct timestamp for directory
+								recordstamp(stamps,pathsector[n],1,filepath[n],days[n],minutes[n],ticks[n]);
 								// Change directory to the newly created directory
-								if(chdir(filepath[n]) == -1) {
+								if(stampchdir(stamps,filepath[n]) == -1) {
 									fprintf(stderr,"Can't change to newly created directory, exiting\n");
-									return 1;
+									goto done;
 								} else { 
 									if(debug)
 										fprintf(outfile,"Changing directory to %s\n",filepath[n]);
@@ -2244,66 +5737,55 @@ int main(int argc,char **argv) {
 				// First we check whether the entry is 0 bytes, if it is, then it's very likely that it's a directory entry and not a file entry
 				// If it really is a file entry, and it is 0 bytes, and it is orphaned, then we're out of luck, if the file is okay (even though it's 0 bytes), it will be created later 
 				// This should hopefully make the work of puzzling together the structure relatively easy
-				if(((ntohl(sector[i].fh.byte_size) == 0) && !bigendian) || (bigendian && (sector[i].fh.byte_size == 0))) {
+				if(amiga32(sector[i].fh.byte_size) == 0) {
 					// Make a directory for this entry instead
-					if(mkdir(sector[i].fh.filename,0777) < 0 && errno != EEXIST) 
+					if(outputmkdir(sector[i].fh.filename) < 0 && errno != EEXIST) 
 						fprintf(stderr,"Can't create directory %s\n",sector[i].fh.filename);
 					else {
-						if(bigendian)
-							// Set correct timestamp for directory
-							utime(sector[i].fh.filename,amigadaystoutimbuf(sector[i].fh.days,sector[i].fh.mins,sector[i].fh.ticks,utim));
-						else
-							utime(sector[i].fh.filename,amigadaystoutimbuf(ntohl(sector[i].fh.days),ntohl(sector[i].fh.mins),ntohl(sector[i].fh.ticks),utim));
+						recordstamp(stamps,i,1,sector[i].fh.filename,amiga32(sector[i].fh.days),amiga32(sector[i].fh.mins),amiga32(sector[i].fh.ticks));
 					}
 				} else {
-					// Make a file for this entry (empty)
-					f = fopen(sector[i].fh.filename, "r+"); /* try to open existing file, if it already exists we won't need to creqte it */
-					if (!f) 
-						f = fopen(sector[i].fh.filename, "w"); /* doesn't exist, so create */
-					// Close the file again
-					fclose(f);
-					// Modify the timestamp
-					if(bigendian)
-						// Set correct timestamp for directory
-						utime(sector[i].fh.filename,amigadaystoutimbuf(sector[i].fh.days,sector[i].fh.mins,sector[i].fh.ticks,utim));
-					else
-						utime(sector[i].fh.filename,amigadaystoutimbuf(ntohl(sector[i].fh.days),ntohl(sector[i].fh.mins),ntohl(sector[i].fh.ticks),utim));
+					// Make a file for this entry (empty), if it's already there it's left alone, either way the space the header
+					// says the file takes is reserved for its data blocks, unless the size is more than the disk can hold
+					if(outputcreate(sector[i].fh.filename,amiga32(sector[i].fh.byte_size) <= (endsector-startsector)*DATABYTES ? amiga32(sector[i].fh.byte_size) : 0) == -1)
+						fprintf(stderr,"Can't create file %s\n",sector[i].fh.filename);
+					// Record the timestamp
+					recordstamp(stamps,i,0,sector[i].fh.filename,amiga32(sector[i].fh.days),amiga32(sector[i].fh.mins),amiga32(sector[i].fh.ticks));
 				}
 				// Return to the previous working directory
-				if(fchdir(root) == -1) {
+				if(stampfchdir(stamps,root,0) == -1) {
 					fprintf(stderr,"Can't return to previous working directory, exiting\n");
-					return 1;
+					goto done;
 				} 
 				// Close the previously opened working directories
-				close(root);
-				close(orphandir);
+				outputclose(root);
+				outputclose(orphandir);
+				root = orphandir = -1;
 				// Leave this sector
 				break;
 			case T_DATA:
-				if( (!bigendian && (ntohl(sector[i].hdr.header_key % 32 != 0))) || (bigendian && (sector[i].hdr.header_key % 32 != 0)))
+				if(!plausiblepointer(sector[i].hdr.header_key))
 					continue;
-				if(bigendian)
-					header_key = sector[i].hdr.header_key;
-				else
-					header_key = ntohl(sector[i].hdr.header_key);
-				if (header_key<SECTORS && ( (!bigendian && (ntohl(sector[header_key].hdr.type) == T_HEADER)) || (bigendian && (sector[header_key].hdr.type == T_HEADER)))) {
+				header_key = amiga32(sector[i].hdr.header_key);
+				if(hasheader(sector,header_key,endsector)) {
 					if(debug) {
 						fprintf(outfile,"%x:  filename  \"%s\"\n", i, sector[header_key].fh.filename);
-						if(bigendian)
-							fprintf(outfile,"%x:  byte_size %d\n", i, sector[header_key].fh.byte_size);
-						else
-							fprintf(outfile,"%x:  byte_size %d\n", i, ntohl(sector[header_key].fh.byte_size));
+						fprintf(outfile,"%x:  byte_size %d\n", i, amiga32(sector[header_key].fh.byte_size));
 					}
 					snprintf(filename,MAX_AMIGADOS_FILENAME_LENGTH,"%s",sector[header_key].fh.filename);
 					orphan = 0;
 				} else {
+					imagestats.orphans++;
+					// In chain mode the headerless data blocks are stitched together by recoverchains() after the scan
+					if(chainmode) {
+						if(debug)
+							fprintf(outfile,"Headerless data block, header key %d, leaving it for chain reconstruction\n",header_key);
+						break;
+					}
 					if(debug) {
 						fprintf(outfile,"Orphaned file found at header key %d previous orphansector value: %d\n",header_key,orphansector[header_key]);
 						fprintf(outfile,"%x:  filename  \"%s\"\n", i, sector[header_key].fh.filename);
-						if(bigendian)
-							fprintf(outfile,"%x:  byte_size %d\n", i, sector[header_key].fh.byte_size);
-						else
-							fprintf(outfile,"%x:  byte_size %d\n", i, ntohl(sector[header_key].fh.byte_size));
+						fprintf(outfile,"%x:  byte_size %d\n", i, amiga32(sector[header_key].fh.byte_size));
 					}
 					// Defaults for days, minutes, ticks if nothing else is readable, date will be set as 1978-01-01 
 					orphanday = 0;
@@ -2338,102 +5820,53 @@ int main(int argc,char **argv) {
 							invalidstring=1;
 						}
 						// Extra boundary check here to verify that we have a valid parent index, it's possible that the parent number is corrupt
-						if(bigendian) {
-					
-							if(sector[header_key].fh.parent && (sector[header_key].fh.parent % 32) == 0 && sector[header_key].fh.parent < endsector) {
-								// Check whether there are invalid characters in the parent filename string and mark it as invalid if there are
-								for(n=0;n<sizeof(sector[sector[header_key].fh.parent].fh.filename)/sizeof(sector[sector[header_key].fh.parent].fh.filename[0]);n++) {
-									if((((unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] <32) && (unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] > 0) || (unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] ==47 || ((unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] >127 && (unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] < 161))
-										invalidparentstring=1;
-								}
-								// If the parent filename is longer than the max_filename_length or it's empty, then it's invalid
-								if(strlen(sector[sector[header_key].fh.parent].fh.filename) > MAX_AMIGADOS_FILENAME_LENGTH || strlen(sector[sector[header_key].fh.parent].fh.filename) == 0)
+						if(sector[header_key].fh.parent && plausiblepointer(sector[header_key].fh.parent) && amiga32(sector[header_key].fh.parent) < endsector) {
+							// Check whether there are invalid characters in the parent filename string and mark it as invalid if there are
+							for(n=0;n<sizeof(sector[amiga32(sector[header_key].fh.parent)].fh.filename)/sizeof(sector[amiga32(sector[header_key].fh.parent)].fh.filename[0]);n++) {
+								if((((unsigned char)sector[amiga32(sector[header_key].fh.parent)].fh.filename[n] <32) && (unsigned char)sector[amiga32(sector[header_key].fh.parent)].fh.filename[n] > 0) || (unsigned char)sector[amiga32(sector[header_key].fh.parent)].fh.filename[n] ==47 || ((unsigned char)sector[amiga32(sector[header_key].fh.parent)].fh.filename[n] >127 && (unsigned char)sector[amiga32(sector[header_key].fh.parent)].fh.filename[n] < 161))
 									invalidparentstring=1;
-							// If there is no parent then we can't use that to construct the string
-							} else {
-								invalidparentstring=1;
 							}
-						} else {
-							if(sector[header_key].fh.parent && (sector[header_key].fh.parent % 32) == 0 && sector[header_key].fh.parent < endsector) {
-								// Check whether there are invalid characters in the parent filename string and mark it as invalid if there are
-								for(n=0;n<sizeof(sector[sector[header_key].fh.parent].fh.filename)/sizeof(sector[sector[header_key].fh.parent].fh.filename[0]);n++) {
-									if((((unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] <32) && (unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] > 0) || (unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] ==47 || ((unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] >127 && (unsigned char)sector[sector[header_key].fh.parent].fh.filename[n] < 161))
-										invalidparentstring=1;
-								}
-								// If the parent filename is longer than the max_filename_length or it's empty, then it's invalid
-								if(strlen(sector[sector[header_key].fh.parent].fh.filename) > MAX_AMIGADOS_FILENAME_LENGTH || strlen(sector[sector[header_key].fh.parent].fh.filename) == 0)
-									invalidparentstring=1;
-							// If there is no parent then we can't use that to construct the string
-							} else {
+							// If the parent filename is longer than the max_filename_length or it's empty, then it's invalid
+							if(strlen(sector[amiga32(sector[header_key].fh.parent)].fh.filename) > MAX_AMIGADOS_FILENAME_LENGTH || strlen(sector[amiga32(sector[header_key].fh.parent)].fh.filename) == 0)
 								invalidparentstring=1;
-							}
+						// If there is no parent then we can't use that to construct the string
+						} else {
+							invalidparentstring=1;
 						}
 						
 						// If the filename string is good and the parent string is good, we'll use both (only one parent used here)
 						if(!invalidstring && !invalidparentstring) {
 							// Store days, minutes, ticks from file since it's available
-							if(bigendian) {
-								snprintf(filename, MAX_FILENAME_LENGTH,"Orphan-%d-%s-%s",header_key,sector[sector[header_key].fh.parent].fh.filename,sector[header_key].fh.filename);
-								orphandays[header_key] = sector[header_key].fh.days;
-								orphanminutes[header_key] = sector[header_key].fh.mins;
-								orphanticks[header_key] = sector[header_key].fh.ticks;
-								orphanday = sector[header_key].fh.days;
-								orphanminute = sector[header_key].fh.mins;
-								orphantick = sector[header_key].fh.ticks;
-								if(sector[header_key].fh.parent == 880) {
-									fprintf(outfile,"Parent er 880\n");
-								}
-							} else {
-								snprintf(filename, MAX_FILENAME_LENGTH,"Orphan-%d-%s-%s",header_key,sector[ntohl(sector[header_key].fh.parent)].fh.filename,sector[header_key].fh.filename);
-								orphandays[header_key] = ntohl(sector[header_key].fh.days);
-								orphanminutes[header_key] = ntohl(sector[header_key].fh.mins);
-								orphanticks[header_key] = ntohl(sector[header_key].fh.ticks);
-								orphanday = ntohl(sector[header_key].fh.days);
-								orphanminute = ntohl(sector[header_key].fh.mins);
-								orphantick = ntohl(sector[header_key].fh.ticks);
-								if(ntohl(sector[header_key].fh.parent) == 880) {
-									fprintf(outfile,"Parent er 880\n");
-								}
+							snprintf(filename, MAX_FILENAME_LENGTH,"Orphan-%d-%s-%s",header_key,sector[amiga32(sector[header_key].fh.parent)].fh.filename,sector[header_key].fh.filename);
+							orphandays[header_key] = amiga32(sector[header_key].fh.days);
+							orphanminutes[header_key] = amiga32(sector[header_key].fh.mins);
+							orphanticks[header_key] = amiga32(sector[header_key].fh.ticks);
+							orphanday = amiga32(sector[header_key].fh.days);
+							orphanminute = amiga32(sector[header_key].fh.mins);
+							orphantick = amiga32(sector[header_key].fh.ticks);
+							if(amiga32(sector[header_key].fh.parent) == rootblock) {
+								fprintf(outfile,"Parent er %d\n",rootblock);
 							}
 						// Otherwise, if the filename string is good, but the parent string is not, we'll use that
 						} else if(!invalidstring) {
 							snprintf(filename, MAX_FILENAME_LENGTH,"Orphan-%d-%s",header_key,sector[header_key].fh.filename);
 							// Store days, minutes, ticks from file since it's available
-							if(bigendian) {
-								orphandays[header_key] = sector[header_key].fh.days;
-								orphanminutes[header_key] = sector[header_key].fh.mins;
-								orphanticks[header_key] = sector[header_key].fh.ticks;
-								orphanday = sector[header_key].fh.days;
-								orphanminute = sector[header_key].fh.mins;
-								orphantick = sector[header_key].fh.ticks;
-							} else {
-								orphandays[header_key] = ntohl(sector[header_key].fh.days);
-								orphanminutes[header_key] = ntohl(sector[header_key].fh.mins);
-								orphanticks[header_key] = ntohl(sector[header_key].fh.ticks);
-								orphanday = ntohl(sector[header_key].fh.days);
-								orphanminute = ntohl(sector[header_key].fh.mins);
-								orphantick = ntohl(sector[header_key].fh.ticks);
-							}
+							orphandays[header_key] = amiga32(sector[header_key].fh.days);
+							orphanminutes[header_key] = amiga32(sector[header_key].fh.mins);
+							orphanticks[header_key] = amiga32(sector[header_key].fh.ticks);
+							orphanday = amiga32(sector[header_key].fh.days);
+							orphanminute = amiga32(sector[header_key].fh.mins);
+							orphantick = amiga32(sector[header_key].fh.ticks);
 						// Otherwise, if the parent filepath is good, we'll use that
 						} else if(!invalidparentstring) {
 							// Store days, minutes, ticks from parent since that's all we have
-							if(bigendian) {
-								snprintf(filename, MAX_FILENAME_LENGTH,"Orphan-%d-%s",header_key,sector[sector[header_key].fh.parent].fh.filename);
-								orphandays[header_key] = sector[ntohl(sector[header_key].fh.parent)].fh.days;
-								orphanminutes[header_key] = sector[ntohl(sector[header_key].fh.parent)].fh.mins;
-								orphanticks[header_key] = sector[ntohl(sector[header_key].fh.parent)].fh.ticks;
-								orphanday = sector[ntohl(sector[header_key].fh.parent)].fh.days;
-								orphanminute = sector[ntohl(sector[header_key].fh.parent)].fh.mins;
-								orphantick = sector[ntohl(sector[header_key].fh.parent)].fh.ticks;
-							} else {
-								snprintf(filename, MAX_FILENAME_LENGTH,"Orphan-%d-%s",header_key,sector[ntohl(sector[header_key].fh.parent)].fh.filename);
-								orphandays[header_key] = ntohl(sector[ntohl(sector[header_key].fh.parent)].fh.days);
-								orphanminutes[header_key] = ntohl(sector[ntohl(sector[header_key].fh.parent)].fh.mins);
-								orphanticks[header_key] = ntohl(sector[ntohl(sector[header_key].fh.parent)].fh.ticks);
-								orphanday = ntohl(sector[ntohl(sector[header_key].fh.parent)].fh.days);
-								orphanminute = ntohl(sector[ntohl(sector[header_key].fh.parent)].fh.mins);
-								orphantick = ntohl(sector[ntohl(sector[header_key].fh.parent)].fh.ticks);
-							}
+							snprintf(filename, MAX_FILENAME_LENGTH,"Orphan-%d-%s",header_key,sector[amiga32(sector[header_key].fh.parent)].fh.filename);
+							orphandays[header_key] = amiga32(sector[amiga32(sector[header_key].fh.parent)].fh.days);
+							orphanminutes[header_key] = amiga32(sector[amiga32(sector[header_key].fh.parent)].fh.mins);
+							orphanticks[header_key] = amiga32(sector[amiga32(sector[header_key].fh.parent)].fh.ticks);
+							orphanday = amiga32(sector[amiga32(sector[header_key].fh.parent)].fh.days);
+							orphanminute = amiga32(sector[amiga32(sector[header_key].fh.parent)].fh.mins);
+							orphantick = amiga32(sector[amiga32(sector[header_key].fh.parent)].fh.ticks);
 						// Otherwise, if the previous filepath is good, we'll use that instead of the parent
 						} else if(strlen(previousfilepath) > 0) {
 							snprintf(filename, MAX_FILENAME_LENGTH,"Orphan-%s-%s",previousfilepath,previousfilepath);
@@ -2443,23 +5876,17 @@ int main(int argc,char **argv) {
 						}
 						// Set the orphan flag to 1
 						orphan = 1;
-						// Mark this sector as an orphan so if we come across it again we'll use the same filename and dates
-						orphansector[header_key] = 1;
-						// And set the orphan filename to our current filename
-						snprintf(orphanfilename[header_key],MAX_FILENAME_LENGTH,"%s",filename);
+						// Keep the orphan filename and mark this sector as an orphan so if we come across it again we'll use the same
+						// filename and dates, without memory for the name it's just made up again the next time
+						orphanfilename[header_key] = arenacopy(&namearena,filename,MAX_FILENAME_LENGTH);
+						orphansector[header_key] = (orphanfilename[header_key] != NULL);
 						if(debug) {
 							if(!invalidstring && !invalidparentstring) {	
-								if(bigendian)
-									fprintf(outfile, "Filename:%s: Parent Filename: %s Orphan Filename: %s\n",sector[header_key].fh.filename,sector[sector[header_key].fh.parent].fh.filename,filename);
-								else
-									fprintf(outfile, "Filename:%s: Parent Filename: %s Orphan Filename: %s\n",sector[header_key].fh.filename,sector[ntohl(sector[header_key].fh.parent)].fh.filename,filename);
+								fprintf(outfile, "Filename:%s: Parent Filename: %s Orphan Filename: %s\n",sector[header_key].fh.filename,sector[amiga32(sector[header_key].fh.parent)].fh.filename,filename);
 							} else if(!invalidstring) {
 								fprintf(outfile, "Filename:%s: Orphan Filename: %s\n",sector[header_key].fh.filename,filename);
 							} else if(!invalidparentstring) {
-								if(bigendian)
-									fprintf(outfile, "Parent Filename: %s Orphan Filename: %s\n",sector[sector[header_key].fh.parent].fh.filename,filename);
-								else
-									fprintf(outfile, "Parent Filename: %s Orphan Filename: %s\n",sector[ntohl(sector[header_key].fh.parent)].fh.filename,filename);
+								fprintf(outfile, "Parent Filename: %s Orphan Filename: %s\n",sector[amiga32(sector[header_key].fh.parent)].fh.filename,filename);
 							} else if(strlen(previousfilepath) > 0) {
 								fprintf(outfile, "Previous filepath: %s Orphan Filename: %s\n",previousfilepath,filename);
 							} else {
@@ -2472,32 +5899,24 @@ int main(int argc,char **argv) {
 				// Find the file path and put it into the filepath array
 				j = 0; n=header_key;
 				// If this is a regular file (has a regular filename, and a directory structure) as well as a valid parent find the path
-				while( n != 0 && header_key<SECTORS && ( (!bigendian && (ntohl(sector[header_key].hdr.type) == T_HEADER)) || (bigendian && (sector[header_key].hdr.type == T_HEADER))) && (sector[n].fh.parent % 32) == 0) {
-					if(sector[n].fh.parent && n != 880)  {
+				while( n != 0 && hasheader(sector,header_key,endsector) && plausiblepointer(sector[n].fh.parent)) {
+					// A parent outside the image or parents that loop end the path like a missing parent
+					if(sector[n].fh.parent && n != rootblock && amiga32(sector[n].fh.parent) <= endsector && j+1 < MAX_PATH_DEPTH)  {
 						//  Also store days, minutes and ticks to recreate the correct date and time of the files
-						if(bigendian) {
-							// Get the path entry name into the filepath array
-							snprintf(filepath[j],MAX_AMIGADOS_FILENAME_LENGTH,"%s",sector[sector[n].fh.parent].fh.filename);
-							days[j] = sector[n].fh.days;
-							minutes[j] = sector[n].fh.mins;
-							ticks[j] = sector[n].fh.ticks;
-							// Set n as the parent to recurse backwards
-							n = sector[n].fh.parent;
-						} else { 
-							// Get the path entry name into the filepath array
-							snprintf(filepath[j],MAX_AMIGADOS_FILENAME_LENGTH,"%s",sector[ntohl(sector[n].fh.parent)].fh.filename);
-							days[j] = ntohl(sector[n].fh.days);
-							minutes[j] = ntohl(sector[n].fh.mins);
-							ticks[j] = ntohl(sector[n].fh.ticks);
-							// Set n as the parent to recurse backwards
-							n = ntohl(sector[n].fh.parent);
-						}
+						// Get the path entry name into the filepath array
+						snprintf(filepath[j],MAX_AMIGADOS_FILENAME_LENGTH,"%s",sector[amiga32(sector[n].fh.parent)].fh.filename);
+						pathsector[j] = amiga32(sector[n].fh.parent);
+						days[j] = amiga32(sector[n].fh.days);
+						minutes[j] = amiga32(sector[n].fh.mins);
+						ticks[j] = amiga32(sector[n].fh.ticks);
+						// Set n as the parent to recurse backwards
+						n = amiga32(sector[n].fh.parent);
 						if(debug)
 							fprintf(outfile,"File belongs to Directory tree %d, found path %s\n",j,filepath[j]);
 						// If the parent is the root sector we don't need more iterations	
-						if(n == 880) {
+						if(n == rootblock) {
 							if(debug)
-								fprintf(outfile,"Parent is root block 880, stopping this loop\n");
+								fprintf(outfile,"Parent is root block %d, stopping this loop\n",rootblock);
 							break;
 						} else {
 							// Increment loop count by 1
@@ -2509,25 +5928,26 @@ int main(int argc,char **argv) {
 				}
 				// We should now have an array of all the filepaths belonging to this header, we'll now re-create all the directories in that path (we might do this multiple times for the top level directories but there is no harm in that)
 				// Open the current directory so we can return to it later
-				root = open(".",O_RDONLY);
+				root = outputopendir(".");
 				if(root == -1 ) {
 					fprintf(stderr,"Can't write to root directory, exiting\n");
-					return 1;
+					goto done;
 				}
 
 				// Make a directory for orphaned files and directories, ignore if it already exists but stop on other errors
-				if(mkdir("Orphaned",0777) > 0 && errno != EEXIST)
+				if(outputmkdir("Orphaned") > 0 && errno != EEXIST)
 					fprintf(stderr,"Can't create directory in current path, check permissions\n");
 
-				chdir("Orphaned");
-				orphandir = open(".",O_RDONLY);
+				stampchdir(stamps,"Orphaned");
+				orphandirid = stamps->cwd;
+				orphandir = outputopendir(".");
 	
 				if(orphandir == -1) {
 					fprintf(stderr,"Can't write to orphan directory, exiting\n");
-					return 1;
+					goto done;
 				}
 				// Change back to root directory
-				fchdir(root);
+				stampfchdir(stamps,root,0);
 
 				// Struct we'll use for filestats
 				struct stat st;
@@ -2541,20 +5961,20 @@ int main(int argc,char **argv) {
 					// and the same file (and directory) can be passed over hundreds of times. 
 					// If the filepath is NULL the parent directory is lost in the filesystem and we'll set it as orphaned
 					if(filepath[n] != NULL) 
-						staterr=stat(filepath[n],&st);
+						staterr=outputstat(filepath[n],&st);
 					else {
 						// NULL filepaths get put into a directory in the root called Orphaned
 						snprintf(filepath[n],9,"Orphaned");
 						// Stat the orphaned directory
-						staterr=stat(filepath[n],&st);
+						staterr=outputstat(filepath[n],&st);
 					}
 					// File/Directory does not exist, let's create it
 					if(staterr != -1 && S_ISDIR(st.st_mode) && !orphan) {
 						if(debug)
 							fprintf(outfile,"Directory %s already exists, not creating\n",filepath[n]);
-						// Set correct timestamp for directory
-						utime(filepath[n],amigadaystoutimbuf(days[n],minutes[n],ticks[n],utim));
-						if(chdir(filepath[n])) 
+						// Record correct timestamp for directory
+						recordstamp(stamps,pathsector[n],1,filepath[n],days[n],minutes[n],ticks[n]);
+						if(stampchdir(stamps,filepath[n])) 
 							fprintf(outfile,"Can't CD to directory %s\n",filepath[n]);
 						else
 							if(debug)
@@ -2563,28 +5983,28 @@ int main(int argc,char **argv) {
 						if(debug)		
 							fprintf(outfile,"File with same name as directory (%s) already exists and is not empty, cowardly refusing to delete it\n",filepath[n]);
 					} else if(staterr != -1 && !S_ISDIR(st.st_mode) && st.st_size == 0 && !orphan) {
-						if(remove(filepath[n])) {
+						if(outputremove(filepath[n])) {
 							fprintf(outfile,"Cannot delete file %s, placing directory in orphanpath instead\n",filepath[n]);
 							// Return to the previous working directory
-							if(fchdir(root) == -1) {
+							if(stampfchdir(stamps,root,0) == -1) {
 								fprintf(stderr,"Can't return to previous working directory, exiting\n");
-								return 1;
+								goto done;
 							}
 						} else {
 							if(debug)
 								fprintf(outfile,"Deleted empty file %s to make room for directory of the same name\n",filepath[n]);
 						}
 						// Create directory
-						if(mkdir(filepath[n],0777) < 0) {
+						if(outputmkdir(filepath[n]) < 0) {
 							fprintf(outfile,"Can't create directory %s\n",filepath[n]);
 						} else {
 							if(debug)
 								fprintf(outfile,"Created directory %s in place of file\n",filepath[n]);
-							// Set correct timestamp for directory
-							utime(filepath[n],amigadaystoutimbuf(days[n],minutes[n],ticks[n],utim));
-							if(chdir(filepath[n])) {;
+							// Record correct timestamp for directory
+							recordstamp(stamps,pathsector[n],1,filepath[n],days[n],minutes[n],ticks[n]);
+							if(stampchdir(stamps,filepath[n])) {;
 								fprintf(stderr,"Can't change to newly created directory, exiting\n");
-								return 1;
+								goto done;
 							} else { 
 								if(debug)
 									fprintf(outfile,"Changing directory to %s\n",filepath[n]);
@@ -2593,17 +6013,17 @@ int main(int argc,char **argv) {
 								
 					} else if(staterr == -1 && errno == ENOENT && !orphan) {
 						// Create directories for files
-						if(mkdir(filepath[n],0777) < 0) {
+						if(outputmkdir(filepath[n]) < 0) {
 							fprintf(outfile,"Can't create directory %s\n",filepath[n]);
 						} else {
 							if(debug)
 								fprintf(outfile,"Created directory %s\n",filepath[n]);
-							// Set correct timestamp for directory
-							utime(filepath[n],amigadaystoutimbuf(days[n],minutes[n],ticks[n],utim));
+							// Record correct timestamp for directory
+							recordstamp(stamps,pathsector[n],1,filepath[n],days[n],minutes[n],ticks[n]);
 							// Change directory to the newly created directory
-							if(chdir(filepath[n]) == -1) {
+							if(stampchdir(stamps,filepath[n]) == -1) {
 								fprintf(stderr,"Can't change to newly created directory, exiting\n");
-								return 1;
+								goto done;
 							} else { 
 								if(debug)
 									fprintf(outfile,"Changing directory to %s\n",filepath[n]);
@@ -2618,8 +6038,8 @@ int main(int argc,char **argv) {
 				// If this is an orphan file we'll need to treat it a little differently, we can't fully recreate the path but we most likely have at least the parent directory
 				if(orphan) {
 					// Split the file 
-					// Temporary variable for strsep
-					char *orphanfilenamecopy = malloc(MAX_FILENAME_LENGTH*sizeof(char *));
+					// strsep() moves orphanfilenamecopy along, keep the start so it can be used for the next orphan
+					char *orphanfilenamestart = orphanfilenamecopy;
 					char *temp;
 					// Copy the filename into the copy
 					snprintf(orphanfilenamecopy,MAX_FILENAME_LENGTH,"%s",filename);
@@ -2635,20 +6055,20 @@ int main(int argc,char **argv) {
 					// then we can place the file in that path, making it easier to sort out which orphans belong in which directory (and therefore, what could be in the file)
 					if(splits == 2) {
 						// Return to the orphaned directory first
-						if(fchdir(orphandir) == -1) {
+						if(stampfchdir(stamps,orphandir,orphandirid) == -1) {
 							fprintf(stderr,"Can't return to previous working directory, exiting\n");
-							return 1;
+							goto done;
 						}
 						// Create a directory based on the path component of the oprhan
-						if(mkdir(orphansplit,0777) < 0 && errno != EEXIST) {
+						if(outputmkdir(orphansplit) < 0 && errno != EEXIST) {
 							fprintf(stderr,"Can't create directory %s\n",orphansplit);
 						} else {
 							if(debug)
 								fprintf(outfile,"Created orphan directory %s\n",orphansplit);
-							// Set modification time
-							//utime(orphansplit,amigadaystoutimbuf(orphanday,orphanminute,orphantick,utim));
+							// Record modification time
+							//recordstamp(stamps,header_key,1,orphansplit,orphanday,orphanminute,orphantick);
 							// Change directory to the newly created directory
-							if(chdir(orphansplit) == -1) {
+							if(stampchdir(stamps,orphansplit) == -1) {
 								fprintf(stderr,"Can't change to newly created directory,placing orphan in the root directory");
 							} else 
 								if(debug)
@@ -2656,30 +6076,26 @@ int main(int argc,char **argv) {
 						}
 					} else {
 						// Return to the previous working directory and place the file in the root
-						if(fchdir(orphandir) == -1) {
+						if(stampfchdir(stamps,orphandir,orphandirid) == -1) {
 							fprintf(stderr,"Can't return to previous working directory, exiting\n");
-							return 1;
+							goto done;
 						}
 					}
-					// Restore orphansplit
+					// Restore orphansplit and orphanfilenamecopy
 					orphansplit=temp;
-					// Free memory used by orphanfilenamecopy
-					free(orphanfilenamecopy);
+					orphanfilenamecopy=orphanfilenamestart;
 				}
 
 					
 					
 				// Open the file for appending (in the current directory with the path intact)
-				f = fopen(filename, "r+"); /* try to open existing file */
+				f = outputfopen(filename, "r+"); /* try to open existing file */
 				if (!f) 
-					f = fopen(filename, "w"); /* doesn't exist, so create */
+					f = outputfopen(filename, "w"); /* doesn't exist, so create */
 				if(!f) {
 					// File could already exist under the same name or even as a directory, try append the sector header to the filename and try again
-					if(bigendian)
-						snprintf(filename,MAX_AMIGADOS_FILENAME_LENGTH,"%s-%d",filename,sector[i].hdr.header_key);
-					else
-						snprintf(filename,MAX_AMIGADOS_FILENAME_LENGTH,"%s-%d",filename,ntohl(sector[i].hdr.header_key));
-					f = fopen(filename, "w"); /* doesn't exist, so create */
+					snprintf(filename,MAX_AMIGADOS_FILENAME_LENGTH,"%s-%d",filename,amiga32(sector[i].hdr.header_key));
+					f = outputfopen(filename, "w"); /* doesn't exist, so create */
 					if(!f) 
 						fprintf(stderr,"Can't create file, this is probably fatal!\n");
 				}
@@ -2712,74 +6128,1589 @@ int main(int argc,char **argv) {
 					// End with a final newline
 					fprintf(outfile,"\n");
 				}
-				// Write the content to the file
-				if(debug) {
-					if(bigendian)	
-						fprintf(outfile,"Seek seq_num %02x : DATABYTES: %lu SEEKSET: %d \n",sector[i].hdr.seq_num,DATABYTES,SEEK_SET);
-					else
-						fprintf(outfile,"Seek seq_num %02x : DATABYTES: %lu SEEKSET: %d \n",ntohl(sector[i].hdr.seq_num),DATABYTES,SEEK_SET);
+				// Write the content to the file
+				if(debug) {
+					fprintf(outfile,"Seek seq_num %02x : DATABYTES: %lu SEEKSET: %d \n",amiga32(sector[i].hdr.seq_num),DATABYTES,SEEK_SET);
+				}
+				outputfseek(f, (amiga32(sector[i].hdr.seq_num)-1)*DATABYTES, SEEK_SET);
+				if(debug) {
+					fprintf(outfile,"seek to %ld\n",  (amiga32(sector[i].hdr.seq_num)-1)*DATABYTES);
+				}
+				outputfwrite(sector[i].dh.data, amiga32(sector[i].hdr.data_size), 1, f);
+				// Close file
+				outputfclose(f);
+				// Record modification time based on the days/minutes/ticks timestamp of the original file
+				//All the stamps are in big-endian so need to be converted..
+				stampindex = recordstamp(stamps,header_key,0,filename,amiga32(sector[header_key].fh.days),amiga32(sector[header_key].fh.mins),amiga32(sector[header_key].fh.ticks));
+				// Keep what was written for the manifest
+				if(manifestwanted())
+					manifestblock(manifestentry(stamps,stampindex),(uint64_t)(amiga32(sector[i].hdr.seq_num)-1)*DATABYTES,sector[i].dh.data,
+						amiga32(sector[i].hdr.data_size) > DATABYTES ? DATABYTES : amiga32(sector[i].hdr.data_size));
+				// Return to the previous working directory
+				if(stampfchdir(stamps,root,0) == -1) {
+					fprintf(stderr,"Can't return to previous working directory, exiting\n");
+					goto done;
+				}
+				// Close the previously opened working directories
+				outputclose(root);
+				outputclose(orphandir);
+				root = orphandir = -1;
+		}
+		if(debug)
+			fprintf(outfile,"\n");
+	}
+	imagestats.scantime += (monotonicnanoseconds()-phasestart)-(imagestats.writetime-writestart);
+	freesectorindex(&index);
+
+	// Reconstruct the headerless files from their data block chains
+	if(chainmode) {
+		n = recoverchains(sector,scanmask,startsector,endsector,debug,outfile);
+		if(n > 0)
+			fprintf(outfile,"Reconstructed %d headerless files from data block chains\n",n);
+	}
+
+	// Report the files that didn't come out the size their header says
+	checksizes(stamps,sector,endsector,outfile);
+	if(manifestwanted())
+		writemanifest(stamps);
+
+	// Now that every file and directory has been created, apply their timestamps
+	applystamps(stamps,debug,outfile);
+
+	// Successful run
+	ret = 0;
+
+done:
+	// The directories of a block we gave up on are still open
+	if(root != -1)
+		outputclose(root);
+	if(orphandir != -1)
+		outputclose(orphandir);
+	// What the manifest kept of a failed image is of no use
+	if(ret != 0)
+		manifestreset();
+	freebuffer(&image);
+	free(zerosectors);
+	freesectorindex(&index);
+
+	// Free the allocation map
+	free(scanmask);
+
+	// The filepath and orphanfilename arrays, the filename, extension and orphansplit and the names in the stamp
+	// table are in the name arena, which is reset when the next image starts
+	imagestats.arenapeak = namearena.peak;
+
+	// Free the space used by the orphansector array
+	free(orphansector);
+
+	// Free the space used by the sector array
+	free(sector);
+
+	// Free the timestamp table, it has already been emptied when the timestamps were applied
+	if(stamps != NULL)
+		freestamps(stamps);
+	free(stamps);
+
+	return ret;
+} // End function extractimage
+
+
+// The benchmark program includes this file and supplies its own main()
+// Order of the index entries, by file name without regard to case like AmigaDOS, then by image and path
+int compareindexentries(const void *a, const void *b) {
+	const struct indexentry *x = a;
+	const struct indexentry *y = b;
+	int result = strcasecmp(indexstrings+x->name,indexstrings+y->name);
+
+	if(result == 0)
+		result = (x->image > y->image) - (x->image < y->image);
+	if(result == 0)
+		result = strcmp(indexstrings+x->path,indexstrings+y->path);
+	return result;
+}
+
+// Sort the entries of an index and write it to filename, returns 0 on success and 1 on error
+int writeindex(struct indexbuilder *builder, char *filename) {
+	struct indexheader header;
+	FILE *f;
+
+	indexstrings = (char *)builder->strings.data;
+	if(builder->numentries)
+		qsort(builder->entries,builder->numentries,sizeof(struct indexentry),compareindexentries);
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,INDEX_MAGIC,sizeof(header.magic));
+	header.byteorder = INDEX_BYTEORDER;
+	header.images = builder->numimages;
+	header.entries = builder->numentries;
+	header.stringsize = builder->strings.size;
+	f = fopen(filename,"w");
+	if(f == NULL) {
+		fprintf(stderr,"Can't open index file %s for writing, error returned was: %s\n",filename,strerror(errno));
+		return 1;
+	}
+	if(fwrite(&header,sizeof(header),1,f) != 1 ||
+		(builder->numimages && fwrite(builder->images,sizeof(uint32_t),builder->numimages,f) != builder->numimages) ||
+		(builder->numentries && fwrite(builder->entries,sizeof(struct indexentry),builder->numentries,f) != builder->numentries) ||
+		(builder->strings.size && fwrite(builder->strings.data,1,builder->strings.size,f) != builder->strings.size)) {
+		fprintf(stderr,"Can't write index file %s\n",filename);
+		fclose(f);
+		return 1;
+	}
+	return fclose(f) != 0;
+}
+
+// Look up names in an index file, a name can end in @text to only match files whose version string contains text
+// Every match is printed as the image, the path in the image, size, date, hash and version, returns 0 if everything
+// was found, 1 if something wasn't and 2 if the index can't be used
+int lookupindex(char *filename, char **names, int numnames, FILE *outfile) {
+	struct indexheader *header;
+	struct indexentry *entries;
+	uint32_t *images;
+	char *strings;
+	char name[MAX_FILENAME_LENGTH];
+	char *version;
+	char date[32];
+	struct stat st;
+	uint8_t *map;
+	uint32_t low = 0; uint32_t high = 0; uint32_t middle = 0;
+	uint64_t start = 0;
+	int fd = 0; int i = 0; int found = 0; int missing = 0;
+
+	fd = open(filename,O_RDONLY);
+	if(fd == -1 || fstat(fd,&st) == -1) {
+		fprintf(stderr,"Can't open index file %s, error returned was: %s\n",filename,strerror(errno));
+		return 2;
+	}
+	map = (st.st_size >= sizeof(struct indexheader)) ? mmap(NULL,st.st_size,PROT_READ,MAP_SHARED,fd,0) : MAP_FAILED;
+	close(fd);
+	if(map == MAP_FAILED) {
+		fprintf(stderr,"Index file %s is too short or can't be mapped\n",filename);
+		return 2;
+	}
+	header = (struct indexheader *)map;
+	if(memcmp(header->magic,INDEX_MAGIC,sizeof(header->magic)) != 0 || header->byteorder != INDEX_BYTEORDER ||
+		sizeof(struct indexheader)+(uint64_t)header->images*sizeof(uint32_t)+(uint64_t)header->entries*sizeof(struct indexentry)+
+		header->stringsize != (uint64_t)st.st_size || header->stringsize == 0 || map[st.st_size-1] != '\0') {
+		fprintf(stderr,"%s is not an index file written on this kind of host\n",filename);
+		munmap(map,st.st_size);
+		return 2;
+	}
+	images = (uint32_t *)(map+sizeof(struct indexheader));
+	entries = (struct indexentry *)(images+header->images);
+	strings = (char *)(entries+header->entries);
+
+	for(i = 0; i < numnames; i++) {
+		start = monotonicnanoseconds();
+		snprintf(name,sizeof(name),"%s",names[i]);
+		version = strchr(name,'@');
+		if(version != NULL)
+			*version++ = '\0';
+		// Find the first entry with the name
+		low = 0;
+		high = header->entries;
+		while(low < high) {
+			middle = low+(high-low)/2;
+			if(entries[middle].name >= header->stringsize || strcasecmp(strings+entries[middle].name,name) < 0)
+				low = middle+1;
+			else
+				high = middle;
+		}
+		found = 0;
+		for(; low < header->entries && entries[low].name < header->stringsize && strcasecmp(strings+entries[low].name,name) == 0; low++) {
+			if(version != NULL && (entries[low].version == 0 || entries[low].version >= header->stringsize ||
+				strstr(strings+entries[low].version,version) == NULL))
+				continue;
+			formatdate(date,sizeof(date),entries[low].mtime);
+			fprintf(outfile,"%s\t%s\t%llu\t%s\t%016llx\t%s\n",
+				entries[low].image < header->images && images[entries[low].image] < header->stringsize ? strings+images[entries[low].image] : "?",
+				entries[low].path < header->stringsize ? strings+entries[low].path : "?",
+				(unsigned long long)entries[low].size,date,(unsigned long long)entries[low].hash,
+				entries[low].version && entries[low].version < header->stringsize ? strings+entries[low].version : "");
+			found++;
+		}
+		fprintf(outfile,"%s: %d found in %.1f us\n",names[i],found,(monotonicnanoseconds()-start)/1e3);
+		if(!found)
+			missing++;
+	}
+	munmap(map,st.st_size);
+	return missing ? 1 : 0;
+}
+
+// Added for version 5
+// Image comparison (-C), two dumps of the same disk are compared a sector at a time without extracting either of
+// them, every sector that differs is mapped to the file it belongs to in each image through the header_key of data
+// blocks and the parent of extension blocks, and the files of the two images are matched by their path. A file is
+// changed if any of its blocks differ in either image or its header is somewhere else on the disk
+
+// One file header of an image being compared
+struct difffile {
+	char path[MAX_PATH_DEPTH*MAX_AMIGADOS_FILENAME_LENGTH];
+	uint32_t key;
+};
+
+// Work out the format from the extension of an image, FORMAT_UNKNOWN if it doesn't tell
+int extensionformat(char *filename) {
+	char *extension = strrchr(filename,'.');
+
+	if(extension == NULL)
+		return FORMAT_UNKNOWN;
+	if(strcasecmp(extension,".adf") == 0)
+		return FORMAT_ADF;
+	if(strcasecmp(extension,".adz") == 0 || strcasecmp(extension,".gz") == 0 || strcasecmp(extension,".zip") == 0)
+		return FORMAT_ADZ;
+	if(strcasecmp(extension,".dms") == 0)
+		return FORMAT_DMS;
+	return FORMAT_UNKNOWN;
+}
+
+// Load an image and unpack it into a raw ADF in memory, returns 0 on success and 1 on error
+int loaddecoded(char *filename, int forcedformat, int endsector, struct membuffer *image, unsigned int debug, FILE *debugfile) {
+	if(loadfile(filename,image) != 0) {
+		fprintf(stderr,"Can't open file %s for reading, error returned was: %s\n",filename,strerror(errno));
+		return 1;
+	}
+	if(decodeimage(image,forcedformat,extensionformat(filename),endsector,debug,debugfile) != 0) {
+		fprintf(stderr,"Can't decode file %s\n",filename);
+		freebuffer(image);
+		return 1;
+	}
+	return 0;
+}
+
+// Compare two sectors, returns 1 if they differ. With SSE2 the 512 bytes are compared 16 at a time and the
+// differences are or'ed together so there's only one branch per sector, memcmp() has to stop at the first
+// difference and that doesn't buy anything when most sectors are the same
+int sectorsdiffer(union sector *a, union sector *b) {
+#ifdef __SSE2__
+	const __m128i *x = (const __m128i *)a;
+	const __m128i *y = (const __m128i *)b;
+	__m128i differ = _mm_setzero_si128();
+	int i = 0;
+
+	for(i = 0; i < (int)(sizeof(union sector)/sizeof(__m128i)); i++)
+		differ = _mm_or_si128(differ,_mm_xor_si128(_mm_loadu_si128(x+i),_mm_loadu_si128(y+i)));
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(differ,_mm_setzero_si128())) != 0xffff;
+#else
+	uint64_t x = 0; uint64_t y = 0; uint64_t differ = 0;
+	int i = 0;
+
+	for(i = 0; i < (int)sizeof(union sector); i += sizeof(uint64_t)) {
+		memcpy(&x,(uint8_t *)a+i,sizeof(uint64_t));
+		memcpy(&y,(uint8_t *)b+i,sizeof(uint64_t));
+		differ |= x^y;
+	}
+	return differ != 0;
+#endif
+}
+
+// The file header a block belongs to, the block itself for file headers, or endsector if it doesn't belong to a file
+uint32_t sectorowner(union sector *sector, uint32_t i, uint32_t endsector) {
+	uint32_t key = endsector;
+
+	switch(amiga32(sector[i].hdr.type)) {
+		case T_HEADER:
+			key = i;
+			break;
+		case T_DATA:
+			key = amiga32(sector[i].hdr.header_key);
+			break;
+		case T_LIST:
+			key = amiga32(sector[i].fh.parent);
+			break;
+	}
+	// Only file headers count, directories, the root block and the bitmap belong to no file
+	if(key >= endsector || amiga32(sector[key].hdr.type) != T_HEADER || (int32_t)amiga32(sector[key].fh.sec_type) != -3)
+		return endsector;
+	return key;
+}
+
+int comparedifffiles(const void *a, const void *b) {
+	const struct difffile *x = a;
+	const struct difffile *y = b;
+	int ret = strcasecmp(x->path,y->path);
+
+	if(ret != 0)
+		return ret;
+	return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// Collect the path of every file header of an image sorted by path, returns the number of files or -1 if we're out
+// of memory
+int difffiles(union sector *sector, uint32_t endsector, struct difffile **files) {
+	uint32_t i = 0;
+	int numfiles = 0;
+
+	// Count them first, the paths are long enough that we don't want one for every sector
+	for(i = 0; i < endsector; i++)
+		if(amiga32(sector[i].hdr.type) == T_HEADER && (int32_t)amiga32(sector[i].fh.sec_type) == -3)
+			numfiles++;
+	*files = malloc((numfiles ? numfiles : 1)*sizeof(struct difffile));
+	if(*files == NULL)
+		return -1;
+	numfiles = 0;
+	for(i = 0; i < endsector; i++) {
+		if(amiga32(sector[i].hdr.type) != T_HEADER || (int32_t)amiga32(sector[i].fh.sec_type) != -3)
+			continue;
+		headerpath(sector,i,endsector,(*files)[numfiles].path,sizeof((*files)[numfiles].path));
+		(*files)[numfiles++].key = i;
+	}
+	qsort(*files,numfiles,sizeof(struct difffile),comparedifffiles);
+	return numfiles;
+}
+
+// Compare two images and list the files that changed, were added or were removed between them, returns 0 if no
+// file differs, 1 if some do and 2 on error
+int diffimages(char *firstfile, char *secondfile, struct extractoptions *options) {
+	struct membuffer first; struct membuffer second;
+	union sector *a = NULL; union sector *b = NULL;
+	struct difffile *afiles = NULL; struct difffile *bfiles = NULL;
+	uint8_t *adirty = NULL; uint8_t *bdirty = NULL;
+	uint32_t endsector = options->endsector;
+	uint32_t asectors = 0; uint32_t bsectors = 0;
+	uint32_t i = 0; uint32_t differing = 0; uint32_t unowned = 0;
+	uint32_t aowner = 0; uint32_t bowner = 0;
+	int numa = 0; int numb = 0; int j = 0; int k = 0; int n = 0; int anext = 0; int bnext = 0; int ret = 0; int changed = 0;
+	int counts[3] = { 0, 0, 0 };
+	FILE *outfile = options->outfile;
+
+	if(loaddecoded(firstfile,options->format,endsector,&first,options->debug,outfile) != 0)
+		return 2;
+	if(loaddecoded(secondfile,options->format,endsector,&second,options->debug,outfile) != 0) {
+		freebuffer(&first);
+		return 2;
+	}
+	a = (union sector *)first.data;
+	b = (union sector *)second.data;
+	asectors = first.size/sizeof(union sector) < endsector ? first.size/sizeof(union sector) : endsector;
+	bsectors = second.size/sizeof(union sector) < endsector ? second.size/sizeof(union sector) : endsector;
+	adirty = calloc(asectors+1,1);
+	bdirty = calloc(bsectors+1,1);
+	numa = difffiles(a,asectors,&afiles);
+	numb = difffiles(b,bsectors,&bfiles);
+	if(adirty == NULL || bdirty == NULL || numa == -1 || numb == -1) {
+		fprintf(stderr,"Out of memory\n");
+		ret = 2;
+		goto done;
+	}
+	if(asectors != bsectors)
+		fprintf(outfile,"%s has %u sectors and %s has %u\n",firstfile,asectors,secondfile,bsectors);
+
+	// Mark the headers of the blocks that differ, a sector only one of the images has differs as well
+	for(i = options->startsector; i < (asectors > bsectors ? asectors : bsectors); i++) {
+		if(i < asectors && i < bsectors && !sectorsdiffer(&a[i],&b[i]))
+			continue;
+		differing++;
+		aowner = i < asectors ? sectorowner(a,i,asectors) : asectors;
+		bowner = i < bsectors ? sectorowner(b,i,bsectors) : bsectors;
+		adirty[aowner] = 1;
+		bdirty[bowner] = 1;
+		if(aowner == asectors && bowner == bsectors)
+			unowned++;
+		if(options->debug)
+			fprintf(outfile,"Sector %u differs, it belongs to %d in %s and %d in %s\n",i,
+				aowner == asectors ? -1 : (int)aowner,firstfile,bowner == bsectors ? -1 : (int)bowner,secondfile);
+	}
+
+	// Walk the two sorted file lists together, a path can have more than one header on a damaged disk so all the
+	// headers with the same path are compared as a group
+	j = 0; k = 0;
+	while(j < numa || k < numb) {
+		ret = j >= numa ? 1 : k >= numb ? -1 : strcasecmp(afiles[j].path,bfiles[k].path);
+		if(ret < 0) {
+			fprintf(outfile,"removed\t%s\n",afiles[j].path);
+			counts[2]++;
+			for(anext = j+1; anext < numa && strcasecmp(afiles[anext].path,afiles[j].path) == 0; anext++);
+			j = anext;
+			continue;
+		}
+		if(ret > 0) {
+			fprintf(outfile,"added\t%s\n",bfiles[k].path);
+			counts[1]++;
+			for(bnext = k+1; bnext < numb && strcasecmp(bfiles[bnext].path,bfiles[k].path) == 0; bnext++);
+			k = bnext;
+			continue;
+		}
+		for(anext = j+1; anext < numa && strcasecmp(afiles[anext].path,afiles[j].path) == 0; anext++);
+		for(bnext = k+1; bnext < numb && strcasecmp(bfiles[bnext].path,bfiles[k].path) == 0; bnext++);
+		changed = anext-j != bnext-k;
+		for(n = 0; j+n < anext; n++)
+			changed |= adirty[afiles[j+n].key] || (k+n < bnext && (bdirty[bfiles[k+n].key] || afiles[j+n].key != bfiles[k+n].key));
+		for(; k+n < bnext; n++)
+			changed |= bdirty[bfiles[k+n].key];
+		if(changed) {
+			fprintf(outfile,"changed\t%s\n",bfiles[k].path);
+			counts[0]++;
+		}
+		j = anext;
+		k = bnext;
+	}
+	fprintf(outfile,"%u of %u sectors differ, %u of them belong to no file, %d files changed, %d added and %d removed\n",
+		differing,asectors > bsectors ? asectors : bsectors,unowned,counts[0],counts[1],counts[2]);
+	ret = (counts[0] || counts[1] || counts[2]) ? 1 : 0;
+done:
+	free(adirty);
+	free(bdirty);
+	free(afiles);
+	free(bfiles);
+	freebuffer(&first);
+	freebuffer(&second);
+	return ret;
+}
+
+// Added for version 5
+// Triage (-T), a quick look at an image to decide what to do with it before extracting it. Only the bootblock and the
+// root block are read, with pread(), and one tab separated line is written for every image: the image, its format,
+// DD or HD, the filesystem from the bootblock, what kind of bootblock it is, whether the root block is valid and
+// the name of the disk. Containers are only recognised, their contents can't be looked at without unpacking them
+
+// Names of the filesystems the last byte of the DOS\x bootblock selects
+static char *triagefilesystems[8] = { "OFS", "FFS", "OFS-INTL", "FFS-INTL", "OFS-DC", "FFS-DC", "OFS-LNFS", "FFS-LNFS" };
+
+// Read and check the root block at a sector, returns NULL if it's valid and what's wrong with it otherwise
+char *triageroot(int fd, uint32_t sector, union sector *root) {
+	uint32_t sum = 0;
+	int i = 0;
+
+	if(pread(fd,root,sizeof(union sector),(off_t)sector*sizeof(union sector)) != sizeof(union sector))
+		return "missing";
+	if(amiga32(root->hdr.type) != T_HEADER || amiga32(root->fh.sec_type) != 1)
+		return "notroot";
+	if(amiga32(root->hdr.data_size) != 72)
+		return "badhashtable";
+	for(i = 0; i < 128; i++)
+		sum += amiga32(((uint32_t *)root)[i]);
+	if(sum != 0)
+		return "badchecksum";
+	return NULL;
+}
+
+// Classify an image from its first bytes, its bootblock and its root block, returns 0 on success and 1 if the
+// image can't be read
+int triageimage(char *imagefile, FILE *outfile) {
+	uint8_t boot[2*sizeof(union sector)];
+	union sector root;
+	char name[MAX_AMIGADOS_FILENAME_LENGTH];
+	char filesystem[16];
+	char *bootblock = "blank"; char *rootstate = NULL; char *density = "DD";
+	struct stat st;
+	uint32_t sum = 0; uint32_t word = 0; uint32_t rootsector = SECTORS/2; uint32_t othersector = MAX_SECTORS/2;
+	ssize_t have = 0;
+	int fd = 0; int format = 0; int i = 0; int last = 0; int length = 0;
+
+	fd = open(imagefile,O_RDONLY);
+	if(fd == -1 || fstat(fd,&st) == -1) {
+		fprintf(stderr,"Can't open file %s for reading, error returned was: %s\n",imagefile,strerror(errno));
+		if(fd != -1)
+			close(fd);
+		return 1;
+	}
+	have = pread(fd,boot,sizeof(boot),0);
+	if(have < 4) {
+		fprintf(stderr,"Can't read the bootblock of %s\n",imagefile);
+		close(fd);
+		return 1;
+	}
+	format = detectformat(boot,have);
+	// The DMS header tells the density and whether it's encrypted, the other containers have to be unpacked first
+	if(format == FORMAT_DMS || format == FORMAT_ADZ || format == FORMAT_ZIP) {
+		close(fd);
+		word = have >= 12 ? (boot[8]<<24)+(boot[9]<<16)+(boot[10]<<8)+boot[11] : 0;
+		fprintf(outfile,"%s\t%s\t%s\t-\t%s\t-\t\n",imagefile,formatname(format),
+			format != FORMAT_DMS ? "-" : (word & DMS_HIGHDENSITY) ? "HD" : "DD",format == FORMAT_DMS && (word & DMS_ENCRYPT) ? "encrypted" : "-");
+		return 0;
+	}
+	memset(boot+have,0,sizeof(boot)-have);
+
+	// DOS\0 to DOS\7 are AmigaDOS disks, anything else is a trackloader or not an Amiga disk at all
+	if(boot[0] == 'D' && boot[1] == 'O' && boot[2] == 'S' && boot[3] < 8)
+		snprintf(filesystem,sizeof(filesystem),"DOS%d %s",boot[3],triagefilesystems[boot[3]]);
+	else
+		snprintf(filesystem,sizeof(filesystem),"NDOS");
+
+	// The bootblock is bootable if its checksum, which adds the carries back in, comes to 0xffffffff. The install
+	// bootblocks of AmigaDOS are a few dozen bytes that look up dos.library, anything longer or without it is a
+	// custom bootblock, which is a trackloader, a game or demo loader or a bootblock virus
+	for(i = 0; i < (int)sizeof(boot); i += 4) {
+		word = amiga32(*(uint32_t *)(boot+i));
+		sum = sum+word < sum ? sum+word+1 : sum+word;
+	}
+	for(i = 12, last = 0; i < (int)sizeof(boot); i++)
+		if(boot[i] != 0)
+			last = i;
+	if(last && sum == 0xffffffff) {
+		bootblock = "custom";
+		for(i = 12; last < 0x80 && i+11 <= last+1; i++)
+			if(memcmp(boot+i,"dos.library",11) == 0)
+				bootblock = "standard";
+	} else if(last) {
+		bootblock = "nonbootable";
+	}
+
+	// The root block is in the middle of the disk, look where the size of the image says and then at the other
+	// density in case the image was padded or cut short
+	if(st.st_size >= MAX_SECTORS*(off_t)sizeof(union sector)) {
+		density = "HD";
+		rootsector = MAX_SECTORS/2;
+		othersector = SECTORS/2;
+	}
+	rootstate = triageroot(fd,rootsector,&root);
+	if(rootstate != NULL && triageroot(fd,othersector,&root) == NULL) {
+		rootstate = NULL;
+		density = othersector == SECTORS/2 ? "DD" : "HD";
+	}
+	name[0] = '\0';
+	if(rootstate == NULL) {
+		rootstate = "ok";
+		length = root.fh.name_len < sizeof(root.fh.filename) ? root.fh.name_len : sizeof(root.fh.filename);
+		snprintf(name,sizeof(name),"%.*s",length,root.fh.filename);
+	}
+	close(fd);
+	// Keep the line parseable whatever the name of the disk is
+	for(i = 0; name[i]; i++)
+		if((unsigned char)name[i] < 32 || name[i] == 127)
+			name[i] = '?';
+	fprintf(outfile,"%s\t%s\t%s\t%s\t%s\t%s\t%s\n",imagefile,formatname(FORMAT_ADF),density,filesystem,bootblock,rootstate,name);
+	return 0;
+}
+
+// Added for version 5
+// Export (-A), the images are only unpacked to raw ADF files instead of being extracted. Every layer is checked as it
+// is decoded (the CRCs of the DMS header and tracks, the CRC of a gzip stream or zip entry) and truncated or damaged
+// data is an error instead of being decoded as well as it can be like extraction does. The raw image is written straight from the
+// buffer the decoder left it in with writesparseimage(), runs of sectors at a time with the zero tracks as holes.
+// An image that already is a raw ADF is copied by the kernel with copy_file_range() where it can be
+
+// Size of the chunks a raw image is copied in when copy_file_range() can't do it
+#define EXPORT_CHUNK (1024*1024)
+
+// Name of the raw image an image is exported to, the image file name without its directory and its extension
+// with .adf added, a name that ends in .adf after that (from .adf.gz) is kept as it is
+void exportname(char *imagefile, char *name, size_t size) {
+	char *extension;
+
+	snprintf(name,size,"%s",strrchr(imagefile,'/') ? strrchr(imagefile,'/')+1 : imagefile);
+	extension = strrchr(name,'.');
+	if(extension != NULL && extension != name)
+		*extension = '\0';
+	extension = strrchr(name,'.');
+	if(extension == NULL || strcasecmp(extension,".adf") != 0)
+		snprintf(name+strlen(name),size-strlen(name),".adf");
+}
+
+// Copy size bytes of a raw image from the file in to the file out, returns 0 on success and 1 on error
+int copyrawimage(int in, int out, off_t size) {
+	uint8_t *chunk;
+	off_t copied = 0;
+	ssize_t have = 0;
+
+#ifdef __linux__
+	// The kernel copies the data without it coming through us, and can share the blocks on filesystems that can
+	while(copied < size && (have = copy_file_range(in,NULL,out,NULL,size-copied,0)) > 0)
+		copied += have;
+#endif
+	if(copied == size)
+		return 0;
+	// Not the same filesystem or no copy_file_range(), what's left is copied in large chunks
+	chunk = malloc(EXPORT_CHUNK);
+	if(chunk == NULL || lseek(in,copied,SEEK_SET) == -1 || lseek(out,copied,SEEK_SET) == -1) {
+		free(chunk);
+		return 1;
+	}
+	while(copied < size && (have = read(in,chunk,EXPORT_CHUNK)) > 0) {
+		if(write(out,chunk,have) != have)
+			break;
+		copied += have;
+	}
+	free(chunk);
+	return copied == size ? 0 : 1;
+}
+
+// Export one image to a raw ADF in the current directory, returns 0 on success and 1 on error
+int exportimage(char *imagefile, int forcedformat, unsigned int debug, FILE *outfile) {
+	char name[MAX_FILENAME_LENGTH];
+	uint8_t magic[4];
+	struct membuffer image;
+	struct stat imagest;
+	struct stat st;
+	ssize_t have = 0;
+	int format = 0; int hintformat = 0; int in = -1; int out = -1; int ret = 0;
+
+	exportname(imagefile,name,sizeof(name));
+	in = open(imagefile,O_RDONLY);
+	if(in == -1 || fstat(in,&imagest) == -1) {
+		fprintf(stderr,"Can't open file %s for reading, error returned was: %s\n",imagefile,strerror(errno));
+		if(in != -1)
+			close(in);
+		return 1;
+	}
+	// Writing the raw image over the image itself would lose it
+	if(stat(name,&st) == 0 && st.st_dev == imagest.st_dev && st.st_ino == imagest.st_ino) {
+		fprintf(stderr,"Not exporting %s over itself\n",imagefile);
+		close(in);
+		return 1;
+	}
+	// The same decision decodeimage() makes for the outermost layer, an image that isn't in a container is copied
+	have = pread(in,magic,sizeof(magic),0);
+	format = detectformat(magic,have > 0 ? have : 0);
+	hintformat = extensionformat(imagefile);
+	if(forcedformat ? forcedformat == FORMAT_ADF :
+		(format == FORMAT_ADF || (format == FORMAT_UNKNOWN && (hintformat == FORMAT_UNKNOWN || hintformat == FORMAT_ADF)))) {
+		out = open(name,O_WRONLY|O_CREAT|O_TRUNC,0666);
+		if(out == -1 || copyrawimage(in,out,imagest.st_size) != 0) {
+			fprintf(stderr,"Can't copy %s to %s: %s\n",imagefile,name,strerror(errno));
+			ret = 1;
+		}
+		if(out != -1 && close(out) != 0)
+			ret = 1;
+		close(in);
+		if(ret == 0)
+			fprintf(outfile,"Copied %s to %s, %llu sectors\n",imagefile,name,(unsigned long long)imagest.st_size/sizeof(union sector));
+		return ret;
+	}
+	close(in);
+	if(loaddecoded(imagefile,forcedformat,MAX_SECTORS,&image,debug,outfile) != 0)
+		return 1;
+	if(image.size % sizeof(union sector) != 0 || (image.size != SECTORS*sizeof(union sector) && image.size != MAX_SECTORS*sizeof(union sector)))
+		fprintf(outfile,"%s is %zu bytes, which is not the size of a DD or HD disk\n",imagefile,image.size);
+	ret = writesparseimage(name,&image,debug,outfile);
+	if(ret == 0)
+		fprintf(outfile,"Exported %s to %s, %zu sectors\n",imagefile,name,image.size/sizeof(union sector));
+	freebuffer(&image);
+	return ret;
+}
+
+// The images of an export, the workers take the next one until there are none left
+struct exportbatch {
+	char **images;
+	int numimages;
+	int next;
+	int failed;
+	int format;
+	unsigned int debug;
+	FILE *outfile;
+};
+
+// Export images until the batch runs out
+void *exportworker(void *arg) {
+	struct exportbatch *batch = arg;
+	int i = 0;
+
+	while((i = __atomic_fetch_add(&batch->next,1,__ATOMIC_RELAXED)) < batch->numimages)
+		if(exportimage(batch->images[i],batch->format,batch->debug,batch->outfile) != 0)
+			__atomic_fetch_add(&batch->failed,1,__ATOMIC_RELAXED);
+	return NULL;
+}
+
+// The raw image an image of a batch is exported to
+struct exportentry {
+	char name[MAX_FILENAME_LENGTH];
+	int image;
+};
+
+int compareexportentries(const void *a, const void *b) {
+	const struct exportentry *x = a;
+	const struct exportentry *y = b;
+	int ret = strcmp(x->name,y->name);
+
+	return ret != 0 ? ret : x->image-y->image;
+}
+
+// Find the images of a batch that would be exported to the same raw image, the workers would write it at the same time
+// and only one of them would be left. Returns the number of images that clash with another one, or -1 if we're out
+// of memory
+int exportclashes(char **images, int numimages) {
+	struct exportentry *entries;
+	int clashes = 0; int i = 0;
+
+	entries = malloc(numimages*sizeof(struct exportentry));
+	if(entries == NULL) {
+		fprintf(stderr,"Out of memory\n");
+		return -1;
+	}
+	for(i = 0; i < numimages; i++) {
+		exportname(images[i],entries[i].name,sizeof(entries[i].name));
+		entries[i].image = i;
+	}
+	qsort(entries,numimages,sizeof(struct exportentry),compareexportentries);
+	for(i = 1; i < numimages; i++) {
+		if(strcmp(entries[i].name,entries[i-1].name) != 0)
+			continue;
+		fprintf(stderr,"%s and %s would both be exported to %s\n",images[entries[i-1].image],images[entries[i].image],entries[i].name);
+		clashes++;
+	}
+	free(entries);
+	return clashes;
+}
+
+// Export a batch of images with the given number of threads, each exports one image at a time so a few large
+// archives don't hold the others up. Returns 0 if every image was exported and 1 otherwise
+int exportimages(char **images, int numimages, int threads, struct extractoptions *options) {
+	struct exportbatch batch;
+	pthread_t *workers;
+	int *started;
+	int i = 0;
+
+	if(exportclashes(images,numimages) != 0) {
+		fprintf(stderr,"Nothing was exported, images with the same name have to be exported in separate runs\n");
+		return 1;
+	}
+	memset(&batch,0,sizeof(struct exportbatch));
+	// A damaged image shouldn't come out as a raw image that looks fine
+	strictdecode = 1;
+	batch.images = images;
+	batch.numimages = numimages;
+	batch.format = options->format;
+	batch.debug = options->debug;
+	batch.outfile = options->outfile;
+	if(threads > numimages)
+		threads = numimages;
+	workers = malloc(threads*sizeof(pthread_t));
+	started = calloc(threads,sizeof(int));
+	if(workers == NULL || started == NULL) {
+		fprintf(stderr,"Out of memory\n");
+		free(workers);
+		free(started);
+		return 1;
+	}
+	// This thread works through the batch as well once the others are running, it's the only one if none start
+	for(i = 1; i < threads; i++) {
+		if(pthread_create(&workers[i],NULL,exportworker,&batch) == 0)
+			started[i] = 1;
+		else if(options->debug)
+			fprintf(options->outfile,"Can't start export thread %d\n",i);
+	}
+	exportworker(&batch);
+	for(i = 1; i < threads; i++)
+		if(started[i])
+			pthread_join(workers[i],NULL);
+	free(workers);
+	free(started);
+	if(batch.failed)
+		fprintf(options->outfile,"%d of %d images could not be exported\n",batch.failed,numimages);
+	return batch.failed ? 1 : 0;
+}
+
+// Added for version 5
+// Daemon mode, extraction jobs come in over a Unix domain socket so a service doesn't have to start a process for every
+// image. A pool of worker processes is forked up front, each of them accepts connections on the socket and runs the
+// jobs it gets one after the other, so the number of workers bounds how many images are extracted at once and a worker
+// keeps its tables, heap and output queue between jobs. Workers are processes and not threads because the extraction
+// changes the working directory. A worker that dies is replaced.
+// A job is one line of tab separated fields like a command line, any of the options -a -z -d -c -b -u -D -s -e -t and
+// -w (with their arguments as fields of their own) followed by the image and the directory to extract it into, e.g.
+// -c<tab>-s<tab>513<tab>/images/disk1.adf<tab>/extracted/disk1
+// The -i and -x patterns of a job are added to the ones the daemon was started with
+// Relative paths are relative to where the daemon was started. The answer to a job is the JSON statistics for it, the
+// same as -j writes, followed by an empty line, a job that can't be run gets a status of "error" and the reason
+
+// Most fields a job line can have
+#define DAEMON_MAX_FIELDS 64
+
+// The options of a job line. getopt() has to stop at the image like POSIX says, glibc only does that with a + in
+// front and the BSDs would take the + as an option. Starting over with getopt() takes an optind of 0 with glibc and
+// musl, the BSDs and macOS want optreset set and an optind of 1 instead
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+#define DAEMON_OPTIONS "abcdzuDs:e:t:w:i:x:"
+#define DAEMON_RESETGETOPT() (optreset = 1, optind = 1)
+#else
+#define DAEMON_OPTIONS "+abcdzuDs:e:t:w:i:x:"
+#define DAEMON_RESETGETOPT() (optind = 0)
+#endif
+
+// Set by SIGTERM and SIGINT to stop the daemon
+volatile sig_atomic_t daemonstop = 0;
+
+void daemonsignal(int signum) {
+	daemonstop = 1;
+}
+
+// Answer a job that couldn't be run
+void daemonerror(FILE *reply, char *image, char *error) {
+	fprintf(reply,"{\n      \"image\": ");
+	writejsonstring(reply,image != NULL ? image : "");
+	fprintf(reply,",\n      \"status\": \"error\",\n      \"error\": ");
+	writejsonstring(reply,error);
+	fprintf(reply,"\n    }\n\n");
+}
+
+// Run one job line and write the answer to reply, defaults are the options the daemon was started with
+// Returns 0 if the image was extracted, 1 if not
+int daemonjob(char *line, struct extractoptions *defaults, int startdir, FILE *reply) {
+	struct extractoptions options = *defaults;
+	char *fields[DAEMON_MAX_FIELDS+1];
+	char *includes[DAEMON_MAX_FIELDS+64];
+	char *excludes[DAEMON_MAX_FIELDS+64];
+	char *field = NULL; char *end = NULL;
+	char *image = NULL; char *outputdir = NULL; char *imagefile = NULL;
+	int numfields = 0; int optionflag = 0; int endsectorset = 0; int ret = 1;
+	long value = 0;
+	uint64_t start = monotonicnanoseconds();
+
+	line[strcspn(line,"\r\n")] = '\0';
+	// The first field stands in for the program name, which getopt() skips
+	fields[numfields++] = "job";
+	for(field = strtok(line,"\t"); field != NULL && numfields < DAEMON_MAX_FIELDS; field = strtok(NULL,"\t"))
+		fields[numfields++] = field;
+	fields[numfields] = NULL;
+	DAEMON_RESETGETOPT();
+	opterr = 0;
+	if(defaults->numincludes > 64 || defaults->numexcludes > 64) {
+		daemonerror(reply,NULL,"the daemon was started with too many patterns");
+		return 1;
+	}
+	if(defaults->numincludes)
+		memcpy(includes,defaults->includes,defaults->numincludes*sizeof(char *));
+	if(defaults->numexcludes)
+		memcpy(excludes,defaults->excludes,defaults->numexcludes*sizeof(char *));
+	options.includes = includes;
+	options.excludes = excludes;
+	while((optionflag = getopt(numfields,fields,DAEMON_OPTIONS)) != -1) {
+		if(optarg != NULL) {
+			value = strtol(optarg,&end,10);
+			if(*end != '\0')
+				value = -1;
+		}
+		switch(optionflag) {
+			case 'a':
+				options.format = 1;
+				break;
+			case 'z':
+				options.format = 2;
+				break;
+			case 'd':
+				options.format = 3;
+				break;
+			case 'c':
+				options.chainmode = 1;
+				break;
+			case 'b':
+				options.bitmapmode = 1;
+				break;
+			case 'u':
+				options.bitmapmode = 2;
+				break;
+			case 'D':
+				options.debug = 1;
+				break;
+			case 's':
+				if(value < 0 || value > 3520) {
+					daemonerror(reply,NULL,"start sector out of range");
+					return 1;
+				}
+				options.startsector = value;
+				break;
+			case 'e':
+				if(value < 0) {
+					daemonerror(reply,NULL,"end sector out of range");
+					return 1;
 				}
-				if(bigendian)
-					fseek(f, (sector[i].hdr.seq_num-1)*DATABYTES, SEEK_SET);
-				else
-					fseek(f, (ntohl(sector[i].hdr.seq_num)-1)*DATABYTES, SEEK_SET);
-				if(debug) {
-					if(bigendian)
-						fprintf(outfile,"seek to %ld\n",  (sector[i].hdr.seq_num-1)*DATABYTES);
-					else
-						fprintf(outfile,"seek to %ld\n",  (ntohl(sector[i].hdr.seq_num)-1)*DATABYTES);
+				options.endsector = value;
+				endsectorset = 1;
+				break;
+			case 't':
+				if(value < 1 || value > 256) {
+					daemonerror(reply,NULL,"number of threads out of range");
+					return 1;
 				}
-				if(bigendian)
-					fwrite(sector[i].dh.data, sector[i].hdr.data_size, 1, f);
-				else 
-					fwrite(sector[i].dh.data, ntohl(sector[i].hdr.data_size), 1, f);
-				// Close file
-				fclose(f);
-				// Set modification time based on the days/minutes/ticks timestamp of the original file
-				if(bigendian) 
-					utime(filename,amigadaystoutimbuf(sector[header_key].fh.days,sector[header_key].fh.mins,sector[header_key].fh.ticks,utim));
-				else
-					//All the stamps are in big-endian so need to be converted..
-					utime(filename,amigadaystoutimbuf(ntohl(sector[header_key].fh.days),ntohl(sector[header_key].fh.mins),ntohl(sector[header_key].fh.ticks),utim));
-				// Return to the previous working directory
-				if(fchdir(root) == -1) {
-					fprintf(stderr,"Can't return to previous working directory, exiting\n");
+				options.threads = value;
+				break;
+			case 'w':
+				if(value < 1 || value > 1048576) {
+					daemonerror(reply,NULL,"window out of range");
 					return 1;
 				}
-				// Close the previously opened working directories
-				close(root);
-				close(orphandir);
+				options.window = value;
+				break;
+			case 'i':
+				options.includes[options.numincludes++] = optarg;
+				break;
+			case 'x':
+				options.excludes[options.numexcludes++] = optarg;
+				break;
+			default:
+				daemonerror(reply,NULL,"unknown option or missing argument");
+				return 1;
 		}
-		if(debug)
-			fprintf(outfile,"\n");
+		optarg = NULL;
+	}
+	if(optind+2 != numfields) {
+		daemonerror(reply,NULL,"a job is the options, the image and the output directory");
+		return 1;
+	}
+	image = fields[optind];
+	outputdir = fields[optind+1];
+	// The same rules as on the command line
+	if(options.window && !endsectorset)
+		options.endsector = 0;
+	if((!options.window && options.endsector > 3520) || (options.endsector && options.startsector > options.endsector)) {
+		daemonerror(reply,image,"end sector out of range");
+		return 1;
+	}
+	// Every job starts where the daemon was started, the image has to be found before changing to the output directory
+	if(fchdir(startdir) == -1) {
+		daemonerror(reply,image,"can't return to the starting directory");
+		return 1;
+	}
+	imagefile = realpath(image,NULL);
+	if(imagefile == NULL) {
+		daemonerror(reply,image,strerror(errno));
+		return 1;
 	}
+	if((mkdir(outputdir,0777) == -1 && errno != EEXIST) || chdir(outputdir) == -1) {
+		daemonerror(reply,image,"can't create or change to the output directory");
+		free(imagefile);
+		return 1;
+	}
+	if(options.window)
+		ret = extractwindowed(imagefile,&options);
+	else
+		ret = extractimage(imagefile,&options);
+	free(imagefile);
+	outputringdrain();
+	imagestats.totaltime = monotonicnanoseconds()-start;
+	if(fchdir(startdir) == -1)
+		ret = 1;
+	fflush(options.outfile);
+	writejsonstats(reply,image,ret,&imagestats);
+	fprintf(reply,"\n\n");
+	return ret;
+}
 
-	// Free the space allocated for the filepath array, in reverse order to the malloc obviously
-	for(i=0; i< MAX_AMIGADOS_FILENAME_LENGTH; i++) {
-		free(filepath[i]);
+// Take connections and run the jobs that come in on them until told to stop
+void daemonworker(int listener, struct extractoptions *defaults, int startdir, unsigned int queuedepth) {
+	FILE *request = NULL; FILE *reply = NULL;
+	char *line = NULL;
+	size_t linesize = 0;
+	int connection = 0;
+
+#ifdef _HAVE_IO_URING
+	// Every worker has a queue of its own
+	if(queuedepth)
+		outputring = outputringsetup(queuedepth);
+#endif
+	while(!daemonstop) {
+		connection = accept(listener,NULL,NULL);
+		if(connection == -1)
+			continue;
+		request = fdopen(connection,"r");
+		reply = fdopen(dup(connection),"w");
+		if(request == NULL || reply == NULL) {
+			if(request != NULL)
+				fclose(request);
+			else
+				close(connection);
+			if(reply != NULL)
+				fclose(reply);
+			continue;
+		}
+		while(!daemonstop && getline(&line,&linesize,request) != -1) {
+			if(line[strspn(line,"\r\n")] == '\0')
+				continue;
+			daemonjob(line,defaults,startdir,reply);
+			if(fflush(reply) == EOF)
+				break;
+		}
+		fclose(request);
+		fclose(reply);
 	}
-	// Free the filepath array itself
-	free(filepath);
+	free(line);
+#ifdef _HAVE_IO_URING
+	outputringclose(outputring);
+	outputring = NULL;
+#endif
+}
 
-	// Free the space allocated for the orphanfilename array, in reverse order to the malloc
-	for(i=0; i<3520; i++) {
-		free(orphanfilename[i]);
+// Listen on socketpath with a pool of workers, returns when SIGTERM or SIGINT is received
+// Returns 0 on a clean shutdown and 1 if the socket can't be set up
+int rundaemon(char *socketpath, int workers, struct extractoptions *defaults, unsigned int queuedepth) {
+	struct sockaddr_un address;
+	struct sigaction action;
+	pid_t *pids = NULL;
+	pid_t pid = 0;
+	int listener = 0; int startdir = 0; int i = 0; int status = 0;
+
+	if(strlen(socketpath) >= sizeof(address.sun_path)) {
+		fprintf(stderr,"Socket path %s is too long\n",socketpath);
+		return 1;
+	}
+	pids = calloc(workers,sizeof(pid_t));
+	startdir = open(".",O_RDONLY);
+	listener = socket(AF_UNIX,SOCK_STREAM,0);
+	if(pids == NULL || startdir == -1 || listener == -1) {
+		fprintf(stderr,"Can't set up the daemon, error returned was: %s\n",strerror(errno));
+		return 1;
+	}
+	memset(&address,0,sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path,sizeof(address.sun_path),"%s",socketpath);
+	// A socket left behind by a daemon that wasn't stopped cleanly is in the way
+	unlink(socketpath);
+	if(bind(listener,(struct sockaddr *)&address,sizeof(address)) == -1 || listen(listener,SOMAXCONN) == -1) {
+		fprintf(stderr,"Can't listen on %s, error returned was: %s\n",socketpath,strerror(errno));
+		close(listener);
+		return 1;
+	}
+	// No SA_RESTART, accept() has to be interrupted when it's time to stop
+	memset(&action,0,sizeof(action));
+	action.sa_handler = daemonsignal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM,&action,NULL);
+	sigaction(SIGINT,&action,NULL);
+	// A client that goes away shouldn't take the worker with it
+	signal(SIGPIPE,SIG_IGN);
+	fprintf(defaults->outfile,"Listening on %s with %d workers\n",socketpath,workers);
+	fflush(defaults->outfile);
+	while(!daemonstop) {
+		// Start the workers that aren't running
+		for(i = 0; i < workers && !daemonstop; i++) {
+			if(pids[i] > 0)
+				continue;
+			pids[i] = fork();
+			if(pids[i] == 0) {
+				daemonworker(listener,defaults,startdir,queuedepth);
+				_exit(0);
+			}
+			if(pids[i] == -1) {
+				fprintf(stderr,"Can't start a worker, error returned was: %s\n",strerror(errno));
+				sleep(1);
+			}
+		}
+		pid = wait(&status);
+		for(i = 0; pid > 0 && i < workers; i++)
+			if(pids[i] == pid)
+				pids[i] = 0;
 	}
-	free(orphanfilename);
+	// Stop the workers, they finish the job they're running first
+	for(i = 0; i < workers; i++)
+		if(pids[i] > 0)
+			kill(pids[i],SIGTERM);
+	while(wait(&status) > 0 || errno == EINTR)
+		;
+	close(listener);
+	unlink(socketpath);
+	close(startdir);
+	free(pids);
+	fprintf(defaults->outfile,"Stopped listening on %s\n",socketpath);
+	return 0;
+}
 
-	// Free the space used by the orphansector array
-	free(orphansector);
+#ifdef EXTRACTADF_NO_MAIN
+// Added for version 5
+// Decode one input of the fuzzing harness in extract-adf-fuzz.c, which is also the format of the inputs in
+// extract-adf-corpus/ that extract-adf-bench.c replays. The first byte picks the decoder, FUZZ_DMS decodes the
+// rest as a whole DMS archive with undmsbuffer(), the others are the crunch_* functions in the order of their crunch
+// modes and get the size to unpack to (big endian, at most BUFFERSIZE) in the next two bytes, flags in the fourth
+// (1 is noclear, 2 is heavy's compressed flag) and the packed bytes after that
+// Returns what the decoder returned, 0 if the input decoded, or -1 if the input is too short to be one
+#define FUZZ_DECODERS 8
+#define FUZZ_DMS 7
+
+char *fuzzdecodernames[FUZZ_DECODERS] = { "store", "rle", "quick", "medium", "deep", "heavy1", "heavy2", "dms" };
+
+int fuzzdecode(const uint8_t *data, size_t size, FILE *debugfile) {
+	struct membuffer in;
+	struct membuffer out;
+	uint8_t *source;
+	size_t length = 0;
+	unsigned int unpacked = 0; unsigned int flags = 0;
+	int ret = 0;
 
-	// Free the space used by the sector array
-	free(sector);
+	if(size < 4)
+		return -1;
+	if(data[0] % FUZZ_DECODERS == FUZZ_DMS) {
+		memset(&in,0,sizeof(struct membuffer));
+		memset(&out,0,sizeof(struct membuffer));
+		in.data = (uint8_t *)data+1;
+		in.size = size-1;
+		// Searching for the key of an encrypted archive takes as long as decoding its first track 65536 times,
+		// encrypted archives are decoded with key 0 instead so the time is that of the decoders
+		dmskey = 0;
+		ret = undmsbuffer(&in,&out,MAX_SECTORS,0,debugfile);
+		freebuffer(&out);
+		return ret;
+	}
+	unpacked = (data[1]<<8)+data[2] < BUFFERSIZE ? (data[1]<<8)+data[2] : BUFFERSIZE;
+	flags = data[3];
+	length = size-4;
+	// The decoders read up to 16 bytes past the end of the packed bytes, they are padded in pack_buffer as well
+	source = calloc(length+16,1);
+	if(source == NULL)
+		return -1;
+	memcpy(source,data+4,length);
+	switch(data[0] % FUZZ_DECODERS) {
+		case 0:
+			ret = crunch_store(source,source+length,unpack_buffer,unpack_buffer+unpacked,0,debugfile);
+			break;
+		case 1:
+			ret = crunch_rle(source,source+length,unpack_buffer,unpack_buffer+unpacked,0,debugfile);
+			break;
+		case 2:
+			ret = crunch_quick(source,source+length,unpack_buffer,unpack_buffer+unpacked,0,debugfile,flags & 1);
+			break;
+		case 3:
+			ret = crunch_medium(source,source+length,unpack_buffer,unpack_buffer+unpacked,0,debugfile,flags & 1);
+			break;
+		case 4:
+			ret = crunch_deep(source,source+length,unpack_buffer,unpack_buffer+unpacked,0,debugfile,flags & 1);
+			break;
+		default:
+			ret = crunch_heavy(source,source+length,unpack_buffer,unpack_buffer+unpacked,flags & 2,
+				data[0] % FUZZ_DECODERS == 5 ? 13 : 14,0,debugfile,flags & 1);
+			break;
+	}
+	free(source);
+	return ret;
+}
+#endif
 
-	// Free the time struct
-	free(utim);
+#ifndef EXTRACTADF_NO_MAIN
+int main(int argc,char **argv) {
+	// Temporary variable
+	int i=0;
+	// The options for this run, see struct extractoptions
+	struct extractoptions options;
+	// int to read option value from getopt and a temp variable to read in the option index
+        int optionflag; int index = 0;
+	// File to write the JSON statistics report to, NULL if none was asked for
+	FILE *jsonfile = NULL;
+	// Totals for all the images in the run
+	struct extractstats totalstats;
+	// Directory we started in, in a batch run every image is extracted into its own directory below it
+	int startdir = 0;
+	// Name of the directory an image is extracted into in a batch run
+	char imagedir[MAX_FILENAME_LENGTH];
+	// Return code of extracting an image
+	int ret = 0;
+	// Filename of the JSON statistics report, - for stdout
+	char *jsonfilename = NULL;
+	unsigned int jsonentries = 0;
+	// When the current image was started
+	uint64_t imagestart = 0;
+	// Full path of the image being extracted
+	char *imagefile = NULL;
+	// Set if an end sector was given
+	int endsectorset = 0;
+	// Collection index to write, or to look names up in
+	char *indexfilename = NULL;
+	char *lookupfilename = NULL;
+	struct indexbuilder indexbuilder;
+	uint32_t *indeximages = NULL;
+	// Depth of the io_uring output queue, 0 writes synchronously
+	unsigned int queuedepth = 0;
+	// Socket to take jobs on in daemon mode, and how many worker processes run them
+	char *socketpath = NULL;
+	int workers = 0;
+	char **patterns = NULL;
+	// Manifest of the hashes of the extracted files
+	char *manifestfilename = NULL;
+	// Image to compare the argument with
+	char *comparefilename = NULL;
+	// Set to only triage the images instead of extracting them
+	int triage = 0;
+	// Set to export the images to raw ADF files instead of extracting them
+	int exportmode = 0;
+
+	// Defaults
+	options.format = 0;
+	options.startsector = FIRST_SECTOR;
+	options.endsector = SECTORS;
+	options.chainmode = 0;
+	options.threads = 1;
+	options.bitmapmode = 0;
+	options.debug = DEBUG;
+	options.outfile = NULL;
+	options.window = 0;
+	options.includes = NULL;
+	options.numincludes = 0;
+	options.excludes = NULL;
+	options.numexcludes = 0;
+	memset(&totalstats,0,sizeof(struct extractstats));
 
-	// Free the orphansplit
-	free(orphansplit);
+	// Read the passed options if any (-d sets debug, -o sets an optional filename to pipe the output to)
+        while((optionflag = getopt(argc, argv, "abcdzuDTAo:s:e:j:t:w:I:L:q:S:P:i:x:m:C:k:K:")) != -1) 
+		switch(optionflag) {
+			// ADF format forced
+			case 'a':
+				options.format=1;
+				break;
+			// ADZ format forced
+			case 'z':
+				options.format=2;
+				break;
+			// DMS format forced
+			case 'd':
+				options.format=3;
+				break;
+			// Reconstruct headerless files from their next_data chains
+			case 'c':
+				options.chainmode=1;
+				break;
+			// Only scan the allocated blocks
+			case 'b':
+				options.bitmapmode=1;
+				break;
+			// Only scan the free blocks
+			case 'u':
+				options.bitmapmode=2;
+				break;
+                        // Debug flag is set to on
+                        case 'D':
+                                options.debug=1;
+                                break;
+                        // Output file flag is specified
+                        case 'o':
+                                options.outfile = fopen(optarg,"w");
+                                // If output file didn't open, error occured, print error, exit
+                                if(options.outfile == NULL) {
+                                        fprintf(stderr,"Can't open output file %s for writing, error returned was: %s\n",optarg,strerror(errno));
+                                        return 1;
+                                } else {
+                                        // Announce that we're writing the output to a file on stdout
+                                        fprintf(stdout,"Writing output to %s\n",optarg);
+                                }
+                                break;
+			// Start sector is specified
+			case 's':
+				i=strtoimax(optarg,NULL,10);
+				// Not an integer or value over 3520 (last sector on a HD adf), print usage
+				if(i>3520 || i <0 || i>options.endsector) {
+					usage(argv[0]);
+					return 2;
+				// Otherwise set the start sector
+				} else {
+					options.startsector = i;
+				}
+				break;
+			case 'e':		
+				i=strtoimax(optarg,NULL,10);
+				// Not an integer or before the start sector, print usage, the limit of 3520 is checked when all the
+				// options are read since windowed mode can go beyond it
+				if(i <0 || i<options.startsector) {
+					usage(argv[0]);
+					return 2;
+				// Otherwise set the end sector
+				} else {
+					options.endsector = i;
+					endsectorset = 1;
+				}
+				break;
+			// Write a JSON statistics report
+			case 'j':
+				jsonfilename = optarg;
+				break;
+			// Number of threads used to classify sectors
+			case 't':
+				i=strtoimax(optarg,NULL,10);
+				if(i < 1 || i > 256) {
+					usage(argv[0]);
+					return 2;
+				} else {
+					options.threads = i;
+					dmskeythreads = i;
+				}
+				break;
+			// Write a collection index of everything extracted
+			case 'I':
+				indexfilename = optarg;
+				break;
+			// Look the arguments up in a collection index instead of extracting
+			case 'L':
+				lookupfilename = optarg;
+				break;
+			// Windowed mode, the number of sectors read at a time
+			case 'w':
+				i=strtoimax(optarg,NULL,10);
+				if(i < 1 || i > 1048576) {
+					usage(argv[0]);
+					return 2;
+				} else {
+					options.window = i;
+				}
+				break;
+			// Queue the output with io_uring, the argument is how many operations can be in flight
+			case 'q':
+				i=strtoimax(optarg,NULL,10);
+				if(i < 0 || i > 4096) {
+					usage(argv[0]);
+					return 2;
+				} else {
+					queuedepth = i;
+				}
+				break;
+			// Only extract the files that match a pattern
+			case 'i':
+				patterns = realloc(options.includes,(options.numincludes+1)*sizeof(char *));
+				if(patterns == NULL) {
+					fprintf(stderr,"Out of memory\n");
+					return 1;
+				}
+				options.includes = patterns;
+				options.includes[options.numincludes++] = optarg;
+				break;
+			// Leave out the files that match a pattern
+			case 'x':
+				patterns = realloc(options.excludes,(options.numexcludes+1)*sizeof(char *));
+				if(patterns == NULL) {
+					fprintf(stderr,"Out of memory\n");
+					return 1;
+				}
+				options.excludes = patterns;
+				options.excludes[options.numexcludes++] = optarg;
+				break;
+			// Write a manifest of the hashes of the extracted files
+			case 'm':
+				manifestfilename = optarg;
+				break;
+			// Triage the images instead of extracting them
+			case 'T':
+				triage = 1;
+				break;
+			// Export the images to raw ADF files instead of extracting them
+			case 'A':
+				exportmode = 1;
+				break;
+			// Compare two images instead of extracting
+			case 'C':
+				comparefilename = optarg;
+				break;
+			// Run as a daemon taking jobs on a socket
+			case 'S':
+				socketpath = optarg;
+				break;
+			// Password of encrypted DMS archives, the key is the CRC of it
+			case 'k':
+				dmskey = mycrc((unsigned char *)optarg,strlen(optarg));
+				break;
+			// Key of encrypted DMS archives
+			case 'K':
+				i=strtoimax(optarg,NULL,0);
+				if(i < 0 || i > 0xffff) {
+					usage(argv[0]);
+					return 2;
+				} else {
+					dmskey = i;
+				}
+				break;
+			// Number of daemon workers
+			case 'P':
+				i=strtoimax(optarg,NULL,10);
+				if(i < 1 || i > 256) {
+					usage(argv[0]);
+					return 2;
+				} else {
+					workers = i;
+				}
+				break;
+                        // Missing argument to o,s or e
+                        case '?':
+                                usage(argv[0]);
+                                return 2;
+                                break;
+                }
+	// Only windowed mode can go beyond the last sector of a HD adf, and without an end sector it reads the whole image
+	if(options.window && !endsectorset)
+		options.endsector = 0;
+	if(!options.window && options.endsector > 3520) {
+		usage(argv[0]);
+		return 2;
+	}
+	// Check if outfile is set, if not set outfile as stdout, or stderr when the JSON report goes to stdout so the
+	// report isn't mixed with the output
+	if(options.outfile == NULL)
+		options.outfile = (jsonfilename != NULL && strcmp(jsonfilename,"-") == 0) ? stderr : stdout;
+	if(options.debug) {
+		if(options.format==0)
+			fprintf(options.outfile,"File format is not set!\n");
+		else if(options.format==1) 
+			fprintf(options.outfile,"File format is ADF\n");
+		else if(options.format==2) 
+			fprintf(options.outfile,"File format is ADZ\n");
+		else if(options.format==3) 
+			fprintf(options.outfile,"File format is DMS\n");
+	}
+	// Lookup mode, the arguments are file names to look up instead of images
+	if(lookupfilename != NULL) {
+		if(optind >= argc) {
+			usage(argv[0]);
+			return 2;
+		}
+		return lookupindex(lookupfilename,argv+optind,argc-optind,options.outfile);
+	}
+	// Compare mode, the image given with -C is compared with the one argument, without an end sector the whole of
+	// a HD image is compared
+	if(comparefilename != NULL) {
+		if(argc-optind != 1) {
+			usage(argv[0]);
+			return 2;
+		}
+		if(!endsectorset)
+			options.endsector = MAX_SECTORS;
+		return diffimages(comparefilename,argv[optind],&options);
+	}
+	// Triage mode, one line for every image
+	if(triage) {
+		if(optind >= argc) {
+			usage(argv[0]);
+			return 2;
+		}
+		for(index = optind; index < argc; index++)
+			if(triageimage(argv[index],options.outfile) != 0)
+				ret = 1;
+		return ret;
+	}
+	// Export mode, every image is unpacked to a raw ADF file, -P of them at a time
+	if(exportmode) {
+		if(optind >= argc) {
+			usage(argv[0]);
+			return 2;
+		}
+		if(workers == 0)
+			workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+		return exportimages(argv+optind,argc-optind,workers,&options);
+	}
+	// Daemon mode, the options given are the defaults for every job
+	if(socketpath != NULL) {
+		if(workers == 0)
+			workers = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+		return rundaemon(socketpath,workers,&options,queuedepth);
+	}
+	// No file given, print usage instructions
+	if(optind >= argc) {
+		usage(argv[0]);
+		return 2;
+	}
+	// Open the JSON report now, so we don't find out it can't be written after all the work is done
+	if(jsonfilename != NULL) {
+		if(strcmp(jsonfilename,"-") == 0)
+			jsonfile = stdout;
+		else
+			jsonfile = fopen(jsonfilename,"w");
+		if(jsonfile == NULL) {
+			fprintf(stderr,"Can't open statistics file %s for writing, error returned was: %s\n",jsonfilename,strerror(errno));
+			return 1;
+		}
+		fprintf(jsonfile,"{\n  \"images\": [\n");
+	}
+	startdir = open(".",O_RDONLY);
+	if(startdir == -1) {
+		fprintf(stderr,"Can't open current directory, exiting\n");
+		return 1;
+	}
+	// Open the manifest now, before changing into the directories of the images
+	if(manifestfilename != NULL) {
+		manifest.file = fopen(manifestfilename,"w");
+		if(manifest.file == NULL) {
+			fprintf(stderr,"Can't open manifest file %s for writing, error returned was: %s\n",manifestfilename,strerror(errno));
+			return 1;
+		}
+	}
+	// Create the index file now so we know we can write it, the files are added to the index as they are hashed
+	if(indexfilename != NULL) {
+		memset(&indexbuilder,0,sizeof(struct indexbuilder));
+		// Offset 0 of the string table is the empty string
+		indexstring(&indexbuilder,"");
+		if(close(open(indexfilename,O_WRONLY|O_CREAT|O_TRUNC,0666)) == -1) {
+			fprintf(stderr,"Can't open index file %s for writing, error returned was: %s\n",indexfilename,strerror(errno));
+			return 1;
+		}
+		manifest.index = &indexbuilder;
+	}
+	if(queuedepth) {
+#ifdef _HAVE_IO_URING
+		outputring = outputringsetup(queuedepth);
+		if(outputring == NULL)
+			fprintf(stderr,"Can't set up io_uring (%s), writing the files synchronously\n",strerror(errno));
+#else
+		fprintf(stderr,"io_uring is not available on this system, writing the files synchronously\n");
+#endif
+	}
+	// Every non-option argument is an image to extract
+	for (index = optind; index < argc; index++) {
+		// If there is more than one image, each gets a directory named after the image file without its extension,
+		// relative image names have to be resolved before we change into it
+		imagefile = realpath(argv[index],NULL);
+		if(argc-optind > 1) {
+			snprintf(imagedir,MAX_FILENAME_LENGTH,"%s",strrchr(argv[index],'/') ? strrchr(argv[index],'/')+1 : argv[index]);
+			if(strrchr(imagedir,'.') != NULL && strrchr(imagedir,'.') != imagedir)
+				*strrchr(imagedir,'.') = '\0';
+			if(mkdir(imagedir,0777) < 0 && errno != EEXIST) {
+				fprintf(stderr,"Can't create directory %s, skipping %s\n",imagedir,argv[index]);
+				totalstats.images++;
+				totalstats.failed++;
+				free(imagefile);
+				continue;
+			}
+			if(chdir(imagedir) == -1) {
+				fprintf(stderr,"Can't change to directory %s, skipping %s\n",imagedir,argv[index]);
+				totalstats.images++;
+				totalstats.failed++;
+				free(imagefile);
+				continue;
+			}
+			fprintf(options.outfile,"Extracting %s into %s\n",argv[index],imagedir);
+		}
+		// What this image produces goes into the index under its name
+		if(indexfilename != NULL) {
+			indeximages = realloc(indexbuilder.images,(indexbuilder.numimages+1)*sizeof(uint32_t));
+			if(indeximages == NULL) {
+				fprintf(stderr,"Out of memory\n");
+				return 1;
+			}
+			indexbuilder.images = indeximages;
+			indexbuilder.images[indexbuilder.numimages] = indexstring(&indexbuilder,argv[index]);
+			manifest.indeximage = indexbuilder.numimages++;
+		}
+		imagestart = monotonicnanoseconds();
+		if(options.window)
+			ret = extractwindowed(imagefile != NULL ? imagefile : argv[index],&options);
+		else
+			ret = extractimage(imagefile != NULL ? imagefile : argv[index],&options);
+		free(imagefile);
+		imagefile = NULL;
+		// Everything queued for this image has to be on disk before the next image starts
+		outputringdrain();
+		imagestats.totaltime = monotonicnanoseconds()-imagestart;
+		// Go back to where we started, the extraction might have bailed out anywhere
+		if(fchdir(startdir) == -1) {
+			fprintf(stderr,"Can't return to starting directory, exiting\n");
+			return 1;
+		}
+		// The separator goes in front of every entry after the first, images that were skipped have none
+		if(jsonfile != NULL) {
+			fprintf(jsonfile,"%s    ",jsonentries++ ? ",\n" : "");
+			writejsonstats(jsonfile,argv[index],ret,&imagestats);
+		}
+		addstats(&totalstats,&imagestats,ret);
+	}
+	close(startdir);
+#ifdef _HAVE_IO_URING
+	// Writes that failed in the queue were reported as they completed, but make the run fail
+	if(outputring != NULL && outputringclose(outputring) != 0)
+		totalstats.failed++;
+	outputring = NULL;
+#endif
+	if(indexfilename != NULL) {
+		if(writeindex(&indexbuilder,indexfilename) != 0)
+			totalstats.failed++;
+		else
+			fprintf(options.outfile,"Indexed %u files from %u images in %s\n",indexbuilder.numentries,indexbuilder.numimages,indexfilename);
+		free(indexbuilder.entries);
+		free(indexbuilder.images);
+		freebuffer(&indexbuilder.strings);
+	}
+	if(manifest.file != NULL && fclose(manifest.file) != 0) {
+		fprintf(stderr,"Can't write manifest file %s\n",manifestfilename);
+		totalstats.failed++;
+	}
+	if(jsonfile != NULL) {
+		fprintf(jsonfile,"%s  ],\n  \"total\": ",jsonentries ? "\n" : "");
+		writejsonstats(jsonfile,NULL,0,&totalstats);
+		fprintf(jsonfile,"\n}\n");
+		if(jsonfile != stdout)
+			fclose(jsonfile);
+	}
 
-	// Successful run	
-	return 0;
-	fprintf(stderr,"ermahgerdus\n");
+	// Successful run unless one of the images failed
+	return totalstats.failed ? 1 : 0;
 }
+#endif